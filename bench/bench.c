@@ -0,0 +1,363 @@
+/**
+ * @file bench.c
+ *
+ * Microbenchmarks for the kernels of the IMU callback, build and run them
+ * with "make bench".
+ *
+ * The inputs come from a settings file: every module is initialized from it
+ * exactly like rc_pilot does, then the sim backend flies the vehicle into a
+ * hover. The state, setpoint and motor signals left behind by that flight
+ * are what each kernel is then run on millions of times.
+ *
+ * Results are printed to stdout as one JSON object per kernel per line.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include <rc/start_stop.h>
+
+#include <settings.h>
+#include <thrust_map.h>
+#include <mix.h>
+#include <setpoint_manager.h>
+#include <state_estimator.h>
+#include <feedback.h>
+#include <bmp_manager.h>
+#include <batt_manager.h>
+#include <hal.h>
+#include <sim.h>
+#include <instrumentation.h>
+#include <scheduler.h>
+#include <arena.h>
+
+#define BENCH_DEFAULT_ITERS	1000000
+#define BENCH_REPEATS		3	// best of, to reject preemption and frequency ramps
+#define BENCH_WARMUP_SECONDS	5.0	// simulated flight before sampling, past take off
+#define BENCH_MAP_INPUTS	256	// spread of thrust inputs for map_motor_signal
+
+/**
+ * one kernel, run() executes it iters times
+ */
+typedef struct bench_kernel_t{
+	const char* name;
+	void (*run)(uint64_t iters);
+} bench_kernel_t;
+
+static volatile double sink;	// keeps the compiler from dropping results
+static double hover_mot[MAX_ROTORS];
+static double map_inputs[BENCH_MAP_INPUTS];
+static int perf_fd = -1;
+
+
+static uint64_t __now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief      Opens the user space cycle counter. Not every kernel or arm core
+ *             exposes one, in that case cycles are reported as null.
+ */
+static void __perf_open(void)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type		= PERF_TYPE_HARDWARE;
+	attr.size		= sizeof(attr);
+	attr.config		= PERF_COUNT_HW_CPU_CYCLES;
+	attr.disabled		= 1;
+	attr.exclude_kernel	= 1;
+	attr.exclude_hv		= 1;
+	perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void __perf_start(void)
+{
+	if(perf_fd<0) return;
+	ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+static int64_t __perf_stop(void)
+{
+	uint64_t count;
+	if(perf_fd<0) return -1;
+	ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+	if(read(perf_fd, &count, sizeof(count))!=sizeof(count)) return -1;
+	return (int64_t)count;
+}
+
+
+static void __run_feedback_march(uint64_t iters)
+{
+	uint64_t i;
+	for(i=0;i<iters;i++) feedback_march();
+}
+
+static void __run_mix_check_saturation(uint64_t iters)
+{
+	uint64_t i;
+	double min, max, acc = 0.0;
+	for(i=0;i<iters;i++){
+		mix_check_saturation(VEC_ROLL+(int)(i%3), hover_mot, &min, &max);
+		acc += max-min;
+	}
+	sink = acc;
+}
+
+static void __run_map_motor_signal(uint64_t iters)
+{
+	uint64_t i;
+	double acc = 0.0;
+	for(i=0;i<iters;i++) acc += map_motor_signal(map_inputs[i%BENCH_MAP_INPUTS]);
+	sink = acc;
+}
+
+static void __run_imu_march(uint64_t iters)
+{
+	uint64_t i;
+	for(i=0;i<iters;i++) state_estimator_bench_imu_march();
+}
+
+static void __run_altitude_march(uint64_t iters)
+{
+	uint64_t i;
+	for(i=0;i<iters;i++) state_estimator_bench_altitude_march();
+}
+
+/**
+ * a mocap sample every other loop like the sim sends them, each one has to
+ * re-run mocap_latency_ms worth of loops
+ */
+static void __run_position_march(uint64_t iters)
+{
+	uint64_t i;
+	mocap_sample_t m;
+
+	memset(&m, 0, sizeof(m));
+	memcpy(m.pos, state_estimate.pos_mocap, sizeof(m.pos));
+	m.quat[0] = 1.0;
+	for(i=0;i<iters;i++){
+		if((i&1)==0){
+			m.timestamp_ns = hal_time_ns();
+			m.count = state_estimate.mocap_count+1;
+			state_estimator_publish_mocap(&m);
+		}
+		state_estimator_bench_position_march();
+	}
+}
+
+static void __run_state_estimator_march(uint64_t iters)
+{
+	uint64_t i;
+	for(i=0;i<iters;i++) state_estimator_march();
+}
+
+/**
+ * same task table as the IMU callback in main.c, logging is off
+ */
+static void __isr(void)
+{
+	scheduler_tick();
+}
+
+static void __run_isr(uint64_t iters)
+{
+	uint64_t i;
+	for(i=0;i<iters;i++) __isr();
+}
+
+static const bench_kernel_t kernels[] = {
+	{"feedback_march",		__run_feedback_march},
+	{"mix_check_saturation",	__run_mix_check_saturation},
+	{"map_motor_signal",		__run_map_motor_signal},
+	{"imu_march",			__run_imu_march},
+	{"altitude_march",		__run_altitude_march},
+	{"position_march",		__run_position_march},
+	{"state_estimator_march",	__run_state_estimator_march},
+	{"isr",				__run_isr}
+};
+#define NUM_KERNELS (int)(sizeof(kernels)/sizeof(kernels[0]))
+
+
+/**
+ * @brief      Brings up every module the IMU callback needs against the sim
+ *             backend and flies into a hover so the kernels see real inputs.
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __setup(void)
+{
+	sim_result_t result;
+	double u_z;
+	int i;
+
+	// the benchmark must not write logs or talk to the network
+	settings.enable_logging = 0;
+	settings.enable_telemetry = 0;
+	settings.warnings_en = 0;
+
+	if(hal_init(HAL_SIM)) return -1;
+	if(arena_init(ARENA_BASE_BYTES)<0) return -1;
+	if(thrust_map_init(settings.thrust_map)<0) return -1;
+	if(mix_init(settings.layout)<0) return -1;
+	if(setpoint_manager_init()<0) return -1;
+	if(hal_imu_init(&mpu_data)<0) return -1;
+	if(bmp_manager_init()<0) return -1;
+	if(batt_manager_init()<0) return -1;
+	if(state_estimator_init()<0) return -1;
+	if(feedback_init()<0) return -1;
+	feedback_disarm();
+	hal_imu_set_callback(__isr);
+
+	arena_freeze();
+	rc_set_state(RUNNING);
+	if(sim_run(BENCH_WARMUP_SECONDS, &result)) return -1;
+	if(result.crashed || fstate.arm_state!=ARMED){
+		fprintf(stderr,"ERROR: warm up flight did not reach a hover\n");
+		return -1;
+	}
+
+	// motor thrusts with only the throttle applied, what the attitude
+	// channels get checked against in the feedback loop
+	u_z = fstate.u[VEC_Z];
+	for(i=0;i<MAX_ROTORS;i++) hover_mot[i] = 0.0;
+	mix_add_input(u_z, VEC_Z, hover_mot);
+	for(i=0;i<BENCH_MAP_INPUTS;i++){
+		map_inputs[i] = -u_z + 0.2*((double)i/(BENCH_MAP_INPUTS-1)-0.5);
+	}
+	return 0;
+}
+
+static void __teardown(void)
+{
+	rc_set_state(EXITING);
+	hal_imu_power_off();
+	bmp_manager_cleanup();
+	batt_manager_cleanup();
+	feedback_cleanup();
+	setpoint_manager_cleanup();
+	state_estimator_cleanup();
+	hal_cleanup();
+}
+
+
+static void __print_usage(void)
+{
+	printf("\n");
+	printf(" Usage: rc_pilot_bench [options] {settings file}\n");
+	printf(" -n {iterations}    calls per kernel and repeat, default %d\n", BENCH_DEFAULT_ITERS);
+	printf(" -k {kernel}        only run this kernel, may be repeated\n");
+	printf(" -l                 list kernels\n");
+	printf(" -h                 print this help message\n");
+	printf("\n");
+}
+
+static int __selected(const char* name, char** only, int n_only)
+{
+	int i;
+	if(n_only==0) return 1;
+	for(i=0;i<n_only;i++) if(strcmp(name, only[i])==0) return 1;
+	return 0;
+}
+
+
+int main(int argc, char** argv)
+{
+	int c, k, r;
+	uint64_t iters = BENCH_DEFAULT_ITERS;
+	uint64_t t0, ns, best_ns;
+	int64_t cyc, best_cyc;
+	char* only[NUM_KERNELS];
+	int n_only = 0;
+	FILE* out;
+
+	while((c = getopt(argc, argv, "n:k:lh")) != -1){
+		switch(c){
+		case 'n':
+			iters = strtoull(optarg, NULL, 10);
+			if(iters==0){
+				fprintf(stderr,"ERROR: iterations must be positive\n");
+				return -1;
+			}
+			break;
+		case 'k':
+			if(n_only<NUM_KERNELS) only[n_only++] = optarg;
+			break;
+		case 'l':
+			for(k=0;k<NUM_KERNELS;k++) printf("%s\n", kernels[k].name);
+			return 0;
+		case 'h':
+			__print_usage();
+			return 0;
+		default:
+			__print_usage();
+			return -1;
+		}
+	}
+	if(optind!=argc-1){
+		__print_usage();
+		return -1;
+	}
+
+	// the flight code prints to stdout along the way, send that to stderr
+	// and keep stdout for results only
+	out = fdopen(dup(STDOUT_FILENO), "w");
+	if(out==NULL || dup2(STDERR_FILENO, STDOUT_FILENO)<0){
+		fprintf(stderr,"ERROR: failed to redirect stdout\n");
+		return -1;
+	}
+
+	if(settings_load_from_file(argv[optind])<0){
+		fprintf(stderr,"ERROR: failed to load settings from %s\n", argv[optind]);
+		return -1;
+	}
+	instr_set_loop_hz(settings.feedback_hz);
+	if(scheduler_init()<0) return -1;
+	if(__setup()){
+		fprintf(stderr,"ERROR: failed to set up %s\n", argv[optind]);
+		return -1;
+	}
+	__perf_open();
+
+	for(k=0;k<NUM_KERNELS;k++){
+		if(!__selected(kernels[k].name, only, n_only)) continue;
+		kernels[k].run(iters/10+1); // warm caches and branch predictors
+		best_ns = UINT64_MAX;
+		best_cyc = -1;
+		for(r=0;r<BENCH_REPEATS;r++){
+			__perf_start();
+			t0 = __now_ns();
+			kernels[k].run(iters);
+			ns = __now_ns()-t0;
+			cyc = __perf_stop();
+			if(ns<best_ns){
+				best_ns = ns;
+				best_cyc = cyc;
+			}
+		}
+		fprintf(out, "{\"settings\":\"%s\",\"kernel\":\"%s\",\"iters\":%llu,"
+			"\"ns_per_call\":%.2f,\"cycles_per_call\":",
+			settings.name, kernels[k].name, (unsigned long long)iters,
+			(double)best_ns/iters);
+		if(best_cyc<0) fprintf(out, "null}\n");
+		else fprintf(out, "%.2f}\n", (double)best_cyc/iters);
+		fflush(out);
+	}
+
+	if(perf_fd>=0) close(perf_fd);
+	__teardown();
+	fclose(out);
+	return 0;
+}
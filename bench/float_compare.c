@@ -0,0 +1,319 @@
+/**
+ * @file float_compare.c
+ *
+ * Checks that the float32 build of the control kernels, NEON included where
+ * the compiler targets it, stays within FLOAT_COMPARE_TOL of the default
+ * double build. Run both builds with "make float32check".
+ *
+ * The same program is built twice. The double build runs a fixed
+ * pseudo-random set of inputs through every kernel real.h switches over and
+ * writes the results with -w, the float32 build runs the same inputs and
+ * compares against that file with -c:
+ *
+ *  - controller_march() of the four controllers in the settings file
+ *  - mix_allocate() for every built in layout and a 12 rotor custom one
+ *  - map_motor_signal() for every thrust map
+ *  - quaternion normalization and Tait-Bryan angles of the estimator
+ *
+ * A result passes if it is within FLOAT_COMPARE_TOL of the reference, scaled
+ * by the reference where that is larger than 1. Exits non zero if any fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <settings.h>
+#include <controller.h>
+#include <thrust_map.h>
+#include <mix.h>
+#include <state_estimator.h>
+#include <rc_pilot_defs.h>
+#include <arena.h>
+
+#define FLOAT_COMPARE_TOL		1e-4	///< same as the replay divergence threshold
+#define FLOAT_COMPARE_SEQUENCES		20	///< controller resets
+#define FLOAT_COMPARE_STEPS		500	///< controller steps between resets
+#define FLOAT_COMPARE_ALLOCATIONS	20000	///< per layout
+#define FLOAT_COMPARE_MAP_INPUTS	1001
+#define FLOAT_COMPARE_QUATS		20000
+#define FLOAT_COMPARE_CUSTOM_ROTORS	12
+
+static uint64_t rng_state = 0x2545F4914F6CDD1DULL;
+
+// either writing the reference or comparing against one
+static FILE* ref_file;
+static int comparing;
+static long num_checked;
+static long num_failed;
+static double worst_err;
+static char worst_name[64];
+
+
+/**
+ * @brief      xorshift64*, uniform on [0,1), same sequence in both builds
+ */
+static double __rand(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return ((rng_state*0x2545F4914F6CDD1DULL) >> 11) * (1.0/9007199254740992.0);
+}
+
+
+/**
+ * @brief      writes one result, or reads the reference for it and checks it
+ *
+ * @return     0 on success, -1 if the reference file doesn't line up
+ */
+static int __result(const char* name, long i, double v)
+{
+	char ref_name[64];
+	long ref_i;
+	double ref, err;
+
+	if(!comparing){
+		fprintf(ref_file, "%s %ld %a\n", name, i, v);
+		return 0;
+	}
+	if(fscanf(ref_file, "%63s %ld %la", ref_name, &ref_i, &ref)!=3 ||
+	   strcmp(ref_name, name) || ref_i!=i){
+		fprintf(stderr,"ERROR: reference file doesn't match at %s %ld\n", name, i);
+		return -1;
+	}
+	num_checked++;
+	// yaw near +-PI may come out on either side
+	if(!strcmp(name, "tb")) err = fabs(remainder(v-ref, 2.0*M_PI));
+	else err = fabs(v-ref)/fmax(1.0, fabs(ref));
+	if(err>worst_err){
+		worst_err = err;
+		snprintf(worst_name, sizeof(worst_name), "%s %ld", name, i);
+	}
+	if(!(err<=FLOAT_COMPARE_TOL)){
+		if(num_failed<10){
+			printf("%s %ld: %.9g, reference %.9g\n", name, i, v, ref);
+		}
+		num_failed++;
+	}
+	return 0;
+}
+
+
+static int __controllers(void)
+{
+	static const char* const names[4] = {"roll", "pitch", "yaw", "altitude"};
+	controller_t c[4];
+	double in = 0.0;
+	long i;
+	int k, s;
+
+	c[0] = settings.roll_controller;
+	c[1] = settings.pitch_controller;
+	c[2] = settings.yaw_controller;
+	c[3] = settings.altitude_controller;
+	for(k=0;k<4;k++){
+		for(s=0;s<FLOAT_COMPARE_SEQUENCES;s++){
+			if(controller_reset(&c[k])) return -1;
+			// a slowly wandering error with some noise on top
+			for(i=0;i<FLOAT_COMPARE_STEPS;i++){
+				in = 0.98*in + 0.02*(2.0*__rand()-1.0)*0.5 + 0.002*(2.0*__rand()-1.0);
+				if(__result(names[k], s*FLOAT_COMPARE_STEPS+i, controller_march(&c[k], in))) return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+static double __input(int ch, double min, double max, void* ctx)
+{
+	double u = ((double*)ctx)[ch];
+
+	if(u>max) u = max;
+	else if(u<min) u = min;
+	return u;
+}
+
+
+static int __allocate(const char* name, int rotors, int dof)
+{
+	static const double limit[MAX_INPUTS] = {
+		[VEC_X]		= MAX_X_COMPONENT,
+		[VEC_Y]		= MAX_Y_COMPONENT,
+		[VEC_Z]		= 0.0,
+		[VEC_ROLL]	= MAX_ROLL_COMPONENT,
+		[VEC_PITCH]	= MAX_PITCH_COMPONENT,
+		[VEC_YAW]	= MAX_YAW_COMPONENT
+	};
+	double want[MAX_INPUTS], u[MAX_INPUTS], mot[MAX_ROTORS];
+	long n;
+	int i;
+
+	for(n=0;n<FLOAT_COMPARE_ALLOCATIONS;n++){
+		want[VEC_Z] = -1.2*__rand();
+		for(i=0;i<MAX_INPUTS;i++){
+			if(i!=VEC_Z) want[i] = (2.0*__rand()-1.0)*1.5*limit[i];
+		}
+		if(mix_allocate(dof, limit, __input, want, u, mot)) return -1;
+		for(i=0;i<rotors;i++){
+			if(__result(name, n*MAX_ROTORS+i, mot[i])) return -1;
+		}
+	}
+	return 0;
+}
+
+
+static int __mixers(void)
+{
+	static const struct{
+		const char* name;
+		rotor_layout_t layout;
+		int rotors;
+		int dof;
+	} layouts[] = {
+		{"mix_4x",		LAYOUT_4X,			4, 4},
+		{"mix_4plus",		LAYOUT_4PLUS,			4, 4},
+		{"mix_6x",		LAYOUT_6X,			6, 4},
+		{"mix_8x",		LAYOUT_8X,			8, 4},
+		{"mix_rotorbits",	LAYOUT_6DOF_ROTORBITS,		6, 6},
+		{"mix_monocoque",	LAYOUT_6DOF_5INCH_MONOCOQUE,	6, 6}
+	};
+	double a;
+	int i;
+
+	for(i=0;i<(int)(sizeof(layouts)/sizeof(layouts[0]));i++){
+		if(mix_init(layouts[i].layout)) return -1;
+		if(__allocate(layouts[i].name, layouts[i].rotors, layouts[i].dof)) return -1;
+	}
+
+	// the generic kernel, three NEON registers
+	settings.num_rotors = FLOAT_COMPARE_CUSTOM_ROTORS;
+	settings.dof = 4;
+	settings.custom_by_geometry = 1;
+	for(i=0;i<FLOAT_COMPARE_CUSTOM_ROTORS;i++){
+		a = (i+0.5)*2.0*M_PI/FLOAT_COMPARE_CUSTOM_ROTORS;
+		settings.custom_rotors[i].x = 0.3*cos(a);
+		settings.custom_rotors[i].y = 0.3*sin(a);
+		settings.custom_rotors[i].ccw = !(i&1);
+	}
+	if(mix_init(LAYOUT_CUSTOM)) return -1;
+	return __allocate("mix_custom12", FLOAT_COMPARE_CUSTOM_ROTORS, 4);
+}
+
+
+static int __thrust_maps(void)
+{
+	static const char* const names[] = {"map_linear", "map_mn1806", "map_f20", "map_rx2206"};
+	static const thrust_map_t maps[] = {LINEAR_MAP, MN1806_1400KV_4S, F20_2300KV_2S, RX2206_4S};
+	long i;
+	int k;
+
+	for(k=0;k<(int)(sizeof(maps)/sizeof(maps[0]));k++){
+		if(thrust_map_init(maps[k])) return -1;
+		for(i=0;i<FLOAT_COMPARE_MAP_INPUTS;i++){
+			if(__result(names[k], i, map_motor_signal((double)i/(FLOAT_COMPARE_MAP_INPUTS-1)))) return -1;
+		}
+	}
+	return 0;
+}
+
+
+static int __quaternions(void)
+{
+	double r, p, y, s, q[4];
+	long n;
+	int i;
+
+	for(n=0;n<FLOAT_COMPARE_QUATS;n++){
+		// any heading, roll and pitch up to the tipover angle, so the gimbal
+		// lock at 90 degrees pitch where float asin() loses it stays out
+		r = (2.0*__rand()-1.0)*TIP_ANGLE;
+		p = (2.0*__rand()-1.0)*TIP_ANGLE;
+		y = (2.0*__rand()-1.0)*M_PI;
+		q[0] = cos(r/2)*cos(p/2)*cos(y/2) + sin(r/2)*sin(p/2)*sin(y/2);
+		q[1] = sin(r/2)*cos(p/2)*cos(y/2) - cos(r/2)*sin(p/2)*sin(y/2);
+		q[2] = cos(r/2)*sin(p/2)*cos(y/2) + sin(r/2)*cos(p/2)*sin(y/2);
+		q[3] = cos(r/2)*cos(p/2)*sin(y/2) - sin(r/2)*sin(p/2)*cos(y/2);
+		// slightly off unit length like the DMP gives, in its axis order
+		s = 1.0 + 0.01*(2.0*__rand()-1.0);
+		mpu_data.dmp_quat[0] =  s*q[0];
+		mpu_data.dmp_quat[1] =  s*q[2];
+		mpu_data.dmp_quat[2] =  s*q[1];
+		mpu_data.dmp_quat[3] = -s*q[3];
+		state_estimator_bench_imu_march();
+		for(i=0;i<4;i++){
+			if(__result("quat", n*7+i, state_estimate.quat_imu[i])) return -1;
+		}
+		for(i=0;i<3;i++){
+			if(__result("tb", n*7+4+i, state_estimate.tb_imu[i])) return -1;
+		}
+	}
+	return 0;
+}
+
+
+static void __print_usage(void)
+{
+	printf("\n");
+	printf("rc_pilot_float_compare -w {ref} {settings file}\n");
+	printf("rc_pilot_float_compare -c {ref} {settings file}\n");
+	printf(" -w {ref}  write the results to ref, run the double build\n");
+	printf(" -c {ref}  compare the results against ref, run the float32 build\n");
+	printf("\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char* ref_path = NULL;
+	int c;
+
+	while((c = getopt(argc, argv, "w:c:h")) != -1){
+		switch(c){
+		case 'w':
+			ref_path = optarg;
+			comparing = 0;
+			break;
+		case 'c':
+			ref_path = optarg;
+			comparing = 1;
+			break;
+		case 'h':
+			__print_usage();
+			return 0;
+		default:
+			__print_usage();
+			return -1;
+		}
+	}
+	if(ref_path==NULL || optind!=argc-1){
+		__print_usage();
+		return -1;
+	}
+
+	if(settings_load_from_file(argv[optind])<0){
+		fprintf(stderr,"ERROR: failed to load settings from %s\n", argv[optind]);
+		return -1;
+	}
+	if(arena_init(ARENA_BASE_BYTES)<0) return -1;
+	ref_file = fopen(ref_path, comparing ? "r" : "w");
+	if(ref_file==NULL){
+		fprintf(stderr,"ERROR: failed to open %s\n", ref_path);
+		return -1;
+	}
+
+	if(__controllers() || __mixers() || __thrust_maps() || __quaternions()){
+		fclose(ref_file);
+		return -1;
+	}
+	fclose(ref_file);
+
+	if(!comparing) return 0;
+	printf("%s: %ld of %ld results beyond %g, worst %.3g at %s\n", settings.name,
+		num_failed, num_checked, FLOAT_COMPARE_TOL, worst_err, worst_name);
+	return num_failed ? 1 : 0;
+}
@@ -0,0 +1,219 @@
+/**
+ * @file mix_compare.c
+ *
+ * Checks that mix_allocate() gives the same result as the original
+ * allocation, mix_check_saturation() then mix_add_input() for every channel
+ * in priority order, build and run it with "make mix_compare".
+ *
+ * Every built in layout, plus a 12 rotor custom one for the generic kernel,
+ * is fed random inputs through both paths. The callback returns the input
+ * saturated to the range it is given most of the time and unsaturated
+ * otherwise, so the motor clamping is exercised too. The ranges handed to
+ * the callback, the inputs and the motor signals must match bit for bit.
+ *
+ * Prints one line per layout and exits non zero on the first mismatch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <settings.h>
+#include <mix.h>
+#include <rc_pilot_defs.h>
+
+#define MIX_COMPARE_DEFAULT_TRIALS	100000
+#define MIX_COMPARE_UNSATURATED		5	// 1 in this many inputs ignore the range
+#define MIX_COMPARE_CUSTOM_ROTORS	12
+
+/**
+ * what one allocation saw and produced
+ */
+typedef struct mix_compare_run_t{
+	double min[MAX_INPUTS];
+	double max[MAX_INPUTS];
+	double u[MAX_INPUTS];
+	double mot[MAX_ROTORS];
+} mix_compare_run_t;
+
+/**
+ * raw inputs of one trial, handed to the callback through ctx
+ */
+typedef struct mix_compare_trial_t{
+	double want[MAX_INPUTS];
+	int unsaturated[MAX_INPUTS];
+	mix_compare_run_t* run;
+} mix_compare_trial_t;
+
+// same order mix_allocate() hands out authority in
+static const int priority[MAX_INPUTS] = \
+	{VEC_Z, VEC_ROLL, VEC_PITCH, VEC_YAW, VEC_X, VEC_Y};
+
+static uint64_t rng_state = 0x2545F4914F6CDD1DULL;
+
+
+/**
+ * @brief      xorshift64*, uniform on [0,1)
+ */
+static double __rand(void)
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return ((rng_state*0x2545F4914F6CDD1DULL) >> 11) * (1.0/9007199254740992.0);
+}
+
+
+static double __input(int ch, double min, double max, void* ctx)
+{
+	mix_compare_trial_t* t = (mix_compare_trial_t*)ctx;
+	double u = t->want[ch];
+
+	t->run->min[ch] = min;
+	t->run->max[ch] = max;
+	if(!t->unsaturated[ch]){
+		if(u>max) u = max;
+		else if(u<min) u = min;
+	}
+	t->run->u[ch] = u;
+	return u;
+}
+
+
+/**
+ * @brief      the allocation as feedback_march() did it before mix_allocate()
+ */
+static int __reference(int n_inputs, const double* limit, mix_compare_trial_t* t)
+{
+	int k, ch;
+	double min, max;
+
+	for(k=0;k<MAX_ROTORS;k++) t->run->mot[k] = 0.0;
+	for(k=0;k<n_inputs;k++){
+		ch = priority[k];
+		if(ch==VEC_Z){
+			min = -DBL_MAX;
+			max = DBL_MAX;
+		}
+		else{
+			if(mix_check_saturation(ch, t->run->mot, &min, &max)) return -1;
+			if(max>limit[ch])  max =  limit[ch];
+			if(min<-limit[ch]) min = -limit[ch];
+		}
+		if(mix_add_input(__input(ch, min, max, t), ch, t->run->mot)) return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      runs trials random allocations through both paths
+ *
+ * @return     0 if all of them match, -1 otherwise
+ */
+static int __compare(const char* name, int rotors, int dof, long trials)
+{
+	static const double limit[MAX_INPUTS] = {
+		[VEC_X]		= MAX_X_COMPONENT,
+		[VEC_Y]		= MAX_Y_COMPONENT,
+		[VEC_Z]		= 0.0,
+		[VEC_ROLL]	= MAX_ROLL_COMPONENT,
+		[VEC_PITCH]	= MAX_PITCH_COMPONENT,
+		[VEC_YAW]	= MAX_YAW_COMPONENT
+	};
+	mix_compare_run_t ref, fused;
+	mix_compare_trial_t t;
+	int i, n_inputs;
+	long n;
+
+	for(n=0;n<trials;n++){
+		n_inputs = (dof==6 && __rand()<0.5) ? 6 : 4;
+		// throttle anywhere from off to past full, the rest past its limit
+		t.want[VEC_Z] = -1.2*__rand();
+		for(i=0;i<MAX_INPUTS;i++){
+			if(i!=VEC_Z) t.want[i] = (2.0*__rand()-1.0)*1.5*limit[i];
+			t.unsaturated[i] = __rand()*MIX_COMPARE_UNSATURATED<1.0;
+		}
+
+		memset(&ref, 0, sizeof(ref));
+		memset(&fused, 0, sizeof(fused));
+		t.run = &ref;
+		if(__reference(n_inputs, limit, &t)) return -1;
+		t.run = &fused;
+		if(mix_allocate(n_inputs, limit, __input, &t, fused.u, fused.mot)) return -1;
+
+		if(memcmp(&ref, &fused, sizeof(ref))){
+			printf("%s: MISMATCH in trial %ld with %d inputs\n", name, n, n_inputs);
+			for(i=0;i<MAX_INPUTS;i++){
+				printf("  ch %d  min %.17g %.17g  max %.17g %.17g  u %.17g %.17g\n", i,
+					ref.min[i], fused.min[i], ref.max[i], fused.max[i], ref.u[i], fused.u[i]);
+			}
+			for(i=0;i<rotors;i++){
+				printf("  mot %d  %.17g %.17g\n", i+1, ref.mot[i], fused.mot[i]);
+			}
+			return -1;
+		}
+	}
+	printf("%s: %ld allocations identical\n", name, trials);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	static const struct{
+		const char* name;
+		rotor_layout_t layout;
+		int rotors;
+		int dof;
+	} layouts[] = {
+		{"LAYOUT_4X",			LAYOUT_4X,			4, 4},
+		{"LAYOUT_4PLUS",		LAYOUT_4PLUS,			4, 4},
+		{"LAYOUT_6X",			LAYOUT_6X,			6, 4},
+		{"LAYOUT_8X",			LAYOUT_8X,			8, 4},
+		{"LAYOUT_6DOF_ROTORBITS",	LAYOUT_6DOF_ROTORBITS,		6, 6},
+		{"LAYOUT_6DOF_5INCH_MONOCOQUE",	LAYOUT_6DOF_5INCH_MONOCOQUE,	6, 6}
+	};
+	long trials = MIX_COMPARE_DEFAULT_TRIALS;
+	double a;
+	int c, i, failed = 0;
+
+	while((c = getopt(argc, argv, "n:s:")) != -1){
+		switch(c){
+		case 'n':
+			trials = atol(optarg);
+			break;
+		case 's':
+			rng_state = strtoull(optarg, NULL, 0);
+			if(rng_state==0) rng_state = 1;
+			break;
+		default:
+			fprintf(stderr,"usage: %s [-n trials] [-s seed]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	for(i=0;i<(int)(sizeof(layouts)/sizeof(layouts[0]));i++){
+		if(mix_init(layouts[i].layout)) return 1;
+		if(__compare(layouts[i].name, layouts[i].rotors, layouts[i].dof, trials)) failed = 1;
+	}
+
+	// evenly spaced, alternating spin, runs the kernel for any rotor count
+	memset(&settings, 0, sizeof(settings));
+	settings.num_rotors = MIX_COMPARE_CUSTOM_ROTORS;
+	settings.dof = 4;
+	settings.custom_by_geometry = 1;
+	for(i=0;i<MIX_COMPARE_CUSTOM_ROTORS;i++){
+		a = (i+0.5)*2.0*M_PI/MIX_COMPARE_CUSTOM_ROTORS;
+		settings.custom_rotors[i].x = 0.3*cos(a);
+		settings.custom_rotors[i].y = 0.3*sin(a);
+		settings.custom_rotors[i].ccw = !(i&1);
+	}
+	if(mix_init(LAYOUT_CUSTOM)) return 1;
+	if(__compare("LAYOUT_CUSTOM 12 rotors", MIX_COMPARE_CUSTOM_ROTORS, 4, trials)) failed = 1;
+
+	return failed;
+}
@@ -0,0 +1,85 @@
+/**
+ * <arena.h>
+ *
+ * @brief      Start up memory arena for everything the control path keeps
+ *             on the heap.
+ *
+ * One block sized from the settings is allocated by arena_init() right
+ * after the settings are loaded. Modules carve their long lived buffers out
+ * of it with arena_alloc() while they initialize: the thrust map tables and
+ * the log ring so far, the controllers and filters are fixed size structs
+ * and need nothing. arena_freeze() is called just before
+ * rc_set_state(RUNNING), after which arena_alloc() fails, so memory use is
+ * fixed for the whole flight and the control path never takes an allocator
+ * lock. arena_alloc() itself takes a mutex as start up phases run in
+ * parallel.
+ *
+ * Built with -D RC_PILOT_ALLOC_DEBUG ("make allocdebug") malloc, calloc,
+ * realloc and free are wrapped. Once armed, every call made from the thread
+ * that registered with arena_watch_thread() is recorded with its caller
+ * address and listed by arena_print_report(). Resolve the rc_pilot+offset
+ * addresses with addr2line -e bin/rc_pilot.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define ARENA_BASE_BYTES	(64*1024)	///< room for everything but the log ring
+#define ARENA_ALIGN		16		///< alignment of every arena_alloc() block
+#define ARENA_MAX_RECORDS	32		///< allocations remembered in debug mode
+
+/**
+ * @brief      Allocates and prefaults the arena. Call once after the
+ *             settings are loaded, before any module is initialized.
+ *
+ * @param[in]  bytes  arena size
+ *
+ * @return     0 on success, -1 on failure
+ */
+int arena_init(size_t bytes);
+
+/**
+ * @brief      Carves a zeroed block out of the arena. Blocks are never
+ *             freed individually.
+ *
+ * @param[in]  bytes  block size
+ *
+ * @return     pointer to the block, NULL if the arena is frozen or full
+ */
+void* arena_alloc(size_t bytes);
+
+/**
+ * @brief      Stops any further arena_alloc(). Call right before
+ *             rc_set_state(RUNNING).
+ */
+void arena_freeze(void);
+
+/**
+ * @brief      Marks the calling thread as the control thread whose heap use
+ *             is recorded in debug mode. Call from the IMU callback.
+ */
+void arena_watch_thread(void);
+
+/**
+ * @brief      Tells the debug hook whether the vehicle is armed, only
+ *             allocations made while armed are recorded.
+ *
+ * @param[in]  armed  1 when arming, 0 when disarming
+ */
+void arena_watch_armed(int armed);
+
+/**
+ * @brief      Prints arena usage and, in debug mode, the allocations the
+ *             control thread made while armed.
+ *
+ * @param      f     stream to print to
+ *
+ * @return     number of allocations recorded while armed, always 0 without
+ *             RC_PILOT_ALLOC_DEBUG
+ */
+int arena_print_report(FILE* f);
+
+#endif // ARENA_H
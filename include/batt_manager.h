@@ -0,0 +1,69 @@
+/**
+ * <batt_manager.h>
+ *
+ * @brief      Battery sampling thread.
+ *
+ * The battery voltage comes from an IIO sysfs read of the barrel jack ADC,
+ * which is a syscall and a string conversion the IMU callback shouldn't pay
+ * for. This low priority thread reads it every BATT_HZ task period, runs the
+ * moving average and publishes the filtered voltage along with the gain
+ * compensation factor settings.v_nominal/v_lp through a seqlock. The
+ * battery task of the IMU callback only copies the newest sample into
+ * state_estimate and the controllers multiply by the cached factor.
+ *
+ * When the HAL backend is not real time (sim and replay) no thread is
+ * started and batt_manager_request_sample() does the read and filter inline
+ * instead, so those stay in lock step with the control loop.
+ */
+
+#ifndef BATT_MANAGER_H
+#define BATT_MANAGER_H
+
+#include <stdint.h>
+
+/**
+ * One filtered battery reading.
+ */
+typedef struct batt_sample_t{
+	double v_raw;		///< pack voltage from hal_batt_read(), v_nominal if no battery
+	double v_lp;		///< moving average of v_raw
+	double gain_scale;	///< settings.v_nominal/v_lp, controller gain compensation
+	uint64_t timestamp_ns;	///< hal_time_ns() when the read finished
+	uint64_t count;		///< increments with every new sample, 0 means none yet
+} batt_sample_t;
+
+/**
+ * @brief      Sets up the filter, takes a first reading synchronously then
+ *             starts the battery thread if the HAL backend is real time.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int batt_manager_init(void);
+
+/**
+ * @brief      Takes a sample inline when there is no thread, does nothing
+ *             otherwise. Called from the BATT_HZ task of the IMU callback.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int batt_manager_request_sample(void);
+
+/**
+ * @brief      Copy out the newest sample. Never blocks. Compare the count
+ *             field against the previous sample to see if it is fresh.
+ *
+ * @param[out] sample  Where to put the sample, left untouched on failure
+ *
+ * @return     0 on success, -1 if the thread was halfway through publishing
+ *             a sample, try again next time
+ */
+int batt_manager_get_latest(batt_sample_t* sample);
+
+/**
+ * @brief      Stops the battery thread.
+ *
+ * @return     0 on clean exit, -1 on exit time out/force close
+ */
+int batt_manager_cleanup(void);
+
+#endif // BATT_MANAGER_H
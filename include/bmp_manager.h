@@ -0,0 +1,74 @@
+/**
+ * <bmp_manager.h>
+ *
+ * @brief      Barometer sampling thread.
+ *
+ * The BMP280 shares the i2c bus with the IMU so reading it from the IMU
+ * callback stalls a loop every BMP_HZ for the length of the transfer.
+ * Instead the IMU callback asks for a sample right after feedback_march()
+ * and this lower priority thread performs the read in the idle time before
+ * the next DMP interrupt. Samples are published through a seqlock so the
+ * state estimator can pick up the newest one without ever blocking.
+ *
+ * With imu_mode "raw" the HAL polls the IMU itself, and hal_bmp_read() and
+ * the poll share a bus lock, so a barometer transfer that runs late delays
+ * the next poll instead of interleaving with it. The DMP's own reads happen
+ * inside librobotcontrol's interrupt thread, outside that lock, so in DMP
+ * mode only the timing above keeps them apart.
+ *
+ * When the HAL backend is not real time (the simulator) there is no idle time
+ * to hand the read off into, so no thread is started and the read happens
+ * inline in bmp_manager_request_sample() instead.
+ */
+
+#ifndef BMP_MANAGER_H
+#define BMP_MANAGER_H
+
+#include <stdint.h>
+#include <rc/bmp.h>
+
+/**
+ * One barometer reading along with when it was taken.
+ */
+typedef struct bmp_sample_t{
+	rc_bmp_data_t data;	///< reading from hal_bmp_read()
+	uint64_t timestamp_ns;	///< hal_time_ns() when the read finished
+	uint64_t count;		///< increments with every new sample, 0 means none yet
+} bmp_sample_t;
+
+/**
+ * @brief      Takes a first reading synchronously then starts the barometer
+ *             thread. With the rc HAL backend rc_bmp_init() must be
+ *             called first.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int bmp_manager_init(void);
+
+/**
+ * @brief      Ask the thread to take a new reading. Never blocks, meant to be
+ *             called from the IMU callback.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int bmp_manager_request_sample(void);
+
+/**
+ * @brief      Copy out the newest sample. Never blocks. Compare the count
+ *             field against the previous sample to see if it is fresh.
+ *
+ * @param[out] sample  Where to put the sample, left untouched on failure
+ *
+ * @return     0 on success, -1 if the thread was halfway through publishing
+ *             a sample, try again next loop
+ */
+int bmp_manager_get_latest(bmp_sample_t* sample);
+
+/**
+ * @brief      Stops the barometer thread.
+ *
+ * @return     0 on clean exit, -1 on exit time out/force close
+ */
+int bmp_manager_cleanup(void);
+
+#endif // BMP_MANAGER_H
@@ -0,0 +1,184 @@
+/**
+ * <controller.h>
+ *
+ * @brief      Fixed size, allocation free discrete controllers for the
+ *             feedback loop.
+ *
+ * Controllers are still described in the settings file as transfer functions
+ * or PID gains and discretized with the librobotcontrol rc_filter functions.
+ * The resulting rc_filter_t is then compiled into a controller_t: one plain
+ * struct with the coefficients and input/output history stored inline,
+ * zero padded to CONTROLLER_MAX_ORDER. That can be copied by assignment and
+ * marched with fixed length loops and no pointer chasing, while giving the
+ * same output as rc_filter_march() for the same filter. A PID with filtered
+ * derivative from rc_filter_pid() is a single second order section. The
+ * description itself is kept as a controller_spec_t so a controller can be
+ * rebuilt by controller_from_spec() when it is retuned while running.
+ *
+ * Marching is split in two halves so several axes can be stepped together.
+ * controller_march_raw() pushes new inputs into a contiguous array of
+ * controllers and computes their unsaturated outputs in one pass. Then
+ * controller_commit() is called on each one after its saturation limits are
+ * known, which applies soft start and saturation and updates the output
+ * history. controller_march() does both for a single controller.
+ *
+ * Coefficients, history and limits are real_t, see real.h, so the float32
+ * build steps the controllers in single precision. The functions still take
+ * and return double.
+ */
+
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include <stdint.h>
+#include <rc/math/filter.h>
+
+#include <real.h>
+
+#define CONTROLLER_MAX_ORDER	4	///< highest order transfer function supported
+
+/**
+ * Discrete transfer function controller. Coefficients and state live next
+ * to each other, unused coefficients beyond order are zero.
+ */
+typedef struct controller_t{
+	real_t gain;				///< scales the numerator, may be changed between steps
+	real_t num[CONTROLLER_MAX_ORDER+1];	///< numerator, num[0] multiplies newest input
+	real_t den[CONTROLLER_MAX_ORDER+1];	///< denominator, den[0] normalizes the output
+	real_t in[CONTROLLER_MAX_ORDER+1];	///< input history, in[0] is newest
+	real_t out[CONTROLLER_MAX_ORDER];	///< output history, out[0] is newest
+	real_t raw;				///< unsaturated output of the step in progress
+	real_t sat_min;
+	real_t sat_max;
+	double ss_steps;			///< soft start length in steps
+	double dt;				///< timestep in seconds
+	uint64_t step;				///< steps since reset
+	int order;
+	int sat_en;
+	int sat_flag;				///< 1 if the last output was saturated
+	int ss_en;
+	int initialized;
+} controller_t;
+
+#define CONTROLLER_INITIALIZER {.initialized = 0}
+
+/**
+ * A controller as described in the settings file, kept so it can be
+ * discretized again when a coefficient is changed while running.
+ */
+typedef struct controller_spec_t{
+	int pid;				///< 1 for kp, ki, kd, 0 for a transfer function
+	int continuous;				///< transfer function is continuous time, discretized with tustin
+	double gain;				///< multiplies the discretized controller
+	double kp;
+	double ki;
+	double kd;
+	double crossover_freq;			///< rad/s, PID derivative filter or tustin prewarp frequency
+	int num_len;
+	int den_len;
+	double num[CONTROLLER_MAX_ORDER+1];	///< transfer function numerator, highest power first
+	double den[CONTROLLER_MAX_ORDER+1];	///< transfer function denominator, highest power first
+} controller_spec_t;
+
+/**
+ * @brief      Compile an rc_filter_t into a controller. The rc_filter_t is not
+ *             modified and may be freed afterwards.
+ *
+ * Saturation and soft start settings are copied along with the
+ * coefficients, history starts at zero.
+ *
+ * @param[out] c     The controller
+ * @param[in]  f     An initialized filter of order <= CONTROLLER_MAX_ORDER
+ *
+ * @return     0 on success, -1 on failure
+ */
+int controller_from_filter(controller_t* c, rc_filter_t f);
+
+/**
+ * @brief      Discretize a controller description at timestep dt and compile
+ *             it into a controller. Allocates temporarily through rc_filter,
+ *             so never call it from the control thread.
+ *
+ * @param[out] c     The controller
+ * @param[in]  s     The description
+ * @param[in]  dt    timestep in seconds
+ *
+ * @return     0 on success, -1 on failure
+ */
+int controller_from_spec(controller_t* c, const controller_spec_t* s, double dt);
+
+/**
+ * @brief      Zero the input and output history and the step counter.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int controller_reset(controller_t* c);
+
+/**
+ * @brief      Enable saturation of the output between min and max.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int controller_enable_saturation(controller_t* c, double min, double max);
+
+/**
+ * @brief      Ramp the saturation limits up from zero over the given time
+ *             after every reset. Saturation must be enabled first.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int controller_enable_soft_start(controller_t* c, double seconds);
+
+/**
+ * @brief      Fill the input history with a value.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int controller_prefill_inputs(controller_t* c, double in);
+
+/**
+ * @brief      Fill the output history with a value.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int controller_prefill_outputs(controller_t* c, double out);
+
+/**
+ * @brief      First half of a step for n contiguous controllers. Pushes in[i]
+ *             into controller i and stores its unsaturated output in the raw
+ *             field. No error checking, this is for the hot path.
+ *
+ * @param      c     array of n initialized controllers
+ * @param[in]  in    n new inputs
+ * @param[in]  n     number of controllers
+ */
+void controller_march_raw(controller_t* c, const double* in, int n);
+
+/**
+ * @brief      Second half of a step. Applies soft start and saturation to the
+ *             raw output and pushes it into the output history.
+ *
+ * @param      c     controller that had controller_march_raw() called on it
+ *
+ * @return     the new output
+ */
+double controller_commit(controller_t* c);
+
+/**
+ * @brief      march one controller a full step, same as rc_filter_march()
+ *
+ * @param      c     The controller
+ * @param[in]  in    new input
+ *
+ * @return     the new output
+ */
+double controller_march(controller_t* c, double in);
+
+/**
+ * @brief      Print the coefficients for debugging.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int controller_print(controller_t c);
+
+#endif // CONTROLLER_H
@@ -17,6 +17,10 @@
 
 #include <stdint.h> // for uint64_t
 #include <rc_pilot_defs.h>
+#include <controller.h>
+#include <mix.h>
+
+#define FEEDBACK_UPDATE_TIMEOUT_US	200000	///< longest wait for the previous controller update to be taken
 
 /**
  * This is the state of the feedback loop. contains most recent values
@@ -31,11 +35,23 @@ typedef struct feedback_state_t{
 	uint64_t last_step_ns;	///< last time controller has finished a step
 
 	double u[6];		///< siso controller outputs
-	double m[8];		///< signals sent to motors after mapping
+	double m[MAX_ROTORS];	///< signals sent to motors after mapping
 }feedback_state_t;
 
 extern feedback_state_t fstate;
 
+/**
+ * Controllers that can be replaced while running. Roll, pitch and yaw come
+ * first and are contiguous so they can be marched together.
+ */
+typedef enum feedback_ctrl_t{
+	FEEDBACK_CTRL_ROLL,
+	FEEDBACK_CTRL_PITCH,
+	FEEDBACK_CTRL_YAW,
+	FEEDBACK_CTRL_ALT,
+	FEEDBACK_NUM_CTRL
+} feedback_ctrl_t;
+
 /**
  * @brief      Initial setup of all feedback controllers. Should only be called
  *             once on program start.
@@ -73,12 +89,33 @@ int feedback_disarm(void);
 
 /**
  * @brief      This is how outside functions should start the flight controller.
+ *             Refused while the deadline watchdog is at its failsafe level.
  *
  * @return     0 on success, -1 on failure
  */
 int feedback_arm(void);
 
 
+/**
+ * @brief      Replaces the coefficients of one controller while running.
+ *
+ * The controllers live in two banks. This copies the new controller into the
+ * bank the control thread is not using and flags it, and the next
+ * feedback_march() swaps the bank pointers before stepping anything, so a
+ * tick always sees one complete set. The control history is carried over,
+ * with bumpless_param_updates the new controller is prefilled with the last
+ * input and output so its output continues from where the old one left off.
+ * Saturation and soft start are set up here the same way feedback_init()
+ * does. Call from one non real time thread only.
+ *
+ * @param[in]  ctrl  which controller
+ * @param[in]  c     new controller, built at settings.dt
+ *
+ * @return     0 on success, -1 if the arguments are invalid or the previous
+ *             update was not taken within FEEDBACK_UPDATE_TIMEOUT_US
+ */
+int feedback_update_controller(feedback_ctrl_t ctrl, const controller_t* c);
+
 /**
  * @brief      Cleanup the feedback controller, freeing memory
  *
@@ -65,7 +65,22 @@ typedef enum flight_mode_t{
 	/**
 	 * PG: TODO: What do you intend for this mode?
 	 */
-	POSITION_CONTROL_6DOF
+	POSITION_CONTROL_6DOF,
+	/**
+	 * Z and yaw follow the trajectory loaded from trajectory_file or
+	 * uploaded as a MAVLink mission, starting from where the vehicle is when
+	 * armed in this mode. Roll and pitch stay on the sticks. X and Y of the
+	 * trajectory only go into the setpoint and the log, there is no
+	 * horizontal position loop yet. Without a trajectory this is
+	 * ALT_HOLD_4DOF.
+	 */
+	TRAJECTORY_4DOF,
+	/**
+	 * Z and yaw follow the trajectory like TRAJECTORY_4DOF, roll and pitch
+	 * are left at 0 and the sticks give X and Y thrust like ALT_HOLD_6DOF.
+	 * Without a trajectory this is ALT_HOLD_6DOF.
+	 */
+	TRAJECTORY_6DOF
 
 } flight_mode_t;
 
@@ -0,0 +1,109 @@
+/**
+ * <hal.h>
+ *
+ * @brief      Thin hardware abstraction layer for the control path.
+ *
+ * Everything the IMU callback and its helpers touch on the hardware goes
+ * through here: the IMU sample and interrupt, the barometer, the battery ADC,
+ * the ESC outputs, the status LEDs and the clock. The rc backend forwards
+ * straight to librobotcontrol. The sim backend (see sim.h) feeds the same
+ * code from a multirotor dynamics model and steps it as fast as the host
+ * allows instead of waiting for interrupts, and the replay backend (see
+ * replay.h) does the same from a recorded log.
+ *
+ * Hardware bring-up that only happens once in main(), such as calibration
+ * and servo rail setup, is not part of the HAL.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#include <stdint.h>
+#include <rc/mpu.h>
+#include <rc/bmp.h>
+#include <rc/led.h>
+
+/**
+ * Where the IMU sample and the attitude quaternion come from.
+ */
+typedef enum imu_mode_t{
+	IMU_MODE_DMP,	///< DMP interrupt and quaternion, up to DMP_MAX_HZ
+	IMU_MODE_RAW	///< polled gyro and accel with a complementary filter, up to RAW_IMU_MAX_HZ
+} imu_mode_t;
+
+typedef enum hal_backend_t{
+	HAL_RC,		///< librobotcontrol on the BeagleBone
+	HAL_SIM,	///< software in the loop, see sim.h
+	HAL_REPLAY	///< recorded flight, see replay.h
+} hal_backend_t;
+
+/**
+ * Backend implementation. All functions return 0 on success and -1 on
+ * failure unless noted otherwise.
+ */
+typedef struct hal_ops_t{
+	const char* name;
+	/**
+	 * 1 if the IMU paces the control loop at settings.feedback_hz in real
+	 * time. 0 if the loop is stepped back to back, in which case helper
+	 * threads that normally run between interrupts must do their work inline
+	 * to stay in lock step.
+	 */
+	int realtime;
+	int (*init)(void);
+	int (*cleanup)(void);
+	/// start the IMU writing samples into data in settings.imu_mode, no callbacks yet
+	int (*imu_init)(rc_mpu_data_t* data);
+	/// call func every time a new sample has been written
+	int (*imu_set_callback)(void (*func)(void));
+	int (*imu_power_off)(void);
+	int (*bmp_read)(rc_bmp_data_t* data);
+	/// battery voltage in volts, less than 3.0 if no battery is connected
+	double (*batt_read)(void);
+	/// ch starts at 1, val is the normalized ESC signal, -0.1 for idle
+	int (*esc_send)(int ch, double val);
+	int (*led_set)(rc_led_t led, int value);
+	/// monotonic time in nanoseconds, simulated time in the sim backend
+	uint64_t (*time_ns)(void);
+} hal_ops_t;
+
+extern const hal_ops_t hal_rc_ops;	///< defined in hal.c
+extern const hal_ops_t hal_sim_ops;	///< defined in sim.c
+extern const hal_ops_t hal_replay_ops;	///< defined in replay.c
+
+/**
+ * backend selected by hal_init(), only read through the wrappers below
+ */
+extern const hal_ops_t* hal;
+
+/**
+ * @brief      Selects and initializes a backend. Must be called before any
+ *             other hal_ function.
+ *
+ * @param[in]  backend  The backend
+ *
+ * @return     0 on success, -1 on failure
+ */
+int hal_init(hal_backend_t backend);
+
+/**
+ * @brief      Cleans up the selected backend.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int hal_cleanup(void);
+
+/** @name wrappers around the selected backend, see hal_ops_t */
+///@{
+static inline int hal_is_realtime(void)			{ return hal->realtime; }
+static inline int hal_imu_init(rc_mpu_data_t* data)	{ return hal->imu_init(data); }
+static inline int hal_imu_set_callback(void (*func)(void)) { return hal->imu_set_callback(func); }
+static inline int hal_imu_power_off(void)		{ return hal->imu_power_off(); }
+static inline int hal_bmp_read(rc_bmp_data_t* data)	{ return hal->bmp_read(data); }
+static inline double hal_batt_read(void)		{ return hal->batt_read(); }
+static inline int hal_esc_send(int ch, double val)	{ return hal->esc_send(ch, val); }
+static inline int hal_led_set(rc_led_t led, int value)	{ return hal->led_set(led, value); }
+static inline uint64_t hal_time_ns(void)		{ return hal->time_ns(); }
+///@}
+
+#endif // HAL_H
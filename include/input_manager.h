@@ -9,6 +9,8 @@
 #ifndef INPUT_MANAGER_H
 #define INPUT_MANAGER_H
 
+#include <stdint.h>
+
 #include <flight_mode.h>
 #include <feedback.h> // only for arm_state_t
 
@@ -33,9 +35,11 @@ typedef enum dsm_kill_mode_t{
 
 
 /**
- * Represents current command by the user. This is populated by the
- * input_manager thread which decides to read from mavlink or DSM depending on
- * what it is receiving.
+ * Represents current command by the user. On the hardware path this is only
+ * written by the DSM callbacks, which publish each radio frame as one
+ * complete record with snapshot_publish_user_input(). Other threads read it
+ * with snapshot_get_user_input(). The input_manager thread asks for arming
+ * through the callback instead of writing here itself.
  */
 typedef struct user_input_t{
 	int initialized;		///< set to 1 after input_manager_init(void)
@@ -48,6 +52,8 @@ typedef struct user_input_t{
 	double yaw_stick;		///< positive to the right, CW yaw
 	double roll_stick;		///< positive to the right
 	double pitch_stick;		///< positive forward
+
+	uint64_t frame_ns;		///< rc_nanos_since_boot() when the radio frame the sticks came from arrived, 0 before the first
 } user_input_t;
 
 extern user_input_t user_input;
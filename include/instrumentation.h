@@ -0,0 +1,175 @@
+/**
+ * <instrumentation.h>
+ *
+ * @brief      Timing instrumentation for the IMU interrupt path.
+ *
+ * Every stage of the IMU callback is timestamped with rc_nanos_since_boot()
+ * and the durations are accumulated into fixed log-linear histograms, so
+ * recording never allocates and costs a handful of instructions. Besides the
+ * per-stage durations this tracks the latency from the DMP interrupt to the
+ * last ESC pulse being sent, from a radio frame arriving to the first ESC
+ * pulse that acted on it and the period between callbacks.
+ *
+ * Recording functions must only be called from the IMU callback thread. The
+ * read functions may be called from any thread, they see slightly stale but
+ * otherwise sensible values.
+ */
+
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+/**
+ * Histogram channels. The first INSTR_NUM_STAGES are tasks of the IMU
+ * callback in the order they run, see scheduler.h. Slow tasks only record
+ * on the ticks they run.
+ */
+typedef enum instr_channel_t{
+	INSTR_SETPOINT,		///< setpoint_manager_update()
+	INSTR_ESTIMATOR,	///< state_estimator_march()
+	INSTR_FEEDBACK,		///< feedback_march()
+	INSTR_LOG,		///< snapshot_publish_tick() and log_manager_add_new()
+	INSTR_BATTERY,		///< state_estimator_batt_march()
+	INSTR_AFTER_FEEDBACK,	///< state_estimator_jobs_after_feedback()
+	INSTR_NUM_STAGES,
+	INSTR_ISR_TOTAL = INSTR_NUM_STAGES, ///< whole callback
+	INSTR_IRQ_TO_ESC,	///< DMP interrupt to last ESC pulse sent
+	INSTR_RX_TO_ESC,	///< radio frame arrival to the first ESC pulse using it
+	INSTR_PERIOD,		///< time between callback invocations
+	INSTR_JITTER,		///< absolute deviation of period from nominal
+	INSTR_NUM_CHANNELS
+} instr_channel_t;
+
+/**
+ * Summary of one histogram channel, all times in nanoseconds. Percentiles
+ * are accurate to the histogram resolution, about 6% or 64ns.
+ */
+typedef struct instr_stats_t{
+	uint64_t count;		///< number of samples
+	uint64_t mean_ns;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	uint64_t max_ns;
+} instr_stats_t;
+
+/**
+ * Durations from the most recent complete tick, for logging.
+ */
+typedef struct instr_tick_t{
+	uint64_t stage_ns[INSTR_NUM_STAGES];	///< 0 for tasks that did not run
+	uint64_t total_ns;
+	uint64_t irq_to_esc_ns;
+	uint64_t period_ns;
+} instr_tick_t;
+
+/**
+ * @brief      Mark the start of a tick. Call first thing in the IMU
+ *             callback.
+ */
+void instr_tick_begin(void);
+
+/**
+ * @brief      Record the time since the previous stage ended (or the tick
+ *             began) into the given stage channel.
+ *
+ * @param[in]  stage  The stage that just finished
+ */
+void instr_stage_end(instr_channel_t stage);
+
+/**
+ * @brief      Mark that the ESC pulses for this tick have been sent. Call
+ *             right after the last rc_servo_send_esc_pulse_normalized().
+ */
+void instr_mark_esc(void);
+
+/**
+ * @brief      Mark which radio frame the setpoint of this tick was computed
+ *             from. Call from setpoint_manager_update() when the sticks were
+ *             acted on. The first tick that sends ESC pulses after a new
+ *             frame records its latency into INSTR_RX_TO_ESC.
+ *
+ * @param[in]  frame_ns  rc_nanos_since_boot() when the frame arrived, see
+ *                       user_input_t
+ */
+void instr_mark_input(uint64_t frame_ns);
+
+/**
+ * @brief      Mark the end of a tick. Call last thing in the IMU callback.
+ */
+void instr_tick_end(void);
+
+/**
+ * @brief      Record an arbitrary duration into a channel.
+ *
+ * @param[in]  ch    The channel
+ * @param[in]  ns    Duration in nanoseconds
+ */
+void instr_record(instr_channel_t ch, uint64_t ns);
+
+/**
+ * @brief      Summarize one channel.
+ *
+ * @param[in]  ch     The channel
+ * @param[out] stats  struct to fill in
+ *
+ * @return     0 on success, -1 on failure
+ */
+int instr_get_stats(instr_channel_t ch, instr_stats_t* stats);
+
+/**
+ * @brief      Copy out the durations of the last complete tick. Intended for
+ *             the logger which runs inside the IMU callback, other threads
+ *             may see a tick that is being overwritten.
+ *
+ * @param[out] tick  struct to fill in
+ *
+ * @return     0 on success, -1 on failure
+ */
+int instr_get_last_tick(instr_tick_t* tick);
+
+/**
+ * @brief      Sets the nominal loop rate the jitter channel is measured
+ *             against. Call once before the IMU callback starts.
+ *
+ * @param[in]  hz    settings.feedback_hz
+ */
+void instr_set_loop_hz(int hz);
+
+/**
+ * @brief      Ask the IMU callback to zero all histograms at the start of its
+ *             next tick. Safe to call from any thread.
+ */
+void instr_reset(void);
+
+/**
+ * @brief      Human readable name of a channel.
+ *
+ * @param[in]  ch    The channel
+ *
+ * @return     name string
+ */
+const char* instr_channel_name(instr_channel_t ch);
+
+/**
+ * @brief      Print a p50/p99/max table of every channel.
+ *
+ * @param      fd    Where to print, usually stdout
+ *
+ * @return     0 on success, -1 on failure
+ */
+int instr_print_report(FILE* fd);
+
+/**
+ * @brief      Print the distribution of one channel as a text histogram, four
+ *             rows per power of 2 from the smallest to the largest sample.
+ *
+ * @param      fd    Where to print, usually stdout
+ * @param[in]  ch    The channel
+ *
+ * @return     0 on success, -1 on failure or if the channel has no samples
+ */
+int instr_print_histogram(FILE* fd, instr_channel_t ch);
+
+#endif // INSTRUMENTATION_H
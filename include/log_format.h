@@ -0,0 +1,191 @@
+/**
+ * <log_format.h>
+ *
+ * @brief      On-disk layout of the binary log format.
+ *
+ * A binary log starts with one log_file_header_t followed by fixed-size
+ * records. Every record begins with loop_index and last_step_ns as uint64_t,
+ * followed by the enabled column groups as doubles in the order of the
+ * LOG_GROUP_* bits below. The record_size field in the header is the total
+ * size of one record so readers can step through the file without knowing
+ * every group.
+ *
+ * If the header names a compression the records are instead stored as a
+ * sequence of complete LZ4 or zstd frames, which decompress back to the same
+ * record stream. The log writer closes a frame at least every
+ * LOG_FRAME_SECONDS, so a crash only loses the frame in progress.
+ *
+ * This header has no dependencies beyond the C standard library so it can be
+ * shared between rc_pilot and host-side tools like rc_pilot_logconv. Use
+ * log_reader.h to read records back regardless of compression.
+ */
+
+#ifndef LOG_FORMAT_H
+#define LOG_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LOG_FILE_MAGIC		"RCPILOT"	///< 7 chars + nul terminator
+#define LOG_FILE_VERSION	7	///< 2 added LOG_GROUP_TIMING, 3 added LOG_GROUP_RAW, 4 batt_count, 5 compression, 6 LOG_GROUP_WATCHDOG, 7 mocap_count and mocap_age
+#define LOG_FILE_BYTE_ORDER	0x01020304	///< written natively, lets readers detect endianness
+
+#define LOG_FRAME_SECONDS	1.0	///< longest stretch of records in one compressed frame
+
+/** @name values of log_file_header_t.compression */
+///@{
+#define LOG_COMPRESSION_NONE	0	///< records stored as is
+#define LOG_COMPRESSION_LZ4	1	///< LZ4 frames
+#define LOG_COMPRESSION_ZSTD	2	///< zstd frames
+///@}
+
+/** @name column groups, bits of log_file_header_t.groups */
+///@{
+#define LOG_GROUP_SENSORS	(1<<0)
+#define LOG_GROUP_STATE		(1<<1)
+#define LOG_GROUP_SETPOINT	(1<<2)
+#define LOG_GROUP_CONTROL_U	(1<<3)
+#define LOG_GROUP_MOTORS	(1<<4)
+#define LOG_GROUP_TIMING	(1<<5)
+#define LOG_GROUP_RAW		(1<<6)	///< everything rc_pilot --replay needs to rerun a flight
+#define LOG_GROUP_WATCHDOG	(1<<7)	///< deadline watchdog counters
+///@}
+
+/** @name number of double columns per group, motors has num_rotors columns */
+///@{
+#define LOG_SENSORS_COLS	8
+#define LOG_STATE_COLS		9
+#define LOG_SETPOINT_COLS	9
+#define LOG_CONTROL_U_COLS	6
+#define LOG_MAX_MOTOR_COLS	12
+#define LOG_TIMING_COLS		8
+#define LOG_RAW_COLS		29
+#define LOG_WATCHDOG_COLS	4
+///@}
+
+/** @name raw group columns in older files, see log_raw_cols() */
+///@{
+#define LOG_RAW_COLS_V3		26	///< version 3, before batt_count
+#define LOG_RAW_COLS_V4		27	///< versions 4 to 6, before mocap_count and mocap_age
+///@}
+
+/** @name csv column names for each group, motors are mot_1...mot_n */
+///@{
+#define LOG_INDEX_NAMES		"loop_index,last_step_ns"
+#define LOG_SENSORS_NAMES	",v_batt,alt_bmp_raw,gyro_roll,gyro_pitch,gyro_yaw,accel_X,accel_Y,accel_Z"
+#define LOG_STATE_NAMES		",roll,pitch,yaw,X,Y,Z,Xdot,Ydot,Zdot"
+#define LOG_SETPOINT_NAMES	",sp_roll,sp_pitch,sp_yaw,sp_X,sp_Y,sp_Z,sp_Xdot,sp_Ydot,sp_Zdot"
+#define LOG_CONTROL_U_NAMES	",u_roll,u_pitch,u_yaw,u_X,u_Y,u_Z"
+#define LOG_TIMING_NAMES	",t_setpoint,t_estimator,t_feedback,t_log,t_after_feedback,t_isr,t_irq_to_esc,t_period"
+#define LOG_RAW_NAMES		",raw_gyro_x,raw_gyro_y,raw_gyro_z,raw_accel_x,raw_accel_y,raw_accel_z"\
+				",raw_quat_w,raw_quat_x,raw_quat_y,raw_quat_z,raw_v_batt,batt_count"\
+				",bmp_count,bmp_pressure,bmp_alt,bmp_temp"\
+				",mocap_running,mocap_X,mocap_Y,mocap_Z,mocap_count,mocap_age"\
+				",in_thr,in_roll,in_pitch,in_yaw,in_mode,in_arm,arm_state"
+#define LOG_RAW_NAMES_V3	",raw_gyro_x,raw_gyro_y,raw_gyro_z,raw_accel_x,raw_accel_y,raw_accel_z"\
+				",raw_quat_w,raw_quat_x,raw_quat_y,raw_quat_z,raw_v_batt"\
+				",bmp_count,bmp_pressure,bmp_alt,bmp_temp"\
+				",mocap_running,mocap_X,mocap_Y,mocap_Z"\
+				",in_thr,in_roll,in_pitch,in_yaw,in_mode,in_arm,arm_state"
+#define LOG_RAW_NAMES_V4	",raw_gyro_x,raw_gyro_y,raw_gyro_z,raw_accel_x,raw_accel_y,raw_accel_z"\
+				",raw_quat_w,raw_quat_x,raw_quat_y,raw_quat_z,raw_v_batt,batt_count"\
+				",bmp_count,bmp_pressure,bmp_alt,bmp_temp"\
+				",mocap_running,mocap_X,mocap_Y,mocap_Z"\
+				",in_thr,in_roll,in_pitch,in_yaw,in_mode,in_arm,arm_state"
+#define LOG_WATCHDOG_NAMES	",wd_overruns,wd_missed,wd_consecutive,wd_level"
+///@}
+
+/**
+ * Header at the start of every binary log file.
+ */
+typedef struct __attribute__((packed)) log_file_header_t{
+	char magic[8];		///< LOG_FILE_MAGIC
+	uint32_t byte_order;	///< LOG_FILE_BYTE_ORDER
+	uint16_t version;	///< LOG_FILE_VERSION
+	uint16_t header_size;	///< sizeof(log_file_header_t), records start here
+	uint32_t record_size;	///< bytes per record
+	uint32_t groups;	///< bitmask of LOG_GROUP_* enabled in this file
+	uint16_t num_rotors;	///< number of motor columns if LOG_GROUP_MOTORS
+	uint16_t feedback_hz;	///< nominal rate records were taken at
+	char name[128];		///< name field from the settings file
+	uint16_t compression;	///< LOG_COMPRESSION_*, added in version 5
+} log_file_header_t;
+
+/**
+ * bytes of log_file_header_t present in files before version 5
+ */
+#define LOG_FILE_HEADER_V4_SIZE	offsetof(log_file_header_t, compression)
+
+/**
+ * @brief      Number of columns in the raw group of a file, which grew as
+ *             fields were added to it.
+ *
+ * @param[in]  version  log_file_header_t.version, 3 or later
+ *
+ * @return     number of raw columns
+ */
+static inline int log_raw_cols(int version)
+{
+	if(version<4) return LOG_RAW_COLS_V3;
+	if(version<7) return LOG_RAW_COLS_V4;
+	return LOG_RAW_COLS;
+}
+
+/**
+ * @brief      csv column names of the raw group of a file, see
+ *             log_raw_cols()
+ *
+ * @param[in]  version  log_file_header_t.version, 3 or later
+ *
+ * @return     names, each with a leading comma
+ */
+static inline const char* log_raw_names(int version)
+{
+	if(version<4) return LOG_RAW_NAMES_V3;
+	if(version<7) return LOG_RAW_NAMES_V4;
+	return LOG_RAW_NAMES;
+}
+
+/**
+ * @brief      Computes the size of one record for a set of enabled groups.
+ *
+ * @param[in]  version     log_file_header_t.version, LOG_FILE_VERSION when
+ *                         writing
+ * @param[in]  groups      bitmask of LOG_GROUP_*
+ * @param[in]  num_rotors  number of motors
+ *
+ * @return     record size in bytes
+ */
+static inline uint32_t log_record_size(int version, uint32_t groups, int num_rotors)
+{
+	uint32_t cols = 0;
+	if(groups & LOG_GROUP_SENSORS)		cols += LOG_SENSORS_COLS;
+	if(groups & LOG_GROUP_STATE)		cols += LOG_STATE_COLS;
+	if(groups & LOG_GROUP_SETPOINT)		cols += LOG_SETPOINT_COLS;
+	if(groups & LOG_GROUP_CONTROL_U)	cols += LOG_CONTROL_U_COLS;
+	if(groups & LOG_GROUP_MOTORS)		cols += num_rotors;
+	if(groups & LOG_GROUP_TIMING)		cols += LOG_TIMING_COLS;
+	if(groups & LOG_GROUP_RAW)		cols += log_raw_cols(version);
+	if(groups & LOG_GROUP_WATCHDOG)		cols += LOG_WATCHDOG_COLS;
+	return 2*sizeof(uint64_t) + cols*sizeof(double);
+}
+
+/**
+ * @brief      Finds where a group starts within a record.
+ *
+ * @param[in]  version     log_file_header_t.version
+ * @param[in]  groups      bitmask of LOG_GROUP_* enabled in the file
+ * @param[in]  num_rotors  number of motors
+ * @param[in]  group       one LOG_GROUP_* bit
+ *
+ * @return     byte offset of the group's first column from the start of the
+ *             record, undefined if the group is not enabled
+ */
+static inline uint32_t log_group_offset(int version, uint32_t groups, int num_rotors, uint32_t group)
+{
+	// every group before this one in bit order, the record size of those
+	// groups is exactly the offset
+	return log_record_size(version, groups & (group-1), num_rotors);
+}
+
+#endif // LOG_FORMAT_H
@@ -9,6 +9,18 @@
 #ifndef LOG_MANAGER_H
 #define LOG_MANAGER_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <log_format.h>
+
+/**
+ * @brief      file format written by the log manager, see log_format.h for
+ *             the binary layout
+ */
+typedef enum log_format_t{
+	LOG_FORMAT_CSV,		///< human readable, one formatted line per entry
+	LOG_FORMAT_BINARY	///< fixed-size records, convert with rc_pilot_logconv
+} log_format_t;
 
 /**
  * Struct containing all possible values that could be writen to the log. For
@@ -82,6 +94,71 @@ typedef struct log_entry_t{
 	double	mot_6;
 	double	mot_7;
 	double	mot_8;
+	double	mot_9;
+	double	mot_10;
+	double	mot_11;
+	double	mot_12;	///< mot_1 to mot_12 must stay contiguous
+	///@}
+
+	/** @name timing of the previous IMU callback in microseconds
+	 * taken from the instrumentation module. The callback that creates an
+	 * entry hasn't finished yet so these describe the tick before it.
+	 */
+	///@{
+	double	t_setpoint;
+	double	t_estimator;
+	double	t_feedback;
+	double	t_log;
+	double	t_after_feedback;
+	double	t_isr;
+	double	t_irq_to_esc;
+	double	t_period;
+	///@}
+
+	/** @name raw inputs of the IMU callback for rc_pilot --replay
+	 * IMU sample in the sensor frame exactly as the DMP delivered it, the
+	 * barometer sample and battery reading the estimator used, the mocap
+	 * sample it fused and the user input the controllers saw. Integer fields are stored
+	 * as doubles like everything else.
+	 */
+	///@{
+	double	raw_gyro_x;	///< deg/s
+	double	raw_gyro_y;
+	double	raw_gyro_z;
+	double	raw_accel_x;	///< m/s^2
+	double	raw_accel_y;
+	double	raw_accel_z;
+	double	raw_quat_w;
+	double	raw_quat_x;
+	double	raw_quat_y;
+	double	raw_quat_z;
+	double	raw_v_batt;	///< before the low pass filter
+	double	batt_count;	///< changes whenever the battery filter ran
+	double	bmp_count;	///< changes whenever a new sample was picked up
+	double	bmp_pressure;
+	double	bmp_alt;
+	double	bmp_temp;
+	double	mocap_running;
+	double	mocap_X;
+	double	mocap_Y;
+	double	mocap_Z;
+	double	mocap_count;	///< changes whenever a new sample was picked up
+	double	mocap_age;	///< s from receiving the sample to picking it up
+	double	in_thr;
+	double	in_roll;
+	double	in_pitch;
+	double	in_yaw;
+	double	in_mode;	///< flight_mode_t
+	double	in_arm;		///< requested arm_state_t
+	double	arm_state;	///< arm_state_t of the feedback controller
+	///@}
+
+	/** @name deadline watchdog counters since start up, see watchdog.h */
+	///@{
+	double	wd_overruns;
+	double	wd_missed;
+	double	wd_consecutive;
+	double	wd_level;	///< watchdog_level_t
 	///@}
 
 } log_entry_t;
@@ -89,23 +166,83 @@ typedef struct log_entry_t{
 
 
 /**
- * @brief      creates a new csv log file and starts the background thread.
+ * Health counters for the log ring buffer, see log_manager_get_stats().
+ */
+typedef struct log_manager_stats_t{
+	uint64_t entries;	///< entries added to the current log file
+	uint64_t overruns;	///< entries dropped because the ring was full
+	uint32_t high_water;	///< most entries ever waiting in the ring at once
+	uint32_t capacity;	///< ring depth in entries
+	uint64_t bytes_raw;	///< binary record bytes written to the file so far
+	uint64_t bytes_written;	///< the same after compression
+} log_manager_stats_t;
+
+
+/**
+ * @brief      creates a new csv or binary log file depending on the
+ *             log_format setting and starts the background thread.
+ *
+ * Call once at start up. The thread keeps running until
+ * log_manager_cleanup() and always has the next log file created and
+ * preallocated. Files are numbered from a counter, once MAX_LOG_FILES exist
+ * the oldest is deleted to make room for the next.
  *
  * @return     0 on success, -1 on failure
  */
 int log_manager_init(void);
 
 
+/**
+ * @brief      Starts a new log file with the next entry, called on arming.
+ *
+ * Only marks the ring position and wakes the writer thread, which finishes
+ * the current file and swaps in the one it prepared. Never blocks, so it
+ * is safe from the IMU callback.
+ *
+ * @return     0 on success, -1 if the log manager isn't running
+ */
+int log_manager_new_segment(void);
+
+
+/**
+ * @brief      Bytes log_manager_reserve() takes out of the arena with the
+ *             current settings, 0 if logging is disabled.
+ *
+ * @return     ring and compression buffer size in bytes
+ */
+size_t log_manager_reserve_bytes(void);
+
+/**
+ * @brief      Takes the ring buffer and, with log_compression, the frame
+ *             buffers out of the arena. Call at start up before
+ *             arena_freeze(), log_manager_init() reuses it for every log file
+ *             afterwards.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int log_manager_reserve(void);
+
 /**
  * @brief      quickly add new data to local buffer
  *
  * This is called after feedback_march after signals have been sent to
- * the motors.
+ * the motors. The entry is placed in a lock-free ring buffer sized by the
+ * log_buffer_seconds setting, so this never blocks on the writer thread. If
+ * the ring is full the entry is dropped and counted as an overrun.
  *
  * @return     0 on success, -1 on failure
  */
 int log_manager_add_new();
 
+/**
+ * @brief      Copies out the ring buffer counters for the current log file.
+ *
+ * @param[out] stats  struct to fill in
+ *
+ * @return     0 on success, -1 on failure
+ */
+int log_manager_get_stats(log_manager_stats_t* stats);
+
 /**
  * @brief      Finish writing remaining data to log and close thread.
  *
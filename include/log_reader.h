@@ -0,0 +1,70 @@
+/**
+ * <log_reader.h>
+ *
+ * @brief      Reads records back out of a binary log, decompressing LZ4 or
+ *             zstd logs on the fly.
+ *
+ * Shared by rc_pilot --replay and rc_pilot_logconv so both accept every log
+ * version the writer has produced. Only depends on the C standard library,
+ * log_format.h and the lz4 and zstd libraries. All buffers live in the
+ * reader struct, nothing is allocated besides the decompression contexts.
+ */
+
+#ifndef LOG_READER_H
+#define LOG_READER_H
+
+#include <stdio.h>
+#include <lz4frame.h>
+#include <zstd.h>
+
+#include <log_format.h>
+
+#define LOG_READER_BYTES	(64*1024)	///< size of each of the reader's buffers
+
+/**
+ * State of one open log, treat as opaque.
+ */
+typedef struct log_reader_t{
+	FILE* f;
+	log_file_header_t header;	///< header of the file, compression is 0 before version 5
+	LZ4F_dctx* lz4;
+	ZSTD_DStream* zstd;
+	size_t frame_hint;		///< decoder return value, 0 between frames
+	char in[LOG_READER_BYTES];	///< compressed bytes read from the file
+	size_t in_len;
+	size_t in_pos;
+	char out[LOG_READER_BYTES];	///< decompressed bytes not yet returned
+	size_t out_len;
+	size_t out_pos;
+} log_reader_t;
+
+/**
+ * @brief      Opens a binary log, checks its header and sets up
+ *             decompression.
+ *
+ * @param[out] r     reader to initialize
+ * @param[in]  path  log file
+ *
+ * @return     0 on success, -1 on failure
+ */
+int log_reader_open(log_reader_t* r, const char* path);
+
+/**
+ * @brief      Copies the next record out of the log.
+ *
+ * @param      r     an open reader
+ * @param[out] rec   record_size bytes to copy the record to
+ *
+ * @return     1 if a record was read, 0 at the end of the log, -1 on a read
+ *             or decompression error
+ */
+int log_reader_read(log_reader_t* r, void* rec);
+
+/**
+ * @brief      Closes the file and frees the decompression contexts.
+ *
+ * @param      r     reader to close, may be closed twice
+ */
+void log_reader_close(log_reader_t* r);
+
+#endif // LOG_READER_H
@@ -2,11 +2,32 @@
  * <mavlink_manager.h>
  *
  * Functions to start and stop the mavlink manager
+ *
+ * ATT_POS_MOCAP packets are stamped on arrival and handed to the state
+ * estimator with state_estimator_publish_mocap(), which fuses them with the
+ * accelerometer, so the listening thread never writes state_estimate.
+ *
+ * Besides motion capture it serves the gains and coefficients of the roll,
+ * pitch, yaw and altitude controllers as MAVLink parameters named after the
+ * controller and the settings file field, eg ROLL_KP, PITCH_FC, ALT_GAIN or
+ * YAW_NUM0 for a transfer function. A PARAM_SET rebuilds the controller in
+ * the rc_mav listening thread and hands it to feedback_update_controller(),
+ * every PARAM_SET is answered with a PARAM_VALUE of the value now in use.
+ * Changes are not written back to the settings file.
+ *
+ * A mission uploaded with MISSION_COUNT and MISSION_ITEM_INT becomes the
+ * trajectory of the TRAJECTORY flight modes, see trajectory.h. Items must be
+ * MAV_CMD_NAV_WAYPOINT in a local NED frame, param1 is the time in seconds
+ * to fly from the previous waypoint and param4 the yaw in degrees, relative
+ * to where the trajectory starts like the position.
  */
 
 #ifndef MAVLINK_MANAGER_H
 #define MAVLINK_MANAGER_H
 
+#define MAVLINK_PARAM_ID_LEN	16	///< MAVLink param_id length
+#define MAVLINK_MAX_PARAMS	48	///< enough for four 4th order transfer functions
+
 
 /**
  * @brief      Starts the mavlink manager
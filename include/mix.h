@@ -15,7 +15,7 @@
 #define MIXING_MATRIX_H
 
 #define MAX_INPUTS 6	///< up to 6 control inputs (roll,pitch,yaw,z,x,y)
-#define MAX_ROTORS 8	///< up to 8 rotors
+#define MAX_ROTORS 12	///< up to 12 rotors, a multiple of 4 for the NEON kernels
 
 /**
  * @brief enum for possible mixing matrices defined here
@@ -28,9 +28,19 @@ typedef enum rotor_layout_t{
 	LAYOUT_6X,
 	LAYOUT_8X,
 	LAYOUT_6DOF_ROTORBITS,
-	LAYOUT_6DOF_5INCH_MONOCOQUE
+	LAYOUT_6DOF_5INCH_MONOCOQUE,
+	LAYOUT_CUSTOM		///< from custom_layout in the settings file
 } rotor_layout_t;
 
+/**
+ * One rotor of a custom layout given by its geometry.
+ */
+typedef struct mix_rotor_t{
+	double x;	///< forward of the center of mass, any unit
+	double y;	///< right of the center of mass, same unit as x
+	int ccw;	///< 1 if the propeller spins counter clockwise seen from above
+} mix_rotor_t;
+
 /**
  * @brief      Initiallizes the mixing matrix for a given input layout.
  *
@@ -42,12 +52,40 @@ typedef enum rotor_layout_t{
  *             mixing_matrix.c below to interface with it. Used in
  *             mixing_matrix.c
  *
+ *             LAYOUT_CUSTOM takes the matrix from settings.custom_matrix, or
+ *             works it out from settings.custom_rotors with
+ *             mix_matrix_from_geometry(). Either way the allocation tables
+ *             are built once here.
+ *
  * @param[in]  layout  The layout enum
  *
  * @return     0 on success, -1 on failure
  */
 int mix_init(rotor_layout_t layout);
 
+/**
+ * @brief      Works out a 4 dof mixing matrix from rotor positions and spin
+ *             directions.
+ *
+ *             The matrix is the pseudo-inverse of the thrust, roll, pitch
+ *             and yaw each rotor produces, so the inputs are decoupled even
+ *             for asymmetric frames. Each column is then scaled to the
+ *             convention of the built in layouts: the largest throttle entry
+ *             is -1 and the largest roll, pitch and yaw entries are 0.5, so
+ *             gains carry over between airframes. A symmetric layout matches
+ *             the built in matrix of that shape to the precision of its
+ *             table, 8X for one is tabulated as 0.21 where this gives 0.2071.
+ *
+ * @param[in]  n     number of rotors, 4 to MAX_ROTORS
+ * @param[in]  r     the rotors, in motor order
+ * @param[out] m     rows are motors, columns are the VEC_ channels, rows past
+ *                   n are zeroed
+ *
+ * @return     0 on success, -1 if the rotors can't control thrust, roll,
+ *             pitch and yaw independently
+ */
+int mix_matrix_from_geometry(int n, const mix_rotor_t* r, double m[MAX_ROTORS][MAX_INPUTS]);
+
 /**
  * @brief      Fills the vector mot with the linear combination of XYZ, roll
  *             pitch yaw. Not actually used, only for testing.
@@ -105,5 +143,61 @@ int mix_check_saturation(int ch, double* mot, double* min, double* max);
  */
 int mix_add_input(double u, int ch, double* mot);
 
+/**
+ * @brief      Callback used by mix_allocate() to compute one control input.
+ *
+ *             Called once per channel in priority order with the range of
+ *             input that can be applied without saturating any motor, already
+ *             clamped to the channel limit. The callback should return an
+ *             input inside that range, typically by marching a controller
+ *             with saturation set to [min,max]. For VEC_Z the range is
+ *             unbounded and the callback must saturate throttle itself.
+ *
+ * @param[in]  ch    channel, one of the VEC_ defines
+ * @param[in]  min   minimum input without saturation
+ * @param[in]  max   maximum input without saturation
+ * @param      ctx   pointer passed through from mix_allocate()
+ *
+ * @return     the control input for this channel
+ */
+typedef double (*mix_input_fn)(int ch, double min, double max, void* ctx);
+
+/**
+ * @brief      Prioritized, saturation aware allocation of all control inputs
+ *             in one call.
+ *
+ *             Zeros the motors then allocates Z, roll, pitch, yaw and, if
+ *             n_inputs is 6, X and Y in that order. Each channel gets the
+ *             authority left over by the ones before it. This gives the same
+ *             result as calling mix_check_saturation() and mix_add_input()
+ *             for every channel in that order, but walks a transposed copy of
+ *             the matrix with a kernel specialized for the rotor count set by
+ *             mix_init().
+ *
+ * @param[in]  n_inputs  4 for Z roll pitch yaw, 6 to also add X and Y
+ * @param[in]  limit     absolute limit of each channel indexed by VEC_,
+ *                       the VEC_Z entry is unused
+ * @param[in]  input     callback computing each input
+ * @param      ctx       passed through to the callback
+ * @param[out] u         control inputs indexed by VEC_, only the allocated
+ *                       channels are written
+ * @param[out] mot       motor outputs
+ *
+ * @return     0 on success, -1 on failure
+ */
+int mix_allocate(int n_inputs, const double limit[MAX_INPUTS],
+		mix_input_fn input, void* ctx, double u[MAX_INPUTS], double* mot);
+
+
+/**
+ * @brief      Copies out the mixing matrix selected by mix_init(), mostly
+ *             for the simulator to derive the rotor geometry from.
+ *
+ * @param[out] m     rows are motors, columns are the VEC_ channels. Rows
+ *                   past the rotor count are zeroed.
+ *
+ * @return     0 on success, -1 if not initialized
+ */
+int mix_get_matrix(double m[MAX_ROTORS][MAX_INPUTS]);
 
 #endif // MIXING_MATRIX_H
\ No newline at end of file
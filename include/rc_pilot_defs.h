@@ -16,9 +16,11 @@ typedef enum arm_state_t{
 	ARMED
 } arm_state_t;
 
-// Speed of feedback loop
-#define FEEDBACK_HZ		200
-#define DT			0.005
+// Speed of the feedback loop is the feedback_hz setting, these bound it
+#define DMP_MAX_HZ		200	///< dmp imu_mode rates must divide this evenly
+#define DMP_MIN_HZ		4
+#define RAW_IMU_MAX_HZ		1000	///< raw imu_mode, gyro and accel internal sample rate
+#define RAW_IMU_MIN_HZ		50
 
 //IMU Parameters
 #define IMU_PRIORITY    51
@@ -51,7 +53,8 @@ typedef enum arm_state_t{
 #define THROTTLE_DEADZONE	0.02
 #define SOFT_START_SECONDS	1.0	// controller soft start seconds
 #define ALT_CUTOFF_FREQ		2.0
-#define BMP_RATE_DIV		10	// optionally sample bmp less frequently than mpu
+#define BMP_HZ			20	// barometer sample rate, independent of feedback_hz
+#define BATT_HZ			25	// battery filter rate, independent of feedback_hz
 
 // controller absolute limits
 #define MAX_ROLL_COMPONENT	0.4
@@ -0,0 +1,56 @@
+/**
+ * <real.h>
+ *
+ * @brief      Scalar type of the control kernels.
+ *
+ * The controllers, the mixer, the thrust map and the attitude part of the
+ * state estimator do their arithmetic in real_t. That is double by default.
+ * Built with -D RC_PILOT_FLOAT32 ("make float32") it is float. Only the
+ * mixer and quaternion kernels are written with NEON intrinsics, used when
+ * the compiler targets NEON. Everything else, the controllers, the thrust
+ * map lookup and __quat_rotate(), is still scalar code that gcc puts on the
+ * Cortex-A8's VFP even with -mfpu=neon, since without -ffast-math it won't
+ * vectorize float math. Those only gain what single precision saves on the
+ * VFP and in memory.
+ *
+ * Only the kernels change. The shared structs, the settings, telemetry and
+ * the log all stay double, values are converted on the way in and out. So a
+ * log recorded by the default build can be replayed by the float32 build to
+ * check that both give the same motor signals, see replay.h.
+ */
+
+#ifndef REAL_H
+#define REAL_H
+
+#include <math.h>
+#include <float.h>
+
+#ifdef RC_PILOT_FLOAT32
+
+typedef float real_t;
+#define REAL_MAX	FLT_MAX
+#define real_sqrt	sqrtf
+#define real_atan2	atan2f
+#define real_asin	asinf
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define RC_PILOT_NEON
+#include <arm_neon.h>
+#endif
+
+#else
+
+typedef double real_t;
+#define REAL_MAX	DBL_MAX
+#define real_sqrt	sqrt
+#define real_atan2	atan2
+#define real_asin	asin
+
+#endif // RC_PILOT_FLOAT32
+
+// set by "make neoncheck", so a compiler without NEON can't pass it
+#if defined(RC_PILOT_REQUIRE_NEON) && !defined(RC_PILOT_NEON)
+#error "RC_PILOT_REQUIRE_NEON is set but the compiler doesn't target NEON"
+#endif
+
+#endif // REAL_H
@@ -0,0 +1,88 @@
+/**
+ * <replay.h>
+ *
+ * @brief      Log replay backend.
+ *
+ * Implements hal_replay_ops on top of a binary log recorded with log_raw
+ * enabled. Every record holds the raw inputs of one IMU callback: the DMP
+ * sample in the sensor frame, the battery reading, the barometer sample the
+ * estimator was using, the mocap sample it fused and the user input the
+ * controllers acted on. replay_run() feeds them back through
+ * setpoint_manager_update(), state_estimator_march() and feedback_march()
+ * as fast as the host allows, with whatever settings file rc_pilot was
+ * started with, and compares the motor signals against the recorded ones.
+ *
+ * The replay is open loop, the recorded sensor data does not react to
+ * different motor outputs. With the settings the log was recorded with the
+ * motor signals match the original exactly, apart from floating point
+ * differences between the flight computer and the host and the altitude
+ * and position filters: logging starts when the vehicle arms, so the
+ * filters start cold from the first record instead of from where they had
+ * converged to. Only modes that close the loop on altitude or position see
+ * that. Logs older than version 7 don't say when mocap samples arrived and
+ * can't be replayed.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <mix.h>
+
+#define REPLAY_TOLERANCE	1e-4	///< motor signal difference counted as a divergence
+
+/**
+ * Summary of one replay.
+ */
+typedef struct replay_result_t{
+	uint64_t records;		///< records replayed
+	uint64_t compared;		///< records with motor signals where the original was armed
+	double log_seconds;		///< flight time covered by the log
+	double wall_seconds;		///< real time the replay took
+	int num_rotors;
+	int has_motors;			///< 0 if the log has no motor signals to compare against
+	double max_diff[MAX_ROTORS];	///< largest difference to the original motor signal
+	double rms_diff[MAX_ROTORS];	///< rms difference to the original motor signal
+	int64_t first_divergence;	///< loop_index of the first record off by more than REPLAY_TOLERANCE, -1 if none
+	uint64_t arm_mismatches;	///< records where the replay and the original disagree on arm state
+} replay_result_t;
+
+/**
+ * @brief      Opens a binary log and loads its first record. Must be called
+ *             after the settings are loaded and before hal_init(HAL_REPLAY).
+ *
+ * @param[in]  path  log file recorded with log_raw enabled
+ *
+ * @return     0 on success, -1 on failure
+ */
+int replay_open(const char* path);
+
+/**
+ * @brief      Replays every record of the log. hal_init(HAL_REPLAY) and every
+ *             module the IMU callback depends on must be set up already and
+ *             the rc state must be RUNNING.
+ *
+ * @param[out] result  replay summary
+ *
+ * @return     0 on success, -1 on failure
+ */
+int replay_run(replay_result_t* result);
+
+/**
+ * @brief      Prints a replay summary.
+ *
+ * @param      f       stream to print to
+ * @param[in]  result  replay summary from replay_run()
+ */
+void replay_print_result(FILE* f, const replay_result_t* result);
+
+/**
+ * @brief      Closes the log.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int replay_close(void);
+
+#endif // REPLAY_H
@@ -0,0 +1,80 @@
+/**
+ * <rt_setup.h>
+ *
+ * @brief      Real time hardening of the flight process.
+ *
+ * rt_setup_init() runs once in main() before any thread is started. It
+ * shrinks the default thread stack, locks all current and future memory
+ * with mlockall(), stops malloc from handing memory back to the kernel and
+ * touches every page of the globals so the control path never takes a
+ * page fault on them. Each real time thread then calls rt_setup_thread()
+ * first thing, which prefaults its stack, pins it to the CPU from the
+ * settings file and for the IMU callback optionally switches it to
+ * SCHED_DEADLINE.
+ *
+ * Minor and major page faults of the process and of every registered
+ * thread are counted from rt_setup_mark(), called once start up is done,
+ * so rt_setup_print_report() shows whether the setup held during flight.
+ */
+
+#ifndef RT_SETUP_H
+#define RT_SETUP_H
+
+#include <stdio.h>
+
+#define RT_THREAD_STACK_BYTES	(256*1024)	///< default stack of threads created after init
+#define RT_STACK_PREFAULT_BYTES	(64*1024)	///< stack touched by every real time thread
+#define RT_MAX_CPU		63		///< highest cpu number accepted in the settings
+
+/**
+ * Threads that take part in the real time setup.
+ */
+typedef enum rt_thread_t{
+	RT_THREAD_IMU,		///< thread running the IMU callback
+	RT_THREAD_INPUT,	///< input_manager
+	RT_THREAD_LOG,		///< log_manager writer
+	RT_THREAD_PRINTF,	///< printf_manager
+	RT_THREAD_BMP,		///< bmp_manager
+	RT_THREAD_TELEMETRY,	///< telemetry_manager
+	RT_THREAD_BATT,		///< batt_manager
+	RT_NUM_THREADS
+} rt_thread_t;
+
+/**
+ * @brief      Locks memory and prefaults the globals according to the
+ *             settings. Call after the settings are loaded and before any
+ *             thread is started.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int rt_setup_init(void);
+
+/**
+ * @brief      Prefaults the stack of the calling thread, sets its cpu
+ *             affinity and scheduling from the settings, and registers it
+ *             for the page fault report. Does nothing unless
+ *             rt_setup_init() was called, so the sim and replay paths are
+ *             unaffected.
+ *
+ * @param[in]  t     which thread is calling
+ *
+ * @return     0 on success, -1 on failure
+ */
+int rt_setup_thread(rt_thread_t t);
+
+/**
+ * @brief      Starts counting page faults. Call once start up is finished.
+ */
+void rt_setup_mark(void);
+
+/**
+ * @brief      Prints page faults taken since rt_setup_mark() by the process
+ *             and each registered thread. Call before the threads exit.
+ *
+ * @param      f     stream to print to
+ *
+ * @return     0 on success, -1 on failure
+ */
+int rt_setup_print_report(FILE* f);
+
+#endif // RT_SETUP_H
@@ -0,0 +1,56 @@
+/**
+ * <scheduler.h>
+ *
+ * @brief      Multi-rate task table run by the IMU callback.
+ *
+ * Everything the IMU callback does is an entry in a static task table in
+ * scheduler.c, run top to bottom once per tick. Tasks that don't need the
+ * full settings.feedback_hz rate run every rate_div'th tick, where rate_div
+ * is feedback_hz/hz rounded down, on the tick given by their phase within
+ * that divisor. Giving slow tasks different phases spreads them over
+ * different ticks so they never all land in the same loop, and placing them
+ * after feedback_march() keeps them off the interrupt to ESC latency path.
+ *
+ * Each task is timed into its own instrumentation stage, so a tick where a
+ * slow task ran shows up in its histogram and the skipped ticks don't.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdio.h>
+
+/**
+ * @brief      Loops between runs of a task at the given rate. Modules that
+ *             filter at a task's rate use this to get the same divisor the
+ *             scheduler does.
+ *
+ * @param[in]  hz    task rate, 0 for every tick
+ *
+ * @return     divisor of settings.feedback_hz, at least 1
+ */
+int scheduler_rate_div(int hz);
+
+/**
+ * @brief      Works out the rate divisor and starting phase of every task.
+ *             Must be called after the settings are loaded and before the
+ *             IMU callback starts.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int scheduler_init(void);
+
+/**
+ * @brief      Runs every task due this tick in table order. Call once per
+ *             IMU callback between instr_tick_begin() and instr_tick_end().
+ */
+void scheduler_tick(void);
+
+/**
+ * @brief      Prints the task table with the divisors in use.
+ *
+ * @param      f     stream to print to
+ */
+void scheduler_print(FILE* f);
+
+#endif // SCHEDULER_H
@@ -0,0 +1,72 @@
+/**
+ * <seqlock.h>
+ *
+ * @brief      Single writer sequence lock for publishing small structs
+ *             between threads without blocking either side.
+ *
+ * The writer bumps the sequence number to odd, copies the payload in, then
+ * bumps it back to even. A reader copies the payload out and keeps the copy
+ * only if the sequence number was even and unchanged across the copy.
+ *
+ * The BeagleBone has a single core so a high priority reader that spins on
+ * a preempted writer would never let the writer finish. Readers here
+ * therefore try exactly once and report failure instead of retrying, the
+ * caller keeps whatever it read last time and tries again next loop.
+ *
+ * Only one thread may write a given seqlock.
+ */
+
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <stdatomic.h>
+#include <string.h>
+
+typedef struct seqlock_t{
+	atomic_uint seq;	///< odd while a write is in progress
+} seqlock_t;
+
+#define SEQLOCK_INITIALIZER {.seq = 0}
+
+/**
+ * @brief      Copy a payload into shared storage under the seqlock. Never
+ *             blocks.
+ *
+ * @param      s     The seqlock
+ * @param      dst   Shared storage protected by s
+ * @param[in]  src   New value
+ * @param[in]  len   Size of the payload in bytes
+ */
+static inline void seqlock_write(seqlock_t* s, void* dst, const void* src, size_t len)
+{
+	unsigned int seq = atomic_load_explicit(&s->seq, memory_order_relaxed);
+	atomic_store_explicit(&s->seq, seq+1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	memcpy(dst, src, len);
+	atomic_store_explicit(&s->seq, seq+2, memory_order_release);
+}
+
+/**
+ * @brief      Try once to copy a consistent payload out of shared storage.
+ *             Never blocks or spins.
+ *
+ * @param      s     The seqlock
+ * @param[out] dst   Where to copy the payload, may be partially written
+ *                   on failure
+ * @param[in]  src   Shared storage protected by s
+ * @param[in]  len   Size of the payload in bytes
+ *
+ * @return     0 if dst holds a consistent copy, -1 if a write was in
+ *             progress
+ */
+static inline int seqlock_try_read(seqlock_t* s, void* dst, const void* src, size_t len)
+{
+	unsigned int before = atomic_load_explicit(&s->seq, memory_order_acquire);
+	if(before & 1) return -1;
+	memcpy(dst, src, len);
+	atomic_thread_fence(memory_order_acquire);
+	if(atomic_load_explicit(&s->seq, memory_order_relaxed)!=before) return -1;
+	return 0;
+}
+
+#endif // SEQLOCK_H
@@ -18,7 +18,10 @@
 #ifndef SETPOINT_MANAGER_H
 #define SETPOINT_MANAGER_H
 
+#include <stdint.h>
+
 #include <rc_pilot_defs.h>
+#include <input_manager.h>
 
 /**
  * Setpoint for the feedback controllers. This is written by setpoint_manager
@@ -33,6 +36,12 @@ typedef struct setpoint_t{
 	int en_6dof;		///< enable 6DOF control features
 	///< @}
 
+	/** @name input timing */
+	///< @{
+	uint64_t input_ns;	///< user_input_t frame_ns of the input this setpoint was computed from
+	uint64_t input_age_ns;	///< how old that input was when it was used, 0 if unknown
+	///< @}
+
 	/** @name direct passthrough
 	 * user inputs tranlate directly to mixing matrix
 	 */
@@ -68,6 +77,14 @@ typedef struct setpoint_t{
 	double Y_dot;
 	///< @}
 
+	/** @name acceleration feed forward, m/s^2, set by the TRAJECTORY modes
+	 * but not used by feedback_march() yet */
+	///< @{
+	double X_ddot;
+	double Y_ddot;
+	double Z_ddot;
+	///< @}
+
 	/** @name horizontal velocity setpoint */
 	///< @{
 	int en_XY_pos_ctrl;
@@ -91,6 +108,18 @@ int setpoint_manager_init(void);
  */
 int setpoint_manager_update(void);
 
+/**
+ * @brief      Copies out the user input the last setpoint_manager_update()
+ *             acted on. The live user_input may have moved on since, this
+ *             is what the controllers actually saw. Only meaningful inside
+ *             the IMU callback.
+ *
+ * @param[out] input  struct to fill in
+ *
+ * @return     0 on success, -1 on failure
+ */
+int setpoint_manager_get_input(user_input_t* input);
+
 /**
  * @brief      cleans up the setpoint manager, not really necessary but here for
  *             completeness
@@ -7,14 +7,16 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
-#include <rc/math/filter.h>
 #include <rc/mpu.h>
 
 #include <flight_mode.h>
 #include <thrust_map.h>
 #include <mix.h>
 #include <input_manager.h>
+#include <log_manager.h>
 #include <rc_pilot_defs.h>
+#include <controller.h>
+#include <hal.h>
 
 
 
@@ -37,9 +39,24 @@ typedef struct settings_t{
 	int num_rotors;
 	rotor_layout_t layout;
 	int dof;
+	int custom_by_geometry;	///< LAYOUT_CUSTOM given as rotors rather than a matrix
+	mix_rotor_t custom_rotors[MAX_ROTORS];
+	double custom_matrix[MAX_ROTORS][MAX_INPUTS]; ///< columns X Y Z roll pitch yaw
 	thrust_map_t thrust_map;
 	double v_nominal;
 	int enable_magnetometer; // we suggest leaving as 0 (mag OFF)
+	int altitude_kf_steady_state; ///< use a precomputed gain for the altitude filter
+	///@}
+
+	/** @name control loop
+	 * Every rate dependent filter, controller and integration derives from
+	 * feedback_hz at init. Controllers given as DT transfer functions are
+	 * taken to be discretized at this rate.
+	 */
+	///@{
+	imu_mode_t imu_mode;
+	int feedback_hz;
+	double dt; ///< 1/feedback_hz, not in the settings file
 	///@}
 
 	/** @name flight modes */
@@ -48,6 +65,7 @@ typedef struct settings_t{
 	flight_mode_t flight_mode_1;
 	flight_mode_t flight_mode_2;
 	flight_mode_t flight_mode_3;
+	char trajectory_file[256]; ///< waypoints for the TRAJECTORY modes, "" for none
 	///@}
 
 
@@ -78,16 +96,23 @@ typedef struct settings_t{
 	int printf_u;
 	int printf_motors;
 	int printf_mode;
+	int printf_hz;		///< console refresh rate
 	///@}
 
 	/** @name log settings */
 	///@{
 	int enable_logging;
+	log_format_t log_format;
 	int log_sensors;
 	int log_state;
 	int log_setpoint;
 	int log_control_u;
 	int log_motor_signals;
+	int log_timing;
+	int log_raw; ///< raw callback inputs for rc_pilot --replay, binary format only
+	int log_watchdog; ///< deadline watchdog counters
+	int log_compression; ///< LOG_COMPRESSION_* from log_format.h, binary format only
+	double log_buffer_seconds; ///< depth of the log ring buffer
 	///@}
 
 	/** @name mavlink stuff */
@@ -95,17 +120,65 @@ typedef struct settings_t{
 	char dest_ip[24];
 	uint8_t my_sys_id;
 	uint16_t mav_port;
+	int enable_mavlink_input; ///< start mavlink_manager for mocap and PARAM_SET tuning
+	double mocap_latency_ms; ///< time from a mocap pose being measured to it being received
+	int bumpless_param_updates; ///< carry the last output over when a controller is retuned
+	///@}
+
+	/** @name outbound telemetry, stream rates in hz, 0 disables a stream */
+	///@{
+	int enable_telemetry;
+	double telemetry_attitude_hz;
+	double telemetry_position_hz;
+	double telemetry_servo_hz;
+	double telemetry_battery_hz;
+	double telemetry_timing_hz;
+	///@}
+
+	/** @name shared memory telemetry ring for processes on the board */
+	///@{
+	int enable_shm_export;
+	char shm_name[64];	///< POSIX shared memory object name, starts with a /
+	///@}
+
+	/** @name real time setup, cpu -1 lets the thread run anywhere */
+	///@{
+	int rt_lock_memory;	///< mlockall() everything at start up
+	int rt_imu_cpu;
+	int rt_input_cpu;
+	int rt_log_cpu;
+	int rt_printf_cpu;
+	int rt_bmp_cpu;
+	int rt_telemetry_cpu;
+	int rt_batt_cpu;
+	int rt_imu_deadline_us;	///< SCHED_DEADLINE runtime per loop for the IMU callback, 0 keeps SCHED_FIFO
+	///@}
+
+	/** @name deadline watchdog */
+	///@{
+	int watchdog_shed_limit;	///< highest WATCHDOG_LEVEL_* from watchdog.h to shed to
+	int watchdog_shed_misses;	///< consecutive misses that shed one more level
+	double watchdog_recover_seconds; ///< time without a miss before stepping back a level
+	///@}
 
 	/** @name feedback controllers */
 	///@{
-	rc_filter_t roll_controller;
-	rc_filter_t pitch_controller;
-	rc_filter_t yaw_controller;
-	rc_filter_t altitude_controller;
-	rc_filter_t horiz_vel_ctrl_4dof;
-	rc_filter_t horiz_vel_ctrl_6dof;
-	rc_filter_t horiz_pos_ctrl_4dof;
-	rc_filter_t horiz_pos_ctrl_6dof;
+	controller_t roll_controller;
+	controller_t pitch_controller;
+	controller_t yaw_controller;
+	controller_t altitude_controller;
+	controller_t horiz_vel_ctrl_4dof;
+	controller_t horiz_vel_ctrl_6dof;
+	controller_t horiz_pos_ctrl_4dof;
+	controller_t horiz_pos_ctrl_6dof;
+	controller_spec_t roll_controller_spec; ///< what each controller above was built from
+	controller_spec_t pitch_controller_spec;
+	controller_spec_t yaw_controller_spec;
+	controller_spec_t altitude_controller_spec;
+	controller_spec_t horiz_vel_ctrl_4dof_spec;
+	controller_spec_t horiz_vel_ctrl_6dof_spec;
+	controller_spec_t horiz_pos_ctrl_4dof_spec;
+	controller_spec_t horiz_pos_ctrl_6dof_spec;
 	double max_XY_velocity;
 	double max_Z_velocity;
 	///@}
@@ -0,0 +1,40 @@
+/**
+ * <shm_export.h>
+ *
+ * @brief      Publishes every tick into the shared memory telemetry ring
+ *             for other processes on the board, see shm_format.h.
+ *
+ * The ring is created and prefaulted at start up, during flight publishing
+ * is one copy into a mapped page with no system call or lock, readers
+ * can't slow the writer down. On exit the ring is marked dead and unlinked,
+ * readers that still have it mapped keep the last records.
+ */
+
+#ifndef SHM_EXPORT_H
+#define SHM_EXPORT_H
+
+/**
+ * @brief      Creates the shared memory object named by settings.shm_name,
+ *             replacing one left over from an earlier run, and fills in the
+ *             header.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int shm_export_init(void);
+
+/**
+ * @brief      Copies state_estimate, setpoint and fstate into the next slot.
+ *             Called from the IMU callback right after
+ *             snapshot_publish_tick(), does nothing unless shm_export_init()
+ *             succeeded.
+ */
+void shm_export_publish(void);
+
+/**
+ * @brief      Marks the ring dead, unmaps and unlinks it.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int shm_export_cleanup(void);
+
+#endif // SHM_EXPORT_H
@@ -0,0 +1,86 @@
+/**
+ * <shm_format.h>
+ *
+ * @brief      Layout of the shared memory telemetry ring.
+ *
+ * With enable_shm_export rc_pilot creates the POSIX shared memory object
+ * named by the shm_name setting, one shm_ring_header_t followed by
+ * SHM_RING_SLOTS slots. Every tick of the IMU callback the state estimate,
+ * setpoint and feedback state are copied into the slot after the previous
+ * one, so processes on the same board get every sample without a socket
+ * and without the control loop ever waiting on them.
+ *
+ * Each slot has its own sequence number. The writer makes it odd, copies
+ * the record in, sets it to 2*index+2 and only then advances head, the
+ * number of records published so far. A reader that finds anything else in
+ * the sequence number before or after copying a record knows the writer
+ * has lapped it and that record is lost. Counters are 32 bit and wrap,
+ * SHM_RING_SLOTS is a power of two so slot indices stay consistent across
+ * the wrap.
+ *
+ * The records are the rc_pilot structs themselves, so readers must be built
+ * against the same headers, and the same real_t, as the writer. The header
+ * records the size of every struct and the reader refuses a ring that
+ * doesn't match. Use shm_reader.h to read the ring.
+ */
+
+#ifndef SHM_FORMAT_H
+#define SHM_FORMAT_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <state_estimator.h>
+#include <setpoint_manager.h>
+#include <feedback.h>
+
+#define SHM_RING_MAGIC		"RCPSHM"	///< 6 chars + nul terminator
+#define SHM_RING_VERSION	1
+#define SHM_RING_BYTE_ORDER	0x01020304	///< written natively
+#define SHM_RING_SLOTS		256		///< power of two, 1.28s at 200hz
+
+/**
+ * One tick worth of data.
+ */
+typedef struct shm_record_t{
+	uint64_t time_ns;		///< hal_time_ns() when the record was published
+	state_estimate_t state;
+	setpoint_t setpoint;
+	feedback_state_t fstate;
+} shm_record_t;
+
+/**
+ * One slot of the ring, slots are cache line aligned.
+ */
+typedef struct shm_ring_slot_t{
+	atomic_uint seq;		///< odd while written, 2*index+2 once complete
+	shm_record_t rec;
+} __attribute__((aligned(64))) shm_ring_slot_t;
+
+/**
+ * Start of the shared memory object, the slots follow at header_size.
+ */
+typedef struct shm_ring_header_t{
+	char magic[8];			///< SHM_RING_MAGIC
+	uint32_t byte_order;		///< SHM_RING_BYTE_ORDER
+	uint16_t version;		///< SHM_RING_VERSION
+	uint16_t header_size;		///< sizeof(shm_ring_header_t), slots start here
+	uint32_t slot_size;		///< sizeof(shm_ring_slot_t)
+	uint32_t num_slots;		///< SHM_RING_SLOTS
+	uint32_t state_size;		///< sizeof(state_estimate_t)
+	uint32_t setpoint_size;		///< sizeof(setpoint_t)
+	uint32_t fstate_size;		///< sizeof(feedback_state_t)
+	uint16_t num_rotors;		///< from the settings file
+	uint16_t feedback_hz;		///< rate records are published at
+	int32_t writer_pid;		///< process id of rc_pilot
+	char name[128];			///< name field from the settings file
+	atomic_uint alive;		///< 1 while rc_pilot is running, 0 after it exited
+	atomic_uint head;		///< records published so far
+} __attribute__((aligned(64))) shm_ring_header_t;
+
+/**
+ * total size of the shared memory object
+ */
+#define SHM_RING_BYTES	(sizeof(shm_ring_header_t) + SHM_RING_SLOTS*sizeof(shm_ring_slot_t))
+
+#endif // SHM_FORMAT_H
@@ -0,0 +1,71 @@
+/**
+ * <shm_reader.h>
+ *
+ * @brief      Reads the shared memory telemetry ring from another process.
+ *
+ * For companion processes on the same board. Maps the ring read only, so
+ * consumers don't need root and can't disturb rc_pilot, and hands out the
+ * records in order, counting the ones that were overwritten before the
+ * reader got to them. Never blocks, poll shm_reader_next() at whatever rate
+ * suits the consumer. Depends only on the C standard library, librt and
+ * shm_format.h.
+ */
+
+#ifndef SHM_READER_H
+#define SHM_READER_H
+
+#include <stdint.h>
+
+#include <shm_format.h>
+
+/**
+ * State of one open ring, treat as opaque.
+ */
+typedef struct shm_reader_t{
+	const shm_ring_header_t* header;	///< mapped header, NULL when closed
+	const shm_ring_slot_t* slots;
+	uint32_t next;			///< index of the next record to return
+	uint64_t missed;		///< records overwritten before they were read
+} shm_reader_t;
+
+/**
+ * @brief      Maps the ring and checks that its layout matches this build.
+ *             Reading starts from the newest record.
+ *
+ * @param[out] r     reader to initialize
+ * @param[in]  name  shared memory object, the shm_name setting of rc_pilot
+ *
+ * @return     0 on success, -1 on failure
+ */
+int shm_reader_open(shm_reader_t* r, const char* name);
+
+/**
+ * @brief      Copies out the next record not read yet.
+ *
+ * @param      r     an open reader
+ * @param[out] rec   where to copy the record, may be partially written when
+ *                   0 is returned
+ *
+ * @return     1 if a record was copied, 0 if there is nothing new
+ */
+int shm_reader_next(shm_reader_t* r, shm_record_t* rec);
+
+/**
+ * @brief      See if rc_pilot is still writing to the ring. Once it has
+ *             exited no more records will arrive, close and reopen to pick
+ *             up the next run.
+ *
+ * @param      r     an open reader
+ *
+ * @return     1 if the writer is running, 0 otherwise
+ */
+int shm_reader_alive(const shm_reader_t* r);
+
+/**
+ * @brief      Unmaps the ring.
+ *
+ * @param      r     reader to close, may be closed twice
+ */
+void shm_reader_close(shm_reader_t* r);
+
+#endif // SHM_READER_H
@@ -0,0 +1,65 @@
+/**
+ * <sim.h>
+ *
+ * @brief      Software in the loop simulation backend.
+ *
+ * Implements hal_sim_ops with a rigid body multirotor model. The rotor
+ * geometry is taken from the mixing matrix of the configured layout, the
+ * motors invert the configured thrust map and lag their commands by a first
+ * order time constant. A scripted virtual pilot takes off, flies roll, pitch
+ * and yaw doublets in flight_mode_1 and lands again. Motion capture poses
+ * arrive at 100hz, mocap_latency_ms after they were measured.
+ *
+ * sim_run() steps the model and the real IMU callback back to back without
+ * sleeping, so a flight takes as long as the host needs to execute it.
+ * hal_time_ns() returns simulated time so every time based computation in
+ * the control path sees a perfect settings.feedback_hz loop. The stage timings in the
+ * instrumentation report still use the real clock and show the host's cost
+ * per loop, the period and jitter channels are meaningless here.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SIM_DEFAULT_SECONDS	26.0	///< long enough for the whole pilot script
+
+/**
+ * Summary of one simulated flight.
+ */
+typedef struct sim_result_t{
+	uint64_t steps;		///< IMU callbacks executed
+	double sim_seconds;	///< simulated time flown
+	double wall_seconds;	///< real time it took
+	double max_tilt;	///< max angle between body and world Z while armed (rad)
+	double rms_att_err;	///< rms roll/pitch setpoint tracking error while airborne (rad)
+	double rms_alt_err;	///< rms error to the pilot's altitude target while airborne (m)
+	double rms_pos_err;	///< rms error of the horizontal position estimate while mocap runs (m)
+	double final_pos[3];	///< NED position at the end (m)
+	int crashed;		///< nonzero if the vehicle tipped over, hit the ground hard or flew away
+} sim_result_t;
+
+/**
+ * @brief      Flies one scripted flight. hal_init(HAL_SIM), the IMU callback
+ *             and every module it depends on must be set up already and the
+ *             rc state must be RUNNING.
+ *
+ * @param[in]  seconds  simulated flight duration
+ * @param[out] result   flight summary
+ *
+ * @return     0 on success, -1 on failure. A crash is not a failure, check
+ *             result->crashed.
+ */
+int sim_run(double seconds, sim_result_t* result);
+
+/**
+ * @brief      Prints a flight summary.
+ *
+ * @param      f       stream to print to
+ * @param[in]  result  flight summary from sim_run()
+ */
+void sim_print_result(FILE* f, const sim_result_t* result);
+
+#endif // SIM_H
@@ -0,0 +1,93 @@
+/**
+ * <snapshot.h>
+ *
+ * @brief      Lock free, coherent copies of the shared flight structs for
+ *             readers outside the IMU callback.
+ *
+ * state_estimate, fstate and setpoint are written field by field from the
+ * IMU callback and user_input from the dsm callbacks, so a thread reading
+ * the globals directly can see half updated vectors and quaternions. Instead
+ * the writers publish a complete copy once per update and readers copy out
+ * the newest complete one. user_input is published once per radio frame and
+ * carries the frame's arrival time, so readers can tell how old it is.
+ *
+ * Each struct has SNAPSHOT_SLOTS buffers each guarded by a seqlock. The
+ * writer always fills the slot after the newest one, so a reader copying the
+ * newest slot never races the writer unless it is preempted for several
+ * publish periods, in which case it just retries on the new newest slot.
+ * This works no matter the relative priority of reader and writer, neither
+ * side ever waits on the other.
+ *
+ * Every non-realtime consumer (printf, telemetry, shared memory export etc)
+ * should read through here rather than the globals.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <state_estimator.h>
+#include <feedback.h>
+#include <setpoint_manager.h>
+#include <input_manager.h>
+
+#define SNAPSHOT_SLOTS		4	///< buffers per struct
+#define SNAPSHOT_READ_TRIES	8	///< reader gives up after this many collisions
+
+/**
+ * @brief      Publish state_estimate, fstate and setpoint. Called from the IMU
+ *             callback once every tick after feedback_march().
+ */
+void snapshot_publish_tick(void);
+
+/**
+ * @brief      Publish user_input. Single writer like the rest: only the dsm
+ *             callback thread on the hardware path, the IMU callback in sim
+ *             and replay.
+ */
+void snapshot_publish_user_input(void);
+
+/**
+ * @brief      Number of times snapshot_publish_tick() has been called, lets
+ *             readers tell if a new tick is available.
+ *
+ * @return     tick count
+ */
+uint64_t snapshot_tick_count(void);
+
+/**
+ * @brief      Copy out the newest published state estimate.
+ *
+ * @param[out] out   where to copy to, left untouched on failure
+ *
+ * @return     0 on success, -1 if the writer kept getting in the way
+ */
+int snapshot_get_state_estimate(state_estimate_t* out);
+
+/**
+ * @brief      Copy out the newest published feedback state.
+ *
+ * @param[out] out   where to copy to, left untouched on failure
+ *
+ * @return     0 on success, -1 if the writer kept getting in the way
+ */
+int snapshot_get_fstate(feedback_state_t* out);
+
+/**
+ * @brief      Copy out the newest published setpoint.
+ *
+ * @param[out] out   where to copy to, left untouched on failure
+ *
+ * @return     0 on success, -1 if the writer kept getting in the way
+ */
+int snapshot_get_setpoint(setpoint_t* out);
+
+/**
+ * @brief      Copy out the newest published user input.
+ *
+ * @param[out] out   where to copy to, left untouched on failure
+ *
+ * @return     0 on success, -1 if the writer kept getting in the way
+ */
+int snapshot_get_user_input(user_input_t* out);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,102 @@
+/**
+ * <startup.h>
+ *
+ * @brief      Start up of the hardware path as a dependency graph.
+ *
+ * main() describes every init step as a phase with the phases it has to
+ * wait for. startup_run() starts each phase in its own thread as soon as
+ * everything it depends on has finished, so the slow hardware inits such as
+ * the PRU, the DSM and the DMP firmware load overlap instead of running one
+ * after another. Phases that share a bus or set up state another one reads
+ * are ordered by their dependencies, everything else may run at the same
+ * time, so a phase must not rely on the order of the table.
+ *
+ * Instead of a fixed wait for the DMP, startup_wait_dmp_settled() watches
+ * the quaternion and gyro until the attitude agrees with the accelerometer
+ * and stops drifting.
+ *
+ * Every phase is timed from startup_begin(), the time to armable is taken by
+ * startup_mark_armable() and both are printed by startup_print_report().
+ */
+
+#ifndef STARTUP_H
+#define STARTUP_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <rc/mpu.h>
+
+#define STARTUP_MAX_PHASES	32	///< dependencies are bits of a uint32_t
+#define STARTUP_AFTER(p)	(1u<<(p))	///< dependency on phase index p
+
+/** @name DMP convergence, see startup_wait_dmp_settled() */
+///@{
+#define STARTUP_SETTLE_POLL_US		10000	///< time between two looks at the DMP
+#define STARTUP_SETTLE_WINDOW_S		0.5	///< checks have to hold for this long
+#define STARTUP_SETTLE_TIMEOUT_S	3.0	///< the fixed wait this replaced
+#define STARTUP_SETTLE_TILT_DEG		2.0	///< max angle between DMP up and the accelerometer
+#define STARTUP_SETTLE_GYRO_DPS		2.0	///< max gyro rate, the vehicle has to sit still
+#define STARTUP_SETTLE_DRIFT_DPS	0.5	///< max rotation of the quaternion over the window
+///@}
+
+/**
+ * One step of start up.
+ */
+typedef struct startup_phase_t{
+	const char* name;	///< printed in errors and the report
+	int (*init)(void);	///< returns 0 on success, -1 on failure
+	uint32_t after;		///< STARTUP_AFTER() of every phase to wait for
+	int enabled;		///< 0 to skip, phases after it still run
+} startup_phase_t;
+
+/**
+ * @brief      Marks the time everything is reported from. Call first thing
+ *             in main().
+ */
+void startup_begin(void);
+
+/**
+ * @brief      Runs the phases, each one in its own thread once all the
+ *             phases in its after mask are done. Once a phase fails no new
+ *             ones are started and the running ones are waited for.
+ *
+ * @param[in]  phases  table of phases, indices are the ones STARTUP_AFTER()
+ *                     refers to
+ * @param[in]  n       number of phases, up to STARTUP_MAX_PHASES
+ *
+ * @return     0 if every enabled phase succeeded, -1 otherwise
+ */
+int startup_run(const startup_phase_t* phases, int n);
+
+/**
+ * @brief      Waits for the DMP to converge after rc_mpu_initialize_dmp()
+ *             instead of a fixed sleep. Settled means that for
+ *             STARTUP_SETTLE_WINDOW_S the up direction of dmp_quat stays
+ *             within STARTUP_SETTLE_TILT_DEG of the accelerometer, the gyro
+ *             reads less than STARTUP_SETTLE_GYRO_DPS and the quaternion
+ *             turns less than STARTUP_SETTLE_DRIFT_DPS, so the DMP has
+ *             leveled itself and taken out the gyro bias. Gives up with a
+ *             warning after STARTUP_SETTLE_TIMEOUT_S, which is how long
+ *             start up used to wait regardless.
+ *
+ * @param[in]  data  filled in by the DMP interrupt thread
+ *
+ * @return     0 once settled or timed out
+ */
+int startup_wait_dmp_settled(const rc_mpu_data_t* data);
+
+/**
+ * @brief      Takes the time to armable, call right before the state is set
+ *             to RUNNING.
+ */
+void startup_mark_armable(void);
+
+/**
+ * @brief      Prints when each phase started and how long it took, in ms
+ *             from startup_begin(), and the time to armable.
+ *
+ * @param      f     stream to print to
+ */
+void startup_print_report(FILE* f);
+
+#endif // STARTUP_H
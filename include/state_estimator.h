@@ -86,6 +86,7 @@ typedef struct state_estimate_t{
 	 */
 	///@{
 	double bmp_pressure_raw;///< raw barometer pressure in Pascals
+	uint64_t bmp_count;	///< count of the barometer sample in use, see bmp_sample_t
 	double alt_bmp_raw;	///< altitude estimate using only bmp from sea level (m)
 	double alt_bmp;		///< altitude estimate using kalman filter (IMU & bmp)
 	double alt_bmp_vel;	///< z velocity estimate using kalman filter (IMU & bmp)
@@ -94,11 +95,15 @@ typedef struct state_estimate_t{
 
 	/** @name Motion Capture data
 	 * As mocap drop in and out the mocap_running flag will turn on and off.
-	 * Old values will remain readable after mocap drops out.
+	 * Old values will remain readable after mocap drops out. These are the
+	 * raw values of the newest sample, the filtered position is in
+	 * pos_global.
 	 */
 	///@{
 	int mocap_running;	///< 1 if motion capture data is recent and valid
-	uint64_t mocap_timestamp_ns; ///< timestamp of last received packet in nanoseconds since boot
+	uint64_t mocap_timestamp_ns; ///< hal_time_ns() when the last packet was received
+	uint64_t mocap_count;	///< count of the mocap sample in use, see mocap_sample_t
+	double mocap_age;	///< s from receiving that sample to the loop that picked it up
 	double pos_mocap[3];	///< position in mocap frame, converted to NED if necessary
 	double quat_mocap[4];	///< UAV orientation according to mocap
 	double tb_mocap[3];	///< Tait-Bryan angles according to mocap
@@ -106,15 +111,16 @@ typedef struct state_estimate_t{
 	///@}
 
 	/** @name Global Position Estimate
-	 * This is the global estimated position, velocity, and acceleration
-	 * output of a kalman filter which filters accelerometer, DMP attitude,
-	 * and mocap data. If mocap is not available, barometer will be used.
+	 * This is the global estimated position, velocity, and acceleration.
+	 * X and Y come from a kalman filter propagated every loop with the
+	 * accelerometer rotated by the DMP attitude and corrected by mocap
+	 * samples at the time they were measured, Z is the altitude filter.
 	 *
 	 * global values are in the mocap's frame for position control.
 	 * relative values are in a frame who's origin is at the position where
-	 * the feedback controller is armed. Without mocap data the filter will
-	 * assume altitude from the barometer and accelerometer, and position
-	 * estimate will have steady state gain of zero to prevent runaway.
+	 * the feedback controller is armed. Without mocap data X and Y hold
+	 * their last value with zero velocity rather than integrating the
+	 * accelerometer on their own.
 	 */
 	///@{
 	double pos_global[3];
@@ -129,6 +135,8 @@ typedef struct state_estimate_t{
 	///@{
 	double v_batt_raw;	///< main battery pack voltage (v)
 	double v_batt_lp;	///< main battery pack voltage with low pass filter (v)
+	double batt_gain_scale;	///< settings.v_nominal/v_batt_lp, controllers multiply their gain by this
+	uint64_t batt_count;	///< count of the batt_manager sample in use
 	double bmp_temp;	///< temperature of barometer
 	///@}
 
@@ -137,12 +145,24 @@ typedef struct state_estimate_t{
 extern state_estimate_t state_estimate;
 extern rc_mpu_data_t mpu_data;
 
+/**
+ * One motion capture pose as received, handed to the estimator with
+ * state_estimator_publish_mocap().
+ */
+typedef struct mocap_sample_t{
+	double pos[3];		///< position, all zero when the mocap system lost visual
+	double quat[4];		///< normalized orientation
+	double tb[3];		///< Tait-Bryan angles of quat
+	uint64_t timestamp_ns;	///< hal_time_ns() when the packet was received
+	uint64_t count;		///< increments with every new sample, 0 means none yet
+} mocap_sample_t;
+
 
 
 /**
  * @brief      Initial setup of the state estimator
  *
- * barometer must be initialized first
+ * barometer and bmp_manager must be initialized first
  *
  * @return     0 on success, -1 on failure
  */
@@ -159,16 +179,46 @@ int state_estimator_init(void);
 int state_estimator_march(void);
 
 
+/**
+ * @brief      Picks up the newest filtered battery voltage from batt_manager
+ *
+ * Runs as its own BATT_HZ task after feedback_march in the ISR, so
+ * v_batt_lp is at most two task periods old when the controllers use it.
+ * Only the sim and replay backends read the ADC from here.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int state_estimator_batt_march(void);
+
+
 /**
  * @brief      jobs the state estimator must do after feedback_controller
  *
- * Called immediately after feedback_march in the ISR. Currently this reads
+ * Runs as a BMP_HZ task after feedback_march in the ISR. Currently this asks
+ * the bmp_manager thread for a new barometer sample.
  *
  * @return     0 on success, -1 on failure
  */
 int state_estimator_jobs_after_feedback(void);
 
 
+/**
+ * @brief      Hands a new mocap sample to the estimator. Never blocks. Only
+ *             one thread may publish, the estimator picks the newest sample
+ *             up in the next state_estimator_march().
+ *
+ * The pose is taken to have been measured mocap_latency_ms before it was
+ * received. The position filter applies it to its state at that loop and
+ * re-runs the loops since, so samples may arrive late and out of order as
+ * long as they are no older than the filter's history.
+ *
+ * @param[in]  sample  The new sample, count must differ from the last one
+ *
+ * @return     0 on success, -1 on failure
+ */
+int state_estimator_publish_mocap(const mocap_sample_t* sample);
+
+
 /**
  * @brief      Cleanup the state estimator, freeing memory
  *
@@ -177,6 +227,18 @@ int state_estimator_jobs_after_feedback(void);
 int state_estimator_cleanup(void);
 
 
+#ifdef RC_PILOT_BENCH
+/**
+ * @brief      Runs only the IMU, the altitude or the position stage of
+ *             state_estimator_march(). Only built into the benchmark suite
+ *             so it can time the stages on their own.
+ */
+void state_estimator_bench_imu_march(void);
+void state_estimator_bench_altitude_march(void);
+void state_estimator_bench_position_march(void);
+#endif
+
+
 
 
 #endif //  STATE_ESTIMATOR_H
@@ -0,0 +1,41 @@
+/**
+ * <telemetry_manager.h>
+ *
+ * @brief      Outbound MAVLink telemetry thread.
+ *
+ * Streams ATTITUDE_QUATERNION, LOCAL_POSITION_NED, SERVO_OUTPUT_RAW,
+ * SYS_STATUS and loop timing to the ground station at dest_ip:mav_port, each
+ * at its own rate from the settings file. Loop timing is sent as one
+ * DEBUG_VECT per instrumentation channel named after the channel with
+ * x,y,z = p50,p99,max in microseconds, plus one named "watchdog" with
+ * x,y,z = overruns, missed ticks and shedding level. A HEARTBEAT goes out at 1hz so ground
+ * stations pick the vehicle up.
+ *
+ * All data comes from the snapshot layer, nothing here runs in the IMU
+ * callback. Messages that are due in the same cycle are serialized back to
+ * back into as few UDP datagrams as fit under TELEMETRY_MAX_DATAGRAM. The
+ * rc_mav library sends one message per datagram through its own socket so
+ * this thread uses a separate send-only socket, incoming messages are still
+ * handled by mavlink_manager.
+ */
+
+#ifndef TELEMETRY_MANAGER_H
+#define TELEMETRY_MANAGER_H
+
+#define TELEMETRY_MAX_DATAGRAM	1400	///< stay under a 1500 byte ethernet/wifi MTU
+
+/**
+ * @brief      Opens the socket and starts the telemetry thread.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int telemetry_manager_init(void);
+
+/**
+ * @brief      Stops the telemetry thread and closes the socket.
+ *
+ * @return     0 on clean exit, -1 on exit time out/force close
+ */
+int telemetry_manager_cleanup(void);
+
+#endif // TELEMETRY_MANAGER_H
@@ -10,9 +10,16 @@
 #define LOG_MANAGER_HZ		20
 #define LOG_MANAGER_PRI		50
 #define LOG_MANAGER_TOUT	2.0
-#define PRINTF_MANAGER_HZ	20
-#define PRINTF_MANAGER_PRI	60
-#define PRINTF_MANAGER_TOUT	0.5
+#define PRINTF_MANAGER_NICE	10	// SCHED_OTHER, cosmetic, rate is settings.printf_hz
+#define PRINTF_MANAGER_TOUT	1.5	// longer than one frame at the slowest rate
+#define BMP_MANAGER_HZ		10	// only sets the exit check timeout, reads are requested by the IMU
+#define BMP_MANAGER_PRI		50	// must stay below IMU_PRIORITY
+#define BMP_MANAGER_TOUT	0.5
+#define TELEMETRY_MANAGER_HZ	50	// max rate of any telemetry stream
+#define TELEMETRY_MANAGER_PRI	40
+#define TELEMETRY_MANAGER_TOUT	0.5
+#define BATT_MANAGER_PRI	30	// rate is BATT_HZ, must stay below IMU_PRIORITY
+#define BATT_MANAGER_TOUT	0.5
 #define BUTTON_EXIT_CHECK_HZ	10
 #define BUTTON_EXIT_TIME_S	2
 
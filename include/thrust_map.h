@@ -9,6 +9,13 @@
 #ifndef THRUST_MAP_H
 #define THRUST_MAP_H
 
+/**
+ * Number of uniformly spaced thrust intervals the selected map is resampled
+ * into by thrust_map_init(). With the included maps the resampled result is
+ * within 1e-4 of interpolating the original table directly.
+ */
+#define THRUST_LUT_SIZE	1024
+
 /**
  * enum thrust_map_t
  *
@@ -40,4 +47,27 @@ int thrust_map_init(thrust_map_t map);
  */
 double map_motor_signal(double m);
 
+
+/**
+ * @brief      Same as map_motor_signal for an array of motors at once.
+ *
+ * @param[in]  in    n thrust inputs, each between 0 and 1 inclusive
+ * @param[out] out   n motor signals, -1 for any input out of range
+ * @param[in]  n     number of motors
+ *
+ * @return     0 on success, -1 if any input was out of range
+ */
+int map_motor_signals(const double* in, double* out, int n);
+
+/**
+ * @brief      Inverse of map_motor_signal, the normalized thrust a motor
+ *             produces for a given signal according to the original table.
+ *             Used by the simulator to model the motors.
+ *
+ * @param[in]  s     motor signal, clamped to between 0 and 1
+ *
+ * @return     normalized thrust between 0 and 1
+ */
+double thrust_map_signal_to_thrust(double s);
+
 #endif // THRUST_MAP_H
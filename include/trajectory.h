@@ -0,0 +1,129 @@
+/**
+ * <trajectory.h>
+ *
+ * @brief      Precomputed trajectories for the TRAJECTORY flight modes.
+ *
+ * A trajectory is a list of waypoints, each with a time, a position in X, Y,
+ * Z and yaw and optionally a velocity. It always starts at rest from where
+ * the vehicle is when the trajectory is started, so waypoints are offsets
+ * from that point, and it holds the last waypoint once done. Between two
+ * waypoints every axis follows the minimum jerk quintic that matches
+ * position and velocity at both ends with zero acceleration.
+ *
+ * The quintic coefficients are worked out by trajectory_set() outside the
+ * IMU callback, from the trajectory_file setting at start up or from a
+ * MAVLink mission upload. The IMU callback then only evaluates the current
+ * segment, position, velocity and acceleration feed forward cost the same
+ * every tick. Segments are at least one loop period long so the cursor moves
+ * at most one segment per tick.
+ *
+ * A new trajectory is handed over through a second bank and is picked up
+ * the next time trajectory_start() is called, never partway through a run.
+ *
+ * Only the Z and yaw axes are flown for now. X and Y are evaluated into the
+ * setpoint and logged, but feedback_march() has no horizontal position loop
+ * to follow them yet, so trajectory_set() warns when they aren't all zero.
+ */
+
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#define TRAJECTORY_MAX_WAYPOINTS	64	///< not counting the implicit start point
+
+/**
+ * Axes of a trajectory, the setpoint fields they drive.
+ */
+typedef enum traj_axis_t{
+	TRAJ_X,
+	TRAJ_Y,
+	TRAJ_Z,
+	TRAJ_YAW,
+	TRAJ_NUM_AXES
+} traj_axis_t;
+
+/**
+ * One waypoint, relative to where the trajectory was started.
+ */
+typedef struct traj_waypoint_t{
+	double t;			///< seconds after the start, increasing
+	double pos[TRAJ_NUM_AXES];	///< m and rad, NED like the setpoint
+	double vel[TRAJ_NUM_AXES];	///< velocity to pass through with, m/s and rad/s
+} traj_waypoint_t;
+
+/**
+ * What the trajectory asks for at one instant, absolute like the setpoint.
+ */
+typedef struct traj_point_t{
+	double pos[TRAJ_NUM_AXES];
+	double vel[TRAJ_NUM_AXES];
+	double acc[TRAJ_NUM_AXES];	///< acceleration feed forward
+	int done;			///< 1 once the last waypoint has been reached
+} traj_point_t;
+
+/**
+ * @brief      Loads settings.trajectory_file if one is given. Call once at
+ *             start up before the IMU callback starts.
+ *
+ * @return     0 on success or if no file is set, -1 on failure
+ */
+int trajectory_init(void);
+
+/**
+ * @brief      Reads waypoints from a json file and hands them to
+ *             trajectory_set(). The file holds a "waypoints" array of
+ *             objects with "t", "X", "Y", "Z", "yaw" and optionally
+ *             "X_dot", "Y_dot", "Z_dot" and "yaw_dot".
+ *
+ * @param[in]  path  The json file
+ *
+ * @return     0 on success, -1 on failure
+ */
+int trajectory_load_file(const char* path);
+
+/**
+ * @brief      Checks the waypoints, computes the segment coefficients and
+ *             stages them for the next trajectory_start(). Not real time
+ *             safe, call from one thread outside the IMU callback only.
+ *
+ * @param[in]  wp    waypoints, not including the start point
+ * @param[in]  n     number of waypoints, 1 to TRAJECTORY_MAX_WAYPOINTS
+ *
+ * @return     0 on success, -1 if the waypoints are invalid
+ */
+int trajectory_set(const traj_waypoint_t* wp, int n);
+
+/**
+ * @brief      Starts flying the newest trajectory from the given point.
+ *             Called from the IMU callback.
+ *
+ * @param[in]  origin  absolute X, Y, Z and yaw the waypoints are relative to
+ *
+ * @return     0 on success, -1 if no trajectory has been loaded
+ */
+int trajectory_start(const double origin[TRAJ_NUM_AXES]);
+
+/**
+ * @brief      Evaluates the running trajectory at the current time then
+ *             moves the time on by one loop period. Called from the IMU
+ *             callback once per tick.
+ *
+ * @param[out] p     point to fill in
+ *
+ * @return     0 on success, -1 if no trajectory is running
+ */
+int trajectory_step(traj_point_t* p);
+
+/**
+ * @brief      Stops the running trajectory, the next trajectory_start()
+ *             starts over from the beginning.
+ */
+void trajectory_stop(void);
+
+/**
+ * @brief      See if a trajectory has been started.
+ *
+ * @return     1 if running, 0 if not
+ */
+int trajectory_is_running(void);
+
+#endif // TRAJECTORY_H
@@ -0,0 +1,115 @@
+/**
+ * <watchdog.h>
+ *
+ * @brief      Deadline watchdog of the IMU callback with load shedding.
+ *
+ * After every tick watchdog_tick() looks at the start and end timestamps the
+ * instrumentation module took. A tick that ran longer than the loop period
+ * is an overrun, and a gap between two ticks of more than one and a half
+ * periods means interrupts went by without a tick, each of which counts as
+ * a missed tick. Both add to the run of consecutive misses.
+ *
+ * Every watchdog_shed_misses consecutive misses the watchdog sheds one more
+ * level of load, up to watchdog_shed_limit: first log records are dropped,
+ * then the console stops updating, then the slow tasks of the IMU callback
+ * run at 1/WATCHDOG_SHED_RATE_DIV of their rate, and last the feedback
+ * controller is disarmed as a failsafe and can't be armed again while the
+ * level stays there. After watchdog_recover_seconds without a miss it steps
+ * back down one level at a time.
+ *
+ * Counters are written by the IMU thread only and can be read from any
+ * thread, they go out with the telemetry timing stream and into the log
+ * with log_watchdog. The watchdog only runs on the hardware path, the sim
+ * and replay backends don't run in real time.
+ */
+
+#ifndef WATCHDOG_H
+#define WATCHDOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define WATCHDOG_SHED_RATE_DIV	2	///< slow tasks run this many times less often when shedding rates
+
+/**
+ * Shedding levels, each one includes the ones before it.
+ */
+typedef enum watchdog_level_t{
+	WATCHDOG_LEVEL_NONE,		///< nothing shed
+	WATCHDOG_LEVEL_LOG,		///< log records are dropped
+	WATCHDOG_LEVEL_PRINTF,		///< printf_manager stops updating the console
+	WATCHDOG_LEVEL_RATES,		///< slow IMU callback tasks run at a lower rate
+	WATCHDOG_LEVEL_FAILSAFE,	///< feedback was disarmed
+	WATCHDOG_NUM_LEVELS
+} watchdog_level_t;
+
+/**
+ * Counters since start up.
+ */
+typedef struct watchdog_stats_t{
+	uint64_t overruns;		///< ticks that took longer than the loop period
+	uint64_t missed;		///< ticks that never ran
+	uint32_t consecutive;		///< current run of ticks with a miss
+	uint32_t max_consecutive;	///< longest run so far
+	watchdog_level_t level;		///< current shedding level
+} watchdog_stats_t;
+
+/**
+ * @brief      Starts watching. Call after the settings are loaded and before
+ *             the IMU callback starts, only on the hardware path.
+ *
+ * @return     0 on success, -1 on failure
+ */
+int watchdog_init(void);
+
+/**
+ * @brief      Checks the tick that just finished and sheds or restores load.
+ *             Call from the IMU callback right after instr_tick_end(). Does
+ *             nothing unless watchdog_init() was called.
+ */
+void watchdog_tick(void);
+
+/**
+ * @brief      Current shedding level, may be called from any thread.
+ *
+ * @return     the level, WATCHDOG_LEVEL_NONE if the watchdog isn't running
+ */
+watchdog_level_t watchdog_level(void);
+
+/**
+ * @brief      Prints a warning if the level changed since the last call,
+ *             several changes in between are reported as one. The IMU
+ *             callback never prints itself, printf_manager and the log
+ *             thread call this and whichever comes first prints.
+ *
+ * @param      f     stream to print to
+ */
+void watchdog_print_level_change(FILE* f);
+
+/**
+ * @brief      Copies out the counters, may be called from any thread.
+ *
+ * @param[out] s     struct to fill in
+ */
+void watchdog_get_stats(watchdog_stats_t* s);
+
+/**
+ * @brief      Human readable name of a level, the same string the
+ *             watchdog_shed_limit setting takes.
+ *
+ * @param[in]  level  The level
+ *
+ * @return     name string
+ */
+const char* watchdog_level_name(watchdog_level_t level);
+
+/**
+ * @brief      Prints the counters.
+ *
+ * @param      f     stream to print to
+ *
+ * @return     0 on success, -1 if the watchdog never ran
+ */
+int watchdog_print_report(FILE* f);
+
+#endif // WATCHDOG_H
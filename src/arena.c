@@ -0,0 +1,192 @@
+/**
+ * @file arena.c
+ *
+ * Start up bump allocator and the debug allocation hook, see arena.h
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <arena.h>
+
+static char* base;
+static size_t size;
+static size_t used;
+static atomic_int frozen;
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER; // phases start up in parallel
+
+
+int arena_init(size_t bytes)
+{
+	if(base!=NULL){
+		fprintf(stderr,"ERROR in arena_init, arena already initialized\n");
+		return -1;
+	}
+	base = (char*)mmap(NULL, bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(base==MAP_FAILED){
+		base = NULL;
+		fprintf(stderr,"ERROR in arena_init, failed to map %zu bytes\n", bytes);
+		return -1;
+	}
+	// touch every page now, anonymous mappings are only backed on first
+	// write
+	memset(base, 0, bytes);
+	size = bytes;
+	used = 0;
+	atomic_store(&frozen, 0);
+	return 0;
+}
+
+
+void* arena_alloc(size_t bytes)
+{
+	void* p;
+	size_t need = (bytes+ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+
+	if(base==NULL){
+		fprintf(stderr,"ERROR in arena_alloc, arena not initialized\n");
+		return NULL;
+	}
+	if(atomic_load(&frozen)){
+		fprintf(stderr,"ERROR in arena_alloc, arena is frozen once running\n");
+		return NULL;
+	}
+	pthread_mutex_lock(&alloc_lock);
+	if(need>size-used){
+		fprintf(stderr,"ERROR in arena_alloc, %zu bytes requested with %zu of %zu left\n",\
+							bytes, size-used, size);
+		pthread_mutex_unlock(&alloc_lock);
+		return NULL;
+	}
+	p = base+used;
+	used += need;
+	pthread_mutex_unlock(&alloc_lock);
+	return p;
+}
+
+
+void arena_freeze(void)
+{
+	atomic_store(&frozen, 1);
+}
+
+
+#ifdef RC_PILOT_ALLOC_DEBUG
+
+/**
+ * one heap call the control thread made while armed
+ */
+typedef struct arena_record_t{
+	const char* func;	///< "malloc", "calloc", "realloc" or "free"
+	size_t bytes;
+	void* caller;		///< return address into the code that called it
+} arena_record_t;
+
+// glibc's own entry points, the wrappers below replace the public names
+extern void* __libc_malloc(size_t bytes);
+extern void* __libc_calloc(size_t n, size_t bytes);
+extern void* __libc_realloc(void* ptr, size_t bytes);
+extern void __libc_free(void* ptr);
+
+// first and last byte of code in the executable, from the linker
+extern char __executable_start[];
+extern char etext[];
+
+static __thread int watched;	// set in the control thread only
+static atomic_int armed;
+static atomic_int num_records;
+static arena_record_t records[ARENA_MAX_RECORDS];
+
+/**
+ * @brief      remembers a heap call if it came from the control thread while
+ *             armed, never allocates itself
+ */
+static void __record(const char* func, size_t bytes, void* caller)
+{
+	int i;
+
+	if(!watched || !atomic_load_explicit(&armed, memory_order_relaxed)) return;
+	i = atomic_fetch_add(&num_records, 1);
+	if(i>=ARENA_MAX_RECORDS) return;
+	records[i].func = func;
+	records[i].bytes = bytes;
+	records[i].caller = caller;
+}
+
+void* malloc(size_t bytes)
+{
+	__record("malloc", bytes, __builtin_return_address(0));
+	return __libc_malloc(bytes);
+}
+
+void* calloc(size_t n, size_t bytes)
+{
+	__record("calloc", n*bytes, __builtin_return_address(0));
+	return __libc_calloc(n, bytes);
+}
+
+void* realloc(void* ptr, size_t bytes)
+{
+	__record("realloc", bytes, __builtin_return_address(0));
+	return __libc_realloc(ptr, bytes);
+}
+
+void free(void* ptr)
+{
+	if(ptr!=NULL) __record("free", 0, __builtin_return_address(0));
+	__libc_free(ptr);
+}
+
+void arena_watch_thread(void)
+{
+	watched = 1;
+}
+
+void arena_watch_armed(int a)
+{
+	atomic_store(&armed, a);
+}
+
+#else
+
+void arena_watch_thread(void)
+{
+	return;
+}
+
+void arena_watch_armed(__attribute__ ((unused)) int a)
+{
+	return;
+}
+
+#endif // RC_PILOT_ALLOC_DEBUG
+
+
+int arena_print_report(FILE* f)
+{
+	int n = 0;
+
+	fprintf(f, "arena: %zu of %zu bytes used\n", used, size);
+#ifdef RC_PILOT_ALLOC_DEBUG
+	int i;
+
+	n = atomic_load(&num_records);
+	fprintf(f, "heap calls from the control thread while armed: %d\n", n);
+	for(i=0;i<n && i<ARENA_MAX_RECORDS;i++){
+		char* c = (char*)records[i].caller;
+		// offsets into the executable are what addr2line wants for PIE
+		if(c>=__executable_start && c<etext){
+			fprintf(f, "  %-8s %8zu bytes from rc_pilot+0x%lx\n", records[i].func,\
+				records[i].bytes, (unsigned long)(c-__executable_start));
+		}
+		else fprintf(f, "  %-8s %8zu bytes from %p\n", records[i].func,\
+				records[i].bytes, records[i].caller);
+	}
+	if(n>ARENA_MAX_RECORDS) fprintf(f, "  ... %d more\n", n-ARENA_MAX_RECORDS);
+#endif
+	return n;
+}
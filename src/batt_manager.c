@@ -0,0 +1,160 @@
+/**
+ * @file batt_manager.c
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <rc/start_stop.h>
+#include <rc/time.h>
+#include <rc/pthread.h>
+#include <rc/math/filter.h>
+
+#include <batt_manager.h>
+#include <seqlock.h>
+#include <thread_defs.h>
+#include <rc_pilot_defs.h>
+#include <settings.h>
+#include <scheduler.h>
+#include <controller.h>
+#include <hal.h>
+#include <rt_setup.h>
+
+#define BATT_LP_SECONDS	0.1	// s, window of the battery moving average
+#define BATT_MIN_V	3.0	// below this nothing is plugged into the barrel jack
+
+static pthread_t batt_thread;
+static int initialized = 0;
+static int threaded = 0;	// 0 when the HAL steps the loop and reads happen inline
+static int period_us;		// one BATT_HZ task period
+
+// fixed size controller_t so nothing is allocated, only touched by whoever
+// takes samples: the thread, or the IMU callback when there is none
+static controller_t batt_lp = CONTROLLER_INITIALIZER;
+
+// newest sample, single writer
+static seqlock_t lock = SEQLOCK_INITIALIZER;
+static batt_sample_t latest;
+
+/**
+ * @brief      Does the ADC read, marches the filter and publishes the result.
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __take_sample(void)
+{
+	static uint64_t count = 0;
+	batt_sample_t s;
+
+	s.v_raw = hal_batt_read();
+	if(s.v_raw<BATT_MIN_V) s.v_raw = settings.v_nominal;
+	s.v_lp = controller_march(&batt_lp, s.v_raw);
+	s.gain_scale = settings.v_nominal/s.v_lp;
+	s.timestamp_ns = hal_time_ns();
+	s.count = ++count;
+	seqlock_write(&lock, &latest, &s, sizeof(s));
+	return 0;
+}
+
+static void* __batt_manager_func(__attribute__ ((unused)) void* ptr)
+{
+	rt_setup_thread(RT_THREAD_BATT);
+	while(rc_get_state()!=EXITING && initialized){
+		rc_usleep(period_us);
+		__take_sample();
+	}
+	return NULL;
+}
+
+int batt_manager_init(void)
+{
+	rc_filter_t f = RC_FILTER_INITIALIZER;
+	double dt, v;
+	int samples;
+
+	if(initialized){
+		fprintf(stderr,"ERROR in batt_manager_init, already initialized\n");
+		return -1;
+	}
+
+	// same period as the battery task so sim and replay filter exactly
+	// like the thread does
+	dt = settings.dt*scheduler_rate_div(BATT_HZ);
+	period_us = (int)(dt*1000000.0);
+	samples = (int)(BATT_LP_SECONDS/dt+0.5);
+	if(samples<2) samples = 2;
+	if(samples>CONTROLLER_MAX_ORDER+1) samples = CONTROLLER_MAX_ORDER+1;
+	if(rc_filter_moving_average(&f, samples, dt)) return -1;
+	if(controller_from_filter(&batt_lp, f)){
+		rc_filter_free(&f);
+		return -1;
+	}
+	rc_filter_free(&f);
+
+	// first reading is synchronous so the estimator starts from a real value
+	v = hal_batt_read();
+	if(v<BATT_MIN_V){
+		if(settings.warnings_en){
+			fprintf(stderr, "WARNING: ADC read %0.1fV on the barrel jack. Please connect\n", v);
+			fprintf(stderr, "battery to barrel jack, assuming nominal voltage for now.\n");
+		}
+		v = settings.v_nominal;
+	}
+	controller_prefill_inputs(&batt_lp, v);
+	controller_prefill_outputs(&batt_lp, v);
+	latest.v_raw = v;
+	latest.v_lp = v;
+	latest.gain_scale = settings.v_nominal/v;
+	latest.timestamp_ns = hal_time_ns();
+	latest.count = 0;
+
+	// without real time pacing there is no idle time between callbacks to
+	// sample in, do it inline in batt_manager_request_sample()
+	if(!hal_is_realtime()){
+		threaded = 0;
+		initialized = 1;
+		return 0;
+	}
+
+	initialized = 1;
+	threaded = 1;
+	if(rc_pthread_create(&batt_thread, __batt_manager_func, NULL,
+				SCHED_FIFO, BATT_MANAGER_PRI)==-1){
+		fprintf(stderr,"ERROR in batt_manager_init, failed to start thread\n");
+		initialized = 0;
+		threaded = 0;
+		return -1;
+	}
+	return 0;
+}
+
+int batt_manager_request_sample(void)
+{
+	if(!initialized) return -1;
+	if(!threaded) return __take_sample();
+	return 0;
+}
+
+int batt_manager_get_latest(batt_sample_t* sample)
+{
+	batt_sample_t tmp;
+	if(seqlock_try_read(&lock, &tmp, &latest, sizeof(tmp))) return -1;
+	*sample = tmp;
+	return 0;
+}
+
+int batt_manager_cleanup(void)
+{
+	int ret = 0;
+	if(initialized){
+		initialized = 0;
+		if(threaded){
+			threaded = 0;
+			ret = rc_pthread_timed_join(batt_thread, NULL, BATT_MANAGER_TOUT);
+			if(ret==1) fprintf(stderr,"WARNING: batt_manager_thread exit timeout\n");
+			else if(ret==-1) fprintf(stderr,"ERROR: failed to join batt_manager thread\n");
+		}
+		batt_lp.initialized = 0;
+	}
+	return ret;
+}
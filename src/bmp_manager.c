@@ -0,0 +1,143 @@
+/**
+ * @file bmp_manager.c
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+#include <rc/start_stop.h>
+#include <rc/time.h>
+#include <rc/pthread.h>
+#include <rc/bmp.h>
+
+#include <bmp_manager.h>
+#include <seqlock.h>
+#include <thread_defs.h>
+#include <settings.h>
+#include <hal.h>
+#include <rt_setup.h>
+
+static pthread_t bmp_thread;
+static int initialized = 0;
+static int threaded = 0;		// 0 when the HAL steps the loop and reads happen inline
+static int request_fd = -1;	// eventfd the IMU callback kicks to request a read
+
+// newest sample, written only by the barometer thread
+static seqlock_t lock = SEQLOCK_INITIALIZER;
+static bmp_sample_t latest;
+
+/**
+ * @brief      Does the i2c transfer and publishes the result.
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __take_sample(void)
+{
+	static uint64_t count = 0;
+	bmp_sample_t s;
+
+	if(hal_bmp_read(&s.data)) return -1;
+	s.timestamp_ns = hal_time_ns();
+	s.count = ++count;
+	seqlock_write(&lock, &latest, &s, sizeof(s));
+	return 0;
+}
+
+static void* __bmp_manager_func(__attribute__ ((unused)) void* ptr)
+{
+	uint64_t requests;
+	struct pollfd pfd = {.fd = request_fd, .events = POLLIN};
+
+	rt_setup_thread(RT_THREAD_BMP);
+	while(rc_get_state()!=EXITING && initialized){
+		// time out periodically to check for exit
+		if(poll(&pfd, 1, 1000/BMP_MANAGER_HZ)<=0) continue;
+		if(read(request_fd, &requests, sizeof(requests))<0){
+			if(errno!=EAGAIN) fprintf(stderr,"ERROR in bmp_manager, failed to read eventfd\n");
+			continue;
+		}
+		// on bad read just wait for the next request
+		if(__take_sample() && settings.warnings_en){
+			fprintf(stderr,"WARNING in bmp_manager, failed to read barometer\n");
+		}
+	}
+	return NULL;
+}
+
+int bmp_manager_init(void)
+{
+	if(initialized){
+		fprintf(stderr,"ERROR in bmp_manager_init, already initialized\n");
+		return -1;
+	}
+
+	// first reading is synchronous so the estimator starts from a real value
+	if(__take_sample()){
+		fprintf(stderr,"ERROR in bmp_manager_init, failed to read barometer\n");
+		return -1;
+	}
+
+	// without real time pacing there is no idle time between callbacks to
+	// hand the read off into, do it inline in bmp_manager_request_sample()
+	if(!hal_is_realtime()){
+		threaded = 0;
+		initialized = 1;
+		return 0;
+	}
+
+	request_fd = eventfd(0, EFD_NONBLOCK);
+	if(request_fd<0){
+		fprintf(stderr,"ERROR in bmp_manager_init, failed to create eventfd\n");
+		return -1;
+	}
+
+	initialized = 1;
+	threaded = 1;
+	if(rc_pthread_create(&bmp_thread, __bmp_manager_func, NULL,
+				SCHED_FIFO, BMP_MANAGER_PRI)==-1){
+		fprintf(stderr,"ERROR in bmp_manager_init, failed to start thread\n");
+		initialized = 0;
+		threaded = 0;
+		close(request_fd);
+		request_fd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int bmp_manager_request_sample(void)
+{
+	const uint64_t one = 1;
+	if(!initialized) return -1;
+	if(!threaded) return __take_sample();
+	if(write(request_fd, &one, sizeof(one))<0) return -1;
+	return 0;
+}
+
+int bmp_manager_get_latest(bmp_sample_t* sample)
+{
+	bmp_sample_t tmp;
+	if(seqlock_try_read(&lock, &tmp, &latest, sizeof(tmp))) return -1;
+	*sample = tmp;
+	return 0;
+}
+
+int bmp_manager_cleanup(void)
+{
+	int ret = 0;
+	if(initialized){
+		initialized = 0;
+		if(!threaded) return 0;
+		threaded = 0;
+		ret = rc_pthread_timed_join(bmp_thread, NULL, BMP_MANAGER_TOUT);
+		if(ret==1) fprintf(stderr,"WARNING: bmp_manager_thread exit timeout\n");
+		else if(ret==-1) fprintf(stderr,"ERROR: failed to join bmp_manager thread\n");
+		close(request_fd);
+		request_fd = -1;
+	}
+	return ret;
+}
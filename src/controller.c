@@ -0,0 +1,254 @@
+/**
+ * @file controller.c
+ *
+ * The step math follows rc_filter_march() operation for operation. The zero
+ * padding of unused coefficients only adds exact zeros to the sums, so the
+ * outputs are identical to the rc_filter_t the controller was compiled from.
+ * In the float32 build they match to single precision.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <controller.h>
+
+#define N CONTROLLER_MAX_ORDER
+
+
+int controller_from_filter(controller_t* c, rc_filter_t f)
+{
+	int i;
+
+	if(f.initialized!=1){
+		fprintf(stderr,"ERROR in controller_from_filter, filter not initialized\n");
+		return -1;
+	}
+	if(f.order<0 || f.order>N){
+		fprintf(stderr,"ERROR in controller_from_filter, order %d is above the max of %d\n",\
+							f.order, N);
+		return -1;
+	}
+	if(f.den.d[0]==0.0){
+		fprintf(stderr,"ERROR in controller_from_filter, leading denominator coefficient is 0\n");
+		return -1;
+	}
+
+	memset(c, 0, sizeof(controller_t));
+	for(i=0;i<=f.order;i++){
+		c->num[i] = f.num.d[i];
+		c->den[i] = f.den.d[i];
+	}
+	c->gain		= f.gain;
+	c->order	= f.order;
+	c->dt		= f.dt;
+	c->sat_en	= f.sat_en;
+	c->sat_min	= f.sat_min;
+	c->sat_max	= f.sat_max;
+	c->ss_en	= f.ss_en;
+	c->ss_steps	= f.ss_steps;
+	c->initialized	= 1;
+	return 0;
+}
+
+
+int controller_from_spec(controller_t* c, const controller_spec_t* s, double dt)
+{
+	rc_filter_t f = RC_FILTER_INITIALIZER;
+	rc_vector_t num = RC_VECTOR_INITIALIZER;
+	rc_vector_t den = RC_VECTOR_INITIALIZER;
+	int i, ret;
+
+	if((s->pid || s->continuous) && !(s->crossover_freq>0.0)){
+		fprintf(stderr,"ERROR in controller_from_spec, crossover frequency must be positive\n");
+		return -1;
+	}
+	if(s->pid){
+		ret = rc_filter_pid(&f, s->kp, s->ki, s->kd, 1.0/s->crossover_freq, dt);
+	}
+	else{
+		if(s->num_len<1 || s->den_len<1 || s->num_len>s->den_len || s->den_len>N+1){
+			fprintf(stderr,"ERROR in controller_from_spec, invalid transfer function size\n");
+			return -1;
+		}
+		if(rc_vector_alloc(&num, s->num_len) || rc_vector_alloc(&den, s->den_len)){
+			fprintf(stderr,"ERROR in controller_from_spec, failed to alloc vectors\n");
+			rc_vector_free(&num);
+			return -1;
+		}
+		for(i=0;i<s->num_len;i++) num.d[i] = s->num[i];
+		for(i=0;i<s->den_len;i++) den.d[i] = s->den[i];
+		if(s->continuous) ret = rc_filter_c2d_tustin(&f, dt, num, den, s->crossover_freq);
+		else ret = rc_filter_alloc(&f, num, den, dt);
+		rc_vector_free(&num);
+		rc_vector_free(&den);
+	}
+	if(ret){
+		fprintf(stderr,"ERROR in controller_from_spec, failed to discretize controller\n");
+		rc_filter_free(&f);
+		return -1;
+	}
+
+	#ifdef DEBUG
+	rc_filter_print(f);
+	#endif
+
+	ret = controller_from_filter(c, f);
+	rc_filter_free(&f);
+	if(ret) return -1;
+	c->gain *= s->gain;
+	return 0;
+}
+
+
+int controller_reset(controller_t* c)
+{
+	if(c->initialized!=1){
+		fprintf(stderr,"ERROR in controller_reset, controller uninitialized\n");
+		return -1;
+	}
+	memset(c->in, 0, sizeof(c->in));
+	memset(c->out, 0, sizeof(c->out));
+	c->raw = 0.0;
+	c->sat_flag = 0;
+	c->step = 0;
+	return 0;
+}
+
+
+int controller_enable_saturation(controller_t* c, double min, double max)
+{
+	if(c->initialized!=1){
+		fprintf(stderr,"ERROR in controller_enable_saturation, controller uninitialized\n");
+		return -1;
+	}
+	if(min>max){
+		fprintf(stderr,"ERROR in controller_enable_saturation, max must be larger than min\n");
+		return -1;
+	}
+	c->sat_en = 1;
+	c->sat_min = min;
+	c->sat_max = max;
+	return 0;
+}
+
+
+int controller_enable_soft_start(controller_t* c, double seconds)
+{
+	if(c->initialized!=1){
+		fprintf(stderr,"ERROR in controller_enable_soft_start, controller uninitialized\n");
+		return -1;
+	}
+	if(c->sat_en!=1){
+		fprintf(stderr,"ERROR in controller_enable_soft_start, saturation must be enabled first\n");
+		return -1;
+	}
+	if(seconds<0.0){
+		fprintf(stderr,"ERROR in controller_enable_soft_start, seconds must be >=0\n");
+		return -1;
+	}
+	c->ss_en = 1;
+	c->ss_steps = seconds/c->dt;
+	return 0;
+}
+
+
+int controller_prefill_inputs(controller_t* c, double in)
+{
+	int i;
+	if(c->initialized!=1){
+		fprintf(stderr,"ERROR in controller_prefill_inputs, controller uninitialized\n");
+		return -1;
+	}
+	for(i=0;i<=c->order;i++) c->in[i] = in;
+	return 0;
+}
+
+
+int controller_prefill_outputs(controller_t* c, double out)
+{
+	int i;
+	if(c->initialized!=1){
+		fprintf(stderr,"ERROR in controller_prefill_outputs, controller uninitialized\n");
+		return -1;
+	}
+	for(i=0;i<c->order;i++) c->out[i] = out;
+	return 0;
+}
+
+
+void controller_march_raw(controller_t* c, const double* in, int n)
+{
+	int i, k;
+	real_t y;
+
+	for(k=0;k<n;k++){
+		// shift in the new input, fixed length so the loops unroll
+		for(i=N;i>0;i--) c[k].in[i] = c[k].in[i-1];
+		c[k].in[0] = in[k];
+
+		y = 0.0;
+		for(i=0;i<=N;i++) y += c[k].gain * c[k].num[i] * c[k].in[i];
+		for(i=1;i<=N;i++) y -= c[k].den[i] * c[k].out[i-1];
+		c[k].raw = y/c[k].den[0];
+	}
+	return;
+}
+
+
+double controller_commit(controller_t* c)
+{
+	int i;
+	real_t a, b;
+	real_t y = c->raw;
+
+	// ramp the limits up after a reset
+	if(c->ss_en==1 && c->step<c->ss_steps){
+		a = c->sat_max*(real_t)(c->step/c->ss_steps);
+		b = c->sat_min*(real_t)(c->step/c->ss_steps);
+		if(y>a) y=a;
+		if(y<b) y=b;
+	}
+
+	if(c->sat_en==1){
+		if(y>c->sat_max){
+			y = c->sat_max;
+			c->sat_flag = 1;
+		}
+		else if(y<c->sat_min){
+			y = c->sat_min;
+			c->sat_flag = 1;
+		}
+		else c->sat_flag = 0;
+	}
+
+	for(i=N-1;i>0;i--) c->out[i] = c->out[i-1];
+	c->out[0] = y;
+	c->step++;
+	return y;
+}
+
+
+double controller_march(controller_t* c, double in)
+{
+	controller_march_raw(c, &in, 1);
+	return controller_commit(c);
+}
+
+
+int controller_print(controller_t c)
+{
+	int i;
+	if(c.initialized!=1){
+		fprintf(stderr,"ERROR in controller_print, controller not initialized\n");
+		return -1;
+	}
+	printf("order: %d gain: %7.4f dt: %7.4f\n", c.order, c.gain, c.dt);
+	printf("num: ");
+	for(i=0;i<=c.order;i++) printf("%10.4f ", c.num[i]);
+	printf("\nden: ");
+	for(i=0;i<=c.order;i++) printf("%10.4f ", c.den[i]);
+	printf("\n");
+	if(c.sat_en) printf("saturation: %7.4f to %7.4f\n", c.sat_min, c.sat_max);
+	if(c.ss_en) printf("soft start: %.0f steps\n", c.ss_steps);
+	return 0;
+}
@@ -4,15 +4,15 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
-#include <rc/math/filter.h>
+#include <stdatomic.h>
 #include <rc/math/kalman.h>
 #include <rc/math/quaternion.h>
 #include <rc/math/other.h>
 #include <rc/start_stop.h>
 #include <rc/led.h>
 #include <rc/mpu.h>
-#include <rc/servo.h>
 #include <rc/time.h>
 
 #include <feedback.h>
@@ -23,84 +23,129 @@
 #include <settings.h>
 #include <mix.h>
 #include <thrust_map.h>
+#include <instrumentation.h>
+#include <controller.h>
+#include <hal.h>
+#include <arena.h>
+#include <watchdog.h>
 
 #define TWO_PI (M_PI*2.0)
 
 feedback_state_t fstate; // extern variable in feedback.h
 
-// keep original controller gains for scaling later
-static double D_roll_gain_orig, D_pitch_gain_orig, D_yaw_gain_orig, D_Z_gain_orig;
-
-
-// filters
-static rc_filter_t D_roll	= RC_FILTER_INITIALIZER;
-static rc_filter_t D_pitch	= RC_FILTER_INITIALIZER;
-static rc_filter_t D_yaw	= RC_FILTER_INITIALIZER;
-static rc_filter_t D_Z		= RC_FILTER_INITIALIZER;
-static rc_filter_t D_Xdot_4	= RC_FILTER_INITIALIZER;
-static rc_filter_t D_Xdot_6	= RC_FILTER_INITIALIZER;
-static rc_filter_t D_X_4	= RC_FILTER_INITIALIZER;
-static rc_filter_t D_X_6	= RC_FILTER_INITIALIZER;
-static rc_filter_t D_Ydot_4	= RC_FILTER_INITIALIZER;
-static rc_filter_t D_Ydot_6	= RC_FILTER_INITIALIZER;
-static rc_filter_t D_Y_4	= RC_FILTER_INITIALIZER;
-static rc_filter_t D_Y_6	= RC_FILTER_INITIALIZER;
+/**
+ * one complete set of the controllers that can be retuned while running
+ */
+typedef struct ctrl_bank_t{
+	controller_t c[FEEDBACK_NUM_CTRL];	///< indexed by feedback_ctrl_t
+	double gain_orig[FEEDBACK_NUM_CTRL];	///< gains before battery scaling
+} ctrl_bank_t;
+
+// D is marched by the control thread, D_next is filled by
+// feedback_update_controller() and swapped in once update_pending is set
+static ctrl_bank_t bank[2];
+static ctrl_bank_t* D = &bank[0];
+static ctrl_bank_t* D_next = &bank[1];
+static atomic_int update_pending;
+// latest version of every controller, only used by the updating thread
+static controller_t latest[FEEDBACK_NUM_CTRL];
+
+static controller_t D_Xdot_4	= CONTROLLER_INITIALIZER;
+static controller_t D_Xdot_6	= CONTROLLER_INITIALIZER;
+static controller_t D_X_4	= CONTROLLER_INITIALIZER;
+static controller_t D_X_6	= CONTROLLER_INITIALIZER;
+static controller_t D_Ydot_4	= CONTROLLER_INITIALIZER;
+static controller_t D_Ydot_6	= CONTROLLER_INITIALIZER;
+static controller_t D_Y_4	= CONTROLLER_INITIALIZER;
+static controller_t D_Y_6	= CONTROLLER_INITIALIZER;
+
+static int last_en_Z_ctrl = 0;
+
+// absolute limit on each mixer channel, indexed by VEC_, Z is saturated in
+// __mix_input() instead
+static const double component_limit[MAX_INPUTS] = {
+	[VEC_X]		= MAX_X_COMPONENT,
+	[VEC_Y]		= MAX_Y_COMPONENT,
+	[VEC_Z]		= 0.0,
+	[VEC_ROLL]	= MAX_ROLL_COMPONENT,
+	[VEC_PITCH]	= MAX_PITCH_COMPONENT,
+	[VEC_YAW]	= MAX_YAW_COMPONENT
+};
 
 
 static int __send_motor_stop_pulse(void)
 {
 	int i;
-	if(settings.num_rotors>8){
+	if(settings.num_rotors>MAX_ROTORS){
 		printf("ERROR: set_motors_to_idle: too many rotors\n");
 		return -1;
 	}
 	for(i=0;i<settings.num_rotors;i++){
 		fstate.m[i] = -0.1;
-		rc_servo_send_esc_pulse_normalized(i+1,-0.1);
+		hal_esc_send(i+1,-0.1);
 	}
+	instr_mark_esc();
 	return 0;
 }
 
-static void __rpy_init(void)
+/**
+ * @brief      sets up saturation and soft start of a new controller, the
+ *             attitude limits are changed every step by the mixer callback
+ */
+static int __ctrl_setup(feedback_ctrl_t ctrl, controller_t* c)
 {
-	// get controllers from settings
+	static const double limit[FEEDBACK_NUM_CTRL] = {
+		[FEEDBACK_CTRL_ROLL]	= MAX_ROLL_COMPONENT,
+		[FEEDBACK_CTRL_PITCH]	= MAX_PITCH_COMPONENT,
+		[FEEDBACK_CTRL_YAW]	= MAX_YAW_COMPONENT,
+		[FEEDBACK_CTRL_ALT]	= 1.0
+	};
 
-	rc_filter_duplicate(&D_roll,	settings.roll_controller);
-	rc_filter_duplicate(&D_pitch,	settings.pitch_controller);
-	rc_filter_duplicate(&D_yaw,	    settings.yaw_controller);
+	// enable saturation. these limits will be changed late but we need to
+	// enable now so that soft start can also be enabled
+	if(controller_enable_saturation(c, -limit[ctrl], limit[ctrl])) return -1;
+	return controller_enable_soft_start(c, SOFT_START_SECONDS);
+}
 
-	#ifdef DEBUG
-	printf("ROLL CONTROLLER:\n");
-	rc_filter_print(D_roll);
-	printf("PITCH CONTROLLER:\n");
-	rc_filter_print(D_pitch);
-	printf("YAW CONTROLLER:\n");
-	rc_filter_print(D_yaw);
-	#endif
 
-	// save original gains as we will scale these by battery voltage later
-	D_roll_gain_orig = D_roll.gain;
-	D_pitch_gain_orig = D_pitch.gain;
-	D_yaw_gain_orig = D_yaw.gain;
+/**
+ * @brief      takes a staged update, called by the control thread before
+ *             anything is marched
+ */
+static void __swap_bank(void)
+{
+	ctrl_bank_t* old = D;
+	int i;
 
-	// enable saturation. these limits will be changed late but we need to
-	// enable now so that soft start can also be enabled
-	rc_filter_enable_saturation(&D_roll,	-MAX_ROLL_COMPONENT, MAX_ROLL_COMPONENT);
-	rc_filter_enable_saturation(&D_pitch,	-MAX_PITCH_COMPONENT, MAX_PITCH_COMPONENT);
-	rc_filter_enable_saturation(&D_yaw,	-MAX_YAW_COMPONENT, MAX_YAW_COMPONENT);
-	// enable soft start
-	rc_filter_enable_soft_start(&D_roll, SOFT_START_SECONDS);
-	rc_filter_enable_soft_start(&D_pitch, SOFT_START_SECONDS);
-	rc_filter_enable_soft_start(&D_yaw, SOFT_START_SECONDS);
+	D = D_next;
+	D_next = old;
+	for(i=0;i<FEEDBACK_NUM_CTRL;i++){
+		controller_t* c = &D->c[i];
+		const controller_t* o = &old->c[i];
+		if(settings.bumpless_param_updates){
+			controller_prefill_inputs(c, o->in[0]);
+			controller_prefill_outputs(c, o->out[0]);
+		}
+		else{
+			memcpy(c->in, o->in, sizeof(c->in));
+			memcpy(c->out, o->out, sizeof(c->out));
+		}
+		// saturation is moved by the mixer, soft start keeps going
+		c->sat_min = o->sat_min;
+		c->sat_max = o->sat_max;
+		c->step = o->step;
+	}
+	atomic_store_explicit(&update_pending, 0, memory_order_release);
 }
 
 
 int feedback_disarm(void)
 {
 	fstate.arm_state = DISARMED;
+	arena_watch_armed(0);
 	// set LEDs
-	rc_led_set(RC_LED_RED,1);
-	rc_led_set(RC_LED_GREEN,0);
+	hal_led_set(RC_LED_RED,1);
+	hal_led_set(RC_LED_GREEN,0);
 	return 0;
 }
 
@@ -111,11 +156,17 @@ int feedback_arm(void)
 		printf("WARNING: trying to arm when controller is already armed\n");
 		return -1;
 	}
-	// start a new log file every time controller is armed, this may take some
-	// time so do it before touching anything else
-	if(settings.enable_logging) log_manager_init();
+	// the failsafe holds until the watchdog steps back down, this is asked
+	// every tick the arm sequence is complete so don't print
+	if(watchdog_level()>=WATCHDOG_LEVEL_FAILSAFE) return -1;
+	// arming happens in the control thread, so in an allocdebug build
+	// everything from here on is checked
+	arena_watch_armed(1);
+	// start a new log file every time controller is armed, the writer
+	// thread has it ready so this only marks where it starts
+	if(settings.enable_logging) log_manager_new_segment();
 	// get the current time
-	fstate.arm_time_ns = rc_nanos_since_boot();
+	fstate.arm_time_ns = hal_time_ns();
 	// reset the index
 	fstate.loop_index = 0;
 	// when swapping from direct throttle to altitude control, the altitude
@@ -128,17 +179,17 @@ int feedback_arm(void)
 	//num_yaw_spins = 0;
 	//last_yaw = -mpu_data.fused_TaitBryan[TB_YAW_Z]; // minus because NED coordinates
 	// zero out all filters
-	rc_filter_reset(&D_roll);
-	rc_filter_reset(&D_pitch);
-	rc_filter_reset(&D_yaw);
-	rc_filter_reset(&D_Z);
+	controller_reset(&D->c[FEEDBACK_CTRL_ROLL]);
+	controller_reset(&D->c[FEEDBACK_CTRL_PITCH]);
+	controller_reset(&D->c[FEEDBACK_CTRL_YAW]);
+	controller_reset(&D->c[FEEDBACK_CTRL_ALT]);
 
 	// prefill filters with current error
-	rc_filter_prefill_inputs(&D_roll, -state_estimate.roll);
-	rc_filter_prefill_inputs(&D_pitch, -state_estimate.pitch);
+	controller_prefill_inputs(&D->c[FEEDBACK_CTRL_ROLL], -state_estimate.roll);
+	controller_prefill_inputs(&D->c[FEEDBACK_CTRL_PITCH], -state_estimate.pitch);
 	// set LEDs
-	rc_led_set(RC_LED_RED,0);
-	rc_led_set(RC_LED_GREEN,1);
+	hal_led_set(RC_LED_RED,0);
+	hal_led_set(RC_LED_GREEN,1);
 	// last thing is to flag as armed
 	fstate.arm_state = ARMED;
 	return 0;
@@ -148,30 +199,42 @@ int feedback_arm(void)
 
 int feedback_init(void)
 {
-	double tmp;
+	int i;
 
-	__rpy_init();
+	// get controllers from settings
+	latest[FEEDBACK_CTRL_ROLL]	= settings.roll_controller;
+	latest[FEEDBACK_CTRL_PITCH]	= settings.pitch_controller;
+	latest[FEEDBACK_CTRL_YAW]	= settings.yaw_controller;
+	latest[FEEDBACK_CTRL_ALT]	= settings.altitude_controller;
+	for(i=0;i<FEEDBACK_NUM_CTRL;i++){
+		if(__ctrl_setup(i, &latest[i])) return -1;
+		D->c[i] = latest[i];
+		// save original gains as we will scale these by battery voltage later
+		D->gain_orig[i] = latest[i].gain;
+	}
+	atomic_store(&update_pending, 0);
 
-	rc_filter_duplicate(&D_Z,	settings.altitude_controller);
-	rc_filter_duplicate(&D_Xdot_4,	settings.horiz_vel_ctrl_4dof);
-	rc_filter_duplicate(&D_Xdot_6,	settings.horiz_vel_ctrl_6dof);
-	rc_filter_duplicate(&D_X_4,	settings.horiz_pos_ctrl_4dof);
-	rc_filter_duplicate(&D_X_6,	settings.horiz_pos_ctrl_6dof);
-	rc_filter_duplicate(&D_Ydot_4,	settings.horiz_vel_ctrl_4dof);
-	rc_filter_duplicate(&D_Ydot_6,	settings.horiz_vel_ctrl_6dof);
-	rc_filter_duplicate(&D_Y_4,	settings.horiz_pos_ctrl_4dof);
-	rc_filter_duplicate(&D_Y_6,	settings.horiz_pos_ctrl_6dof);
+	D_Xdot_4 = settings.horiz_vel_ctrl_4dof;
+	D_Xdot_6 = settings.horiz_vel_ctrl_6dof;
+	D_X_4 = settings.horiz_pos_ctrl_4dof;
+	D_X_6 = settings.horiz_pos_ctrl_6dof;
+	D_Ydot_4 = settings.horiz_vel_ctrl_4dof;
+	D_Ydot_6 = settings.horiz_vel_ctrl_6dof;
+	D_Y_4 = settings.horiz_pos_ctrl_4dof;
+	D_Y_6 = settings.horiz_pos_ctrl_6dof;
 
 
 	#ifdef DEBUG
+	printf("ROLL CONTROLLER:\n");
+	controller_print(D->c[FEEDBACK_CTRL_ROLL]);
+	printf("PITCH CONTROLLER:\n");
+	controller_print(D->c[FEEDBACK_CTRL_PITCH]);
+	printf("YAW CONTROLLER:\n");
+	controller_print(D->c[FEEDBACK_CTRL_YAW]);
 	printf("ALTITUDE CONTROLLER:\n");
-	rc_filter_print(D_Z);
+	controller_print(D->c[FEEDBACK_CTRL_ALT]);
 	#endif
 
-	D_Z_gain_orig = D_Z.gain;
-
-	rc_filter_enable_saturation(&D_Z, -1.0, 1.0);
-	rc_filter_enable_soft_start(&D_Z, SOFT_START_SECONDS);
 	// make sure everything is disarmed them start the ISR
 	feedback_disarm();
 	fstate.initialized=1;
@@ -184,13 +247,110 @@ int feedback_init(void)
 
 
 
+/**
+ * @brief      Computes one control input for mix_allocate().
+ *
+ * The controllers are marched here, with their saturation set to the range
+ * the mixer says is still available, so that each axis only uses the motor
+ * authority left over by the higher priority axes.
+ */
+static double __mix_input(int ch, double min, double max, __attribute__ ((unused)) void* ctx)
+{
+	double tmp;
+
+	switch(ch){
+	/***************************************************************************
+	* Throttle/Altitude Controller
+	*
+	* If transitioning from direct throttle to altitude control, prefill the
+	* filter with current throttle input to make smooth transition. This is also
+	* true if taking off for the first time in altitude mode as arm_controller
+	* sets up last_en_Z_ctrl and last_usr_thr every time controller arms
+	***************************************************************************/
+	case VEC_Z:
+		// run altitude controller if enabled
+		// this needs work...
+		// we need to:
+		//		find hover thrust and correct from there
+		//		this code does not work a.t.m.
+		if(setpoint.en_Z_ctrl){
+			if(last_en_Z_ctrl == 0){
+				setpoint.Z = state_estimate.alt_bmp; // set altitude setpoint to current altitude
+				controller_reset(&D->c[FEEDBACK_CTRL_ALT]);
+				tmp = -setpoint.Z_throttle / (cos(state_estimate.roll)*cos(state_estimate.pitch));
+				controller_prefill_outputs(&D->c[FEEDBACK_CTRL_ALT], tmp);
+				last_en_Z_ctrl = 1;
+			}
+			D->c[FEEDBACK_CTRL_ALT].gain = D->gain_orig[FEEDBACK_CTRL_ALT] * state_estimate.batt_gain_scale;
+			tmp = controller_march(&D->c[FEEDBACK_CTRL_ALT], -setpoint.Z+state_estimate.alt_bmp); //altitude is positive but +Z is down
+			rc_saturate_double(&tmp, MIN_THRUST_COMPONENT, MAX_THRUST_COMPONENT);
+			last_en_Z_ctrl = 1;
+			return tmp / cos(state_estimate.roll)*cos(state_estimate.pitch);
+		}
+		// else use direct throttle
+		// compensate for tilt
+		tmp = setpoint.Z_throttle / (cos(state_estimate.roll)*cos(state_estimate.pitch));
+		//printf("throttle: %f\n",tmp);
+		rc_saturate_double(&tmp, MIN_THRUST_COMPONENT, MAX_THRUST_COMPONENT);
+		return tmp;
+
+	/***************************************************************************
+	* Roll Pitch Yaw controllers, only run if enabled
+	* otherwise direct throttle to roll pitch yaw
+	***************************************************************************/
+	case VEC_ROLL:
+		if(setpoint.en_rpy_ctrl){
+			controller_enable_saturation(&D->c[FEEDBACK_CTRL_ROLL], min, max);
+			return controller_commit(&D->c[FEEDBACK_CTRL_ROLL]);
+		}
+		tmp = setpoint.roll_throttle;
+		break;
+
+	case VEC_PITCH:
+		if(setpoint.en_rpy_ctrl){
+			controller_enable_saturation(&D->c[FEEDBACK_CTRL_PITCH], min, max);
+			return controller_commit(&D->c[FEEDBACK_CTRL_PITCH]);
+		}
+		tmp = setpoint.pitch_throttle;
+		break;
+
+	// if throttle stick is down (waiting to take off) keep yaw setpoint at
+	// current heading, otherwide update by yaw rate
+	case VEC_YAW:
+		if(setpoint.en_rpy_ctrl){
+			controller_enable_saturation(&D->c[FEEDBACK_CTRL_YAW], min, max);
+			return controller_commit(&D->c[FEEDBACK_CTRL_YAW]);
+		}
+		tmp = setpoint.yaw_throttle;
+		break;
+
+	// for 6dof systems, add X and Y
+	case VEC_X:
+		tmp = setpoint.X_throttle;
+		break;
+
+	case VEC_Y:
+		tmp = setpoint.Y_throttle;
+		break;
+
+	default:
+		return 0.0;
+	}
+
+	rc_saturate_double(&tmp, min, max);
+	return tmp;
+}
+
+
 int feedback_march(void)
 {
 	int i;
-	double tmp, min, max;
-	double u[6], mot[8];
-	log_entry_t new_log;
-	static int last_en_Z_ctrl = 0;
+	double u[6], mot[MAX_ROTORS];
+	double rpy_err[3];
+
+	// pick up a retuned controller before anything is marched so the
+	// whole tick uses one set
+	if(atomic_load_explicit(&update_pending, memory_order_acquire)) __swap_bank();
 
 	// Disarm if rc_state is somehow paused without disarming the controller.
 	// This shouldn't happen if other threads are working properly.
@@ -198,6 +358,11 @@ int feedback_march(void)
 		feedback_disarm();
 	}
 
+	// the watchdog failsafe latches, nothing flies until it steps down
+	if(fstate.arm_state==ARMED && watchdog_level()>=WATCHDOG_LEVEL_FAILSAFE){
+		feedback_disarm();
+	}
+
 	// check for a tipover
 	if(fabs(state_estimate.roll)>TIP_ANGLE || fabs(state_estimate.pitch)>TIP_ANGLE){
 		feedback_disarm();
@@ -211,136 +376,33 @@ int feedback_march(void)
 	}
 
 	// We are about to start marching the individual SISO controllers forward.
-	// Start by zeroing out the motors signals then add from there.
-	for(i=0;i<8;i++) mot[i] = 0.0;
+	// Start by zeroing out the motors signals then let the mixer allocate
+	// Z, roll, pitch, yaw and optionally X, Y onto them in that order.
+	for(i=0;i<MAX_ROTORS;i++) mot[i] = 0.0;
 	for(i=0;i<6;i++) u[i] = 0.0;
 
-
-	/***************************************************************************
-	* Throttle/Altitude Controller
-	*
-	* If transitioning from direct throttle to altitude control, prefill the
-	* filter with current throttle input to make smooth transition. This is also
-	* true if taking off for the first time in altitude mode as arm_controller
-	* sets up last_en_Z_ctrl and last_usr_thr every time controller arms
-	***************************************************************************/
-	// run altitude controller if enabled
-	// this needs work...
-	// we need to:
-	//		find hover thrust and correct from there
-	//		this code does not work a.t.m.
-	if(setpoint.en_Z_ctrl){
-		if(last_en_Z_ctrl == 0){
-			setpoint.Z = state_estimate.alt_bmp; // set altitude setpoint to current altitude
-			rc_filter_reset(&D_Z);
-			tmp = -setpoint.Z_throttle / (cos(state_estimate.roll)*cos(state_estimate.pitch));
-			rc_filter_prefill_outputs(&D_Z, tmp);
-			last_en_Z_ctrl = 1;
-		}
-		D_Z.gain = D_Z_gain_orig * settings.v_nominal/state_estimate.v_batt_lp;
-		tmp = rc_filter_march(&D_Z, -setpoint.Z+state_estimate.alt_bmp); //altitude is positive but +Z is down
-		rc_saturate_double(&tmp, MIN_THRUST_COMPONENT, MAX_THRUST_COMPONENT);
-		u[VEC_Z] = tmp / cos(state_estimate.roll)*cos(state_estimate.pitch);
-		mix_add_input(u[VEC_Z], VEC_Z, mot);
-		last_en_Z_ctrl = 1;
-	}
-	// else use direct throttle
-	else{
-
-		// compensate for tilt
-		tmp = setpoint.Z_throttle / (cos(state_estimate.roll)*cos(state_estimate.pitch));
-		//printf("throttle: %f\n",tmp);
-		rc_saturate_double(&tmp, MIN_THRUST_COMPONENT, MAX_THRUST_COMPONENT);
-		u[VEC_Z] = tmp;
-		mix_add_input(u[VEC_Z], VEC_Z, mot);
-	}
-
-	/***************************************************************************
-	* Roll Pitch Yaw controllers, only run if enabled
-	***************************************************************************/
+	// step the roll pitch yaw controllers together up to saturation, the
+	// mixer callback finishes each axis once its available range is known
 	if(setpoint.en_rpy_ctrl){
-		// Roll
-		mix_check_saturation(VEC_ROLL, mot, &min, &max);
-		if(max>MAX_ROLL_COMPONENT)  max =  MAX_ROLL_COMPONENT;
-		if(min<-MAX_ROLL_COMPONENT) min = -MAX_ROLL_COMPONENT;
-		rc_filter_enable_saturation(&D_roll, min, max);
-		D_roll.gain = D_roll_gain_orig * settings.v_nominal/state_estimate.v_batt_lp;
-		u[VEC_ROLL] = rc_filter_march(&D_roll, setpoint.roll - state_estimate.roll);
-		mix_add_input(u[VEC_ROLL], VEC_ROLL, mot);
-
-		// pitch
-		mix_check_saturation(VEC_PITCH, mot, &min, &max);
-		if(max>MAX_PITCH_COMPONENT)  max =  MAX_PITCH_COMPONENT;
-		if(min<-MAX_PITCH_COMPONENT) min = -MAX_PITCH_COMPONENT;
-		rc_filter_enable_saturation(&D_pitch, min, max);
-		D_pitch.gain = D_pitch_gain_orig * settings.v_nominal/state_estimate.v_batt_lp;
-		u[VEC_PITCH] = rc_filter_march(&D_pitch, setpoint.pitch - state_estimate.pitch);
-		mix_add_input(u[VEC_PITCH], VEC_PITCH, mot);
-
-		// Yaw
-		// if throttle stick is down (waiting to take off) keep yaw setpoint at
-		// current heading, otherwide update by yaw rate
-		mix_check_saturation(VEC_YAW, mot, &min, &max);
-		if(max>MAX_YAW_COMPONENT)  max =  MAX_YAW_COMPONENT;
-		if(min<-MAX_YAW_COMPONENT) min = -MAX_YAW_COMPONENT;
-		rc_filter_enable_saturation(&D_yaw, min, max);
-		D_yaw.gain = D_yaw_gain_orig * settings.v_nominal/state_estimate.v_batt_lp;
-		u[VEC_YAW] = rc_filter_march(&D_yaw, setpoint.yaw - state_estimate.yaw);
-		mix_add_input(u[VEC_YAW], VEC_YAW, mot);
-	}
-	// otherwise direct throttle to roll pitch yaw
-	else{
-		// roll
-		mix_check_saturation(VEC_ROLL, mot, &min, &max);
-		if(max>MAX_ROLL_COMPONENT)  max =  MAX_ROLL_COMPONENT;
-		if(min<-MAX_ROLL_COMPONENT) min = -MAX_ROLL_COMPONENT;
-		u[VEC_ROLL] = setpoint.roll_throttle;
-		rc_saturate_double(&u[VEC_ROLL], min, max);
-		mix_add_input(u[VEC_ROLL], VEC_ROLL, mot);
-
-		// pitch
-		mix_check_saturation(VEC_PITCH, mot, &min, &max);
-		if(max>MAX_PITCH_COMPONENT)  max =  MAX_PITCH_COMPONENT;
-		if(min<-MAX_PITCH_COMPONENT) min = -MAX_PITCH_COMPONENT;
-		u[VEC_PITCH] = setpoint.pitch_throttle;
-		rc_saturate_double(&u[VEC_PITCH], min, max);
-		mix_add_input(u[VEC_PITCH], VEC_PITCH, mot);
-
-		// YAW
-		mix_check_saturation(VEC_YAW, mot, &min, &max);
-		if(max>MAX_YAW_COMPONENT)  max =  MAX_YAW_COMPONENT;
-		if(min<-MAX_YAW_COMPONENT) min = -MAX_YAW_COMPONENT;
-		u[VEC_YAW] = setpoint.yaw_throttle;
-		rc_saturate_double(&u[VEC_YAW], min, max);
-		mix_add_input(u[VEC_YAW], VEC_YAW, mot);
-	}
-
-	// for 6dof systems, add X and Y
-	if(setpoint.en_6dof){
-		// X
-		mix_check_saturation(VEC_X, mot, &min, &max);
-		if(max>MAX_X_COMPONENT)  max =  MAX_X_COMPONENT;
-		if(min<-MAX_X_COMPONENT) min = -MAX_X_COMPONENT;
-		u[VEC_X] = setpoint.X_throttle;
-		rc_saturate_double(&u[VEC_X], min, max);
-		mix_add_input(u[VEC_X], VEC_X, mot);
-
-		// Y
-		mix_check_saturation(VEC_Y, mot, &min, &max);
-		if(max>MAX_Y_COMPONENT)  max =  MAX_Y_COMPONENT;
-		if(min<-MAX_Y_COMPONENT) min = -MAX_Y_COMPONENT;
-		u[VEC_Y] = setpoint.Y_throttle;
-		rc_saturate_double(&u[VEC_Y], min, max);
-		mix_add_input(u[VEC_Y], VEC_Y, mot);
+		rpy_err[FEEDBACK_CTRL_ROLL]	= setpoint.roll  - state_estimate.roll;
+		rpy_err[FEEDBACK_CTRL_PITCH]	= setpoint.pitch - state_estimate.pitch;
+		rpy_err[FEEDBACK_CTRL_YAW]	= setpoint.yaw   - state_estimate.yaw;
+		for(i=FEEDBACK_CTRL_ROLL;i<=FEEDBACK_CTRL_YAW;i++){
+			D->c[i].gain = D->gain_orig[i] * state_estimate.batt_gain_scale;
+		}
+		controller_march_raw(&D->c[FEEDBACK_CTRL_ROLL], rpy_err, 3);
 	}
+	mix_allocate(setpoint.en_6dof ? 6 : 4, component_limit, __mix_input, NULL, u, mot);
 
 	/***************************************************************************
 	* Send ESC motor signals immediately at the end of the control loop
 	***************************************************************************/
 	for(i=0;i<settings.num_rotors;i++){
 		rc_saturate_double(&mot[i], 0.0, 1.0);
-		fstate.m[i] = map_motor_signal(mot[i]);
+	}
+	map_motor_signals(mot, fstate.m, settings.num_rotors);
 
+	for(i=0;i<settings.num_rotors;i++){
 		// NO NO NO this undoes all the fancy mixing-based saturation
 		// done above, idle should be done with MAX_THRUST_COMPONENT instead
 		// rc_saturate_double(&fstate.m[i], MOTOR_IDLE_CMD, 1.0);
@@ -351,8 +413,9 @@ int feedback_march(void)
 		rc_saturate_double(&fstate.m[i], 0.0, 1.0);
 
 		// finally send pulses!
-		rc_servo_send_esc_pulse_normalized(i+1,fstate.m[i]);
+		hal_esc_send(i+1,fstate.m[i]);
 	}
+	instr_mark_esc();
 
 	/***************************************************************************
 	* Final cleanup, timing, and indexing
@@ -362,8 +425,47 @@ int feedback_march(void)
 	// keep track of loops since arming
 	fstate.loop_index++;
 	// log us since arming, mostly for the log
-	fstate.last_step_ns = rc_nanos_since_boot();
+	fstate.last_step_ns = hal_time_ns();
+
+	return 0;
+}
 
+
+int feedback_update_controller(feedback_ctrl_t ctrl, const controller_t* c)
+{
+	uint64_t deadline;
+	int i;
+
+	if(fstate.initialized!=1){
+		fprintf(stderr,"ERROR in feedback_update_controller, feedback not initialized\n");
+		return -1;
+	}
+	if(ctrl<0 || ctrl>=FEEDBACK_NUM_CTRL){
+		fprintf(stderr,"ERROR in feedback_update_controller, invalid controller\n");
+		return -1;
+	}
+	if(c->initialized!=1 || fabs(c->dt-settings.dt)>1e-9){
+		fprintf(stderr,"ERROR in feedback_update_controller, controller must be built at settings.dt\n");
+		return -1;
+	}
+
+	// D_next belongs to the control thread until the last update is taken
+	deadline = rc_nanos_since_boot()+FEEDBACK_UPDATE_TIMEOUT_US*1000ULL;
+	while(atomic_load_explicit(&update_pending, memory_order_acquire)){
+		if(rc_nanos_since_boot()>deadline){
+			fprintf(stderr,"ERROR in feedback_update_controller, previous update not taken\n");
+			return -1;
+		}
+		rc_usleep(1000);
+	}
+
+	latest[ctrl] = *c;
+	if(__ctrl_setup(ctrl, &latest[ctrl])) return -1;
+	for(i=0;i<FEEDBACK_NUM_CTRL;i++){
+		D_next->c[i] = latest[i];
+		D_next->gain_orig[i] = latest[i].gain;
+	}
+	atomic_store_explicit(&update_pending, 1, memory_order_release);
 	return 0;
 }
 
@@ -0,0 +1,320 @@
+/**
+ * @file hal.c
+ *
+ * Backend selection and the librobotcontrol backend.
+ */
+
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <rc/mpu.h>
+#include <rc/pthread.h>
+#include <rc/bmp.h>
+#include <rc/adc.h>
+#include <rc/servo.h>
+#include <rc/led.h>
+#include <rc/time.h>
+
+#include <hal.h>
+#include <rc_pilot_defs.h>
+#include <settings.h>
+
+#define RAW_IMU_KP		0.5	///< complementary filter gain pulling toward gravity
+#define RAW_IMU_THREAD_TOUT	0.5	///< seconds to wait for the polling thread to exit
+
+const hal_ops_t* hal = &hal_rc_ops;
+
+// librobotcontrol's i2c bus lock is only advisory, the raw imu poll and the
+// barometer thread take this around every transfer instead. Priority
+// inheritance so the barometer can't hold up the poll for longer than its
+// own transfer.
+static pthread_mutex_t i2c_lock;
+
+// raw imu_mode state, the polling thread stands in for the DMP interrupt
+static rc_mpu_data_t* raw_data;
+static void (*raw_callback)(void);
+static pthread_t raw_thread;
+static volatile int raw_running;
+static double raw_q[4];		// sensor frame, W X Y Z like dmp_quat
+
+
+/**
+ * @brief      starts the attitude filter level with gravity at the current
+ *             accelerometer reading and zero yaw, same as the DMP at power on
+ */
+static void __raw_filter_init(const double a[3])
+{
+	double roll = atan2(a[1], a[2]);
+	double pitch = atan2(-a[0], sqrt(a[1]*a[1]+a[2]*a[2]));
+	double cr = cos(roll/2.0), sr = sin(roll/2.0);
+	double cp = cos(pitch/2.0), sp = sin(pitch/2.0);
+
+	raw_q[0] = cr*cp;
+	raw_q[1] = sr*cp;
+	raw_q[2] = cr*sp;
+	raw_q[3] = -sr*sp;
+}
+
+/**
+ * @brief      one step of a Mahony complementary filter in the sensor frame,
+ *             gyro integration corrected toward the gravity vector measured
+ *             by the accelerometer. Yaw is gyro only, like the DMP without a
+ *             magnetometer.
+ *
+ * @param[in]  g     gyro, deg/s
+ * @param[in]  a     accel, m/s^2
+ * @param[in]  dt    seconds since the last step
+ */
+static void __raw_filter_step(const double g[3], const double a[3], double dt)
+{
+	double w[3], v[3], e[3] = {0.0, 0.0, 0.0};
+	double q0 = raw_q[0], q1 = raw_q[1], q2 = raw_q[2], q3 = raw_q[3];
+	double norm = sqrt(a[0]*a[0]+a[1]*a[1]+a[2]*a[2]);
+	int i;
+
+	if(norm>0.0){
+		// up as seen from the sensor according to the current estimate
+		v[0] = 2.0*(q1*q3-q0*q2);
+		v[1] = 2.0*(q0*q1+q2*q3);
+		v[2] = q0*q0-q1*q1-q2*q2+q3*q3;
+		e[0] = (a[1]*v[2]-a[2]*v[1])/norm;
+		e[1] = (a[2]*v[0]-a[0]*v[2])/norm;
+		e[2] = (a[0]*v[1]-a[1]*v[0])/norm;
+	}
+	for(i=0;i<3;i++) w[i] = g[i]*M_PI/180.0 + RAW_IMU_KP*e[i];
+
+	raw_q[0] += 0.5*dt*(-q1*w[0]-q2*w[1]-q3*w[2]);
+	raw_q[1] += 0.5*dt*( q0*w[0]+q2*w[2]-q3*w[1]);
+	raw_q[2] += 0.5*dt*( q0*w[1]-q1*w[2]+q3*w[0]);
+	raw_q[3] += 0.5*dt*( q0*w[2]+q1*w[1]-q2*w[0]);
+
+	norm = sqrt(raw_q[0]*raw_q[0]+raw_q[1]*raw_q[1]+raw_q[2]*raw_q[2]+raw_q[3]*raw_q[3]);
+	for(i=0;i<4;i++) raw_q[i] /= norm;
+}
+
+/**
+ * @brief      reads the gyro and accel at settings.feedback_hz, runs the
+ *             attitude filter into dmp_quat and calls the IMU callback the
+ *             way the DMP interrupt thread would
+ */
+static void* __raw_imu_func(__attribute__ ((unused)) void* ptr)
+{
+	struct timespec next;
+	const long period_ns = 1000000000L/settings.feedback_hz;
+	int i, ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(raw_running){
+		next.tv_nsec += period_ns;
+		if(next.tv_nsec>=1000000000L){
+			next.tv_nsec -= 1000000000L;
+			next.tv_sec++;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		if(!raw_running) break;
+
+		pthread_mutex_lock(&i2c_lock);
+		ret = rc_mpu_read_accel(raw_data) || rc_mpu_read_gyro(raw_data);
+		pthread_mutex_unlock(&i2c_lock);
+		if(ret){
+			fprintf(stderr,"WARNING in raw imu thread, failed to read sensor\n");
+			continue;
+		}
+		__raw_filter_step(raw_data->gyro, raw_data->accel, settings.dt);
+		for(i=0;i<4;i++) raw_data->dmp_quat[i] = raw_q[i];
+		if(raw_callback!=NULL) raw_callback();
+	}
+	return NULL;
+}
+
+static int __rc_raw_imu_init(rc_mpu_data_t* data)
+{
+	int i;
+	rc_mpu_config_t mpu_conf = rc_mpu_default_config();
+	mpu_conf.i2c_bus = I2C_BUS;
+	mpu_conf.accel_fsr = ACCEL_FSR_8G;
+	mpu_conf.gyro_fsr = GYRO_FSR_2000DPS;
+	mpu_conf.accel_dlpf = ACCEL_DLPF_184;
+	mpu_conf.gyro_dlpf = GYRO_DLPF_184;
+	mpu_conf.enable_magnetometer = 0;
+
+	if(rc_mpu_initialize(data, mpu_conf)) return -1;
+	if(rc_mpu_read_accel(data) || rc_mpu_read_gyro(data)){
+		fprintf(stderr,"ERROR in raw imu init, failed to read sensor\n");
+		rc_mpu_power_off();
+		return -1;
+	}
+	__raw_filter_init(data->accel);
+	for(i=0;i<4;i++) data->dmp_quat[i] = raw_q[i];
+	raw_data = data;
+	return 0;
+}
+
+static int __rc_raw_imu_set_callback(void (*func)(void))
+{
+	if(raw_running){
+		raw_callback = func;
+		return 0;
+	}
+	raw_callback = func;
+	raw_running = 1;
+	if(rc_pthread_create(&raw_thread, __raw_imu_func, NULL, SCHED_FIFO, IMU_PRIORITY)){
+		fprintf(stderr,"ERROR in raw imu, failed to start polling thread\n");
+		raw_running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+static int __rc_raw_imu_power_off(void)
+{
+	int ret;
+
+	if(raw_running){
+		raw_running = 0;
+		ret = rc_pthread_timed_join(raw_thread, NULL, RAW_IMU_THREAD_TOUT);
+		if(ret==1) fprintf(stderr,"WARNING: raw imu thread exit timeout\n");
+		else if(ret==-1) fprintf(stderr,"ERROR: failed to join raw imu thread\n");
+	}
+	raw_data = NULL;
+	return rc_mpu_power_off();
+}
+
+
+static int __rc_init(void)
+{
+	pthread_mutexattr_t attr;
+
+	if(pthread_mutexattr_init(&attr) ||
+	   pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT) ||
+	   pthread_mutex_init(&i2c_lock, &attr)){
+		fprintf(stderr,"ERROR: failed to create i2c bus lock\n");
+		return -1;
+	}
+	pthread_mutexattr_destroy(&attr);
+
+	// servos, adc and barometer are brought up by main() in the order the
+	// cape needs, only check the layout fits on the servo header
+	if(settings.num_rotors>RC_SERVO_CH_MAX){
+		fprintf(stderr,"ERROR: the cape has %d servo channels, layout needs %d\n",
+						RC_SERVO_CH_MAX, settings.num_rotors);
+		return -1;
+	}
+	return 0;
+}
+
+static int __rc_cleanup(void)
+{
+	pthread_mutex_destroy(&i2c_lock);
+	return 0;
+}
+
+static int __rc_imu_init(rc_mpu_data_t* data)
+{
+	if(settings.imu_mode==IMU_MODE_RAW) return __rc_raw_imu_init(data);
+
+	rc_mpu_config_t mpu_conf = rc_mpu_default_config();
+	mpu_conf.i2c_bus = I2C_BUS;
+	mpu_conf.gpio_interrupt_pin_chip = GPIO_INT_PIN_CHIP;
+	mpu_conf.gpio_interrupt_pin = GPIO_INT_PIN_PIN;
+	mpu_conf.dmp_sample_rate = settings.feedback_hz;
+	mpu_conf.dmp_fetch_accel_gyro = 1;
+	//mpu_conf.orient = ORIENTATION_Z_UP;
+	mpu_conf.dmp_interrupt_sched_policy = SCHED_FIFO;
+	mpu_conf.dmp_interrupt_priority = IMU_PRIORITY;
+
+	// optionally enbale magnetometer
+	mpu_conf.enable_magnetometer = settings.enable_magnetometer;
+
+	if(rc_mpu_initialize_dmp(data, mpu_conf)) return -1;
+	return 0;
+}
+
+static int __rc_imu_set_callback(void (*func)(void))
+{
+	if(settings.imu_mode==IMU_MODE_RAW) return __rc_raw_imu_set_callback(func);
+	return rc_mpu_set_dmp_callback(func);
+}
+
+static int __rc_imu_power_off(void)
+{
+	if(settings.imu_mode==IMU_MODE_RAW) return __rc_raw_imu_power_off();
+	return rc_mpu_power_off();
+}
+
+static int __rc_bmp_read(rc_bmp_data_t* data)
+{
+	int ret;
+
+	pthread_mutex_lock(&i2c_lock);
+	ret = rc_bmp_read(data);
+	pthread_mutex_unlock(&i2c_lock);
+	return ret;
+}
+
+static double __rc_batt_read(void)
+{
+	return rc_adc_dc_jack();
+}
+
+static int __rc_esc_send(int ch, double val)
+{
+	return rc_servo_send_esc_pulse_normalized(ch, val);
+}
+
+static int __rc_led_set(rc_led_t led, int value)
+{
+	return rc_led_set(led, value);
+}
+
+static uint64_t __rc_time_ns(void)
+{
+	return rc_nanos_since_boot();
+}
+
+const hal_ops_t hal_rc_ops = {
+	.name			= "rc",
+	.realtime		= 1,
+	.init			= __rc_init,
+	.cleanup		= __rc_cleanup,
+	.imu_init		= __rc_imu_init,
+	.imu_set_callback	= __rc_imu_set_callback,
+	.imu_power_off		= __rc_imu_power_off,
+	.bmp_read		= __rc_bmp_read,
+	.batt_read		= __rc_batt_read,
+	.esc_send		= __rc_esc_send,
+	.led_set		= __rc_led_set,
+	.time_ns		= __rc_time_ns
+};
+
+
+int hal_init(hal_backend_t backend)
+{
+	switch(backend){
+	case HAL_RC:
+		hal = &hal_rc_ops;
+		break;
+	case HAL_SIM:
+		hal = &hal_sim_ops;
+		break;
+	case HAL_REPLAY:
+		hal = &hal_replay_ops;
+		break;
+	default:
+		fprintf(stderr,"ERROR in hal_init, unknown backend\n");
+		return -1;
+	}
+	if(hal->init()){
+		fprintf(stderr,"ERROR in hal_init, failed to initialize %s backend\n", hal->name);
+		return -1;
+	}
+	return 0;
+}
+
+
+int hal_cleanup(void)
+{
+	return hal->cleanup();
+}
@@ -6,6 +6,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <math.h> // for fabs
+#include <stdatomic.h>
 
 #include <rc/start_stop.h>
 #include <rc/pthread.h>
@@ -18,11 +19,17 @@
 #include <state_estimator.h>
 #include <rc_pilot_defs.h>
 #include <thread_defs.h>
+#include <snapshot.h>
+#include <rt_setup.h>
 
 user_input_t user_input; // extern variable in input_manager.h
 
 static pthread_t input_manager_thread;
 static arm_state_t kill_switch = DISARMED; // raw kill switch on the radio
+static atomic_int thread_running;
+// set by the input_manager thread once the arming sequence is done, the dsm
+// callback consumes it on the next frame so it stays the only writer
+static atomic_int arm_requested;
 
 
 /**
@@ -41,6 +48,32 @@ static double __deadzone(double in, double zone)
 }
 
 
+/**
+ * @brief      checks the published attitude is within ARM_TIP_THRESHOLD of level
+ *
+ * @return     1 if level, 0 if not or no consistent estimate was available
+ */
+static int __is_level(void)
+{
+	state_estimate_t se;
+	if(snapshot_get_state_estimate(&se)) return 0;
+	if(fabs(se.roll)>ARM_TIP_THRESHOLD||fabs(se.pitch)>ARM_TIP_THRESHOLD) return 0;
+	return 1;
+}
+
+/**
+ * @brief      checks the published feedback state says the controller is up
+ *
+ * @return     1 if initialized, 0 otherwise
+ */
+static int __feedback_initialized(void)
+{
+	feedback_state_t fs;
+	if(snapshot_get_fstate(&fs)) return 0;
+	return fs.initialized;
+}
+
+
 /**
  * @brief      blocking function that returns after arming sequence is complete
  *
@@ -48,17 +81,19 @@ static double __deadzone(double in, double zone)
  */
 static int __wait_for_arming_sequence()
 {
+	user_input_t ui;
+
 	// already armed, just return. Should never do this in normal operation though
-	if(user_input.requested_arm_mode == ARMED) return 0;
+	if(snapshot_get_user_input(&ui)==0 && ui.requested_arm_mode == ARMED) return 0;
 
 ARM_SEQUENCE_START:
 	// wait for feedback controller to have started
-	while(fstate.initialized==0){
+	while(!__feedback_initialized()){
 		rc_usleep(100000);
 		if(rc_get_state()==EXITING) return 0;
 	}
 	// wait for level
-	while(fabs(state_estimate.roll)>ARM_TIP_THRESHOLD||fabs(state_estimate.pitch)>ARM_TIP_THRESHOLD){
+	while(!__is_level()){
 		rc_usleep(100000);
 		if(rc_get_state()==EXITING) return 0;
 	}
@@ -82,7 +117,7 @@ ARM_SEQUENCE_START:
 
 	// final check of kill switch and level before arming
 	if(kill_switch==DISARMED) goto ARM_SEQUENCE_START;
-	if(fabs(state_estimate.roll)>ARM_TIP_THRESHOLD||fabs(state_estimate.pitch)>ARM_TIP_THRESHOLD){
+	if(!__is_level()){
 		goto ARM_SEQUENCE_START;
 	}
 	return 0;
@@ -91,6 +126,7 @@ ARM_SEQUENCE_START:
 
 void new_dsm_data_callback()
 {
+	uint64_t now = rc_nanos_since_boot();
 	double new_thr, new_roll, new_pitch, new_yaw, new_mode, new_kill;
 
 	// Read normalized (+-1) inputs from RC radio stick and multiply by
@@ -161,6 +197,11 @@ void new_dsm_data_callback()
 		break;
 	}
 
+	// the arming sequence finished since the last frame
+	if(atomic_exchange(&arm_requested, 0) && kill_switch==ARMED){
+		user_input.requested_arm_mode = ARMED;
+	}
+
 	// fill in sticks
 	if(user_input.requested_arm_mode==ARMED){
 		user_input.thr_stick   = new_thr;
@@ -176,11 +217,13 @@ void new_dsm_data_callback()
 		user_input.pitch_stick = 0.0;
 		user_input.yaw_stick   = 0.0;
 	}
+	user_input.frame_ns = now;
 
 	if(user_input.input_active==0){
 		user_input.input_active=1; // flag that connection has come back online
 		printf("DSM CONNECTION ESTABLISHED\n");
 	}
+	snapshot_publish_user_input();
 	return;
 
 }
@@ -194,17 +237,22 @@ void dsm_disconnect_callback(void)
 	user_input.yaw_stick = 0.0;
 	user_input.input_active = 0;
 	kill_switch = DISARMED;
+	atomic_store(&arm_requested, 0);
 	user_input.requested_arm_mode=DISARMED;
+	snapshot_publish_user_input();
 	fprintf(stderr, "LOST DSM CONNECTION\n");
 }
 
 
 void* input_manager(void* ptr)
 {
-	user_input.initialized = 1;
+	user_input_t ui;
+
+	rt_setup_thread(RT_THREAD_INPUT);
+	atomic_store(&thread_running, 1);
 	// wait for first packet
 	while(rc_get_state()!=EXITING){
-		if(user_input.input_active) break;
+		if(snapshot_get_user_input(&ui)==0 && ui.input_active) break;
 		rc_usleep(1000000/INPUT_MANAGER_HZ);
 	}
 
@@ -212,15 +260,18 @@ void* input_manager(void* ptr)
 	// logic to handle other inputs such as mavlink/bluetooth/wifi
 	while(rc_get_state()!=EXITING){
 		// if the core got disarmed, wait for arming sequence
-		if(user_input.requested_arm_mode == DISARMED){
+		if(snapshot_get_user_input(&ui)==0 && ui.requested_arm_mode == DISARMED){
 			__wait_for_arming_sequence();
 			// user may have pressed the pause button or shut down while waiting
 			// check before continuing
 			if(rc_get_state()!=RUNNING) continue;
-			else{
-				user_input.requested_arm_mode=ARMED;
-				//printf("\n\nDSM ARM REQUEST\n\n");
+			// hand the request to the dsm callback and wait for it to
+			// be taken so the next check doesn't start over
+			atomic_store(&arm_requested, 1);
+			while(atomic_load(&arm_requested) && rc_get_state()!=EXITING){
+				rc_usleep(1000000/INPUT_MANAGER_HZ);
 			}
+			//printf("\n\nDSM ARM REQUEST\n\n");
 		}
 		// wait
 		rc_usleep(1000000/INPUT_MANAGER_HZ);
@@ -232,13 +283,19 @@ void* input_manager(void* ptr)
 
 int input_manager_init()
 {
-	user_input.initialized = 0;
 	int i;
+
+	user_input.initialized = 0;
+	atomic_store(&thread_running, 0);
+	atomic_store(&arm_requested, 0);
 	// start dsm hardware
 	if(rc_dsm_init()==-1){
 		fprintf(stderr, "ERROR in input_manager_init, failed to initialize dsm\n");
 		return -1;
 	}
+	// last write from this thread, the callbacks own user_input from here
+	user_input.initialized = 1;
+	snapshot_publish_user_input();
 	rc_dsm_set_disconnect_callback(dsm_disconnect_callback);
 	rc_dsm_set_callback(new_dsm_data_callback);
 	// start thread
@@ -249,7 +306,7 @@ int input_manager_init()
 	}
 	// wait for thread to start
 	for(i=0;i<50;i++){
-		if(user_input.initialized) return 0;
+		if(atomic_load(&thread_running)) return 0;
 		rc_usleep(50000);
 	}
 	fprintf(stderr, "ERROR in input_manager_init, timeout waiting for thread to start\n");
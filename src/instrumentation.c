@@ -0,0 +1,337 @@
+/**
+ * @file instrumentation.c
+ *
+ * Histograms are log-linear: values are counted in units of 64ns, the first
+ * 32 buckets are one unit wide and beyond that every power of 2 is split into
+ * 16 buckets. That covers 64ns to over a minute in 464 buckets with a worst
+ * case error of about 6%, and finding a bucket is a shift and a clz.
+ */
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include <rc/time.h>
+#include <rc/mpu.h>
+
+#include <rc_pilot_defs.h>
+#include <instrumentation.h>
+
+#define UNIT_SHIFT	6	// histogram unit is 2^6 = 64ns
+#define SUB_BITS	4	// 16 buckets per power of 2
+#define SUB_BUCKETS	(1<<SUB_BITS)
+#define LINEAR_BUCKETS	(2*SUB_BUCKETS)
+#define NUM_BUCKETS	(LINEAR_BUCKETS + (32-SUB_BITS-1)*SUB_BUCKETS)
+#define MAX_UNITS	0xFFFFFFFFu
+#define ROW_BUCKETS	4	// buckets per row of instr_print_histogram()
+#define BAR_WIDTH	50
+
+typedef struct histogram_t{
+	atomic_uint bucket[NUM_BUCKETS];
+	atomic_uint_fast64_t count;
+	atomic_uint_fast64_t sum_ns;
+	atomic_uint_fast64_t max_ns;
+} histogram_t;
+
+static histogram_t hist[INSTR_NUM_CHANNELS];
+static atomic_int reset_requested;
+static uint64_t nominal_period_ns;	// jitter is measured against this
+
+// timestamps for the tick in progress, only touched by the IMU thread
+static uint64_t last_begin_ns;
+static uint64_t tick_begin_ns;
+static uint64_t stage_mark_ns;
+static uint64_t irq_ns;
+static uint64_t esc_ns;
+static uint64_t input_ns;		// radio frame acted on this tick
+static uint64_t last_input_ns;		// last frame recorded into rx_to_esc
+static instr_tick_t tick, last_tick;
+
+static const char* const channel_names[INSTR_NUM_CHANNELS] = {
+	"setpoint",
+	"estimator",
+	"feedback",
+	"log",
+	"battery",
+	"after_feedback",
+	"isr_total",
+	"irq_to_esc",
+	"rx_to_esc",
+	"period",
+	"jitter"
+};
+
+
+static int __bucket_index(uint64_t ns)
+{
+	uint64_t units = ns>>UNIT_SHIFT;
+	uint32_t v;
+	int e;
+
+	if(units>MAX_UNITS) units = MAX_UNITS;
+	v = (uint32_t)units;
+	if(v<LINEAR_BUCKETS) return v;
+	e = 31-__builtin_clz(v);
+	return LINEAR_BUCKETS + (e-SUB_BITS-1)*SUB_BUCKETS + ((v>>(e-SUB_BITS)) & (SUB_BUCKETS-1));
+}
+
+
+/**
+ * @brief      upper edge of a bucket in nanoseconds, used for percentiles so
+ *             they err on the pessimistic side
+ */
+static uint64_t __bucket_upper_ns(int idx)
+{
+	uint64_t lower, width;
+	int e;
+
+	if(idx<LINEAR_BUCKETS) return ((uint64_t)idx+1)<<UNIT_SHIFT;
+	e = (idx-LINEAR_BUCKETS)/SUB_BUCKETS + SUB_BITS + 1;
+	width = 1ULL<<(e-SUB_BITS);
+	lower = (uint64_t)(SUB_BUCKETS + (idx-LINEAR_BUCKETS)%SUB_BUCKETS)*width;
+	return (lower+width)<<UNIT_SHIFT;
+}
+
+
+static void __reset_all(void)
+{
+	int i, j;
+	for(i=0;i<INSTR_NUM_CHANNELS;i++){
+		for(j=0;j<NUM_BUCKETS;j++){
+			atomic_store_explicit(&hist[i].bucket[j], 0, memory_order_relaxed);
+		}
+		atomic_store_explicit(&hist[i].count, 0, memory_order_relaxed);
+		atomic_store_explicit(&hist[i].sum_ns, 0, memory_order_relaxed);
+		atomic_store_explicit(&hist[i].max_ns, 0, memory_order_relaxed);
+	}
+}
+
+
+void instr_record(instr_channel_t ch, uint64_t ns)
+{
+	histogram_t* h;
+	int idx;
+
+	if(ch<0 || ch>=INSTR_NUM_CHANNELS) return;
+	h = &hist[ch];
+	idx = __bucket_index(ns);
+
+	// single writer, so plain load+store is enough and avoids a locked
+	// read-modify-write on every sample
+	atomic_store_explicit(&h->bucket[idx],
+		atomic_load_explicit(&h->bucket[idx], memory_order_relaxed)+1,
+		memory_order_relaxed);
+	atomic_store_explicit(&h->count,
+		atomic_load_explicit(&h->count, memory_order_relaxed)+1,
+		memory_order_relaxed);
+	atomic_store_explicit(&h->sum_ns,
+		atomic_load_explicit(&h->sum_ns, memory_order_relaxed)+ns,
+		memory_order_relaxed);
+	if(ns>atomic_load_explicit(&h->max_ns, memory_order_relaxed)){
+		atomic_store_explicit(&h->max_ns, ns, memory_order_relaxed);
+	}
+}
+
+
+void instr_tick_begin(void)
+{
+	uint64_t now = rc_nanos_since_boot();
+	int64_t since_irq = rc_mpu_nanos_since_last_dmp_interrupt();
+	uint64_t period;
+	int i;
+
+	if(atomic_exchange(&reset_requested, 0)) __reset_all();
+
+	if(last_begin_ns!=0){
+		period = now-last_begin_ns;
+		instr_record(INSTR_PERIOD, period);
+		if(period>nominal_period_ns) instr_record(INSTR_JITTER, period-nominal_period_ns);
+		else instr_record(INSTR_JITTER, nominal_period_ns-period);
+		tick.period_ns = period;
+	}
+	for(i=0;i<INSTR_NUM_STAGES;i++) tick.stage_ns[i] = 0;
+	last_begin_ns = now;
+	tick_begin_ns = now;
+	stage_mark_ns = now;
+	// fall back to callback start if the interrupt time isn't available
+	if(since_irq>=0 && (uint64_t)since_irq<now) irq_ns = now-since_irq;
+	else irq_ns = now;
+	esc_ns = 0;
+	input_ns = 0;
+}
+
+
+void instr_stage_end(instr_channel_t stage)
+{
+	uint64_t now = rc_nanos_since_boot();
+	uint64_t dur = now-stage_mark_ns;
+
+	stage_mark_ns = now;
+	if(stage<0 || stage>=INSTR_NUM_STAGES) return;
+	tick.stage_ns[stage] = dur;
+	instr_record(stage, dur);
+}
+
+
+void instr_mark_esc(void)
+{
+	esc_ns = rc_nanos_since_boot();
+}
+
+
+void instr_mark_input(uint64_t frame_ns)
+{
+	input_ns = frame_ns;
+}
+
+
+void instr_tick_end(void)
+{
+	uint64_t now = rc_nanos_since_boot();
+
+	tick.total_ns = now-tick_begin_ns;
+	instr_record(INSTR_ISR_TOTAL, tick.total_ns);
+	if(esc_ns!=0){
+		tick.irq_to_esc_ns = esc_ns-irq_ns;
+		instr_record(INSTR_IRQ_TO_ESC, tick.irq_to_esc_ns);
+	}
+	else tick.irq_to_esc_ns = 0;
+	// only the first pulse after a frame, later ticks reuse the same sticks
+	if(esc_ns!=0 && input_ns!=0 && input_ns!=last_input_ns && esc_ns>input_ns){
+		instr_record(INSTR_RX_TO_ESC, esc_ns-input_ns);
+		last_input_ns = input_ns;
+	}
+	last_tick = tick;
+}
+
+
+int instr_get_stats(instr_channel_t ch, instr_stats_t* stats)
+{
+	int i;
+	uint64_t count, target50, target99, cum;
+	histogram_t* h;
+
+	if(ch<0 || ch>=INSTR_NUM_CHANNELS || stats==NULL){
+		fprintf(stderr,"ERROR in instr_get_stats, invalid argument\n");
+		return -1;
+	}
+	h = &hist[ch];
+	count = atomic_load_explicit(&h->count, memory_order_relaxed);
+	stats->count	= count;
+	stats->max_ns	= atomic_load_explicit(&h->max_ns, memory_order_relaxed);
+	stats->mean_ns	= count ? atomic_load_explicit(&h->sum_ns, memory_order_relaxed)/count : 0;
+	stats->p50_ns	= 0;
+	stats->p99_ns	= 0;
+	if(count==0) return 0;
+
+	// round up so p99 of a small sample set is its largest value
+	target50 = (count*50+99)/100;
+	target99 = (count*99+99)/100;
+	cum = 0;
+	for(i=0;i<NUM_BUCKETS;i++){
+		cum += atomic_load_explicit(&h->bucket[i], memory_order_relaxed);
+		if(stats->p50_ns==0 && cum>=target50) stats->p50_ns = __bucket_upper_ns(i);
+		if(cum>=target99){
+			stats->p99_ns = __bucket_upper_ns(i);
+			break;
+		}
+	}
+	// bucket edges can overshoot the largest sample actually seen
+	if(stats->p50_ns>stats->max_ns) stats->p50_ns = stats->max_ns;
+	if(stats->p99_ns>stats->max_ns) stats->p99_ns = stats->max_ns;
+	return 0;
+}
+
+
+int instr_get_last_tick(instr_tick_t* t)
+{
+	if(t==NULL){
+		fprintf(stderr,"ERROR in instr_get_last_tick, received NULL pointer\n");
+		return -1;
+	}
+	*t = last_tick;
+	return 0;
+}
+
+
+void instr_set_loop_hz(int hz)
+{
+	nominal_period_ns = hz>0 ? 1000000000/hz : 0;
+}
+
+
+void instr_reset(void)
+{
+	atomic_store(&reset_requested, 1);
+}
+
+
+const char* instr_channel_name(instr_channel_t ch)
+{
+	if(ch<0 || ch>=INSTR_NUM_CHANNELS) return "unknown";
+	return channel_names[ch];
+}
+
+
+int instr_print_report(FILE* fd)
+{
+	int i;
+	instr_stats_t s;
+
+	if(fd==NULL) return -1;
+	fprintf(fd, "\n%-16s %10s %9s %9s %9s %9s\n", "channel", "samples",
+					"mean(us)", "p50(us)", "p99(us)", "max(us)");
+	for(i=0;i<INSTR_NUM_CHANNELS;i++){
+		instr_get_stats(i, &s);
+		fprintf(fd, "%-16s %10llu %9.1f %9.1f %9.1f %9.1f\n",
+					instr_channel_name(i),
+					(unsigned long long)s.count,
+					s.mean_ns/1000.0,
+					s.p50_ns/1000.0,
+					s.p99_ns/1000.0,
+					s.max_ns/1000.0);
+	}
+	return 0;
+}
+
+
+int instr_print_histogram(FILE* fd, instr_channel_t ch)
+{
+	int i, j, first, last, bar;
+	unsigned int row, peak;
+	histogram_t* h;
+
+	if(fd==NULL || ch<0 || ch>=INSTR_NUM_CHANNELS) return -1;
+	h = &hist[ch];
+
+	// find the rows that hold samples and the tallest one to scale the bars
+	first = -1;
+	last = -1;
+	peak = 0;
+	for(i=0;i<NUM_BUCKETS;i+=ROW_BUCKETS){
+		row = 0;
+		for(j=i;j<i+ROW_BUCKETS;j++){
+			row += atomic_load_explicit(&h->bucket[j], memory_order_relaxed);
+		}
+		if(row==0) continue;
+		if(first<0) first = i;
+		last = i;
+		if(row>peak) peak = row;
+	}
+	if(first<0) return -1;
+
+	fprintf(fd, "\n%s histogram\n%9s - %9s %10s\n", instr_channel_name(ch),
+					"from(us)", "to(us)", "samples");
+	for(i=first;i<=last;i+=ROW_BUCKETS){
+		row = 0;
+		for(j=i;j<i+ROW_BUCKETS;j++){
+			row += atomic_load_explicit(&h->bucket[j], memory_order_relaxed);
+		}
+		bar = (int)(((uint64_t)row*BAR_WIDTH+peak-1)/peak);
+		fprintf(fd, "%9.1f - %9.1f %10u %.*s\n",
+					i ? __bucket_upper_ns(i-1)/1000.0 : 0.0,
+					__bucket_upper_ns(i+ROW_BUCKETS-1)/1000.0,
+					row, bar,
+					"##################################################");
+	}
+	return 0;
+}
@@ -2,14 +2,22 @@
  * @file log_manager.c
  */
 
+#define _GNU_SOURCE	// fallocate()
+#include <fcntl.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
 #include <string.h>
+#include <lz4frame.h>
+#include <zstd.h>
 
 
 // to allow printf macros for multi-architecture portability
@@ -24,58 +32,121 @@
 #include <rc_pilot_defs.h>
 #include <thread_defs.h>
 #include <log_manager.h>
+#include <log_format.h>
+#include <instrumentation.h>
+#include <watchdog.h>
+#include <snapshot.h>
 #include <settings.h>
 #include <setpoint_manager.h>
 #include <feedback.h>
 #include <state_estimator.h>
+#include <rt_setup.h>
+#include <arena.h>
 
 
-#define MAX_LOG_FILES	500
-#define BUF_LEN		50
+#define MAX_LOG_FILES	500	// newest logs kept, the oldest is deleted to make room
+#define LOG_CSV_EXT	".csv"
+#define LOG_BINARY_EXT	".rcl"
+#define LOG_ZSTD_LEVEL	1	// zstd level, higher levels cost too much cpu on the BBB
+#define LOG_PREALLOC_SECONDS	600	// flight time the next file is preallocated for
+#define LOG_CSV_LINE_BYTES	256	// rough csv line length, only for preallocating
+#define LOG_RETRY_SECONDS	5	// between attempts to open the next file after one failed
 
-static uint64_t num_entries;	// number of entries logged so far
-static int buffer_pos;		// position in current buffer
-static int current_buf;	// 0 or 1 to indicate which buffer is being filled
-static int needs_writing;	// flag set to 1 if a buffer is full
-static FILE* fd;		// file descriptor for the log file
+static uint64_t num_entries;	// number of entries logged to the current file
+static FILE* fd;		// log file the writer thread is filling
 
-// array of two buffers so one can fill while writing the other to file
-static log_entry_t buffer[2][BUF_LEN];
+// the next log file is created, preallocated and given its header by the
+// writer thread ahead of time, so starting it on arming is a pointer swap
+static FILE* next_fd;
+static char next_path[100];
+static int next_index;		// number the next log file gets
+static int oldest_index;	// lowest numbered log that may still exist
+static int num_logs;		// log files in LOG_DIR
+static int open_failed;		// opening the next file failed, error already printed
+static uint64_t retry_ns;	// no new attempt from the writer loop before this
+static int prealloc_warned;
+static int truncate_warned;
+
+// set by log_manager_new_segment(), entries from segment_start on go to the
+// next file
+static atomic_uint segment_start;
+static atomic_int segment_pending;
+
+// single-producer single-consumer ring of log entries. Only the IMU callback
+// writes head and only the writer thread writes tail, so neither side ever
+// waits on the other. ring_len is always a power of 2 so indices can wrap
+// freely and be masked on access.
+static log_entry_t* ring;
+static uint32_t ring_len;
+static uint32_t ring_mask;
+static atomic_uint ring_head;	// next slot the producer will fill
+static atomic_uint ring_tail;	// next slot the writer will write to disk
+static int wake_fd = -1;	// eventfd the producer kicks to wake the writer
+static int wake_pending;	// entries added since the writer was last kicked
+// wake the writer thread after this many new entries, same latency as the
+// old LOG_MANAGER_HZ polling but without spinning on an empty buffer
+static int wake_entries;
+
+// counters, written only by the producer
+static atomic_uint_fast64_t overruns;
+static atomic_uint high_water;
+
+// compressed binary logs are staged here by the writer thread and written
+// out one complete frame at a time, both buffers come from the arena
+static char* frame_buf;		// packed records of the frame in progress
+static size_t frame_cap;
+static size_t frame_len;
+static uint64_t frame_start_ns;	// when the first record of the frame was staged
+static char* packed;		// compressed frame
+static size_t packed_cap;
+static uint32_t record_size;	// bytes per binary record in the current file
+static LZ4F_cctx* lz4_ctx;
+static ZSTD_CCtx* zstd_ctx;
+static const LZ4F_preferences_t lz4_prefs = {
+	.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled
+};
+
+// bytes of records produced and bytes that went to the file, written only by
+// the writer thread
+static atomic_uint_fast64_t bytes_raw;
+static atomic_uint_fast64_t bytes_written;
 
 // background thread and running flag
 static pthread_t pthread;
 static int logging_enabled; // set to 0 to exit the write_thread
 
 
-static int __write_header(FILE* fd)
+static int __write_csv_header(FILE* fd)
 {
+	int i;
+
 	// always print loop index
-	fprintf(fd, "loop_index,last_step_ns");
+	fprintf(fd, LOG_INDEX_NAMES);
 
 	if(settings.log_sensors){
-		fprintf(fd, ",v_batt,alt_bmp_raw,gyro_roll,gyro_pitch,gyro_yaw,accel_X,accel_Y,accel_Z");
+		fprintf(fd, LOG_SENSORS_NAMES);
 	}
 
 	if(settings.log_state){
-		fprintf(fd, ",roll,pitch,yaw,X,Y,Z,Xdot,Ydot,Zdot");
+		fprintf(fd, LOG_STATE_NAMES);
 	}
 
 	if(settings.log_setpoint){
-		fprintf(fd, ",sp_roll,sp_pitch,sp_yaw,sp_X,sp_Y,sp_Z,sp_Xdot,sp_Ydot,sp_Zdot");
+		fprintf(fd, LOG_SETPOINT_NAMES);
 	}
 
 	if(settings.log_control_u){
-		fprintf(fd, ",u_roll,u_pitch,u_yaw,u_X,u_Y,u_Z");
+		fprintf(fd, LOG_CONTROL_U_NAMES);
 	}
 
-	if(settings.log_motor_signals && settings.num_rotors==8){
-		fprintf(fd, ",mot_1,mot_2,mot_3,mot_4,mot_5,mot_6,mot_7,mot_8");
+	if(settings.log_motor_signals){
+		for(i=0;i<settings.num_rotors;i++) fprintf(fd, ",mot_%d", i+1);
 	}
-	if(settings.log_motor_signals && settings.num_rotors==6){
-		fprintf(fd, ",mot_1,mot_2,mot_3,mot_4,mot_5,mot_6");
+	if(settings.log_timing){
+		fprintf(fd, LOG_TIMING_NAMES);
 	}
-	if(settings.log_motor_signals && settings.num_rotors==4){
-		fprintf(fd, ",mot_1,mot_2,mot_3,mot_4");
+	if(settings.log_watchdog){
+		fprintf(fd, LOG_WATCHDOG_NAMES);
 	}
 
 	fprintf(fd, "\n");
@@ -85,8 +156,11 @@ static int __write_header(FILE* fd)
 }
 
 
-static int __write_log_entry(FILE* fd, log_entry_t e)
+static int __write_csv_entry(FILE* fd, log_entry_t e)
 {
+	int i;
+	const double* mot;
+
 	// always print loop index
 	fprintf(fd, "%" PRIu64 ",%" PRIu64, e.loop_index, e.last_step_ns);
 
@@ -129,7 +203,7 @@ static int __write_log_entry(FILE* fd, log_entry_t e)
 	}
 
 	if(settings.log_control_u){
-		fprintf(fd, ",%.4F,%.4F,%.4F,%.4F,%.4F,%.4F,%.4F,%.4F,%.4F",\
+		fprintf(fd, ",%.4F,%.4F,%.4F,%.4F,%.4F,%.4F",\
 							e.u_roll,\
 							e.u_pitch,\
 							e.u_yaw,\
@@ -138,29 +212,29 @@ static int __write_log_entry(FILE* fd, log_entry_t e)
 							e.u_Z);
 	}
 
-	if(settings.log_motor_signals && settings.num_rotors==8){
-		fprintf(fd, ",%.4F,%.4F,%.4F,%.4F,%.4F,%.4F,%.4F,%.4F",	e.mot_1,\
-							e.mot_2,\
-							e.mot_3,\
-							e.mot_4,\
-							e.mot_5,\
-							e.mot_6,\
-							e.mot_7,\
-							e.mot_8);
+	if(settings.log_motor_signals){
+		mot = &e.mot_1;
+		for(i=0;i<settings.num_rotors;i++) fprintf(fd, ",%.4F", mot[i]);
 	}
-	if(settings.log_motor_signals && settings.num_rotors==6){
-		fprintf(fd, ",%.4F,%.4F,%.4F,%.4F,%.4F,%.4F",	e.mot_1,\
-							e.mot_2,\
-							e.mot_3,\
-							e.mot_4,\
-							e.mot_5,\
-							e.mot_6);
+
+	if(settings.log_timing){
+		fprintf(fd, ",%.1F,%.1F,%.1F,%.1F,%.1F,%.1F,%.1F,%.1F",\
+							e.t_setpoint,\
+							e.t_estimator,\
+							e.t_feedback,\
+							e.t_log,\
+							e.t_after_feedback,\
+							e.t_isr,\
+							e.t_irq_to_esc,\
+							e.t_period);
 	}
-	if(settings.log_motor_signals && settings.num_rotors==4){
-		fprintf(fd, ",%.4F,%.4F,%.4F,%.4F",		e.mot_1,\
-							e.mot_2,\
-							e.mot_3,\
-							e.mot_4);
+
+	if(settings.log_watchdog){
+		fprintf(fd, ",%.0F,%.0F,%.0F,%.0F",\
+							e.wd_overruns,\
+							e.wd_missed,\
+							e.wd_consecutive,\
+							e.wd_level);
 	}
 
 	fprintf(fd, "\n");
@@ -168,181 +242,806 @@ static int __write_log_entry(FILE* fd, log_entry_t e)
 }
 
 
-static void* __log_manager_func(__attribute__ ((unused)) void* ptr)
+/**
+ * @brief      bitmask of LOG_GROUP_* selected in the settings file
+ */
+static uint32_t __enabled_groups(void)
 {
-	int i, buf_to_write;
-	// while logging enabled and not exiting, write full buffers to disk
-	while(rc_get_state()!=EXITING && logging_enabled){
-		if(needs_writing){
-			// buffer to be written is opposite of one currently being filled
-			if(current_buf==0) buf_to_write=1;
-			else buf_to_write=0;
-			// write the full buffer to disk;
-			for(i=0;i<BUF_LEN;i++){
-				__write_log_entry(fd, buffer[buf_to_write][i]);
+	uint32_t groups = 0;
+	if(settings.log_sensors)	groups |= LOG_GROUP_SENSORS;
+	if(settings.log_state)		groups |= LOG_GROUP_STATE;
+	if(settings.log_setpoint)	groups |= LOG_GROUP_SETPOINT;
+	if(settings.log_control_u)	groups |= LOG_GROUP_CONTROL_U;
+	if(settings.log_motor_signals)	groups |= LOG_GROUP_MOTORS;
+	if(settings.log_timing)		groups |= LOG_GROUP_TIMING;
+	if(settings.log_raw)		groups |= LOG_GROUP_RAW;
+	if(settings.log_watchdog)	groups |= LOG_GROUP_WATCHDOG;
+	return groups;
+}
+
+
+static int __write_binary_header(FILE* fd)
+{
+	log_file_header_t h;
+
+	memset(&h, 0, sizeof(h));
+	strcpy(h.magic, LOG_FILE_MAGIC);
+	h.byte_order	= LOG_FILE_BYTE_ORDER;
+	h.version	= LOG_FILE_VERSION;
+	h.header_size	= sizeof(log_file_header_t);
+	h.groups	= __enabled_groups();
+	h.num_rotors	= settings.num_rotors;
+	h.record_size	= log_record_size(h.version, h.groups, h.num_rotors);
+	h.feedback_hz	= settings.feedback_hz;
+	strncpy(h.name, settings.name, sizeof(h.name)-1);
+
+	h.compression	= settings.log_compression;
+	record_size	= h.record_size;
+
+	if(fwrite(&h, sizeof(h), 1, fd)!=1){
+		fprintf(stderr,"ERROR in log_manager, failed to write binary header\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * Each group is a contiguous run of doubles in log_entry_t, so a record is
+ * just the index followed by a memcpy per enabled group. No formatting.
+ *
+ * @return     record length in bytes
+ */
+static size_t __pack_binary_entry(char* buf, const log_entry_t* e)
+{
+	size_t len = 0;
+
+	memcpy(buf, &e->loop_index, 2*sizeof(uint64_t));
+	len += 2*sizeof(uint64_t);
+	if(settings.log_sensors){
+		memcpy(buf+len, &e->v_batt, LOG_SENSORS_COLS*sizeof(double));
+		len += LOG_SENSORS_COLS*sizeof(double);
+	}
+	if(settings.log_state){
+		memcpy(buf+len, &e->roll, LOG_STATE_COLS*sizeof(double));
+		len += LOG_STATE_COLS*sizeof(double);
+	}
+	if(settings.log_setpoint){
+		memcpy(buf+len, &e->sp_roll, LOG_SETPOINT_COLS*sizeof(double));
+		len += LOG_SETPOINT_COLS*sizeof(double);
+	}
+	if(settings.log_control_u){
+		memcpy(buf+len, &e->u_roll, LOG_CONTROL_U_COLS*sizeof(double));
+		len += LOG_CONTROL_U_COLS*sizeof(double);
+	}
+	if(settings.log_motor_signals){
+		memcpy(buf+len, &e->mot_1, settings.num_rotors*sizeof(double));
+		len += settings.num_rotors*sizeof(double);
+	}
+	if(settings.log_timing){
+		memcpy(buf+len, &e->t_setpoint, LOG_TIMING_COLS*sizeof(double));
+		len += LOG_TIMING_COLS*sizeof(double);
+	}
+	if(settings.log_raw){
+		memcpy(buf+len, &e->raw_gyro_x, LOG_RAW_COLS*sizeof(double));
+		len += LOG_RAW_COLS*sizeof(double);
+	}
+	if(settings.log_watchdog){
+		memcpy(buf+len, &e->wd_overruns, LOG_WATCHDOG_COLS*sizeof(double));
+		len += LOG_WATCHDOG_COLS*sizeof(double);
+	}
+	return len;
+}
+
+
+/**
+ * @brief      compresses the staged records into one complete frame and
+ *             writes it out. Frames are independent so everything up to the
+ *             last one written survives a crash.
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __write_frame(FILE* fd)
+{
+	size_t n, ret;
+
+	if(frame_len==0) return 0;
+	if(settings.log_compression==LOG_COMPRESSION_LZ4){
+		// begin, one update and end make a complete frame in packed
+		n = LZ4F_compressBegin(lz4_ctx, packed, packed_cap, &lz4_prefs);
+		if(!LZ4F_isError(n)){
+			ret = LZ4F_compressUpdate(lz4_ctx, packed+n, packed_cap-n,\
+						frame_buf, frame_len, NULL);
+			if(!LZ4F_isError(ret)){
+				n += ret;
+				ret = LZ4F_compressEnd(lz4_ctx, packed+n, packed_cap-n, NULL);
+				n += ret;
 			}
-			fflush(fd);
-			needs_writing = 0;
+			if(LZ4F_isError(ret)) n = ret;
+		}
+		if(LZ4F_isError(n)){
+			fprintf(stderr,"ERROR in log_manager, %s\n", LZ4F_getErrorName(n));
+			frame_len = 0;
+			return -1;
 		}
-		rc_usleep(1000000/LOG_MANAGER_HZ);
 	}
-
-	// if program is exiting or logging got disabled, write out the rest of
-	// the logs that are in the buffer current being filled
-	//printf("writing out remaining log file\n");
-	for(i=0;i<buffer_pos;i++){
-		__write_log_entry(fd, buffer[current_buf][i]);
+	else{
+		n = ZSTD_compressCCtx(zstd_ctx, packed, packed_cap, frame_buf, frame_len, LOG_ZSTD_LEVEL);
+		if(ZSTD_isError(n)){
+			fprintf(stderr,"ERROR in log_manager, %s\n", ZSTD_getErrorName(n));
+			frame_len = 0;
+			return -1;
+		}
+	}
+	frame_len = 0;
+	if(fwrite(packed, n, 1, fd)!=1){
+		fprintf(stderr,"ERROR in log_manager, failed to write compressed frame\n");
+		return -1;
 	}
 	fflush(fd);
-	fclose(fd);
+	atomic_fetch_add_explicit(&bytes_written, n, memory_order_relaxed);
+	return 0;
+}
+
+
+static int __write_binary_entry(FILE* fd, log_entry_t e)
+{
+	char buf[sizeof(log_entry_t)];
+	size_t len;
+
+	if(settings.log_compression==LOG_COMPRESSION_NONE){
+		len = __pack_binary_entry(buf, &e);
+		fwrite(buf, len, 1, fd);
+		atomic_fetch_add_explicit(&bytes_written, len, memory_order_relaxed);
+	}
+	else{
+		if(frame_cap-frame_len<record_size) __write_frame(fd);
+		if(frame_len==0) frame_start_ns = rc_nanos_since_boot();
+		len = __pack_binary_entry(frame_buf+frame_len, &e);
+		frame_len += len;
+	}
+	atomic_fetch_add_explicit(&bytes_raw, len, memory_order_relaxed);
+	return 0;
+}
+
+
+static int __write_header(FILE* fd)
+{
+	if(settings.log_format==LOG_FORMAT_BINARY) return __write_binary_header(fd);
+	return __write_csv_header(fd);
+}
+
+
+static int __write_log_entry(FILE* fd, log_entry_t e)
+{
+	if(settings.log_format==LOG_FORMAT_BINARY) return __write_binary_entry(fd, e);
+	return __write_csv_entry(fd, e);
+}
+
+
+/**
+ * @brief      block until the producer signals new entries, or until the
+ *             timeout passes so the exit condition gets checked regularly.
+ */
+static void __wait_for_entries(void)
+{
+	uint64_t count;
+	struct pollfd pfd = {.fd = wake_fd, .events = POLLIN};
+
+	if(poll(&pfd, 1, 1000/LOG_MANAGER_HZ)>0){
+		if(read(wake_fd, &count, sizeof(count))<0 && errno!=EAGAIN){
+			fprintf(stderr,"ERROR in log_manager, failed to read eventfd\n");
+		}
+	}
+}
+
+
+/**
+ * @brief      number of a log file from its name, -1 if it isn't one
+ */
+static int __log_number(const char* name)
+{
+	int n;
+	char ext[8];
+
+	if(sscanf(name, "%d%7s", &n, ext)!=2 || n<1) return -1;
+	if(strcmp(ext, LOG_CSV_EXT) && strcmp(ext, LOG_BINARY_EXT)) return -1;
+	return n;
+}
+
+
+/**
+ * @brief      finds the existing logs once at start up so new file names
+ *             come from a counter
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __scan_logs(void)
+{
+	DIR* dir;
+	struct dirent* d;
+	struct stat st;
+	int n;
+
+	// first make sure the directory exists, make it if not
+	if(stat(LOG_DIR, &st)==-1 && mkdir(LOG_DIR, 0755)){
+		fprintf(stderr,"ERROR in log_manager, can't create " LOG_DIR "\n");
+		return -1;
+	}
+	dir = opendir(LOG_DIR);
+	if(dir==NULL){
+		fprintf(stderr,"ERROR in log_manager, can't open " LOG_DIR "\n");
+		return -1;
+	}
+	// csv and binary logs share the same numbering
+	next_index = 1;
+	oldest_index = 0;
+	num_logs = 0;
+	while((d = readdir(dir))!=NULL){
+		n = __log_number(d->d_name);
+		if(n<0) continue;
+		num_logs++;
+		if(n>=next_index) next_index = n+1;
+		if(oldest_index==0 || n<oldest_index) oldest_index = n;
+	}
+	closedir(dir);
+	if(oldest_index==0) oldest_index = next_index;
+	return 0;
+}
+
+
+/**
+ * @brief      deletes the oldest logs until there is room for one more
+ */
+static void __rotate_logs(void)
+{
+	char path[100];
+
+	while(num_logs>=MAX_LOG_FILES && oldest_index<next_index){
+		sprintf(path, LOG_DIR "%d" LOG_BINARY_EXT, oldest_index);
+		if(unlink(path)==0) num_logs--;
+		sprintf(path, LOG_DIR "%d" LOG_CSV_EXT, oldest_index);
+		if(unlink(path)==0) num_logs--;
+		oldest_index++;
+	}
+}
+
+
+/**
+ * @brief      creates the next log file, reserves its blocks and writes the
+ *             header
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __prepare_next(void)
+{
+	off_t bytes;
+
+	if(next_fd!=NULL) return 0;
+	__rotate_logs();
+	sprintf(next_path, LOG_DIR "%d%s", next_index,\
+		settings.log_format==LOG_FORMAT_BINARY ? LOG_BINARY_EXT : LOG_CSV_EXT);
+	next_fd = fopen(next_path, "w+");
+	if(next_fd==NULL){
+		// a full or read only card fails every time, say so once
+		if(!open_failed){
+			fprintf(stderr,"ERROR in log_manager, can't open %s for writing, retrying every %ds\n",\
+						next_path, LOG_RETRY_SECONDS);
+		}
+		open_failed = 1;
+		retry_ns = rc_nanos_since_boot() + (uint64_t)LOG_RETRY_SECONDS*1000000000;
+		return -1;
+	}
+	if(open_failed){
+		fprintf(stderr,"log_manager, opened %s, new log files work again\n", next_path);
+		open_failed = 0;
+	}
+	next_index++;
+	num_logs++;
+
+	// reserve the blocks without changing the file size, so readers never
+	// see the unused tail and the filesystem doesn't allocate in flight.
+	// Not every filesystem can, logging works without it.
+	if(settings.log_format==LOG_FORMAT_BINARY){
+		bytes = log_record_size(LOG_FILE_VERSION, __enabled_groups(), settings.num_rotors);
+	}
+	else bytes = LOG_CSV_LINE_BYTES;
+	bytes *= (off_t)LOG_PREALLOC_SECONDS*settings.feedback_hz;
+	if(fallocate(fileno(next_fd), FALLOC_FL_KEEP_SIZE, 0, bytes) &&
+	   errno!=EOPNOTSUPP && !prealloc_warned){
+		fprintf(stderr,"WARNING in log_manager, can't preallocate %s, %s\n", next_path, strerror(errno));
+		prealloc_warned = 1;
+	}
+
+	__write_header(next_fd);
+	fflush(next_fd);
+	return 0;
+}
+
+
+/**
+ * @brief      gives back the preallocated blocks past the end of a finished
+ *             log file and closes it
+ */
+static void __close_file(FILE* f)
+{
+	if(f==NULL) return;
+	fflush(f);
+	// on failure only the unused preallocation is left behind
+	if(ftruncate(fileno(f), ftell(f)) && !truncate_warned){
+		fprintf(stderr,"WARNING in log_manager, can't trim the preallocation of a finished log, %s\n", strerror(errno));
+		truncate_warned = 1;
+	}
+	fclose(f);
+}
+
+
+/**
+ * @brief      finishes the current file and moves on to the prepared one
+ */
+static void __start_segment(void)
+{
+	// with no file to switch to keep writing the current one
+	if(next_fd==NULL && __prepare_next()){
+		if(fd!=NULL){
+			fprintf(stderr,"WARNING in log_manager, no new log file, this segment goes on the end of the previous log\n");
+		}
+		return;
+	}
+	if(fd!=NULL){
+		__write_frame(fd);
+		__close_file(fd);
+	}
+	fd = next_fd;
+	next_fd = NULL;
+	atomic_store(&bytes_raw, 0);
+	atomic_store(&bytes_written, 0);
+}
+
+
+/**
+ * @brief      write the entries before ring index head out to disk
+ */
+static void __drain_to(unsigned int head)
+{
+	unsigned int tail = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+
+	if((int)(head-tail)<=0) return;
+	while(tail!=head){
+		__write_log_entry(fd, ring[tail & ring_mask]);
+		tail++;
+	}
+	// hand the slots back to the producer only once they are staged or
+	// written out
+	atomic_store_explicit(&ring_tail, tail, memory_order_release);
+	if(settings.log_compression==LOG_COMPRESSION_NONE) fflush(fd);
+}
+
+
+/**
+ * @brief      write every entry currently in the ring out to disk, switching
+ *             files at the point a new segment was requested
+ */
+static void __drain_ring(void)
+{
+	unsigned int head = atomic_load_explicit(&ring_head, memory_order_acquire);
+
+	// head was loaded first, so a request made before any entry we are
+	// about to write is already visible here
+	if(atomic_load_explicit(&segment_pending, memory_order_acquire)){
+		__drain_to(atomic_load_explicit(&segment_start, memory_order_relaxed));
+		__start_segment();
+		atomic_store_explicit(&segment_pending, 0, memory_order_release);
+	}
+	__drain_to(head);
+
+	// close the frame once it spans LOG_FRAME_SECONDS, also when entries
+	// stopped coming in, this bounds what a crash can lose
+	if(frame_len>0 && rc_nanos_since_boot()-frame_start_ns>=(uint64_t)(LOG_FRAME_SECONDS*1000000000.0)){
+		__write_frame(fd);
+	}
+}
+
+
+static void* __log_manager_func(__attribute__ ((unused)) void* ptr)
+{
+	rt_setup_thread(RT_THREAD_LOG);
+
+	// while logging enabled and not exiting, write new entries to disk
+	while(rc_get_state()!=EXITING && logging_enabled){
+		__wait_for_entries();
+		__drain_ring();
+		watchdog_print_level_change(stderr);
+		// get the next file ready while there is time, backing off after a
+		// failure
+		if(next_fd==NULL && rc_nanos_since_boot()>=retry_ns) __prepare_next();
+	}
+
+	// if program is exiting or logging got disabled, write out whatever is
+	// left in the ring
+	__drain_ring();
+	__write_frame(fd);
+	__close_file(fd);
+	fd = NULL;
+
+	// the prepared file was never used
+	if(next_fd!=NULL){
+		fclose(next_fd);
+		unlink(next_path);
+		next_fd = NULL;
+		next_index--;
+		num_logs--;
+	}
 
 	// zero out state
 	logging_enabled = 0;
 	num_entries = 0;
-	buffer_pos = 0;
-	current_buf = 0;
-	needs_writing = 0;
 	return NULL;
 }
 
 
-int log_manager_init()
+/**
+ * @brief      number of entries to hold settings.log_buffer_seconds, rounded
+ *             up to a power of 2
+ */
+static uint32_t __ring_entries(void)
 {
-	int i;
-	char path[100];
-	struct stat st = {0};
+	uint32_t len = 1;
+	uint32_t wanted = (uint32_t)(settings.log_buffer_seconds*settings.feedback_hz);
 
-	// if the thread if running, stop before starting a new log file
-	if(logging_enabled){
-		//fprintf(stderr,"ERROR: in start_log_manager, log manager already running.\n");
-		//return -1;
-		log_manager_cleanup();
+	while(len<wanted) len<<=1;
+	return len;
+}
+
+
+/**
+ * @brief      bytes of packed records one compressed frame holds, a frame
+ *             always has room for LOG_FRAME_SECONDS of records
+ */
+static size_t __frame_bytes(void)
+{
+	size_t records = (size_t)(LOG_FRAME_SECONDS*settings.feedback_hz)+1;
+	return records*log_record_size(LOG_FILE_VERSION, __enabled_groups(), settings.num_rotors);
+}
+
+
+/**
+ * @brief      worst case size of one compressed frame
+ */
+static size_t __packed_bytes(void)
+{
+	if(settings.log_compression==LOG_COMPRESSION_LZ4){
+		return LZ4F_compressFrameBound(__frame_bytes(), &lz4_prefs);
 	}
+	return ZSTD_compressBound(__frame_bytes());
+}
 
-	// first make sure the directory exists, make it if not
-	if(stat(LOG_DIR, &st) == -1) {
-		mkdir(LOG_DIR, 0755);
-	}
-
-	// search for existing log files to determine the next number in the series
-	for(i=1;i<=MAX_LOG_FILES+1;i++){
-		memset(&path, 0, sizeof(path));
-		sprintf(path, LOG_DIR "%d.csv", i);
-		// if file exists, move onto the next index
-		if(stat(path, &st)==0) continue;
-		else break;
-	}
-	// limit number of log files
-	if(i==MAX_LOG_FILES+1){
-		fprintf(stderr,"ERROR: log file limit exceeded\n");
-		fprintf(stderr,"delete old log files before continuing\n");
+
+size_t log_manager_reserve_bytes(void)
+{
+	size_t bytes;
+
+	if(!settings.enable_logging) return 0;
+	bytes = __ring_entries()*sizeof(log_entry_t);
+	if(settings.log_compression!=LOG_COMPRESSION_NONE){
+		bytes += __frame_bytes()+__packed_bytes()+2*ARENA_ALIGN;
+	}
+	return bytes;
+}
+
+
+/**
+ * @brief      takes the frame buffers out of the arena and creates the
+ *             compression context, which is reused for every frame
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __compression_reserve(void)
+{
+	size_t ret;
+
+	frame_cap = __frame_bytes();
+	packed_cap = __packed_bytes();
+	frame_buf = (char*)arena_alloc(frame_cap);
+	packed = (char*)arena_alloc(packed_cap);
+	if(frame_buf==NULL || packed==NULL){
+		fprintf(stderr,"ERROR in log_manager, failed to allocate compression buffers\n");
 		return -1;
 	}
-	// create and open new file for writing
-	fd = fopen(path, "w+");
-	if(fd == 0) {
-		printf("ERROR: can't open log file for writing\n");
+	if(settings.log_compression==LOG_COMPRESSION_LZ4){
+		ret = LZ4F_createCompressionContext(&lz4_ctx, LZ4F_VERSION);
+		if(LZ4F_isError(ret)){
+			fprintf(stderr,"ERROR in log_manager, %s\n", LZ4F_getErrorName(ret));
+			return -1;
+		}
+	}
+	else{
+		zstd_ctx = ZSTD_createCCtx();
+		if(zstd_ctx==NULL){
+			fprintf(stderr,"ERROR in log_manager, failed to create zstd context\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+int log_manager_reserve(void)
+{
+	uint32_t len = __ring_entries();
+
+	if(ring!=NULL) return 0;
+	ring = (log_entry_t*)arena_alloc(len*sizeof(log_entry_t));
+	if(ring==NULL){
+		fprintf(stderr,"ERROR in log_manager, failed to allocate ring buffer\n");
+		return -1;
+	}
+	ring_len = len;
+	ring_mask = len-1;
+	if(settings.log_compression!=LOG_COMPRESSION_NONE) return __compression_reserve();
+	return 0;
+}
+
+
+/**
+ * @brief      empty the ring reserved at start up, it is reused between log
+ *             files
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __ring_init(void)
+{
+	if(log_manager_reserve()) return -1;
+	if(__ring_entries()!=ring_len){
+		fprintf(stderr,"ERROR in log_manager, ring size changed after start up\n");
 		return -1;
 	}
+	atomic_store(&ring_head, 0);
+	atomic_store(&ring_tail, 0);
+	atomic_store(&overruns, 0);
+	atomic_store(&high_water, 0);
+	atomic_store(&bytes_raw, 0);
+	atomic_store(&bytes_written, 0);
+	atomic_store(&segment_pending, 0);
+	frame_len = 0;
+	wake_pending = 0;
+	wake_entries = settings.feedback_hz/LOG_MANAGER_HZ;
+	if(wake_entries<1) wake_entries = 1;
 
-	// write header
-	__write_header(fd);
+	if(wake_fd<0){
+		wake_fd = eventfd(0, EFD_NONBLOCK);
+		if(wake_fd<0){
+			fprintf(stderr,"ERROR in log_manager, failed to create eventfd\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+int log_manager_init()
+{
+	if(logging_enabled){
+		fprintf(stderr,"ERROR in log_manager_init, log manager already running\n");
+		return -1;
+	}
+	if(__ring_init()<0) return -1;
+	if(__scan_logs()<0) return -1;
+	open_failed = 0;
+	retry_ns = 0;
+	prealloc_warned = 0;
+	truncate_warned = 0;
 
-	// start thread
+	// the first file is opened here, every later one ahead of time by the
+	// writer thread
+	if(__prepare_next()<0) return -1;
+	__start_segment();
 	logging_enabled = 1;
 	num_entries = 0;
-	buffer_pos = 0;
-	current_buf = 0;
-	needs_writing = 0;
 
 	// start logging thread
 	if(rc_pthread_create(&pthread, __log_manager_func, NULL, SCHED_FIFO, LOG_MANAGER_PRI)<0){
 		fprintf(stderr,"ERROR in start_log_manager, failed to start thread\n");
+		logging_enabled = 0;
 		return -1;
 	}
-	rc_usleep(1000);
+	return 0;
+}
+
+
+int log_manager_new_segment(void)
+{
+	uint64_t one = 1;
+
+	if(!logging_enabled){
+		fprintf(stderr,"ERROR in log_manager_new_segment, log manager not running\n");
+		return -1;
+	}
+	// a request the writer hasn't served yet already starts a fresh file
+	if(atomic_load_explicit(&segment_pending, memory_order_acquire)) return 0;
+	atomic_store_explicit(&segment_start,\
+		atomic_load_explicit(&ring_head, memory_order_relaxed), memory_order_relaxed);
+	atomic_store_explicit(&segment_pending, 1, memory_order_release);
+	num_entries = 0;
+	if(write(wake_fd, &one, sizeof(one))<0){
+		// the writer still picks it up on its next poll timeout
+	}
 	return 0;
 }
 
 static log_entry_t __construct_new_entry()
 {
 	log_entry_t l;
-	l.loop_index	= fstate.loop_index;
-	l.last_step_ns	= fstate.last_step_ns;
-
-	l.v_batt	= state_estimate.v_batt_lp;
-	l.alt_bmp_raw	= state_estimate.alt_bmp_raw;
-	l.gyro_roll	= state_estimate.gyro[0];
-	l.gyro_pitch	= state_estimate.gyro[1];
-	l.gyro_yaw	= state_estimate.gyro[2];
-	l.accel_X	= state_estimate.accel[0];
-	l.accel_Y	= state_estimate.accel[1];
-	l.accel_Z	= state_estimate.accel[2];
-
-	l.roll		= state_estimate.tb_imu[0];
-	l.pitch		= state_estimate.tb_imu[1];
-	l.yaw		= state_estimate.tb_imu[2];
-	l.X		= state_estimate.pos_global[0];
-	l.Y		= state_estimate.pos_global[1];
-	l.Z		= state_estimate.pos_global[2];
-	l.Xdot		= state_estimate.vel_global[0];
-	l.Ydot		= state_estimate.vel_global[1];
-	l.Zdot		= state_estimate.vel_global[2];
-
-	l.sp_roll	= setpoint.roll;
-	l.sp_pitch	= setpoint.pitch;
-	l.sp_yaw	= setpoint.yaw;
-	l.sp_X		= setpoint.X;
-	l.sp_Y		= setpoint.Y;
-	l.sp_Z		= setpoint.Z;
-	l.sp_Xdot	= setpoint.X_dot;
-	l.sp_Ydot	= setpoint.Y_dot;
-	l.sp_Zdot	= setpoint.Z_dot;
-
-	l.u_roll	= fstate.u[VEC_ROLL];
-	l.u_pitch	= fstate.u[VEC_PITCH];
-	l.u_yaw		= fstate.u[VEC_YAW];
-	l.u_X		= fstate.u[VEC_Y];
-	l.u_Y		= fstate.u[VEC_X];
-	l.u_Z		= fstate.u[VEC_Z];
-
-	l.mot_1		= fstate.m[0];
-	l.mot_2		= fstate.m[1];
-	l.mot_3		= fstate.m[2];
-	l.mot_4		= fstate.m[3];
-	l.mot_5		= fstate.m[4];
-	l.mot_6		= fstate.m[5];
-	l.mot_7		= fstate.m[6];
-	l.mot_8		= fstate.m[7];
+	instr_tick_t t;
+	watchdog_stats_t wd;
+	state_estimate_t se;
+	feedback_state_t fs;
+	setpoint_t sp;
+	user_input_t ui;
+
+	// this runs in the IMU callback right after the snapshot was published
+	// so there is no writer to collide with
+	snapshot_get_state_estimate(&se);
+	snapshot_get_fstate(&fs);
+	snapshot_get_setpoint(&sp);
+	setpoint_manager_get_input(&ui);
+
+	l.loop_index	= fs.loop_index;
+	l.last_step_ns	= fs.last_step_ns;
+
+	l.v_batt	= se.v_batt_lp;
+	l.alt_bmp_raw	= se.alt_bmp_raw;
+	l.gyro_roll	= se.gyro[0];
+	l.gyro_pitch	= se.gyro[1];
+	l.gyro_yaw	= se.gyro[2];
+	l.accel_X	= se.accel[0];
+	l.accel_Y	= se.accel[1];
+	l.accel_Z	= se.accel[2];
+
+	l.roll		= se.tb_imu[0];
+	l.pitch		= se.tb_imu[1];
+	l.yaw		= se.tb_imu[2];
+	l.X		= se.pos_global[0];
+	l.Y		= se.pos_global[1];
+	l.Z		= se.pos_global[2];
+	l.Xdot		= se.vel_global[0];
+	l.Ydot		= se.vel_global[1];
+	l.Zdot		= se.vel_global[2];
+
+	l.sp_roll	= sp.roll;
+	l.sp_pitch	= sp.pitch;
+	l.sp_yaw	= sp.yaw;
+	l.sp_X		= sp.X;
+	l.sp_Y		= sp.Y;
+	l.sp_Z		= sp.Z;
+	l.sp_Xdot	= sp.X_dot;
+	l.sp_Ydot	= sp.Y_dot;
+	l.sp_Zdot	= sp.Z_dot;
+
+	l.u_roll	= fs.u[VEC_ROLL];
+	l.u_pitch	= fs.u[VEC_PITCH];
+	l.u_yaw		= fs.u[VEC_YAW];
+	l.u_X		= fs.u[VEC_Y];
+	l.u_Y		= fs.u[VEC_X];
+	l.u_Z		= fs.u[VEC_Z];
+
+	l.mot_1		= fs.m[0];
+	l.mot_2		= fs.m[1];
+	l.mot_3		= fs.m[2];
+	l.mot_4		= fs.m[3];
+	l.mot_5		= fs.m[4];
+	l.mot_6		= fs.m[5];
+	l.mot_7		= fs.m[6];
+	l.mot_8		= fs.m[7];
+	l.mot_9		= fs.m[8];
+	l.mot_10	= fs.m[9];
+	l.mot_11	= fs.m[10];
+	l.mot_12	= fs.m[11];
+
+	instr_get_last_tick(&t);
+	l.t_setpoint	= t.stage_ns[INSTR_SETPOINT]/1000.0;
+	l.t_estimator	= t.stage_ns[INSTR_ESTIMATOR]/1000.0;
+	l.t_feedback	= t.stage_ns[INSTR_FEEDBACK]/1000.0;
+	l.t_log		= t.stage_ns[INSTR_LOG]/1000.0;
+	l.t_after_feedback = t.stage_ns[INSTR_AFTER_FEEDBACK]/1000.0;
+	l.t_isr		= t.total_ns/1000.0;
+	l.t_irq_to_esc	= t.irq_to_esc_ns/1000.0;
+	l.t_period	= t.period_ns/1000.0;
+
+	// the DMP only overwrites mpu_data right before the next callback
+	l.raw_gyro_x	= mpu_data.gyro[0];
+	l.raw_gyro_y	= mpu_data.gyro[1];
+	l.raw_gyro_z	= mpu_data.gyro[2];
+	l.raw_accel_x	= mpu_data.accel[0];
+	l.raw_accel_y	= mpu_data.accel[1];
+	l.raw_accel_z	= mpu_data.accel[2];
+	l.raw_quat_w	= mpu_data.dmp_quat[0];
+	l.raw_quat_x	= mpu_data.dmp_quat[1];
+	l.raw_quat_y	= mpu_data.dmp_quat[2];
+	l.raw_quat_z	= mpu_data.dmp_quat[3];
+	l.raw_v_batt	= se.v_batt_raw;
+	l.batt_count	= se.batt_count;
+	l.bmp_count	= se.bmp_count;
+	l.bmp_pressure	= se.bmp_pressure_raw;
+	l.bmp_alt	= se.alt_bmp_raw;
+	l.bmp_temp	= se.bmp_temp;
+	l.mocap_running	= se.mocap_running;
+	l.mocap_X	= se.pos_mocap[0];
+	l.mocap_Y	= se.pos_mocap[1];
+	l.mocap_Z	= se.pos_mocap[2];
+	l.mocap_count	= se.mocap_count;
+	l.mocap_age	= se.mocap_age;
+	l.in_thr	= ui.thr_stick;
+	l.in_roll	= ui.roll_stick;
+	l.in_pitch	= ui.pitch_stick;
+	l.in_yaw	= ui.yaw_stick;
+	l.in_mode	= ui.flight_mode;
+	l.in_arm	= ui.requested_arm_mode;
+	l.arm_state	= fs.arm_state;
+
+	watchdog_get_stats(&wd);
+	l.wd_overruns	= wd.overruns;
+	l.wd_missed	= wd.missed;
+	l.wd_consecutive = wd.consecutive;
+	l.wd_level	= wd.level;
 
 	return l;
 }
 
 int log_manager_add_new()
 {
+	unsigned int head, tail, fill;
+	uint64_t one = 1;
+
 	if(!logging_enabled){
 		fprintf(stderr,"ERROR: trying to log entry while logger isn't running\n");
 		return -1;
 	}
-	if(needs_writing && buffer_pos >= BUF_LEN){
-		fprintf(stderr,"WARNING: logging buffer full, skipping log entry\n");
+	head = atomic_load_explicit(&ring_head, memory_order_relaxed);
+	tail = atomic_load_explicit(&ring_tail, memory_order_acquire);
+	fill = head-tail;
+	// don't print from here, this runs in the IMU callback. Overruns are
+	// counted and reported when the log is closed.
+	if(fill>=ring_len){
+		atomic_fetch_add_explicit(&overruns, 1, memory_order_relaxed);
 		return -1;
 	}
-	// add to buffer and increment counters
-	buffer[current_buf][buffer_pos] = __construct_new_entry();
-	buffer_pos++;
+	// fill the slot then publish it to the writer
+	ring[head & ring_mask] = __construct_new_entry();
+	atomic_store_explicit(&ring_head, head+1, memory_order_release);
 	num_entries++;
-	// check if we've filled a buffer
-	if(buffer_pos >= BUF_LEN){
-		buffer_pos = 0;		// reset buffer position to 0
-		needs_writing = 1;	// flag the writer to dump to disk
-		// swap buffers
-		if(current_buf==0) current_buf=1;
-		else current_buf=0;
+
+	fill++;
+	if(fill>atomic_load_explicit(&high_water, memory_order_relaxed)){
+		atomic_store_explicit(&high_water, fill, memory_order_relaxed);
+	}
+	// kick the writer every wake_entries, eventfd write never blocks
+	wake_pending++;
+	if(wake_pending>=wake_entries){
+		wake_pending = 0;
+		if(write(wake_fd, &one, sizeof(one))<0){
+			// counter can only saturate if the writer is dead, nothing to do
+		}
 	}
 	return 0;
 }
 
+
+int log_manager_get_stats(log_manager_stats_t* stats)
+{
+	if(stats==NULL){
+		fprintf(stderr,"ERROR in log_manager_get_stats, received NULL pointer\n");
+		return -1;
+	}
+	stats->entries		= num_entries;
+	stats->overruns		= atomic_load_explicit(&overruns, memory_order_relaxed);
+	stats->high_water	= atomic_load_explicit(&high_water, memory_order_relaxed);
+	stats->capacity		= ring_len;
+	stats->bytes_raw	= atomic_load_explicit(&bytes_raw, memory_order_relaxed);
+	stats->bytes_written	= atomic_load_explicit(&bytes_written, memory_order_relaxed);
+	return 0;
+}
+
 int log_manager_cleanup()
 {
 	// just return if not logging
@@ -354,5 +1053,11 @@ int log_manager_cleanup()
 	int ret = rc_pthread_timed_join(pthread,NULL,LOG_MANAGER_TOUT);
 	if(ret==1) fprintf(stderr,"WARNING: log_manager_thread exit timeout\n");
 	else if(ret==-1) fprintf(stderr,"ERROR: failed to join log_manager thread\n");
+
+	uint64_t dropped = atomic_load(&overruns);
+	if(dropped && settings.warnings_en){
+		fprintf(stderr,"WARNING: log_manager dropped %" PRIu64 " entries, ", dropped);
+		fprintf(stderr,"ring high water mark %u of %u\n", atomic_load(&high_water), ring_len);
+	}
 	return ret;
 }
@@ -0,0 +1,214 @@
+/**
+ * @file log_reader.c
+ *
+ * Binary log reader shared by replay and rc_pilot_logconv, see log_reader.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <log_reader.h>
+
+
+/**
+ * @brief      reads and validates the header, files before version 5 end
+ *             before the compression field
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __read_header(log_reader_t* r)
+{
+	log_file_header_t* h = &r->header;
+
+	memset(h, 0, sizeof(log_file_header_t));
+	if(fread(h, LOG_FILE_HEADER_V4_SIZE, 1, r->f)!=1){
+		fprintf(stderr,"ERROR in log_reader, file too short to contain a log header\n");
+		return -1;
+	}
+	if(strncmp(h->magic, LOG_FILE_MAGIC, sizeof(h->magic))!=0){
+		fprintf(stderr,"ERROR in log_reader, not a binary rc_pilot log\n");
+		return -1;
+	}
+	if(h->byte_order!=LOG_FILE_BYTE_ORDER){
+		fprintf(stderr,"ERROR in log_reader, log was written on a machine with different endianness\n");
+		return -1;
+	}
+	if(h->version>LOG_FILE_VERSION){
+		fprintf(stderr,"ERROR in log_reader, log version %d is newer than this build (%d)\n",\
+						h->version, LOG_FILE_VERSION);
+		return -1;
+	}
+	if(h->version>=5){
+		if(h->header_size<sizeof(log_file_header_t) ||
+		   fread(&h->compression, sizeof(h->compression), 1, r->f)!=1){
+			fprintf(stderr,"ERROR in log_reader, truncated log header\n");
+			return -1;
+		}
+	}
+	if(h->num_rotors>LOG_MAX_MOTOR_COLS){
+		fprintf(stderr,"ERROR in log_reader, log claims %d rotors, max is %d\n",\
+						h->num_rotors, LOG_MAX_MOTOR_COLS);
+		return -1;
+	}
+	if(h->record_size!=log_record_size(h->version, h->groups, h->num_rotors)){
+		fprintf(stderr,"ERROR in log_reader, record size in header does not match enabled groups\n");
+		return -1;
+	}
+	if(h->compression>LOG_COMPRESSION_ZSTD){
+		fprintf(stderr,"ERROR in log_reader, unknown compression %d\n", h->compression);
+		return -1;
+	}
+	// skip over any header fields added by newer minor revisions
+	if(fseek(r->f, h->header_size, SEEK_SET)){
+		fprintf(stderr,"ERROR in log_reader, failed to seek past header\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      adds decompressed bytes to the out buffer, keeping what is left
+ *             of a partly returned record at the front
+ *
+ * @return     1 if bytes were added, 0 at the end of the file, -1 on error
+ */
+static int __fill(log_reader_t* r)
+{
+	size_t src, dst, ret;
+	ZSTD_inBuffer ib;
+	ZSTD_outBuffer ob;
+
+	if(r->out_pos>0){
+		memmove(r->out, r->out+r->out_pos, r->out_len-r->out_pos);
+		r->out_len -= r->out_pos;
+		r->out_pos = 0;
+	}
+
+	if(r->header.compression==LOG_COMPRESSION_NONE){
+		dst = fread(r->out+r->out_len, 1, LOG_READER_BYTES-r->out_len, r->f);
+		r->out_len += dst;
+		if(dst>0) return 1;
+		if(ferror(r->f)) goto read_error;
+		return 0;
+	}
+
+	// a call may consume input without producing output, eg a frame
+	// header, so keep going until something comes out or the file ends
+	while(1){
+		if(r->in_pos==r->in_len){
+			r->in_len = fread(r->in, 1, LOG_READER_BYTES, r->f);
+			r->in_pos = 0;
+			if(r->in_len==0){
+				if(ferror(r->f)) goto read_error;
+				return 0;
+			}
+		}
+		src = r->in_len-r->in_pos;
+		dst = LOG_READER_BYTES-r->out_len;
+		if(r->header.compression==LOG_COMPRESSION_LZ4){
+			ret = LZ4F_decompress(r->lz4, r->out+r->out_len, &dst,\
+						r->in+r->in_pos, &src, NULL);
+			if(LZ4F_isError(ret)){
+				fprintf(stderr,"ERROR in log_reader, %s\n", LZ4F_getErrorName(ret));
+				return -1;
+			}
+		}
+		else{
+			ib.src = r->in;
+			ib.size = r->in_len;
+			ib.pos = r->in_pos;
+			ob.dst = r->out;
+			ob.size = LOG_READER_BYTES;
+			ob.pos = r->out_len;
+			ret = ZSTD_decompressStream(r->zstd, &ob, &ib);
+			if(ZSTD_isError(ret)){
+				fprintf(stderr,"ERROR in log_reader, %s\n", ZSTD_getErrorName(ret));
+				return -1;
+			}
+			src = ib.pos-r->in_pos;
+			dst = ob.pos-r->out_len;
+		}
+		r->frame_hint = ret;
+		r->in_pos += src;
+		r->out_len += dst;
+		if(dst>0) return 1;
+	}
+
+read_error:
+	fprintf(stderr,"ERROR in log_reader, failed to read log\n");
+	return -1;
+}
+
+
+int log_reader_open(log_reader_t* r, const char* path)
+{
+	size_t ret;
+
+	r->lz4 = NULL;
+	r->zstd = NULL;
+	r->frame_hint = 0;
+	r->in_len = r->in_pos = 0;
+	r->out_len = r->out_pos = 0;
+	r->f = fopen(path, "rb");
+	if(r->f==NULL){
+		fprintf(stderr,"ERROR in log_reader, can't open %s\n", path);
+		return -1;
+	}
+	if(__read_header(r)) goto fail;
+
+	if(r->header.compression==LOG_COMPRESSION_LZ4){
+		ret = LZ4F_createDecompressionContext(&r->lz4, LZ4F_VERSION);
+		if(LZ4F_isError(ret)){
+			fprintf(stderr,"ERROR in log_reader, %s\n", LZ4F_getErrorName(ret));
+			r->lz4 = NULL;
+			goto fail;
+		}
+	}
+	else if(r->header.compression==LOG_COMPRESSION_ZSTD){
+		r->zstd = ZSTD_createDStream();
+		if(r->zstd==NULL || ZSTD_isError(ZSTD_initDStream(r->zstd))){
+			fprintf(stderr,"ERROR in log_reader, failed to create zstd stream\n");
+			goto fail;
+		}
+	}
+	return 0;
+
+fail:
+	log_reader_close(r);
+	return -1;
+}
+
+
+int log_reader_read(log_reader_t* r, void* rec)
+{
+	size_t size = r->header.record_size;
+	int ret;
+
+	while(r->out_len-r->out_pos<size){
+		ret = __fill(r);
+		if(ret<0) return -1;
+		if(ret==0){
+			// what a crash mid flight leaves behind, everything up to
+			// the last complete frame is still good
+			if(r->out_len>r->out_pos || r->frame_hint!=0){
+				fprintf(stderr,"WARNING in log_reader, log ends with an incomplete record\n");
+			}
+			return 0;
+		}
+	}
+	memcpy(rec, r->out+r->out_pos, size);
+	r->out_pos += size;
+	return 1;
+}
+
+
+void log_reader_close(log_reader_t* r)
+{
+	if(r->lz4!=NULL) LZ4F_freeDecompressionContext(r->lz4);
+	if(r->zstd!=NULL) ZSTD_freeDStream(r->zstd);
+	if(r->f!=NULL) fclose(r->f);
+	r->lz4 = NULL;
+	r->zstd = NULL;
+	r->f = NULL;
+}
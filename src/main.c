@@ -6,6 +6,7 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <stdlib.h>
 #include <getopt.h>
 
 #include <rc/start_stop.h>
@@ -24,9 +25,25 @@
 #include <mix.h>
 #include <input_manager.h>
 #include <setpoint_manager.h>
+#include <trajectory.h>
 #include <state_estimator.h>
 #include <log_manager.h>
 #include <printf_manager.h>
+#include <bmp_manager.h>
+#include <batt_manager.h>
+#include <snapshot.h>
+#include <telemetry_manager.h>
+#include <shm_export.h>
+#include <mavlink_manager.h>
+#include <instrumentation.h>
+#include <scheduler.h>
+#include <watchdog.h>
+#include <rt_setup.h>
+#include <arena.h>
+#include <hal.h>
+#include <sim.h>
+#include <replay.h>
+#include <startup.h>
 
 #define FAIL(str) \
 fprintf(stderr, str); \
@@ -39,6 +56,11 @@ void print_usage()
 	printf("\n");
 	printf(" Options\n");
 	printf(" -s {settings file} Specify settings file to use\n");
+	printf(" --sim[=seconds]    Fly a scripted flight against a simulated\n");
+	printf("                    vehicle as fast as possible, no hardware\n");
+	printf(" --replay {log}     Rerun a binary log recorded with log_raw\n");
+	printf("                    through the controllers in the settings\n");
+	printf("                    file and compare the motor signals\n");
 	printf(" -h                 Print this help message\n");
 	printf("\n");
 	printf("Some example settings files are included with the\n");
@@ -91,19 +113,250 @@ void on_pause_press()
 	return;
 }
 
+/**
+ * Start up phases of the hardware path, indices into the table in main()
+ */
+typedef enum init_phase_t{
+	INIT_THRUST_MAP,
+	INIT_MIX,
+	INIT_SETPOINT,
+	INIT_TRAJECTORY,
+	INIT_SERVO,
+	INIT_ADC,
+	INIT_INPUT,
+	INIT_BUTTON,
+	INIT_LOG,
+	INIT_BMP,
+	INIT_BATT,
+	INIT_ESTIMATOR,
+	INIT_FEEDBACK,
+	INIT_MAVLINK,
+	INIT_IMU,
+	INIT_DMP_SETTLE,
+	INIT_PID_FILE,
+	INIT_SHM,
+	INIT_NUM_PHASES
+} init_phase_t;
+
+static int __init_thrust_map(void)
+{
+	return thrust_map_init(settings.thrust_map);
+}
+
+static int __init_mix(void)
+{
+	return mix_init(settings.layout);
+}
+
+static int __init_button(void)
+{
+	// assign functions to be called when button events occur
+	if(rc_button_init(RC_BTN_PIN_PAUSE, RC_BTN_POLARITY_NORM_HIGH,
+						RC_BTN_DEBOUNCE_DEFAULT_US)){
+		return -1;
+	}
+	rc_button_set_callbacks(RC_BTN_PIN_PAUSE,on_pause_press,NULL);
+	return 0;
+}
+
+static int __init_bmp(void)
+{
+	if(rc_bmp_init(BMP_OVERSAMPLE_16, BMP_FILTER_16)) return -1;
+	return bmp_manager_init();
+}
+
+static int __init_imu(void)
+{
+	return hal_imu_init(&mpu_data);
+}
+
+static int __init_dmp_settle(void)
+{
+	return startup_wait_dmp_settled(&mpu_data);
+}
+
+static int __init_pid_file(void)
+{
+	return (rc_make_pid_file()!=0) ? -1 : 0;
+}
+
 /**
  * @brief      Interrupt service routine for IMU
  *
- * This is called every time the Invensense IMU has new data
+ * This is called every time the Invensense IMU has new data. The tasks due
+ * this tick are run from the scheduler's table and each one is timed into
+ * the instrumentation histograms.
  */
 static void __imu_isr(void)
 {
+	static int rt_thread_set = 0;
+
+	// the callback thread belongs to the HAL backend, set it up from the
+	// inside on the first tick
+	if(!rt_thread_set){
+		rt_setup_thread(RT_THREAD_IMU);
+		arena_watch_thread();
+		rt_thread_set = 1;
+	}
 	//printf("imu interupt...\n");
-	setpoint_manager_update();
-	state_estimator_march();
-	feedback_march();
-	if(settings.enable_logging) log_manager_add_new();
-	state_estimator_jobs_after_feedback();
+	instr_tick_begin();
+	scheduler_tick();
+	instr_tick_end();
+	watchdog_tick();
+}
+
+
+/**
+ * @brief      Software in the loop flight. Sets up only the modules the IMU
+ *             callback needs, flies one scripted flight against the sim
+ *             backend and reports how it went.
+ *
+ * @param[in]  seconds  simulated flight duration
+ *
+ * @return     0 if the flight completed without crashing, -1 otherwise
+ */
+static int __sim_main(double seconds)
+{
+	sim_result_t result;
+	int ret;
+
+	if(thrust_map_init(settings.thrust_map)<0){
+		fprintf(stderr,"ERROR: failed to initialize thrust map\n");
+		return -1;
+	}
+	if(mix_init(settings.layout)<0){
+		fprintf(stderr,"ERROR: failed to initialize mixing matrix\n");
+		return -1;
+	}
+	if(setpoint_manager_init()<0){
+		fprintf(stderr,"ERROR: failed to initialize setpoint_manager\n");
+		return -1;
+	}
+	if(trajectory_init()<0){
+		fprintf(stderr,"ERROR: failed to load trajectory\n");
+		return -1;
+	}
+	if(hal_imu_init(&mpu_data)<0){
+		fprintf(stderr,"ERROR: failed to start simulated IMU\n");
+		return -1;
+	}
+	if(bmp_manager_init()<0){
+		fprintf(stderr,"ERROR: failed to start barometer\n");
+		return -1;
+	}
+	if(batt_manager_init()<0){
+		fprintf(stderr,"ERROR: failed to start battery sampling\n");
+		return -1;
+	}
+	if(state_estimator_init()<0){
+		fprintf(stderr,"ERROR: failed to init state_estimator\n");
+		return -1;
+	}
+	if(feedback_init()<0){
+		fprintf(stderr,"ERROR: failed to init feedback controller\n");
+		return -1;
+	}
+	if(settings.enable_logging && log_manager_init()<0){
+		fprintf(stderr,"ERROR: failed to initialize log manager\n");
+		return -1;
+	}
+	feedback_disarm();
+	hal_imu_set_callback(__imu_isr);
+
+	printf("flying %.1fs simulated flight in %s\n", seconds, settings.name);
+	arena_freeze();
+	rc_set_state(RUNNING);
+	ret = sim_run(seconds, &result);
+	rc_set_state(EXITING);
+
+	hal_imu_power_off();
+	bmp_manager_cleanup();
+	batt_manager_cleanup();
+	feedback_cleanup();
+	setpoint_manager_cleanup();
+	log_manager_cleanup();
+	hal_cleanup();
+
+	if(ret) return -1;
+	instr_print_report(stdout);
+	arena_print_report(stdout);
+	sim_print_result(stdout, &result);
+	return result.crashed ? -1 : 0;
+}
+
+
+/**
+ * @brief      Reruns a recorded flight through the estimator and controllers
+ *             of the loaded settings file and reports how far the motor
+ *             signals are from the recorded ones.
+ *
+ * @param[in]  path  binary log recorded with log_raw enabled
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __replay_main(const char* path)
+{
+	replay_result_t result;
+	int ret;
+
+	// arming would start a new log of the replay
+	settings.enable_logging = 0;
+
+	if(thrust_map_init(settings.thrust_map)<0){
+		fprintf(stderr,"ERROR: failed to initialize thrust map\n");
+		return -1;
+	}
+	if(mix_init(settings.layout)<0){
+		fprintf(stderr,"ERROR: failed to initialize mixing matrix\n");
+		return -1;
+	}
+	if(setpoint_manager_init()<0){
+		fprintf(stderr,"ERROR: failed to initialize setpoint_manager\n");
+		return -1;
+	}
+	if(trajectory_init()<0){
+		fprintf(stderr,"ERROR: failed to load trajectory\n");
+		return -1;
+	}
+	if(hal_imu_init(&mpu_data)<0){
+		fprintf(stderr,"ERROR: failed to load replayed IMU\n");
+		return -1;
+	}
+	if(bmp_manager_init()<0){
+		fprintf(stderr,"ERROR: failed to start barometer\n");
+		return -1;
+	}
+	if(batt_manager_init()<0){
+		fprintf(stderr,"ERROR: failed to start battery sampling\n");
+		return -1;
+	}
+	if(state_estimator_init()<0){
+		fprintf(stderr,"ERROR: failed to init state_estimator\n");
+		return -1;
+	}
+	if(feedback_init()<0){
+		fprintf(stderr,"ERROR: failed to init feedback controller\n");
+		return -1;
+	}
+	feedback_disarm();
+
+	printf("replaying %s with %s\n", path, settings.name);
+	arena_freeze();
+	rc_set_state(RUNNING);
+	ret = replay_run(&result);
+	rc_set_state(EXITING);
+
+	hal_imu_power_off();
+	bmp_manager_cleanup();
+	batt_manager_cleanup();
+	feedback_cleanup();
+	setpoint_manager_cleanup();
+	hal_cleanup();
+	replay_close();
+
+	if(ret) return -1;
+	replay_print_result(stdout, &result);
+	return 0;
 }
 
 
@@ -118,11 +371,37 @@ int main(int argc, char *argv[])
 
 	int c;
 	char* settings_file_path = NULL;
+	int sim = 0;
+	double sim_seconds = SIM_DEFAULT_SECONDS;
+	char* replay_path = NULL;
+	static const struct option long_options[] = {
+		{"sim",		optional_argument,	NULL,	'S'},
+		{"replay",	required_argument,	NULL,	'R'},
+		{0,		0,			0,	0}
+	};
 
 	// parse arguments
 	opterr = 0;
-	while ((c = getopt(argc, argv, "s:h")) != -1){
+	while ((c = getopt_long(argc, argv, "s:h", long_options, NULL)) != -1){
 		switch (c){
+		// software in the loop mode
+		case 'S':
+			sim = 1;
+			if(optarg!=NULL){
+				sim_seconds = atof(optarg);
+				if(sim_seconds<=0.0){
+					printf("\nInvalid sim duration\n");
+					print_usage();
+					return -1;
+				}
+			}
+			break;
+
+		// log replay mode
+		case 'R':
+			replay_path = optarg;
+			break;
+
 		// settings file option
 		case 's':
 			settings_file_path=optarg;
@@ -146,6 +425,14 @@ int main(int argc, char *argv[])
 		print_usage();
 		return -1;
 	}
+	if(sim && replay_path!=NULL){
+		printf("\n--sim and --replay can't be used together\n");
+		print_usage();
+		return -1;
+	}
+
+	// start up is timed from here
+	startup_begin();
 
 	// first things first, load settings which may be used during startup
 	if(settings_load_from_file(settings_file_path)<0){
@@ -153,6 +440,31 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 	printf("Loaded settings: %s\n", settings.name);
+	instr_set_loop_hz(settings.feedback_hz);
+	if(scheduler_init()<0){
+		fprintf(stderr,"ERROR: failed to set up the task table\n");
+		return -1;
+	}
+	scheduler_print(stdout);
+
+	// every long lived buffer comes out of one block sized here, nothing is
+	// allocated after the arena is frozen before RUNNING
+	if(arena_init(ARENA_BASE_BYTES+log_manager_reserve_bytes())<0){
+		fprintf(stderr,"ERROR: failed to allocate memory arena\n");
+		return -1;
+	}
+	if(settings.enable_logging && log_manager_reserve()<0) return -1;
+
+	// the replayed log has to be open before the backend can serve reads
+	if(replay_path!=NULL && replay_open(replay_path)<0) return -1;
+
+	// everything in the control path talks to hardware through the HAL
+	if(hal_init(sim ? HAL_SIM : replay_path!=NULL ? HAL_REPLAY : HAL_RC)<0){
+		fprintf(stderr,"ERROR: failed to initialize HAL\n");
+		return -1;
+	}
+	if(sim) return __sim_main(sim_seconds);
+	if(replay_path!=NULL) return __replay_main(replay_path);
 
 	// before touching hardware, make sure another instance isn't running
 	// return value -3 means a root process is running and we need more
@@ -191,28 +503,10 @@ int main(int argc, char *argv[])
 		FAIL("WARNING, can't set CPU governor, need to run as root\n")
 	}
 
-	// do initialization not involving threads
-	printf("initializing thrust map\n");
-	if(thrust_map_init(settings.thrust_map)<0){
-		FAIL("ERROR: failed to initialize thrust map\n")
-	}
-	printf("initializing mixing matrix\n");
-	if(mix_init(settings.layout)<0){
-		FAIL("ERROR: failed to initialize mixing matrix\n")
-	}
-	printf("initializing setpoint_manager\n");
-	if(setpoint_manager_init()<0){
-		FAIL("ERROR: failed to initialize setpoint_manager\n")
-	}
-
-	// initialize cape hardware, this prints an error itself if unsuccessful
-	printf("initializing servos\n");
-	if(rc_servo_init()==-1){
-		FAIL("ERROR: failed to initialize servos, probably need to run as root\n")
-	}
-	printf("initializing adc\n");
-	if(rc_adc_init()==-1){
-		FAIL("ERROR: failed to initialize ADC")
+	// lock memory and prefault before any thread is started
+	printf("initializing real time setup\n");
+	if(rt_setup_init()<0){
+		FAIL("ERROR: failed to complete real time setup\n")
 	}
 
 	// start signal handler so threads can exit cleanly
@@ -221,81 +515,63 @@ int main(int argc, char *argv[])
 		FAIL("ERROR: failed to complete rc_enable_signal_handler\n")
 	}
 
-	// start threads
-	printf("initializing DSM and input_manager\n");
-	if(input_manager_init()<0){
-		FAIL("ERROR: failed to initialize input_manager\n")
-	}
-
-	// initialize buttons and Assign functions to be called when button
-	// events occur
-	if(rc_button_init(RC_BTN_PIN_PAUSE, RC_BTN_POLARITY_NORM_HIGH,
-						RC_BTN_DEBOUNCE_DEFAULT_US)){
-		FAIL("ERROR: failed to init buttons\n")
-	}
-	rc_button_set_callbacks(RC_BTN_PIN_PAUSE,on_pause_press,NULL);
-
-	// initialize log_manager if enabled in settings
-	if(settings.enable_logging){
-		printf("initializing log manager");
-		if(log_manager_init()<0){
-			FAIL("ERROR: failed to initialize log manager\n")
-		}
-	}
-
-	// start barometer, must do before starting state estimator
-	printf("initializing Barometer\n");
-	if(rc_bmp_init(BMP_OVERSAMPLE_16, BMP_FILTER_16)){
-		FAIL("ERROR: failed to initialize barometer\n")
-	}
-
-	// set up state estimator
-	printf("initializing state_estimator\n");
-	if(state_estimator_init()<0){
-		FAIL("ERROR: failed to init state_estimator")
-	}
-
-	// set up feedback controller
-	printf("initializing feedback controller\n");
-	if(feedback_init()<0){
-		FAIL("ERROR: failed to init feedback controller")
-	}
-
-	// start the IMU
-	rc_mpu_config_t mpu_conf = rc_mpu_default_config();
-	mpu_conf.i2c_bus = I2C_BUS;
-    mpu_conf.gpio_interrupt_pin_chip = GPIO_INT_PIN_CHIP;
-    mpu_conf.gpio_interrupt_pin = GPIO_INT_PIN_PIN;
-	mpu_conf.dmp_sample_rate = FEEDBACK_HZ;
-	mpu_conf.dmp_fetch_accel_gyro = 1;
-	//mpu_conf.orient = ORIENTATION_Z_UP;
-	mpu_conf.dmp_interrupt_sched_policy = SCHED_FIFO;
-	mpu_conf.dmp_interrupt_priority = IMU_PRIORITY;
-
-	// optionally enbale magnetometer
-	mpu_conf.enable_magnetometer = settings.enable_magnetometer;
-
-	// now set up the imu for dmp interrupt operation
-	printf("initializing MPU\n");
-	if(rc_mpu_initialize_dmp(&mpu_data, mpu_conf)){
-		fprintf(stderr,"ERROR: failed to start MPU DMP\n");
-		return -1;
-	}
-
-	// final setup
-	if(rc_make_pid_file()!=0){
-		FAIL("ERROR: failed to make a PID file\n")
+	// Everything else starts as soon as what it needs is up, independent
+	// hardware in parallel. The barometer and the MPU share an I2C bus, the
+	// state estimator starts from the first barometer and battery readings
+	// and the mavlink manager hands gains to feedback and missions to the
+	// trajectory.
+	const startup_phase_t phases[INIT_NUM_PHASES] = {
+	[INIT_THRUST_MAP]	= {"thrust map",	__init_thrust_map,	0, 1},
+	[INIT_MIX]		= {"mixing matrix",	__init_mix,		0, 1},
+	[INIT_SETPOINT]		= {"setpoint manager",	setpoint_manager_init,	0, 1},
+	[INIT_TRAJECTORY]	= {"trajectory",	trajectory_init,	0, 1},
+	[INIT_SERVO]		= {"servos",		rc_servo_init,		0, 1},
+	[INIT_ADC]		= {"adc",		rc_adc_init,		0, 1},
+	[INIT_INPUT]		= {"dsm input manager",	input_manager_init,	0, 1},
+	[INIT_BUTTON]		= {"buttons",		__init_button,		0, 1},
+	[INIT_LOG]		= {"log manager",	log_manager_init,	0, settings.enable_logging},
+	[INIT_BMP]		= {"barometer",		__init_bmp,		0, 1},
+	[INIT_BATT]		= {"battery",		batt_manager_init,
+					STARTUP_AFTER(INIT_ADC), 1},
+	[INIT_ESTIMATOR]	= {"state estimator",	state_estimator_init,
+					STARTUP_AFTER(INIT_BMP) | STARTUP_AFTER(INIT_BATT), 1},
+	[INIT_FEEDBACK]		= {"feedback controller", feedback_init,
+					STARTUP_AFTER(INIT_MIX) | STARTUP_AFTER(INIT_THRUST_MAP), 1},
+	[INIT_MAVLINK]		= {"mavlink manager",	mavlink_manager_init,
+					STARTUP_AFTER(INIT_FEEDBACK) | STARTUP_AFTER(INIT_ESTIMATOR) |
+					STARTUP_AFTER(INIT_TRAJECTORY), settings.enable_mavlink_input},
+	[INIT_IMU]		= {"mpu",		__init_imu,
+					STARTUP_AFTER(INIT_BMP), 1},
+	[INIT_DMP_SETTLE]	= {"dmp settle",	__init_dmp_settle,
+					STARTUP_AFTER(INIT_IMU), settings.imu_mode==IMU_MODE_DMP},
+	[INIT_PID_FILE]		= {"pid file",		__init_pid_file,	0, 1},
+	[INIT_SHM]		= {"shared memory export", shm_export_init,	0, settings.enable_shm_export}
+	};
+	printf("starting up...\n");
+	fflush(stdout);
+	if(startup_run(phases, INIT_NUM_PHASES)<0){
+		FAIL("ERROR: start up failed\n")
 	}
 
 	// make sure everything is disarmed them start the ISR
 	feedback_disarm();
-	printf("waiting for dmp to settle...\n");
-	fflush(stdout);
-	rc_usleep(3000000);
-	if(rc_mpu_set_dmp_callback(__imu_isr)!=0){
+	if(watchdog_init()<0){
+		FAIL("ERROR: failed to start deadline watchdog\n")
+	}
+	if(hal_imu_set_callback(__imu_isr)!=0){
 		FAIL("ERROR: failed to set dmp callback function\n")
 	}
 
+	// start streaming telemetry to the ground station if enabled
+	if(settings.enable_telemetry){
+		printf("initializing telemetry manager\n");
+		if(telemetry_manager_init()<0){
+			FAIL("ERROR: failed to initialize telemetry_manager\n")
+		}
+	}
+	startup_mark_armable();
+	startup_print_report(stdout);
+
 	// start printf_thread if running from a terminal
 	// if it was started as a background process then don't bother	
 	
@@ -307,21 +583,37 @@ int main(int argc, char *argv[])
 	}
 
 	// set state to running and chill until something exits the program
+	rt_setup_mark();
+	arena_freeze();
 	rc_set_state(RUNNING);
 	while(rc_get_state()!=EXITING){
 		usleep(50000);
 	}
+	// while the threads are still around to be asked
+	rt_setup_print_report(stdout);
 
 	// some of these, like printf_manager and log_manager, have cleanup
 	// functions that can be called even if not being used. So just call all
 	// cleanup functions here.
 	printf("cleaning up\n");
-	rc_mpu_power_off();
+	hal_imu_power_off();
+	bmp_manager_cleanup();
+	batt_manager_cleanup();
 	feedback_cleanup();
 	input_manager_cleanup();
 	setpoint_manager_cleanup();
 	printf_cleanup();
+	telemetry_manager_cleanup();
+	shm_export_cleanup();
+	if(settings.enable_mavlink_input) mavlink_manager_cleanup();
 	log_manager_cleanup();
+	hal_cleanup();
+
+	// report where the time went in the IMU callback and the input lag
+	instr_print_report(stdout);
+	instr_print_histogram(stdout, INSTR_RX_TO_ESC);
+	watchdog_print_report(stdout);
+	arena_print_report(stdout);
 
 	// turn off red LED and blink green to say shut down was safe
 	rc_led_set(RC_LED_RED,0);
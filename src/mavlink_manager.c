@@ -6,60 +6,344 @@
 
 
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <rc/mavlink_udp.h>
 #include <rc/math/quaternion.h>
-#include <rc/time.h>
 #include <mavlink_manager.h>
 #include <settings.h>
 #include <state_estimator.h>
+#include <feedback.h>
+#include <controller.h>
+#include <trajectory.h>
+#include <hal.h>
 
 #define LOCALHOST_IP	"127.0.0.1"
 #define DEFAULT_SYS_ID	1
 
+/**
+ * one tunable number, points into the description of its controller
+ */
+typedef struct param_t{
+	char id[MAVLINK_PARAM_ID_LEN+1];
+	feedback_ctrl_t ctrl;
+	double* value;
+} param_t;
+
+static const char* const ctrl_prefix[FEEDBACK_NUM_CTRL] = {
+	[FEEDBACK_CTRL_ROLL]	= "ROLL",
+	[FEEDBACK_CTRL_PITCH]	= "PITCH",
+	[FEEDBACK_CTRL_YAW]	= "YAW",
+	[FEEDBACK_CTRL_ALT]	= "ALT"
+};
+
+// only touched by the rc_mav listening thread the callbacks run in
+static controller_spec_t spec[FEEDBACK_NUM_CTRL];
+static param_t params[MAVLINK_MAX_PARAMS];
+static int num_params = 0;
+
+// mission upload in progress, also only touched by the listening thread
+static traj_waypoint_t mission[TRAJECTORY_MAX_WAYPOINTS];
+static int mission_count = 0;
+static int mission_next = 0;
+static uint8_t mission_sys, mission_comp;	// who is uploading
+
 
 
 static void __callback_func_mocap(void)
 {
+	static uint64_t count = 0;
 	int i;
 	mavlink_att_pos_mocap_t data;
+	mocap_sample_t s;
 
 	if(rc_mav_get_att_pos_mocap(&data)<0){
 		fprintf(stderr, "ERROR in mavlink manager, problem fetching att_pos_mocal packet\n");
 		return;
 	}
 
-	// check if position is 0 0 0 which indicates mocap system is alive but
-	// has lost visual contact on the object
-	if(fabs(data.x)<0.0001 && fabs(data.y)<0.0001 && fabs(data.z)<0.0001){
-		if(state_estimate.mocap_running==1){
-			state_estimate.mocap_running=0;
-			if(settings.warnings_en){
-				fprintf(stderr,"WARNING, MOCAP LOST VISUAL\n");
-			}
+	// mark timestamp first, the estimator works out when the pose was
+	// measured from it. A position of 0 0 0 which indicates mocap system
+	// is alive but has lost visual contact is handed on as is.
+	s.timestamp_ns = hal_time_ns();
+	for(i=0;i<4;i++) s.quat[i]=(double)data.q[i];
+	// normalize quaternion because we don't trust the mocap system
+	rc_quaternion_norm_array(s.quat);
+	// calculate tait bryan angles too
+	rc_quaternion_to_tb_array(s.quat, s.tb);
+	// position
+	s.pos[0]=(double)data.x;
+	s.pos[1]=(double)data.y;
+	s.pos[2]=(double)data.z;
+	s.count = ++count;
+	state_estimator_publish_mocap(&s);
+	return;
+}
+
+
+
+static void __add_param(feedback_ctrl_t ctrl, const char* name, int i, double* value)
+{
+	param_t* p = &params[num_params++];
+
+	if(i<0) snprintf(p->id, sizeof(p->id), "%s_%s", ctrl_prefix[ctrl], name);
+	else snprintf(p->id, sizeof(p->id), "%s_%s%d", ctrl_prefix[ctrl], name, i);
+	p->ctrl = ctrl;
+	p->value = value;
+}
+
+/**
+ * @brief      lists every number the description of each controller is made
+ *             of, eg ROLL_KP for a PID or ALT_NUM0 for a transfer function
+ */
+static void __build_param_table(void)
+{
+	controller_spec_t* s;
+	int i, j;
+
+	spec[FEEDBACK_CTRL_ROLL]	= settings.roll_controller_spec;
+	spec[FEEDBACK_CTRL_PITCH]	= settings.pitch_controller_spec;
+	spec[FEEDBACK_CTRL_YAW]		= settings.yaw_controller_spec;
+	spec[FEEDBACK_CTRL_ALT]		= settings.altitude_controller_spec;
+
+	num_params = 0;
+	for(i=0;i<FEEDBACK_NUM_CTRL;i++){
+		s = &spec[i];
+		__add_param(i, "GAIN", -1, &s->gain);
+		if(s->pid){
+			__add_param(i, "KP", -1, &s->kp);
+			__add_param(i, "KI", -1, &s->ki);
+			__add_param(i, "KD", -1, &s->kd);
 		}
 		else{
-			state_estimate.is_active=0;
+			for(j=0;j<s->num_len;j++) __add_param(i, "NUM", j, &s->num[j]);
+			for(j=0;j<s->den_len;j++) __add_param(i, "DEN", j, &s->den[j]);
 		}
+		if(s->pid || s->continuous) __add_param(i, "FC", -1, &s->crossover_freq);
+	}
+	return;
+}
+
+/**
+ * @brief      finds a parameter by the id from a PARAM_SET or
+ *             PARAM_REQUEST_READ, which is only terminated if shorter than
+ *             16 characters
+ *
+ * @return     index into params or -1 if not found
+ */
+static int __find_param(const char* id)
+{
+	int i;
+	for(i=0;i<num_params;i++){
+		if(strncmp(params[i].id, id, MAVLINK_PARAM_ID_LEN)==0) return i;
+	}
+	return -1;
+}
+
+static void __send_param(int i)
+{
+	mavlink_message_t msg;
+
+	mavlink_msg_param_value_pack(settings.my_sys_id, MAV_COMP_ID_AUTOPILOT1, &msg,
+				params[i].id, (float)*params[i].value,
+				MAV_PARAM_TYPE_REAL32, num_params, i);
+	if(rc_mav_send_msg(msg)<0){
+		fprintf(stderr, "ERROR in mavlink manager, failed to send PARAM_VALUE\n");
+	}
+}
+
+static void __callback_func_param_request_list(void)
+{
+	mavlink_message_t msg;
+	mavlink_param_request_list_t req;
+	int i;
+
+	if(rc_mav_get_msg_common(MAVLINK_MSG_ID_PARAM_REQUEST_LIST, &msg)<0){
+		fprintf(stderr, "ERROR in mavlink manager, problem fetching param_request_list packet\n");
 		return;
 	}
+	mavlink_msg_param_request_list_decode(&msg, &req);
+	if(req.target_system!=settings.my_sys_id) return;
+	for(i=0;i<num_params;i++) __send_param(i);
+	return;
+}
 
-	// copy data
-	for(i=0;i<4;i++) state_estimate.quat_mocap[i]=(double)data.q[i];
-	// normalize quaternion because we don't trust the mocap system
-	rc_quaternion_norm_array(state_estimate.quat_mocap);
-	// calculate tait bryan angles too
-	rc_quaternion_to_tb_array(state_estimate.quat_mocap, state_estimate.tb_mocap);
-	// position
-	state_estimate.pos_mocap[0]=(double)data.x;
-	state_estimate.pos_mocap[1]=(double)data.y;
-	state_estimate.pos_mocap[2]=(double)data.z;
-	// mark timestamp
-	state_estimate.mocap_timestamp_ns=rc_nanos_since_boot();
-	state_estimate.mocap_running=1;
+static void __callback_func_param_request_read(void)
+{
+	mavlink_message_t msg;
+	mavlink_param_request_read_t req;
+	int i;
 
+	if(rc_mav_get_msg_common(MAVLINK_MSG_ID_PARAM_REQUEST_READ, &msg)<0){
+		fprintf(stderr, "ERROR in mavlink manager, problem fetching param_request_read packet\n");
+		return;
+	}
+	mavlink_msg_param_request_read_decode(&msg, &req);
+	if(req.target_system!=settings.my_sys_id) return;
+	// index -1 means look it up by id
+	i = req.param_index;
+	if(i<0) i = __find_param(req.param_id);
+	if(i<0 || i>=num_params) return;
+	__send_param(i);
 	return;
 }
 
+/**
+ * @brief      rebuilds the controller a parameter belongs to and hands it to
+ *             feedback, which swaps it in between two steps. A value that
+ *             doesn't give a valid controller is rejected and the old one
+ *             sent back so the ground station shows what is really flying.
+ */
+static void __callback_func_param_set(void)
+{
+	mavlink_message_t msg;
+	mavlink_param_set_t set;
+	controller_t c;
+	param_t* p;
+	double old;
+	int i;
+
+	if(rc_mav_get_msg_common(MAVLINK_MSG_ID_PARAM_SET, &msg)<0){
+		fprintf(stderr, "ERROR in mavlink manager, problem fetching param_set packet\n");
+		return;
+	}
+	mavlink_msg_param_set_decode(&msg, &set);
+	if(set.target_system!=settings.my_sys_id) return;
+	i = __find_param(set.param_id);
+	if(i<0){
+		if(settings.warnings_en){
+			fprintf(stderr,"WARNING in mavlink manager, unknown parameter %.16s\n", set.param_id);
+		}
+		return;
+	}
+	p = &params[i];
+
+	old = *p->value;
+	*p->value = set.param_value;
+	if(!isfinite(set.param_value) ||
+	   controller_from_spec(&c, &spec[p->ctrl], settings.dt) ||
+	   feedback_update_controller(p->ctrl, &c)){
+		fprintf(stderr,"ERROR in mavlink manager, rejected %s = %f\n", p->id, set.param_value);
+		*p->value = old;
+	}
+	__send_param(i);
+	return;
+}
+
+static void __send_mission_ack(uint8_t type)
+{
+	mavlink_message_t msg;
+
+	mavlink_msg_mission_ack_pack(settings.my_sys_id, MAV_COMP_ID_AUTOPILOT1, &msg,
+				mission_sys, mission_comp, type, MAV_MISSION_TYPE_MISSION);
+	if(rc_mav_send_msg(msg)<0){
+		fprintf(stderr, "ERROR in mavlink manager, failed to send MISSION_ACK\n");
+	}
+}
+
+static void __request_mission_item(void)
+{
+	mavlink_message_t msg;
+
+	mavlink_msg_mission_request_int_pack(settings.my_sys_id, MAV_COMP_ID_AUTOPILOT1, &msg,
+				mission_sys, mission_comp, mission_next, MAV_MISSION_TYPE_MISSION);
+	if(rc_mav_send_msg(msg)<0){
+		fprintf(stderr, "ERROR in mavlink manager, failed to send MISSION_REQUEST_INT\n");
+	}
+}
+
+/**
+ * @brief      starts a mission upload, the items are asked for one at a time
+ */
+static void __callback_func_mission_count(void)
+{
+	mavlink_message_t msg;
+	mavlink_mission_count_t count;
+
+	if(rc_mav_get_msg_common(MAVLINK_MSG_ID_MISSION_COUNT, &msg)<0){
+		fprintf(stderr, "ERROR in mavlink manager, problem fetching mission_count packet\n");
+		return;
+	}
+	mavlink_msg_mission_count_decode(&msg, &count);
+	if(count.target_system!=settings.my_sys_id) return;
+	if(count.mission_type!=MAV_MISSION_TYPE_MISSION) return;
+	mission_sys = msg.sysid;
+	mission_comp = msg.compid;
+	if(count.count<1 || count.count>TRAJECTORY_MAX_WAYPOINTS){
+		mission_count = 0;
+		__send_mission_ack(MAV_MISSION_NO_SPACE);
+		return;
+	}
+	mission_count = count.count;
+	mission_next = 0;
+	__request_mission_item();
+	return;
+}
+
+/**
+ * @brief      takes one mission item as a trajectory waypoint. Only
+ *             MAV_CMD_NAV_WAYPOINT in a local NED frame is accepted, x y z
+ *             are the offset from where the trajectory starts, param1 the
+ *             seconds to get there from the previous waypoint and param4
+ *             the yaw offset in degrees. The vehicle passes through every
+ *             waypoint at rest.
+ */
+static void __callback_func_mission_item_int(void)
+{
+	mavlink_message_t msg;
+	mavlink_mission_item_int_t item;
+	traj_waypoint_t* wp;
+	double t0;
+
+	if(rc_mav_get_msg_common(MAVLINK_MSG_ID_MISSION_ITEM_INT, &msg)<0){
+		fprintf(stderr, "ERROR in mavlink manager, problem fetching mission_item_int packet\n");
+		return;
+	}
+	mavlink_msg_mission_item_int_decode(&msg, &item);
+	if(item.target_system!=settings.my_sys_id) return;
+	if(item.mission_type!=MAV_MISSION_TYPE_MISSION || mission_count==0) return;
+	// a repeat of the one before, ask again for the one we want
+	if(item.seq!=mission_next){
+		__request_mission_item();
+		return;
+	}
+	if(item.command!=MAV_CMD_NAV_WAYPOINT){
+		mission_count = 0;
+		__send_mission_ack(MAV_MISSION_UNSUPPORTED);
+		return;
+	}
+	if(item.frame!=MAV_FRAME_LOCAL_NED && item.frame!=MAV_FRAME_LOCAL_OFFSET_NED){
+		mission_count = 0;
+		__send_mission_ack(MAV_MISSION_UNSUPPORTED_FRAME);
+		return;
+	}
+
+	t0 = (mission_next==0) ? 0.0 : mission[mission_next-1].t;
+	wp = &mission[mission_next];
+	memset(wp, 0, sizeof(traj_waypoint_t));
+	wp->t = t0 + item.param1;
+	wp->pos[TRAJ_X]		= item.x/1e4;	// local frames send meters*1e4
+	wp->pos[TRAJ_Y]		= item.y/1e4;
+	wp->pos[TRAJ_Z]		= item.z;
+	wp->pos[TRAJ_YAW]	= item.param4*M_PI/180.0;
+	mission_next++;
+	if(mission_next<mission_count){
+		__request_mission_item();
+		return;
+	}
+
+	// all there, trajectory_set() checks the times
+	mission_count = 0;
+	if(trajectory_set(mission, mission_next)){
+		__send_mission_ack(MAV_MISSION_INVALID_PARAM1);
+		return;
+	}
+	if(settings.warnings_en){
+		printf("received trajectory of %d waypoints, %.1fs\n", mission_next, mission[mission_next-1].t);
+	}
+	__send_mission_ack(MAV_MISSION_ACCEPTED);
+	return;
+}
 
 
 int mavlink_manager_init(void)
@@ -75,10 +359,20 @@ int mavlink_manager_init(void)
 
 	// set the mocap callback to record position
 	rc_mav_set_callback(MAVLINK_MSG_ID_ATT_POS_MOCAP, __callback_func_mocap);
+
+	// controller tuning from the ground station
+	__build_param_table();
+	rc_mav_set_callback(MAVLINK_MSG_ID_PARAM_REQUEST_LIST, __callback_func_param_request_list);
+	rc_mav_set_callback(MAVLINK_MSG_ID_PARAM_REQUEST_READ, __callback_func_param_request_read);
+	rc_mav_set_callback(MAVLINK_MSG_ID_PARAM_SET, __callback_func_param_set);
+
+	// trajectories uploaded as missions
+	rc_mav_set_callback(MAVLINK_MSG_ID_MISSION_COUNT, __callback_func_mission_count);
+	rc_mav_set_callback(MAVLINK_MSG_ID_MISSION_ITEM_INT, __callback_func_mission_item_int);
 	return 0;
 }
 
-int cleanup_mavlink_manager(void)
+int mavlink_manager_cleanup(void)
 {
 	return rc_mav_cleanup();
 }
\ No newline at end of file
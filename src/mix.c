@@ -4,8 +4,16 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include <float.h> // for DBL_MAX
 #include <mix.h>
+#include <real.h>
+#include <rc_pilot_defs.h> // for VEC_ channel order
+#include <settings.h>
+
+#define MIX_GEOMETRY_AXES	4	// thrust roll pitch yaw
+#define MIX_SINGULAR_TOL	1e-9	// relative pivot below which a layout is degenerate
 
 
 /**
@@ -117,11 +125,345 @@ static double mix_6dof_5inch_monocoque[][6] = { \
 {-0.2296,   -0.2296,   -1.0000,    0.2289,    0.2296,   -0.2221}};
 
 
+// LAYOUT_CUSTOM, filled in by mix_init()
+static double mix_custom[MAX_ROTORS][MAX_INPUTS];
+
 static double (*mix_matrix)[6];
 static int initialized;
 static int rotors;
 static int dof;
 
+// transposed copy of mix_matrix so each input channel is one contiguous row
+// for the fused allocation kernels, zero padded past the rotor count
+static real_t mix_t[MAX_INPUTS][MAX_ROTORS];
+
+#ifdef RC_PILOT_NEON
+// 1/mix_t, 0 where mix_t is 0, NEON has no divide
+static real_t mix_inv_t[MAX_INPUTS][MAX_ROTORS];
+#endif
+
+// order in which mix_allocate() hands out motor authority
+static const int priority[MAX_INPUTS] = \
+	{VEC_Z, VEC_ROLL, VEC_PITCH, VEC_YAW, VEC_X, VEC_Y};
+
+typedef void (*allocate_kernel_t)(int n_inputs, const double* limit,
+		mix_input_fn input, void* ctx, double* u, real_t* mot);
+static allocate_kernel_t allocate_kernel;
+
+
+/**
+ * @brief      Saturation aware allocation of all inputs over an n_rot rotor
+ *             matrix in one pass.
+ *
+ * For every channel in priority order this finds the range of input that
+ * keeps all motors in [0,1] with one walk over the transposed row, clamps it
+ * to the caller's limit, asks the caller for the input and adds it onto the
+ * motors. The arithmetic is identical to mix_check_saturation() followed by
+ * mix_add_input() so in the default double build results match bit for bit.
+ * Always inlined into the fixed rotor count wrappers below so the compiler
+ * can unroll the loops.
+ */
+static inline __attribute__((always_inline)) void __allocate(const int n_rot,
+		int n_inputs, const double* limit, mix_input_fn input, void* ctx,
+		double* u, real_t* mot)
+{
+	int i, k, ch;
+	real_t m, tmp, min, max;
+	const real_t* row;
+
+	for(k=0;k<n_inputs;k++){
+		ch = priority[k];
+		row = mix_t[ch];
+
+		// throttle goes first and sets the operating point everything else
+		// is allocated around, the caller saturates it directly
+		if(ch==VEC_Z){
+			min = -REAL_MAX;
+			max = REAL_MAX;
+		}
+		else{
+			max = REAL_MAX;
+			min = -REAL_MAX;
+			for(i=0;i<n_rot;i++){
+				m = row[i];
+				// if mix channel is 0, impossible to saturate
+				if(m==0.0) continue;
+				if(m>0.0){
+					tmp = (1.0-mot[i])/m;
+					if(tmp<max) max = tmp;
+					tmp = -mot[i]/m;
+					if(tmp>min) min = tmp;
+				}
+				else{
+					tmp = -mot[i]/m;
+					if(tmp<max) max = tmp;
+					tmp = (1.0-mot[i])/m;
+					if(tmp>min) min = tmp;
+				}
+			}
+			if(max>limit[ch])  max =  limit[ch];
+			if(min<-limit[ch]) min = -limit[ch];
+		}
+
+		u[ch] = input(ch, min, max, ctx);
+
+		for(i=0;i<n_rot;i++){
+			mot[i] += (real_t)u[ch]*row[i];
+			if(mot[i]>1.0) mot[i]=1.0;
+			else if(mot[i]<0.0) mot[i]=0.0;
+		}
+	}
+	return;
+}
+
+#ifdef RC_PILOT_NEON
+/**
+ * @brief      Same allocation as __allocate() four rotors per NEON register,
+ *             n_q registers. The motors stay in registers for the whole
+ *             allocation. Divides are replaced by the precomputed
+ *             reciprocals, and zero matrix entries by a lane mask instead of
+ *             a branch, so a 6 rotor layout runs as 8 with two empty lanes.
+ */
+static inline __attribute__((always_inline)) void __allocate_neon(const int n_q,
+		int n_inputs, const double* limit, mix_input_fn input, void* ctx,
+		double* u, real_t* mot)
+{
+	int k, q, ch;
+	real_t min, max;
+	float32x4_t m[MAX_ROTORS/4], row, inv, a, b, hi, lo, vmin, vmax;
+	float32x2_t p;
+	uint32x4_t pos, nul;
+	const float32x4_t zero = vdupq_n_f32(0.0f);
+	const float32x4_t one = vdupq_n_f32(1.0f);
+	const float32x4_t big = vdupq_n_f32(REAL_MAX);
+	const float32x4_t nbig = vdupq_n_f32(-REAL_MAX);
+
+	for(q=0;q<n_q;q++) m[q] = vld1q_f32(mot+4*q);
+
+	for(k=0;k<n_inputs;k++){
+		ch = priority[k];
+
+		if(ch==VEC_Z){
+			min = -REAL_MAX;
+			max = REAL_MAX;
+		}
+		else{
+			vmax = big;
+			vmin = nbig;
+			for(q=0;q<n_q;q++){
+				row = vld1q_f32(&mix_t[ch][4*q]);
+				inv = vld1q_f32(&mix_inv_t[ch][4*q]);
+				a = vmulq_f32(vsubq_f32(one, m[q]), inv);	// (1-mot)/m
+				b = vnegq_f32(vmulq_f32(m[q], inv));		// -mot/m
+				pos = vcgtq_f32(row, zero);
+				nul = vceqq_f32(row, zero);
+				hi = vbslq_f32(nul, big, vbslq_f32(pos, a, b));
+				lo = vbslq_f32(nul, nbig, vbslq_f32(pos, b, a));
+				vmax = vminq_f32(vmax, hi);
+				vmin = vmaxq_f32(vmin, lo);
+			}
+			p = vpmin_f32(vget_low_f32(vmax), vget_high_f32(vmax));
+			max = vget_lane_f32(vpmin_f32(p, p), 0);
+			p = vpmax_f32(vget_low_f32(vmin), vget_high_f32(vmin));
+			min = vget_lane_f32(vpmax_f32(p, p), 0);
+			if(max>limit[ch])  max =  limit[ch];
+			if(min<-limit[ch]) min = -limit[ch];
+		}
+
+		u[ch] = input(ch, min, max, ctx);
+
+		for(q=0;q<n_q;q++){
+			row = vld1q_f32(&mix_t[ch][4*q]);
+			m[q] = vmlaq_n_f32(m[q], row, (float)u[ch]);
+			m[q] = vminq_f32(vmaxq_f32(m[q], zero), one);
+		}
+	}
+
+	for(q=0;q<n_q;q++) vst1q_f32(mot+4*q, m[q]);
+	return;
+}
+
+static void __allocate_4(int n_inputs, const double* limit, mix_input_fn input,
+					void* ctx, double* u, real_t* mot)
+{
+	__allocate_neon(1, n_inputs, limit, input, ctx, u, mot);
+}
+
+static void __allocate_6(int n_inputs, const double* limit, mix_input_fn input,
+					void* ctx, double* u, real_t* mot)
+{
+	__allocate_neon(2, n_inputs, limit, input, ctx, u, mot);
+}
+
+static void __allocate_8(int n_inputs, const double* limit, mix_input_fn input,
+					void* ctx, double* u, real_t* mot)
+{
+	__allocate_neon(2, n_inputs, limit, input, ctx, u, mot);
+}
+
+static void __allocate_n(int n_inputs, const double* limit, mix_input_fn input,
+					void* ctx, double* u, real_t* mot)
+{
+	__allocate_neon((rotors+3)/4, n_inputs, limit, input, ctx, u, mot);
+}
+
+#else
+
+static void __allocate_4(int n_inputs, const double* limit, mix_input_fn input,
+					void* ctx, double* u, real_t* mot)
+{
+	__allocate(4, n_inputs, limit, input, ctx, u, mot);
+}
+
+static void __allocate_6(int n_inputs, const double* limit, mix_input_fn input,
+					void* ctx, double* u, real_t* mot)
+{
+	__allocate(6, n_inputs, limit, input, ctx, u, mot);
+}
+
+static void __allocate_8(int n_inputs, const double* limit, mix_input_fn input,
+					void* ctx, double* u, real_t* mot)
+{
+	__allocate(8, n_inputs, limit, input, ctx, u, mot);
+}
+
+// any other rotor count, same arithmetic without the unrolling
+static void __allocate_n(int n_inputs, const double* limit, mix_input_fn input,
+					void* ctx, double* u, real_t* mot)
+{
+	__allocate(rotors, n_inputs, limit, input, ctx, u, mot);
+}
+
+#endif // RC_PILOT_NEON
+
+/**
+ * @brief      transposes the selected matrix and picks the kernel for the
+ *             rotor count
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __setup_kernel(void)
+{
+	int i,j;
+
+	for(j=0;j<MAX_INPUTS;j++){
+		for(i=0;i<MAX_ROTORS;i++){
+			mix_t[j][i] = (i<rotors) ? mix_matrix[i][j] : 0.0;
+			#ifdef RC_PILOT_NEON
+			mix_inv_t[j][i] = (mix_t[j][i]!=0.0) ? 1.0/mix_matrix[i][j] : 0.0;
+			#endif
+		}
+	}
+	switch(rotors){
+	case 4:
+		allocate_kernel = __allocate_4;
+		break;
+	case 6:
+		allocate_kernel = __allocate_6;
+		break;
+	case 8:
+		allocate_kernel = __allocate_8;
+		break;
+	default:
+		allocate_kernel = __allocate_n;
+		break;
+	}
+	return 0;
+}
+
+
+int mix_matrix_from_geometry(int n, const mix_rotor_t* r, double m[MAX_ROTORS][MAX_INPUTS])
+{
+	static const int col[MIX_GEOMETRY_AXES] = {VEC_Z, VEC_ROLL, VEC_PITCH, VEC_YAW};
+	double B[MIX_GEOMETRY_AXES][MAX_ROTORS];	// what each rotor produces
+	double A[MIX_GEOMETRY_AXES][2*MIX_GEOMETRY_AXES]; // [B*B' | I]
+	double tmp, scale, big;
+	int i, j, k, p;
+
+	if(n<MIX_GEOMETRY_AXES || n>MAX_ROTORS){
+		fprintf(stderr,"ERROR in mix_matrix_from_geometry, need 4 to %d rotors\n", MAX_ROTORS);
+		return -1;
+	}
+
+	// thrust up is negative Z, a rotor right of center rolls the vehicle
+	// left and one in front pitches the nose up. Same signs as the built in
+	// tables take.
+	for(i=0;i<n;i++){
+		B[0][i] = -1.0;
+		B[1][i] = -r[i].y;
+		B[2][i] = r[i].x;
+		B[3][i] = r[i].ccw ? 1.0 : -1.0;
+	}
+
+	// pseudo-inverse B'*inv(B*B') by gauss-jordan on the 4x4 B*B'
+	for(j=0;j<MIX_GEOMETRY_AXES;j++){
+		for(k=0;k<MIX_GEOMETRY_AXES;k++){
+			A[j][k] = 0.0;
+			for(i=0;i<n;i++) A[j][k] += B[j][i]*B[k][i];
+			A[j][MIX_GEOMETRY_AXES+k] = (j==k) ? 1.0 : 0.0;
+		}
+	}
+	big = 0.0;
+	for(j=0;j<MIX_GEOMETRY_AXES;j++) if(A[j][j]>big) big = A[j][j];
+	for(j=0;j<MIX_GEOMETRY_AXES;j++){
+		p = j;
+		for(k=j+1;k<MIX_GEOMETRY_AXES;k++) if(fabs(A[k][j])>fabs(A[p][j])) p = k;
+		if(fabs(A[p][j])<=MIX_SINGULAR_TOL*big){
+			fprintf(stderr,"ERROR in mix_matrix_from_geometry, rotors can't control thrust, roll, pitch and yaw independently\n");
+			return -1;
+		}
+		for(k=0;k<2*MIX_GEOMETRY_AXES;k++){
+			tmp = A[j][k];
+			A[j][k] = A[p][k];
+			A[p][k] = tmp;
+		}
+		scale = 1.0/A[j][j];
+		for(k=0;k<2*MIX_GEOMETRY_AXES;k++) A[j][k] *= scale;
+		for(i=0;i<MIX_GEOMETRY_AXES;i++){
+			if(i==j) continue;
+			tmp = A[i][j];
+			for(k=0;k<2*MIX_GEOMETRY_AXES;k++) A[i][k] -= tmp*A[j][k];
+		}
+	}
+
+	for(i=0;i<MAX_ROTORS;i++){
+		for(j=0;j<MAX_INPUTS;j++) m[i][j] = 0.0;
+	}
+	for(i=0;i<n;i++){
+		for(j=0;j<MIX_GEOMETRY_AXES;j++){
+			tmp = 0.0;
+			for(k=0;k<MIX_GEOMETRY_AXES;k++) tmp += B[k][i]*A[k][MIX_GEOMETRY_AXES+j];
+			m[i][col[j]] = tmp;
+		}
+	}
+
+	// scale each column to the convention of the built in layouts
+	for(j=0;j<MIX_GEOMETRY_AXES;j++){
+		big = 0.0;
+		for(i=0;i<n;i++) if(fabs(m[i][col[j]])>big) big = fabs(m[i][col[j]]);
+		scale = ((col[j]==VEC_Z) ? 1.0 : 0.5)/big;
+		for(i=0;i<n;i++) m[i][col[j]] *= scale;
+	}
+	return 0;
+}
+
+/**
+ * @brief      fills mix_custom from the custom_layout settings
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __setup_custom(void)
+{
+	rotors = settings.num_rotors;
+	dof = settings.dof;
+	if(settings.custom_by_geometry){
+		if(mix_matrix_from_geometry(rotors, settings.custom_rotors, mix_custom)) return -1;
+	}
+	else memcpy(mix_custom, settings.custom_matrix, sizeof(mix_custom));
+	mix_matrix = mix_custom;
+	return 0;
+}
+
 
 int mix_init(rotor_layout_t layout)
 {
@@ -156,11 +498,15 @@ int mix_init(rotor_layout_t layout)
 		dof = 6;
 		mix_matrix = mix_6dof_5inch_monocoque;
 		break;
+	case LAYOUT_CUSTOM:
+		if(__setup_custom()) return -1;
+		break;
 	default:
 		fprintf(stderr,"ERROR in mix_init() unknown rotor layout\n");
 		return -1;
 	}
 
+	if(__setup_kernel()) return -1;
 	initialized = 1;
 	return 0;
 }
@@ -295,3 +641,42 @@ int mix_add_input(double u, int ch, double* mot)
 }
 
 
+int mix_allocate(int n_inputs, const double limit[MAX_INPUTS],
+		mix_input_fn input, void* ctx, double u[MAX_INPUTS], double* mot)
+{
+	int i;
+	real_t m[MAX_ROTORS] = {0};
+
+	if(initialized!=1){
+		fprintf(stderr,"ERROR: in mix_allocate, mix matrix not set yet\n");
+		return -1;
+	}
+	if(n_inputs!=4 && n_inputs!=6){
+		fprintf(stderr,"ERROR: in mix_allocate, n_inputs should be 4 or 6\n");
+		return -1;
+	}
+	if(n_inputs>dof){
+		fprintf(stderr,"ERROR: in mix_allocate, layout only has %d dof\n", dof);
+		return -1;
+	}
+
+	allocate_kernel(n_inputs, limit, input, ctx, u, m);
+	for(i=0;i<rotors;i++) mot[i] = m[i];
+	return 0;
+}
+
+
+int mix_get_matrix(double m[MAX_ROTORS][MAX_INPUTS])
+{
+	int i,j;
+	if(initialized==0){
+		fprintf(stderr,"ERROR in mix_get_matrix, mixing matrix not set yet\n");
+		return -1;
+	}
+	for(i=0;i<MAX_ROTORS;i++){
+		for(j=0;j<MAX_INPUTS;j++){
+			m[i][j] = (i<rotors) ? mix_matrix[i][j] : 0.0;
+		}
+	}
+	return 0;
+}
@@ -3,8 +3,11 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <sys/resource.h>
 
 #include <rc/start_stop.h>
 #include <rc/time.h>
@@ -18,12 +21,38 @@
 #include <state_estimator.h>
 #include <thread_defs.h>
 #include <settings.h>
+#include <snapshot.h>
+#include <rt_setup.h>
+#include <watchdog.h>
 
 
 
+#define PRINTF_MAX_CELLS	48	///< fields on the status line
+#define PRINTF_CELL_BYTES	24	///< room for one field's text
+#define PRINTF_FRAME_BYTES	4096	///< one rendered frame or the header
+
+/**
+ * one field of the status line, the column never moves so a field can be
+ * repainted on its own
+ */
+typedef struct printf_cell_t{
+	const char* colour;		///< colour of the text on screen
+	const char* sep;		///< static text painted after the field
+	int width;			///< visible width, text is padded or cut to it
+	int col;			///< 1 based terminal column of the first char
+	int dirty;			///< changed since it was last painted
+	char text[PRINTF_CELL_BYTES];	///< text on screen
+} printf_cell_t;
+
 static pthread_t printf_manager_thread;
 static int initialized = 0;
 
+static printf_cell_t cells[PRINTF_MAX_CELLS];
+static int num_cells = 0;	// laid out by the first frame
+static int cursor;		// next cell filled this frame
+static char frame[PRINTF_FRAME_BYTES];
+static int frame_len;
+
 const char* const colours[] = {KYEL, KCYN, KGRN, KMAG};
 const int num_colours = 4; // length of above array
 int current_colour = 0;
@@ -51,139 +80,311 @@ static void __reset_colour()
 }
 
 
+/**
+ * @brief      name and colour a flight mode is shown with
+ *
+ * @return     0 on success, -1 for an unknown mode
+ */
+static int __flight_mode_text(flight_mode_t mode, const char** name, const char** colour)
+{
+	switch(mode){
+	case TEST_BENCH_4DOF:
+		*name = "TEST_BENCH_4DOF";	*colour = KYEL;	return 0;
+	case TEST_BENCH_6DOF:
+		*name = "TEST_BENCH_6DOF";	*colour = KYEL;	return 0;
+	case DIRECT_THROTTLE_4DOF:
+		*name = "DIR_THRTLE_4DOF";	*colour = KCYN;	return 0;
+	case DIRECT_THROTTLE_6DOF:
+		*name = "DIR_THRTLE_6DOF";	*colour = KCYN;	return 0;
+	case ALT_HOLD_4DOF:
+		*name = "ALT_HOLD_4DOF  ";	*colour = KBLU;	return 0;
+	case ALT_HOLD_6DOF:
+		*name = "ALT_HOLD_6DOF  ";	*colour = KBLU;	return 0;
+	case TRAJECTORY_4DOF:
+		*name = "TRAJECTORY_4DOF";	*colour = KGRN;	return 0;
+	case TRAJECTORY_6DOF:
+		*name = "TRAJECTORY_6DOF";	*colour = KGRN;	return 0;
+	default:
+		return -1;
+	}
+}
+
+
+/**
+ * @brief      appends to the frame buffer, anything past the end is dropped
+ */
+static void __attribute__((format(printf,1,2))) __append(const char* fmt, ...)
+{
+	va_list args;
+	int n;
+
+	if(frame_len>=PRINTF_FRAME_BYTES-1) return;
+	va_start(args, fmt);
+	n = vsnprintf(frame+frame_len, PRINTF_FRAME_BYTES-frame_len, fmt, args);
+	va_end(args);
+	if(n<0) return;
+	frame_len += n;
+	if(frame_len>PRINTF_FRAME_BYTES-1) frame_len = PRINTF_FRAME_BYTES-1;
+}
+
+
+/**
+ * @brief      writes the frame buffer out with a single write() unless the
+ *             terminal only takes part of it, then empties it
+ */
+static void __write_frame(void)
+{
+	const char* p = frame;
+	ssize_t n;
+
+	while(frame_len>0){
+		n = write(STDOUT_FILENO, p, frame_len);
+		if(n<0){
+			if(errno==EINTR) continue;
+			break;
+		}
+		p += n;
+		frame_len -= n;
+	}
+	frame_len = 0;
+}
+
+
+/**
+ * @brief      sets the next field of the frame. The first frame lays the
+ *             fields out, later ones only mark the fields that changed.
+ *
+ * @param[in]  colour  colour of the text
+ * @param[in]  width   visible width, only used by the first frame
+ * @param[in]  sep     static text after the field, only used by the first
+ *                     frame
+ * @param[in]  text    field text
+ */
+static void __put_text(const char* colour, int width, const char* sep, const char* text)
+{
+	printf_cell_t* c;
+	char buf[PRINTF_CELL_BYTES];
+
+	if(cursor>=PRINTF_MAX_CELLS) return;
+	c = &cells[cursor];
+	if(cursor==num_cells){
+		c->width = width<PRINTF_CELL_BYTES ? width : PRINTF_CELL_BYTES-1;
+		c->sep = sep;
+		c->col = cursor==0 ? 1 : cells[cursor-1].col+cells[cursor-1].width+(int)strlen(cells[cursor-1].sep);
+		c->colour = NULL;
+		c->text[0] = 0;
+		num_cells++;
+	}
+	cursor++;
+
+	// pad or cut to the field width so later columns never move
+	snprintf(buf, sizeof(buf), "%-*.*s", c->width, c->width, text);
+	if(c->colour!=colour || strcmp(c->text, buf)){
+		c->colour = colour;
+		strcpy(c->text, buf);
+		c->dirty = 1;
+	}
+}
+
+static void __put_value(const char* colour, int width, double v)
+{
+	char buf[PRINTF_CELL_BYTES];
+
+	snprintf(buf, sizeof(buf), "%+5.2f", v);
+	__put_text(colour, width, "|", buf);
+}
+
+
 static int __print_header()
 {
 	int i;
 
-	printf("\n");
+	__append("\n");
 	__reset_colour();
 	if(settings.printf_arm){
-		printf("  arm   |");
+		__append("  arm   |");
 	}
 	if(settings.printf_altitude){
-		printf("%s alt(m) |altdot|", __next_colour());
+		__append("%s alt(m) |altdot|", __next_colour());
 	}
 	if(settings.printf_rpy){
-		printf("%s roll|pitch| yaw |", __next_colour());
+		__append("%s roll|pitch| yaw |", __next_colour());
 	}
 	if(settings.printf_sticks){
-		printf("%s  kill  | thr |roll |pitch| yaw |", __next_colour());
+		__append("%s  kill  | thr |roll |pitch| yaw |", __next_colour());
 	}
 	if(settings.printf_setpoint){
-		printf("%s  sp_a | sp_r| sp_p| sp_y|", __next_colour());
+		__append("%s  sp_a | sp_r| sp_p| sp_y|", __next_colour());
 	}
 	if(settings.printf_u){
-		printf("%s U0X | U1Y | U2Z | U3r | U4p | U5y |", __next_colour());
+		__append("%s U0X | U1Y | U2Z | U3r | U4p | U5y |", __next_colour());
 	}
 	if(settings.printf_motors){
-		printf("%s", __next_colour());
+		__append("%s", __next_colour());
 		for(i=0;i<settings.num_rotors;i++){
-			printf("  M%d |", i+1);
+			__append("  M%d |", i+1);
 		}
 	}
-	printf(KNRM);
+	__append(KNRM);
 	if(settings.printf_mode){
-		printf("   MODE ");
+		__append("   MODE ");
 	}
 
-	printf("\n");
-	fflush(stdout);
+	__append("\n");
+	__write_frame();
 	return 0;
 }
 
 
-static void* __printf_manager_func(__attribute__ ((unused)) void* ptr)
+/**
+ * @brief      fills every field of the status line from one set of snapshots
+ */
+static void __fill_frame(const state_estimate_t* se, const feedback_state_t* fs,\
+				const setpoint_t* sp, const user_input_t* ui)
 {
-	arm_state_t prev_arm_state;
+	const char* colour;
+	const char* name;
 	int i;
+
+	cursor = 0;
+	if(settings.printf_arm){
+		if(fs->arm_state==ARMED) __put_text(KRED, 8, "|", " ARMED");
+		else			 __put_text(KGRN, 8, "|", "DISARMED");
+	}
+	__reset_colour();
+	if(settings.printf_altitude){
+		colour = __next_colour();
+		__put_value(colour, 6, se->alt_bmp);
+		__put_value(colour, 6, se->alt_bmp_vel);
+	}
+	if(settings.printf_rpy){
+		colour = __next_colour();
+		__put_value(colour, 5, se->roll);
+		__put_value(colour, 5, se->pitch);
+		__put_value(colour, 5, se->continuous_yaw);
+	}
+	if(settings.printf_sticks){
+		if(ui->requested_arm_mode==ARMED) __put_text(KRED, 8, "|", " ARMED");
+		else				  __put_text(KGRN, 8, "|", "DISARMED");
+		colour = __next_colour();
+		__put_value(colour, 5, ui->thr_stick);
+		__put_value(colour, 5, ui->roll_stick);
+		__put_value(colour, 5, ui->pitch_stick);
+		__put_value(colour, 5, ui->yaw_stick);
+	}
+	if(settings.printf_setpoint){
+		colour = __next_colour();
+		__put_value(colour, 5, sp->Z);
+		__put_value(colour, 5, sp->roll);
+		__put_value(colour, 5, sp->pitch);
+		__put_value(colour, 5, sp->yaw);
+	}
+	if(settings.printf_u){
+		colour = __next_colour();
+		for(i=0;i<6;i++) __put_value(colour, 5, fs->u[i]);
+	}
+	if(settings.printf_motors){
+		colour = __next_colour();
+		for(i=0;i<settings.num_rotors;i++) __put_value(colour, 5, fs->m[i]);
+	}
+	if(settings.printf_mode){
+		if(__flight_mode_text(ui->flight_mode, &name, &colour)){
+			name = "UNKNOWN MODE";
+			colour = KRED;
+		}
+		__put_text(colour, 15, "", name);
+	}
+}
+
+
+/**
+ * @brief      renders the fields into the frame buffer, either the whole
+ *             line or only what changed, moving the cursor to each field's
+ *             column
+ */
+static void __render_frame(int full)
+{
+	int i;
+	printf_cell_t* c;
+
+	if(full){
+		__append("\r");
+		for(i=0;i<num_cells;i++){
+			c = &cells[i];
+			__append("%s%s%s", c->colour, c->text, c->sep);
+			c->dirty = 0;
+		}
+	}
+	else{
+		for(i=0;i<num_cells;i++){
+			c = &cells[i];
+			if(!c->dirty) continue;
+			__append("\033[%dG%s%s", c->col, c->colour, c->text);
+			c->dirty = 0;
+		}
+	}
+	if(frame_len>0) __append(KNRM);
+}
+
+
+static void* __printf_manager_func(__attribute__ ((unused)) void* ptr)
+{
+	int frames = 0;
+	state_estimate_t se;
+	feedback_state_t fs;
+	setpoint_t sp;
+	user_input_t ui;
+	rt_setup_thread(RT_THREAD_PRINTF);
 	initialized = 1;
+
+	// the console is cosmetic, let everything else in the process win
+	setpriority(PRIO_PROCESS, 0, PRINTF_MANAGER_NICE);
+
 	printf("\nTurn your transmitter kill switch to arm.\n");
 	printf("Then move throttle UP then DOWN to arm controller\n\n");
 
 	// turn off linewrap to avoid runaway prints
 	printf(WRAP_DISABLE);
+	// frames bypass stdio from here on
+	fflush(stdout);
 
 	// print the header
 	__print_header();
 
-	prev_arm_state = fstate.arm_state;
-
 	//sleep so state_estimator can run first
 	rc_usleep(100000);
 
 	while(rc_get_state()!=EXITING){
-		// re-print header on disarming
-		//if(fstate.arm_state==DISARMED && prev_arm_state==ARMED){
-		//	__print_header();
-		//}
-
-		printf("\r");
-		if(settings.printf_arm){
-			if(fstate.arm_state==ARMED) printf("%s ARMED %s |",KRED,KNRM);
-			else			    printf("%sDISARMED%s|",KGRN,KNRM);
-		}
-		__reset_colour();
-		if(settings.printf_altitude){
-			printf("%s%+5.2f |%+5.2f |",	__next_colour(),\
-							state_estimate.alt_bmp,\
-							state_estimate.alt_bmp_vel);
-		}
-		if(settings.printf_rpy){
-			printf(KCYN);
-			printf("%s%+5.2f|%+5.2f|%+5.2f|",
-							__next_colour(),\
-							state_estimate.roll,\
-							state_estimate.pitch,\
-							state_estimate.continuous_yaw);
-		}
-		if(settings.printf_sticks){
-			if(user_input.requested_arm_mode==ARMED)
-				printf("%s ARMED  ",KRED);
-			else	printf("%sDISARMED",KGRN);
-			printf(KGRN);
-			printf("%s|%+5.2f|%+5.2f|%+5.2f|%+5.2f|",\
-							__next_colour(),\
-							user_input.thr_stick,\
-							user_input.roll_stick,\
-							user_input.pitch_stick,\
-							user_input.yaw_stick);
-		}
-		if(settings.printf_setpoint){
-			printf("%s%+5.2f|%+5.2f|%+5.2f|%+5.2f|",\
-							__next_colour(),\
-							setpoint.Z,\
-							setpoint.roll,\
-							setpoint.pitch,\
-							setpoint.yaw);
-		}
-		if(settings.printf_u){
-			printf("%s%+5.2f|%+5.2f|%+5.2f|%+5.2f|%+5.2f|%+5.2f|",\
-							__next_colour(),\
-							fstate.u[0],\
-							fstate.u[1],\
-							fstate.u[2],\
-							fstate.u[3],\
-							fstate.u[4],\
-							fstate.u[5]);
-		}
-		if(settings.printf_motors){
-			printf("%s",__next_colour());
-			for(i=0;i<settings.num_rotors;i++){
-				printf("%+5.2f|", fstate.m[i]);
-			}
+		watchdog_print_level_change(stderr);
+
+		// the deadline watchdog wants the CPU back, the line stays as is
+		// and gets a full repaint once it may print again
+		if(watchdog_level()>=WATCHDOG_LEVEL_PRINTF){
+			frames = 0;
+			rc_usleep(1000000/settings.printf_hz);
+			continue;
 		}
-		printf(KNRM);
-		if(settings.printf_mode){
-			print_flight_mode(user_input.flight_mode);
+
+		// take one coherent copy of everything to print, if the writer
+		// got in the way just skip this print
+		if(snapshot_get_state_estimate(&se) || snapshot_get_fstate(&fs) ||
+		   snapshot_get_setpoint(&sp) || snapshot_get_user_input(&ui)){
+			rc_usleep(1000000/settings.printf_hz);
+			continue;
 		}
 
-		fflush(stdout);
-		prev_arm_state = fstate.arm_state;
-		rc_usleep(1000000/PRINTF_MANAGER_HZ);
+		// repaint the whole line about once a second in case a warning
+		// printed over it, otherwise only the fields that changed
+		__fill_frame(&se, &fs, &sp, &ui);
+		__render_frame(frames%settings.printf_hz==0);
+		__write_frame();
+		frames++;
+		rc_usleep(1000000/settings.printf_hz);
 	}
 
 	// put linewrap back on
-	printf(WRAP_ENABLE);
+	__append(WRAP_ENABLE);
+	__write_frame();
 
 	return NULL;
 }
@@ -193,7 +394,7 @@ static void* __printf_manager_func(__attribute__ ((unused)) void* ptr)
 int printf_init()
 {
 	if(rc_pthread_create(&printf_manager_thread, __printf_manager_func, NULL,
-				SCHED_FIFO, PRINTF_MANAGER_PRI)==-1){
+				SCHED_OTHER, 0)==-1){
 		fprintf(stderr,"ERROR in start_printf_manager, failed to start thread\n");
 		return -1;
 	}
@@ -217,27 +418,13 @@ int printf_cleanup()
 
 
 int print_flight_mode(flight_mode_t mode){
-	switch(mode){
-	case TEST_BENCH_4DOF:
-		printf("%sTEST_BENCH_4DOF%s",KYEL,KNRM);
-		return 0;
-	case TEST_BENCH_6DOF:
-		printf("%sTEST_BENCH_6DOF%s",KYEL,KNRM);
-		return 0;
-	case DIRECT_THROTTLE_4DOF:
-		printf("%sDIR_THRTLE_4DOF%s",KCYN,KNRM);
-		return 0;
-	case DIRECT_THROTTLE_6DOF:
-		printf("%sDIR_THRTLE_6DOF%s",KCYN,KNRM);
-		return 0;
-	case ALT_HOLD_4DOF:
-		printf("%sALT_HOLD_4DOF  %s",KBLU,KNRM);
-		return 0;
-	case ALT_HOLD_6DOF:
-		printf("%sALT_HOLD_6DOF  %s",KBLU,KNRM);
-		return 0;
-	default:
+	const char* name;
+	const char* colour;
+
+	if(__flight_mode_text(mode, &name, &colour)){
 		fprintf(stderr,"ERROR in print_flight_mode, unknown flight mode\n");
 		return -1;
 	}
+	printf("%s%s%s", colour, name, KNRM);
+	return 0;
 }
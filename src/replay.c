@@ -0,0 +1,379 @@
+/**
+ * @file replay.c
+ *
+ * Log replay backend, see replay.h
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <math.h>
+
+#include <rc/time.h>
+
+#include <replay.h>
+#include <hal.h>
+#include <log_format.h>
+#include <log_reader.h>
+#include <log_manager.h>
+#include <rc_pilot_defs.h>
+#include <settings.h>
+#include <input_manager.h>
+#include <setpoint_manager.h>
+#include <state_estimator.h>
+#include <bmp_manager.h>
+#include <snapshot.h>
+#include <feedback.h>
+
+static log_reader_t reader;	// decompresses the log if needed
+static log_file_header_t header;
+static char* rec;		// current record
+static uint32_t raw_offset;	// start of LOG_GROUP_RAW within a record
+static uint32_t mot_offset;	// start of LOG_GROUP_MOTORS within a record
+static double esc[MAX_ROTORS];	// last signals sent to the ESCs
+static rc_mpu_data_t* imu_data;
+
+
+/**
+ * @brief      reads column i of the group starting at offset out of the
+ *             current record
+ */
+static double __col(uint32_t offset, int i)
+{
+	double val;
+	memcpy(&val, rec+offset+i*sizeof(double), sizeof(double));
+	return val;
+}
+
+/**
+ * raw column by its name in log_entry_t, the group is written straight from
+ * the struct so the field order is the column order
+ */
+#define RAW(field) __col(raw_offset, \
+	(offsetof(log_entry_t, field)-offsetof(log_entry_t, raw_gyro_x))/sizeof(double))
+
+
+/**
+ * @brief      checks the header log_reader_open() validated can be replayed
+ *             with the loaded settings
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __check_header(void)
+{
+	header = reader.header;
+	if(!(header.groups & LOG_GROUP_RAW)){
+		fprintf(stderr,"ERROR in replay, log was not recorded with log_raw enabled\n");
+		return -1;
+	}
+	if(header.version<7){
+		fprintf(stderr,"ERROR in replay, raw group of log version %d is not supported\n",\
+						header.version);
+		return -1;
+	}
+	if(header.num_rotors!=settings.num_rotors){
+		fprintf(stderr,"ERROR in replay, log has %d rotors but settings have %d\n",\
+						header.num_rotors, settings.num_rotors);
+		return -1;
+	}
+	if(header.feedback_hz!=settings.feedback_hz){
+		fprintf(stderr,"ERROR in replay, log was recorded at %dhz, settings have feedback_hz %d\n",\
+						header.feedback_hz, settings.feedback_hz);
+		return -1;
+	}
+	raw_offset = log_group_offset(header.version, header.groups, header.num_rotors, LOG_GROUP_RAW);
+	mot_offset = log_group_offset(header.version, header.groups, header.num_rotors, LOG_GROUP_MOTORS);
+	return 0;
+}
+
+/**
+ * @brief      loads the next record
+ *
+ * @return     0 on success, -1 at the end of the file
+ */
+static int __read_record(void)
+{
+	if(log_reader_read(&reader, rec)!=1) return -1;
+	return 0;
+}
+
+static uint64_t __record_index(int i)
+{
+	uint64_t val;
+	memcpy(&val, rec+i*sizeof(uint64_t), sizeof(uint64_t));
+	return val;
+}
+
+static void __load_imu(void)
+{
+	imu_data->gyro[0]	= RAW(raw_gyro_x);
+	imu_data->gyro[1]	= RAW(raw_gyro_y);
+	imu_data->gyro[2]	= RAW(raw_gyro_z);
+	imu_data->accel[0]	= RAW(raw_accel_x);
+	imu_data->accel[1]	= RAW(raw_accel_y);
+	imu_data->accel[2]	= RAW(raw_accel_z);
+	imu_data->dmp_quat[0]	= RAW(raw_quat_w);
+	imu_data->dmp_quat[1]	= RAW(raw_quat_x);
+	imu_data->dmp_quat[2]	= RAW(raw_quat_y);
+	imu_data->dmp_quat[3]	= RAW(raw_quat_z);
+}
+
+/**
+ * @brief      puts everything the original callback saw in place, this is
+ *             what the hardware and the other threads did between two
+ *             callbacks on the flight computer
+ *
+ * @param[in]  bmp_changed  the barometer sample changed since the last record
+ * @param[in]  batt_changed the battery task ran since the last record
+ * @param[in]  mocap_changed the estimator picked up a new mocap sample
+ */
+static void __load_record(int bmp_changed, int batt_changed, int mocap_changed)
+{
+	mocap_sample_t m;
+	uint64_t age_ns, now;
+
+	__load_imu();
+
+	// the battery task runs after the record is logged, so its new sample
+	// shows up in the next record, right where the filter output was first
+	// used by the controllers
+	if(batt_changed) state_estimator_batt_march();
+
+	// the sample is read inline in the replay backend, so requesting it
+	// here makes the estimator pick it up in the same loop it did in flight
+	if(bmp_changed) bmp_manager_request_sample();
+
+	// received as long before this callback as it was in flight, so the
+	// estimator applies it to the same loop of its history. A sample that
+	// left mocap off was the all zero lost visual packet, or one too old to
+	// use in which case a lost packet does the same.
+	if(mocap_changed){
+		now = hal_time_ns();
+		age_ns = (uint64_t)llround(RAW(mocap_age)*1e9);
+		memset(&m, 0, sizeof(m));
+		if((int)RAW(mocap_running)){
+			m.pos[0]	= RAW(mocap_X);
+			m.pos[1]	= RAW(mocap_Y);
+			m.pos[2]	= RAW(mocap_Z);
+		}
+		m.quat[0]	= 1.0;
+		m.timestamp_ns	= (age_ns<now) ? now-age_ns : 0;
+		m.count		= (uint64_t)RAW(mocap_count);
+		state_estimator_publish_mocap(&m);
+	}
+
+	user_input.initialized		= 1;
+	user_input.input_active		= 1;
+	user_input.flight_mode		= (flight_mode_t)RAW(in_mode);
+	user_input.requested_arm_mode	= (arm_state_t)RAW(in_arm);
+	user_input.thr_stick		= RAW(in_thr);
+	user_input.roll_stick		= RAW(in_roll);
+	user_input.pitch_stick		= RAW(in_pitch);
+	user_input.yaw_stick		= RAW(in_yaw);
+	user_input.frame_ns		= rc_nanos_since_boot();
+	snapshot_publish_user_input();
+}
+
+
+int replay_open(const char* path)
+{
+	if(reader.f!=NULL){
+		fprintf(stderr,"ERROR in replay_open, a log is already open\n");
+		return -1;
+	}
+	if(log_reader_open(&reader, path)) return -1;
+	if(__check_header()) goto fail;
+	rec = (char*)malloc(header.record_size);
+	if(rec==NULL){
+		fprintf(stderr,"ERROR in replay_open, failed to allocate record buffer\n");
+		goto fail;
+	}
+	// the modules read the first record while they initialize
+	if(__read_record()){
+		fprintf(stderr,"ERROR in replay_open, log has no records\n");
+		goto fail;
+	}
+	return 0;
+
+fail:
+	replay_close();
+	return -1;
+}
+
+
+int replay_run(replay_result_t* result)
+{
+	int i;
+	uint64_t wall_start;
+	double bmp_count, batt_count, mocap_count, d;
+	double sq[MAX_ROTORS] = {0};
+
+	if(hal!=&hal_replay_ops){
+		fprintf(stderr,"ERROR in replay_run, replay backend not selected\n");
+		return -1;
+	}
+	if(imu_data==NULL){
+		fprintf(stderr,"ERROR in replay_run, IMU not initialized\n");
+		return -1;
+	}
+
+	memset(result, 0, sizeof(replay_result_t));
+	result->num_rotors = header.num_rotors;
+	result->has_motors = (header.groups & LOG_GROUP_MOTORS) ? 1 : 0;
+	result->first_divergence = -1;
+
+	// bmp_manager_init() already took the first record's sample
+	bmp_count = RAW(bmp_count);
+	batt_count = RAW(batt_count);
+	// the estimator starts without mocap, a sample in the first record is new
+	mocap_count = 0.0;
+	wall_start = rc_nanos_since_boot();
+
+	do{
+		__load_record(RAW(bmp_count)!=bmp_count, RAW(batt_count)!=batt_count,
+				RAW(mocap_count)!=mocap_count);
+		bmp_count = RAW(bmp_count);
+		batt_count = RAW(batt_count);
+		mocap_count = RAW(mocap_count);
+
+		setpoint_manager_update();
+		state_estimator_march();
+		feedback_march();
+		result->records++;
+
+		if((int)RAW(arm_state)!=(int)fstate.arm_state) result->arm_mismatches++;
+		if(!result->has_motors || (int)RAW(arm_state)!=ARMED) continue;
+
+		result->compared++;
+		for(i=0;i<header.num_rotors;i++){
+			d = fabs(esc[i]-__col(mot_offset, i));
+			sq[i] += d*d;
+			if(d>result->max_diff[i]) result->max_diff[i] = d;
+			if(d>REPLAY_TOLERANCE && result->first_divergence<0){
+				result->first_divergence = (int64_t)__record_index(0);
+			}
+		}
+	}while(__read_record()==0);
+
+	result->wall_seconds = (rc_nanos_since_boot()-wall_start)/1e9;
+	// last_step_ns stops while disarmed, count records instead
+	result->log_seconds = result->records/(double)header.feedback_hz;
+	for(i=0;i<header.num_rotors;i++){
+		result->rms_diff[i] = result->compared ? sqrt(sq[i]/result->compared) : 0.0;
+	}
+	return 0;
+}
+
+
+void replay_print_result(FILE* f, const replay_result_t* r)
+{
+	int i;
+
+	fprintf(f, "replayed %llu records (%.1fs of flight) in %.3fs",\
+			(unsigned long long)r->records, r->log_seconds, r->wall_seconds);
+	if(r->wall_seconds>0.0) fprintf(f, ", %.0fx real time", r->log_seconds/r->wall_seconds);
+	fprintf(f, "\n");
+	fprintf(f, "arm state mismatches: %llu\n", (unsigned long long)r->arm_mismatches);
+	if(!r->has_motors){
+		fprintf(f, "log has no motor signals to compare against, enable log_motor_signals\n");
+		return;
+	}
+	fprintf(f, "compared %llu armed records\n", (unsigned long long)r->compared);
+	fprintf(f, "motor   max diff   rms diff\n");
+	for(i=0;i<r->num_rotors;i++){
+		fprintf(f, "%5d %10.6f %10.6f\n", i+1, r->max_diff[i], r->rms_diff[i]);
+	}
+	if(r->first_divergence<0) fprintf(f, "no divergence over %g\n", REPLAY_TOLERANCE);
+	else fprintf(f, "first divergence over %g at loop_index %lld\n",\
+			REPLAY_TOLERANCE, (long long)r->first_divergence);
+}
+
+
+int replay_close(void)
+{
+	log_reader_close(&reader);
+	free(rec);
+	rec = NULL;
+	return 0;
+}
+
+
+static int __replay_init(void)
+{
+	if(reader.f==NULL){
+		fprintf(stderr,"ERROR in replay backend, call replay_open() first\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int __replay_cleanup(void)
+{
+	return 0;
+}
+
+static int __replay_imu_init(rc_mpu_data_t* data)
+{
+	imu_data = data;
+	__load_imu();
+	return 0;
+}
+
+static int __replay_imu_set_callback(__attribute__ ((unused)) void (*func)(void))
+{
+	// replay_run() steps the callback stages itself
+	return 0;
+}
+
+static int __replay_imu_power_off(void)
+{
+	imu_data = NULL;
+	return 0;
+}
+
+static int __replay_bmp_read(rc_bmp_data_t* data)
+{
+	data->pressure_pa	= RAW(bmp_pressure);
+	data->alt_m		= RAW(bmp_alt);
+	data->temp_c		= RAW(bmp_temp);
+	return 0;
+}
+
+static double __replay_batt_read(void)
+{
+	return RAW(raw_v_batt);
+}
+
+static int __replay_esc_send(int ch, double val)
+{
+	if(ch<1 || ch>MAX_ROTORS) return -1;
+	esc[ch-1] = val;
+	return 0;
+}
+
+static int __replay_led_set(__attribute__ ((unused)) rc_led_t led,
+			__attribute__ ((unused)) int value)
+{
+	return 0;
+}
+
+static uint64_t __replay_time_ns(void)
+{
+	return __record_index(1);
+}
+
+const hal_ops_t hal_replay_ops = {
+	.name			= "replay",
+	.realtime		= 0,
+	.init			= __replay_init,
+	.cleanup		= __replay_cleanup,
+	.imu_init		= __replay_imu_init,
+	.imu_set_callback	= __replay_imu_set_callback,
+	.imu_power_off		= __replay_imu_power_off,
+	.bmp_read		= __replay_bmp_read,
+	.batt_read		= __replay_batt_read,
+	.esc_send		= __replay_esc_send,
+	.led_set		= __replay_led_set,
+	.time_ns		= __replay_time_ns
+};
@@ -0,0 +1,280 @@
+/**
+ * @file rt_setup.c
+ *
+ * Memory locking, prefaulting, cpu pinning and page fault accounting, see
+ * rt_setup.h
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <rt_setup.h>
+#include <settings.h>
+
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE	6
+#endif
+
+/**
+ * sched_setattr() argument, glibc only wraps it in recent versions
+ */
+typedef struct rt_sched_attr_t{
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+} rt_sched_attr_t;
+
+/**
+ * page fault counters of one thread
+ */
+typedef struct rt_faults_t{
+	uint64_t minor;
+	uint64_t major;
+} rt_faults_t;
+
+// start and end of the initialized data and bss, from crt1 and the linker
+extern char __data_start[];
+extern char _end[];
+
+static const char* const thread_names[RT_NUM_THREADS] = {
+	"imu",
+	"input",
+	"log",
+	"printf",
+	"bmp",
+	"telemetry",
+	"batt"
+};
+
+static int initialized = 0;
+static long page_size;
+static atomic_int marked;
+static rt_faults_t process_base;
+static atomic_int tid[RT_NUM_THREADS];		// 0 until the thread registers
+static rt_faults_t thread_base[RT_NUM_THREADS];
+
+
+/**
+ * @brief      touches every page in a range so it is backed before the
+ *             control path needs it, writing back what was read breaks
+ *             copy on write sharing as well
+ */
+static void __prefault(char* start, char* end)
+{
+	volatile char* p;
+	uintptr_t mask = ~((uintptr_t)page_size-1);
+
+	for(p=(char*)((uintptr_t)start & mask); p<end; p+=page_size) *p = *p;
+}
+
+/**
+ * @brief      grows the stack of the calling thread by
+ *             RT_STACK_PREFAULT_BYTES so later calls don't fault on it
+ */
+static void __attribute__((noinline)) __prefault_stack(void)
+{
+	volatile char buf[RT_STACK_PREFAULT_BYTES];
+	int i;
+
+	for(i=0;i<RT_STACK_PREFAULT_BYTES;i+=page_size) buf[i] = 0;
+	(void)buf[0];
+}
+
+static int __thread_cpu(rt_thread_t t)
+{
+	switch(t){
+	case RT_THREAD_IMU:		return settings.rt_imu_cpu;
+	case RT_THREAD_INPUT:		return settings.rt_input_cpu;
+	case RT_THREAD_LOG:		return settings.rt_log_cpu;
+	case RT_THREAD_PRINTF:		return settings.rt_printf_cpu;
+	case RT_THREAD_BMP:		return settings.rt_bmp_cpu;
+	case RT_THREAD_TELEMETRY:	return settings.rt_telemetry_cpu;
+	case RT_THREAD_BATT:		return settings.rt_batt_cpu;
+	default:			return -1;
+	}
+}
+
+/**
+ * @brief      reads a thread's fault counters out of /proc, works from any
+ *             thread unlike RUSAGE_THREAD
+ *
+ * @return     0 on success, -1 if the thread is gone
+ */
+static int __read_thread_faults(int id, rt_faults_t* f)
+{
+	char path[64], buf[512];
+	char* p;
+	unsigned long long minflt, majflt;
+	FILE* fd;
+	size_t n;
+
+	snprintf(path, sizeof(path), "/proc/self/task/%d/stat", id);
+	fd = fopen(path, "r");
+	if(fd==NULL) return -1;
+	n = fread(buf, 1, sizeof(buf)-1, fd);
+	fclose(fd);
+	buf[n] = 0;
+
+	// the thread name in parentheses may contain spaces, fields after it
+	// are state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt
+	p = strrchr(buf, ')');
+	if(p==NULL) return -1;
+	if(sscanf(p+1, " %*c %*d %*d %*d %*d %*d %*u %llu %*u %llu", &minflt, &majflt)!=2){
+		return -1;
+	}
+	f->minor = minflt;
+	f->major = majflt;
+	return 0;
+}
+
+static void __read_process_faults(rt_faults_t* f)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	f->minor = ru.ru_minflt;
+	f->major = ru.ru_majflt;
+}
+
+/**
+ * @brief      switches the calling thread to SCHED_DEADLINE with a
+ *             reservation of runtime_us every loop period
+ */
+static int __set_deadline(int runtime_us)
+{
+	rt_sched_attr_t attr;
+	uint64_t period_ns = 1000000000ULL/settings.feedback_hz;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.sched_policy = SCHED_DEADLINE;
+	attr.sched_runtime = (uint64_t)runtime_us*1000;
+	attr.sched_deadline = period_ns;
+	attr.sched_period = period_ns;
+	if(syscall(SYS_sched_setattr, 0, &attr, 0)){
+		perror("ERROR in rt_setup_thread, sched_setattr SCHED_DEADLINE");
+		return -1;
+	}
+	return 0;
+}
+
+
+int rt_setup_init(void)
+{
+	pthread_attr_t attr;
+
+	page_size = sysconf(_SC_PAGESIZE);
+
+	// with MCL_FUTURE every thread stack is populated in full when it is
+	// created, so keep them small instead of the 8MB default
+	if(pthread_attr_init(&attr) ||
+	   pthread_attr_setstacksize(&attr, RT_THREAD_STACK_BYTES) ||
+	   pthread_setattr_default_np(&attr)){
+		fprintf(stderr,"ERROR in rt_setup_init, failed to set default thread stack size\n");
+		return -1;
+	}
+	pthread_attr_destroy(&attr);
+
+	if(settings.rt_lock_memory){
+		if(mlockall(MCL_CURRENT|MCL_FUTURE)){
+			perror("ERROR in rt_setup_init, mlockall");
+			return -1;
+		}
+		// keep freed heap memory mapped and locked and never satisfy
+		// malloc with a fresh mmap that would fault on first touch
+		mallopt(M_TRIM_THRESHOLD, -1);
+		mallopt(M_MMAP_MAX, 0);
+		mallopt(M_ARENA_MAX, 1);
+	}
+
+	// covers the controllers in feedback.c, the filters' bookkeeping in
+	// state_estimator.c and every other module's state
+	__prefault(__data_start, _end);
+	__prefault_stack();
+	initialized = 1;
+	return 0;
+}
+
+
+int rt_setup_thread(rt_thread_t t)
+{
+	cpu_set_t set;
+	int cpu;
+
+	if(!initialized) return 0;
+	if(t<0 || t>=RT_NUM_THREADS){
+		fprintf(stderr,"ERROR in rt_setup_thread, invalid thread\n");
+		return -1;
+	}
+	__prefault_stack();
+
+	cpu = __thread_cpu(t);
+	if(cpu>=0){
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set)){
+			fprintf(stderr,"ERROR in rt_setup_thread, failed to pin %s thread to cpu %d\n",\
+				thread_names[t], cpu);
+			return -1;
+		}
+	}
+	if(t==RT_THREAD_IMU && settings.rt_imu_deadline_us>0){
+		if(__set_deadline(settings.rt_imu_deadline_us)) return -1;
+	}
+
+	// threads registering after the mark count from here
+	if(atomic_load(&marked)) __read_thread_faults((int)syscall(SYS_gettid), &thread_base[t]);
+	atomic_store(&tid[t], (int)syscall(SYS_gettid));
+	return 0;
+}
+
+
+void rt_setup_mark(void)
+{
+	int i, id;
+
+	if(!initialized) return;
+	__read_process_faults(&process_base);
+	for(i=0;i<RT_NUM_THREADS;i++){
+		id = atomic_load(&tid[i]);
+		if(id!=0) __read_thread_faults(id, &thread_base[i]);
+	}
+	atomic_store(&marked, 1);
+}
+
+
+int rt_setup_print_report(FILE* f)
+{
+	rt_faults_t now;
+	int i, id;
+
+	if(!initialized || !atomic_load(&marked)) return -1;
+	__read_process_faults(&now);
+	fprintf(f, "page faults since start up   minor     major\n");
+	fprintf(f, "%-20s %13llu %9llu\n", "process",\
+		(unsigned long long)(now.minor-process_base.minor),\
+		(unsigned long long)(now.major-process_base.major));
+	for(i=0;i<RT_NUM_THREADS;i++){
+		id = atomic_load(&tid[i]);
+		if(id==0 || __read_thread_faults(id, &now)) continue;
+		fprintf(f, "%-20s %13llu %9llu\n", thread_names[i],\
+			(unsigned long long)(now.minor-thread_base[i].minor),\
+			(unsigned long long)(now.major-thread_base[i].major));
+	}
+	return 0;
+}
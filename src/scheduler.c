@@ -0,0 +1,158 @@
+/**
+ * @file scheduler.c
+ *
+ * Task table of the IMU callback, see scheduler.h
+ */
+
+#include <stdio.h>
+
+#include <scheduler.h>
+#include <instrumentation.h>
+#include <rc_pilot_defs.h>
+#include <settings.h>
+#include <setpoint_manager.h>
+#include <state_estimator.h>
+#include <feedback.h>
+#include <snapshot.h>
+#include <log_manager.h>
+#include <shm_export.h>
+#include <watchdog.h>
+
+/**
+ * One entry of the task table, named after its instrumentation stage.
+ */
+typedef struct sched_task_t{
+	int (*func)(void);
+	int hz;				///< rate to run at, 0 for every tick
+	int phase;			///< tick within the rate divisor to run on
+	instr_channel_t channel;	///< instrumentation stage the run time goes to
+} sched_task_t;
+
+static int __log_task(void);
+
+// Full rate tasks first in the order the control path needs them, ESC
+// pulses go out at the end of feedback. The slow tasks after it get
+// different phases so they share as few ticks as possible. Two of them meet
+// only when the gcd of their divisors divides their phase difference, so
+// with phases 1 apart the battery and barometer never share a tick while
+// their divisors have a common factor, e.g. 8 and 10 at 200hz or 20 and 25 at
+// 500hz. scheduler_init() warns when they do.
+static const sched_task_t tasks[] = {
+	{setpoint_manager_update,		0,		0,	INSTR_SETPOINT},
+	{state_estimator_march,			0,		0,	INSTR_ESTIMATOR},
+	{feedback_march,			0,		0,	INSTR_FEEDBACK},
+	{__log_task,				0,		0,	INSTR_LOG},
+	{state_estimator_batt_march,		BATT_HZ,	1,	INSTR_BATTERY},
+	{state_estimator_jobs_after_feedback,	BMP_HZ,		0,	INSTR_AFTER_FEEDBACK}
+};
+#define NUM_TASKS (int)(sizeof(tasks)/sizeof(tasks[0]))
+
+static int rate_div[NUM_TASKS];
+static int countdown[NUM_TASKS];	// ticks until the task runs next, 0 runs it
+static int initialized = 0;
+
+
+static int __log_task(void)
+{
+	snapshot_publish_tick();
+	shm_export_publish();
+	// the first thing to go when the loop runs late
+	if(settings.enable_logging && watchdog_level()<WATCHDOG_LEVEL_LOG){
+		return log_manager_add_new();
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      greatest common divisor of two positive numbers
+ */
+static int __gcd(int a, int b)
+{
+	int t;
+
+	while(b!=0){
+		t = a%b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+
+int scheduler_rate_div(int hz)
+{
+	int div;
+
+	if(hz<=0) return 1;
+	div = settings.feedback_hz/hz;
+	return div<1 ? 1 : div;
+}
+
+
+int scheduler_init(void)
+{
+	int i, j, g;
+
+	for(i=0;i<NUM_TASKS;i++){
+		if(tasks[i].phase<0){
+			fprintf(stderr,"ERROR in scheduler_init, %s has negative phase\n",\
+				instr_channel_name(tasks[i].channel));
+			return -1;
+		}
+		// tasks faster than the loop simply run every tick
+		rate_div[i] = scheduler_rate_div(tasks[i].hz);
+		countdown[i] = tasks[i].phase%rate_div[i];
+	}
+
+	// slow tasks whose ticks coincide, runs with the watchdog shedding
+	// rates are not checked
+	for(i=0;i<NUM_TASKS;i++){
+		for(j=i+1;j<NUM_TASKS;j++){
+			if(tasks[i].hz==0 || tasks[j].hz==0) continue;
+			g = __gcd(rate_div[i], rate_div[j]);
+			if((countdown[i]-countdown[j])%g==0 && settings.warnings_en){
+				fprintf(stderr,"WARNING in scheduler_init, %s and %s share a tick every %d ticks\n",\
+					instr_channel_name(tasks[i].channel),\
+					instr_channel_name(tasks[j].channel), rate_div[i]/g*rate_div[j]);
+			}
+		}
+	}
+	initialized = 1;
+	return 0;
+}
+
+
+void scheduler_tick(void)
+{
+	int i;
+	int shed;
+
+	if(!initialized) return;
+	// the watchdog may slow the tasks that don't run every tick
+	shed = watchdog_level()>=WATCHDOG_LEVEL_RATES;
+	// count down instead of taking the tick modulo the divisor, there is
+	// no hardware divide on the Cortex-A8
+	for(i=0;i<NUM_TASKS;i++){
+		if(countdown[i]>0){
+			countdown[i]--;
+			continue;
+		}
+		if(shed && tasks[i].hz>0) countdown[i] = rate_div[i]*WATCHDOG_SHED_RATE_DIV-1;
+		else countdown[i] = rate_div[i]-1;
+		tasks[i].func();
+		instr_stage_end(tasks[i].channel);
+	}
+}
+
+
+void scheduler_print(FILE* f)
+{
+	int i;
+
+	fprintf(f, "task                hz   div phase\n");
+	for(i=0;i<NUM_TASKS;i++){
+		fprintf(f, "%-16s %5d %5d %5d\n", instr_channel_name(tasks[i].channel),\
+			settings.feedback_hz/rate_div[i], rate_div[i], tasks[i].phase%rate_div[i]);
+	}
+}
@@ -8,6 +8,7 @@
 #include <string.h> // for memset
 
 #include <rc/start_stop.h>
+#include <rc/time.h>
 
 #include <setpoint_manager.h>
 #include <settings.h>
@@ -16,25 +17,32 @@
 #include <state_estimator.h>
 #include <rc_pilot_defs.h>
 #include <flight_mode.h>
+#include <snapshot.h>
+#include <instrumentation.h>
+#include <trajectory.h>
 
 #define XYZ_MAX_ERROR	0.5 ///< meters.
 
 setpoint_t setpoint; // extern variable in setpoint_manager.h
 
+// coherent copy of user_input taken at the start of every update, the
+// input_manager and dsm threads can preempt the IMU callback mid-write
+static user_input_t ui;
+
 
 void __update_yaw(void)
 {
 	// if throttle stick is down all the way, probably landed, so
 	// keep the yaw setpoint at current yaw so it takes off straight
-	if(user_input.thr_stick < -0.95){
+	if(ui.thr_stick < -0.95){
 		setpoint.yaw = state_estimate.yaw;
 		setpoint.yaw_dot = 0.0;
 		return;
 	}
 	// otherwise, scale yaw_rate by max yaw rate in rad/s
 	// and move yaw setpoint
-	setpoint.yaw_dot = user_input.yaw_stick * MAX_YAW_RATE;
-	setpoint.yaw += setpoint.yaw_dot*DT;
+	setpoint.yaw_dot = ui.yaw_stick * MAX_YAW_RATE;
+	setpoint.yaw += setpoint.yaw_dot*settings.dt;
 	return;
 }
 
@@ -47,8 +55,8 @@ void __update_Z(void)
 		setpoint.Z_dot = 0.0;
 		return;
 	}
-	setpoint.Z_dot = -user_input.thr_stick * settings.max_Z_velocity;
-	setpoint.Z += setpoint.Z_dot*DT;
+	setpoint.Z_dot = -ui.thr_stick * settings.max_Z_velocity;
+	setpoint.Z += setpoint.Z_dot*settings.dt;
 	return;
 }
 
@@ -65,7 +73,7 @@ void __update_XY_pos(void)
 		return;
 	}
 	else{
-		setpoint.X += setpoint.X_dot*DT;
+		setpoint.X += setpoint.X_dot*settings.dt;
 	}
 
 	if(setpoint.Y > (state_estimate.Y + XYZ_MAX_ERROR)){
@@ -79,12 +87,61 @@ void __update_XY_pos(void)
 		return;
 	}
 	else{
-		setpoint.Y += setpoint.Y_dot*DT;
+		setpoint.Y += setpoint.Y_dot*settings.dt;
 	}
 
 	return;
 }
 
+/**
+ * @brief      stops a running trajectory and clears its feed forward, called
+ *             whenever the vehicle is not flying one
+ */
+static void __stop_trajectory(void)
+{
+	if(!trajectory_is_running()) return;
+	trajectory_stop();
+	setpoint.X_ddot = 0.0;
+	setpoint.Y_ddot = 0.0;
+	setpoint.Z_ddot = 0.0;
+	return;
+}
+
+void __update_trajectory(void)
+{
+	traj_point_t p;
+	double origin[TRAJ_NUM_AXES];
+
+	// starts over from wherever the vehicle is every time it arms in this
+	// mode, altitude and yaw from the setpoint so there is no step
+	if(fstate.arm_state!=ARMED) __stop_trajectory();
+	else if(!trajectory_is_running()){
+		origin[TRAJ_X]		= state_estimate.X;
+		origin[TRAJ_Y]		= state_estimate.Y;
+		origin[TRAJ_Z]		= setpoint.Z;
+		origin[TRAJ_YAW]	= setpoint.yaw;
+		trajectory_start(origin);
+	}
+	// disarmed or nothing loaded, altitude and yaw stay on the sticks
+	if(trajectory_step(&p)){
+		__update_Z();
+		__update_yaw();
+		return;
+	}
+	setpoint.X	= p.pos[TRAJ_X];
+	setpoint.Y	= p.pos[TRAJ_Y];
+	setpoint.Z	= p.pos[TRAJ_Z];
+	setpoint.yaw	= p.pos[TRAJ_YAW];
+	setpoint.X_dot	= p.vel[TRAJ_X];
+	setpoint.Y_dot	= p.vel[TRAJ_Y];
+	setpoint.Z_dot	= p.vel[TRAJ_Z];
+	setpoint.yaw_dot	= p.vel[TRAJ_YAW];
+	setpoint.X_ddot	= p.acc[TRAJ_X];
+	setpoint.Y_ddot	= p.acc[TRAJ_Y];
+	setpoint.Z_ddot	= p.acc[TRAJ_Z];
+	return;
+}
+
 
 int setpoint_manager_init(void)
 {
@@ -101,27 +158,44 @@ int setpoint_manager_init(void)
 
 int setpoint_manager_update(void)
 {
+	uint64_t now;
+
+	// on a collision with the writer just keep last tick's input
+	snapshot_get_user_input(&ui);
+
 	if(setpoint.initialized==0){
 		fprintf(stderr, "ERROR in setpoint_manager_update, not initialized yet\n");
 		return -1;
 	}
 
-	if(user_input.initialized==0){
+	if(ui.initialized==0){
 		fprintf(stderr, "ERROR in setpoint_manager_update, input_manager not initialized yet\n");
 		return -1;
 	}
 
+	// age of the radio frame behind this setpoint
+	now = rc_nanos_since_boot();
+	setpoint.input_ns = ui.frame_ns;
+	if(ui.frame_ns!=0 && now>ui.frame_ns) setpoint.input_age_ns = now-ui.frame_ns;
+	else setpoint.input_age_ns = 0;
+
 	// if PAUSED or UNINITIALIZED, do nothing
 	if(rc_get_state()!=RUNNING) return 0;
 
 	// shutdown feedback on kill switch
-	if(user_input.requested_arm_mode == DISARMED){
+	if(ui.requested_arm_mode == DISARMED){
 		if(fstate.arm_state==ARMED) feedback_disarm();
+		__stop_trajectory();
 		return 0;
 	}
 
+	// switching out of a trajectory mode abandons the trajectory
+	if(ui.flight_mode!=TRAJECTORY_4DOF && ui.flight_mode!=TRAJECTORY_6DOF){
+		__stop_trajectory();
+	}
+
 	// finally, switch between flight modes and adjust setpoint properly
-	switch(user_input.flight_mode){
+	switch(ui.flight_mode){
 
 
 	case TEST_BENCH_4DOF:
@@ -132,13 +206,13 @@ int setpoint_manager_update(void)
 		setpoint.en_XY_vel_ctrl	= 0;
 		setpoint.en_XY_pos_ctrl	= 0;
 
-		setpoint.roll_throttle	=  user_input.roll_stick;
-		setpoint.pitch_throttle	=  user_input.pitch_stick;
-		setpoint.yaw_throttle	=  user_input.yaw_stick;
-		setpoint.Z_throttle	= -user_input.thr_stick;
+		setpoint.roll_throttle	=  ui.roll_stick;
+		setpoint.pitch_throttle	=  ui.pitch_stick;
+		setpoint.yaw_throttle	=  ui.yaw_stick;
+		setpoint.Z_throttle	= -ui.thr_stick;
 		// TODO add these two throttle modes as options to settings, I use a radio
 		// with self-centering throttle so having 0 in the middle is safest
-		// setpoint.Z_throttle = -(user_input.thr_stick+1.0)/2.0;
+		// setpoint.Z_throttle = -(ui.thr_stick+1.0)/2.0;
 		break;
 
 	case TEST_BENCH_6DOF:
@@ -148,12 +222,12 @@ int setpoint_manager_update(void)
 		setpoint.en_XY_vel_ctrl	= 0;
 		setpoint.en_XY_pos_ctrl	= 0;
 
-		setpoint.X_throttle	= -user_input.pitch_stick;
-		setpoint.Y_throttle	=  user_input.roll_stick;
+		setpoint.X_throttle	= -ui.pitch_stick;
+		setpoint.Y_throttle	=  ui.roll_stick;
 		setpoint.roll_throttle	=  0.0;
 		setpoint.pitch_throttle	=  0.0;
-		setpoint.yaw_throttle	=  user_input.yaw_stick;
-		setpoint.Z_throttle	= -user_input.thr_stick;
+		setpoint.yaw_throttle	=  ui.yaw_stick;
+		setpoint.Z_throttle	= -ui.thr_stick;
 		break;
 
 	case DIRECT_THROTTLE_4DOF:
@@ -163,9 +237,9 @@ int setpoint_manager_update(void)
 		setpoint.en_XY_vel_ctrl	= 0;
 		setpoint.en_XY_pos_ctrl	= 0;
 
-		setpoint.roll		=  user_input.roll_stick;
-		setpoint.pitch		=  user_input.pitch_stick;
-		setpoint.Z_throttle	= -user_input.thr_stick;
+		setpoint.roll		=  ui.roll_stick;
+		setpoint.pitch		=  ui.pitch_stick;
+		setpoint.Z_throttle	= -ui.thr_stick;
 		__update_yaw();
 		break;
 
@@ -176,9 +250,9 @@ int setpoint_manager_update(void)
 		setpoint.en_XY_vel_ctrl	= 0;
 		setpoint.en_XY_pos_ctrl	= 0;
 
-		setpoint.X_throttle	= -user_input.pitch_stick;
-		setpoint.Y_throttle	=  user_input.roll_stick;
-		setpoint.Z_throttle	= -user_input.thr_stick;
+		setpoint.X_throttle	= -ui.pitch_stick;
+		setpoint.Y_throttle	=  ui.roll_stick;
+		setpoint.Z_throttle	= -ui.thr_stick;
 		__update_yaw();
 		break;
 
@@ -189,8 +263,8 @@ int setpoint_manager_update(void)
 		setpoint.en_XY_vel_ctrl	= 0;
 		setpoint.en_XY_pos_ctrl	= 0;
 
-		setpoint.roll		= user_input.roll_stick;
-		setpoint.pitch		= user_input.pitch_stick;
+		setpoint.roll		= ui.roll_stick;
+		setpoint.pitch		= ui.pitch_stick;
 		__update_Z();
 		__update_yaw();
 		break;
@@ -204,8 +278,8 @@ int setpoint_manager_update(void)
 
 		setpoint.roll		= 0.0;
 		setpoint.pitch		= 0.0;
-		setpoint.X_throttle	= -user_input.pitch_stick;
-		setpoint.Y_throttle	=  user_input.roll_stick;
+		setpoint.X_throttle	= -ui.pitch_stick;
+		setpoint.Y_throttle	=  ui.roll_stick;
 		__update_Z();
 		__update_yaw();
 		break;
@@ -217,8 +291,8 @@ int setpoint_manager_update(void)
 		setpoint.en_XY_vel_ctrl	= 1;
 		setpoint.en_XY_pos_ctrl	= 0;
 
-		setpoint.X_dot = -user_input.pitch_stick * settings.max_XY_velocity;
-		setpoint.Y_dot =  user_input.roll_stick  * settings.max_XY_velocity;
+		setpoint.X_dot = -ui.pitch_stick * settings.max_XY_velocity;
+		setpoint.Y_dot =  ui.roll_stick  * settings.max_XY_velocity;
 		__update_Z();
 		__update_yaw();
 		break;
@@ -230,8 +304,8 @@ int setpoint_manager_update(void)
 		setpoint.en_XY_vel_ctrl	= 1;
 		setpoint.en_XY_pos_ctrl	= 0;
 
-		setpoint.X_dot = -user_input.pitch_stick * settings.max_XY_velocity;
-		setpoint.Y_dot =  user_input.roll_stick  * settings.max_XY_velocity;
+		setpoint.X_dot = -ui.pitch_stick * settings.max_XY_velocity;
+		setpoint.Y_dot =  ui.roll_stick  * settings.max_XY_velocity;
 		__update_Z();
 		__update_yaw();
 		break;
@@ -243,8 +317,8 @@ int setpoint_manager_update(void)
 		setpoint.en_XY_vel_ctrl	= 0;
 		setpoint.en_XY_pos_ctrl	= 1;
 
-		setpoint.X_dot = -user_input.pitch_stick * settings.max_XY_velocity;
-		setpoint.Y_dot =  user_input.roll_stick  * settings.max_XY_velocity;
+		setpoint.X_dot = -ui.pitch_stick * settings.max_XY_velocity;
+		setpoint.Y_dot =  ui.roll_stick  * settings.max_XY_velocity;
 		__update_XY_pos();
 		__update_Z();
 		__update_yaw();
@@ -257,28 +331,67 @@ int setpoint_manager_update(void)
 		setpoint.en_XY_vel_ctrl	= 0;
 		setpoint.en_XY_pos_ctrl	= 1;
 
-		setpoint.X_dot = -user_input.pitch_stick * settings.max_XY_velocity;
-		setpoint.Y_dot =  user_input.roll_stick  * settings.max_XY_velocity;
+		setpoint.X_dot = -ui.pitch_stick * settings.max_XY_velocity;
+		setpoint.Y_dot =  ui.roll_stick  * settings.max_XY_velocity;
 		__update_XY_pos();
 		__update_Z();
 		__update_yaw();
 		break;
 
+	case TRAJECTORY_4DOF:
+		setpoint.en_6dof	= 0;
+		setpoint.en_rpy_ctrl	= 1;
+		setpoint.en_Z_ctrl	= 1;
+		setpoint.en_XY_vel_ctrl	= 0;
+		setpoint.en_XY_pos_ctrl	= 0;
+
+		setpoint.roll		= ui.roll_stick;
+		setpoint.pitch		= ui.pitch_stick;
+		__update_trajectory();
+		break;
+
+	case TRAJECTORY_6DOF:
+		setpoint.en_6dof	= 1;
+		setpoint.en_rpy_ctrl	= 1;
+		setpoint.en_Z_ctrl	= 1;
+		setpoint.en_XY_vel_ctrl	= 0;
+		setpoint.en_XY_pos_ctrl	= 0;
+
+		setpoint.roll		= 0.0;
+		setpoint.pitch		= 0.0;
+		setpoint.X_throttle	= -ui.pitch_stick;
+		setpoint.Y_throttle	=  ui.roll_stick;
+		__update_trajectory();
+		break;
+
 	default: // should never get here
 		fprintf(stderr,"ERROR in setpoint_manager thread, unknown flight mode\n");
 		break;
 
-	} // end switch(user_input.flight_mode)
+	} // end switch(ui.flight_mode)
 
 	// arm feedback when requested
-	if(user_input.requested_arm_mode == ARMED){
+	if(ui.requested_arm_mode == ARMED){
 		if(fstate.arm_state==DISARMED) feedback_arm();
 	}
+	// the sticks reach the motors this tick
+	instr_mark_input(ui.frame_ns);
 
 	return 0;
 }
 
 
+int setpoint_manager_get_input(user_input_t* input)
+{
+	if(input==NULL){
+		fprintf(stderr,"ERROR in setpoint_manager_get_input, received NULL pointer\n");
+		return -1;
+	}
+	*input = ui;
+	return 0;
+}
+
+
 int setpoint_manager_cleanup(void)
 {
 	setpoint.initialized=0;
@@ -15,6 +15,9 @@
 
 #include <settings.h>
 #include <rc_pilot_defs.h>
+#include <thread_defs.h>
+#include <rt_setup.h>
+#include <watchdog.h>
 
 
 // json object respresentation of the whole settings file
@@ -117,6 +120,11 @@ if(json_object_is_type(tmp, json_type_string)==0){\
 	fprintf(stderr,"ERROR parsing settings file, " #name " should be a string\n");\
 	return -1;\
 }\
+if(strlen(json_object_get_string(tmp))>=sizeof(settings.name)){\
+	fprintf(stderr,"ERROR parsing settings file, " #name " should be at most %d characters\n",\
+						(int)sizeof(settings.name)-1);\
+	return -1;\
+}\
 strcpy(settings.name, json_object_get_string(tmp));
 
 // macro for reading feedback controller
@@ -125,16 +133,156 @@ if(json_object_object_get_ex(jobj, #name, &tmp)==0){\
 	fprintf(stderr,"ERROR: can't find " #name " in settings file\n");\
 	return -1;\
 }\
-if(__parse_controller(tmp, &settings.name)){\
+if(__parse_controller(tmp, &settings.name##_spec)){\
 	fprintf(stderr,"ERROR: could not parse " #name "\n");\
 	return -1;\
 }\
+if(controller_from_spec(&settings.name, &settings.name##_spec, settings.dt)){\
+	fprintf(stderr,"ERROR: could not build " #name "\n");\
+	return -1;\
+}\
 
 
 ////////////////////////////////////////////////////////////////////////////////
 /// functions for parsing enums
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * @brief      reads a number that may be written as an int or a double
+ *
+ * @return     0 on success, -1 if obj is neither
+ */
+static int __get_number(json_object* obj, double* out)
+{
+	if(!json_object_is_type(obj, json_type_double) && !json_object_is_type(obj, json_type_int)){
+		return -1;
+	}
+	*out = json_object_get_double(obj);
+	return 0;
+}
+
+/**
+ * @brief      pulls the custom_layout object used with LAYOUT_CUSTOM into the
+ *             settings struct
+ *
+ * It holds either a "rotors" array of {"x", "y", "spin"} objects in motor
+ * order, spin being "cw" or "ccw" seen from above, from which mix_init()
+ * works out a 4 dof matrix, or a "matrix" array with one row of X, Y, Z,
+ * roll, pitch and yaw coefficients per motor along with "dof" 4 or 6.
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __parse_custom_layout(void)
+{
+	struct json_object *obj = NULL;
+	struct json_object *array = NULL;
+	struct json_object *row = NULL;
+	struct json_object *tmp = NULL;
+	const char* spin;
+	int i, j, n, thrust;
+
+	memset(settings.custom_rotors, 0, sizeof(settings.custom_rotors));
+	memset(settings.custom_matrix, 0, sizeof(settings.custom_matrix));
+	if(json_object_object_get_ex(jobj, "custom_layout", &obj)==0){
+		fprintf(stderr,"ERROR: LAYOUT_CUSTOM needs custom_layout in settings file\n");
+		return -1;
+	}
+
+	if(json_object_object_get_ex(obj, "rotors", &array)){
+		if(json_object_is_type(array, json_type_array)==0){
+			fprintf(stderr,"ERROR: custom_layout rotors should be an array\n");
+			return -1;
+		}
+		n = json_object_array_length(array);
+		if(n<4 || n>MAX_ROTORS){
+			fprintf(stderr,"ERROR: custom_layout needs 4 to %d rotors\n", MAX_ROTORS);
+			return -1;
+		}
+		for(i=0;i<n;i++){
+			row = json_object_array_get_idx(array, i);
+			if(json_object_object_get_ex(row, "x", &tmp)==0 ||
+			   __get_number(tmp, &settings.custom_rotors[i].x) ||
+			   json_object_object_get_ex(row, "y", &tmp)==0 ||
+			   __get_number(tmp, &settings.custom_rotors[i].y)){
+				fprintf(stderr,"ERROR: custom_layout rotor %d needs numbers x and y\n", i+1);
+				return -1;
+			}
+			if(json_object_object_get_ex(row, "spin", &tmp)==0 ||
+			   json_object_is_type(tmp, json_type_string)==0){
+				fprintf(stderr,"ERROR: custom_layout rotor %d needs spin \"cw\" or \"ccw\"\n", i+1);
+				return -1;
+			}
+			spin = json_object_get_string(tmp);
+			if(strcmp(spin, "ccw")==0) settings.custom_rotors[i].ccw = 1;
+			else if(strcmp(spin, "cw")==0) settings.custom_rotors[i].ccw = 0;
+			else{
+				fprintf(stderr,"ERROR: custom_layout rotor %d needs spin \"cw\" or \"ccw\"\n", i+1);
+				return -1;
+			}
+		}
+		settings.num_rotors = n;
+		settings.dof = 4;
+		settings.custom_by_geometry = 1;
+		return 0;
+	}
+
+	if(json_object_object_get_ex(obj, "matrix", &array)==0){
+		fprintf(stderr,"ERROR: custom_layout should contain rotors or matrix\n");
+		return -1;
+	}
+	if(json_object_is_type(array, json_type_array)==0){
+		fprintf(stderr,"ERROR: custom_layout matrix should be an array\n");
+		return -1;
+	}
+	// fewer motors than thrust, roll, pitch and yaw can't be controlled
+	n = json_object_array_length(array);
+	if(n<4 || n>MAX_ROTORS){
+		fprintf(stderr,"ERROR: custom_layout matrix needs 4 to %d rows\n", MAX_ROTORS);
+		return -1;
+	}
+	for(i=0;i<n;i++){
+		row = json_object_array_get_idx(array, i);
+		if(json_object_is_type(row, json_type_array)==0 ||
+		   json_object_array_length(row)!=MAX_INPUTS){
+			fprintf(stderr,"ERROR: custom_layout matrix rows should hold %d numbers, X Y Z roll pitch yaw\n", MAX_INPUTS);
+			return -1;
+		}
+		for(j=0;j<MAX_INPUTS;j++){
+			if(__get_number(json_object_array_get_idx(row, j), &settings.custom_matrix[i][j])){
+				fprintf(stderr,"ERROR: custom_layout matrix entries should be numbers\n");
+				return -1;
+			}
+		}
+	}
+	// throttle is negative Z in the built in tables, a positive entry would
+	// make that motor slow down as throttle goes up
+	thrust = 0;
+	for(i=0;i<n;i++){
+		if(settings.custom_matrix[i][VEC_Z]>0.0){
+			fprintf(stderr,"ERROR: custom_layout matrix row %d has a positive Z entry, throttle is negative like the built in layouts\n", i+1);
+			return -1;
+		}
+		if(settings.custom_matrix[i][VEC_Z]<0.0) thrust = 1;
+	}
+	if(!thrust){
+		fprintf(stderr,"ERROR: custom_layout matrix has no throttle, every Z entry is 0\n");
+		return -1;
+	}
+	if(json_object_object_get_ex(obj, "dof", &tmp)==0 ||
+	   json_object_is_type(tmp, json_type_int)==0){
+		fprintf(stderr,"ERROR: custom_layout matrix needs dof 4 or 6\n");
+		return -1;
+	}
+	settings.dof = json_object_get_int(tmp);
+	if(settings.dof!=4 && settings.dof!=6){
+		fprintf(stderr,"ERROR: custom_layout matrix needs dof 4 or 6\n");
+		return -1;
+	}
+	settings.num_rotors = n;
+	settings.custom_by_geometry = 0;
+	return 0;
+}
+
 /**
  * @brief      pulls rotor layout out of json object into settings struct
  *
@@ -155,24 +303,33 @@ static int __parse_layout(void)
 	tmp_str = (char*)json_object_get_string(tmp);
 	if(strcmp(tmp_str, "LAYOUT_6DOF_ROTORBITS")==0){
 		settings.num_rotors = 6;
+		settings.dof = 6;
 		settings.layout = LAYOUT_6DOF_ROTORBITS;
 	}
 	else if(strcmp(tmp_str, "LAYOUT_4X")==0){
 		settings.num_rotors = 4;
+		settings.dof = 4;
 		settings.layout = LAYOUT_4X;
 	}
 	else if(strcmp(tmp_str, "LAYOUT_4PLUS")==0){
 		settings.num_rotors = 4;
+		settings.dof = 4;
 		settings.layout = LAYOUT_4PLUS;
 	}
 	else if(strcmp(tmp_str, "LAYOUT_6X")==0){
 		settings.num_rotors = 6;
+		settings.dof = 4;
 		settings.layout = LAYOUT_6X;
 	}
 	else if(strcmp(tmp_str, "LAYOUT_8X")==0){
 		settings.num_rotors = 8;
+		settings.dof = 4;
 		settings.layout = LAYOUT_8X;
 	}
+	else if(strcmp(tmp_str, "LAYOUT_CUSTOM")==0){
+		settings.layout = LAYOUT_CUSTOM;
+		return __parse_custom_layout();
+	}
 	else{
 		fprintf(stderr,"ERROR: invalid layout string\n");
 		return -1;
@@ -214,6 +371,152 @@ static int __parse_thrust_map(void)
 }
 
 
+static int __parse_log_format(void)
+{
+	struct json_object *tmp = NULL;
+	char* tmp_str = NULL;
+	if(json_object_object_get_ex(jobj, "log_format", &tmp)==0){
+		fprintf(stderr,"ERROR: can't find log_format in settings file\n");
+		return -1;
+	}
+	if(json_object_is_type(tmp, json_type_string)==0){
+		fprintf(stderr,"ERROR: log_format should be a string\n");
+		return -1;
+	}
+	tmp_str = (char*)json_object_get_string(tmp);
+	if(strcmp(tmp_str, "csv")==0){
+		settings.log_format = LOG_FORMAT_CSV;
+	}
+	else if(strcmp(tmp_str, "binary")==0){
+		settings.log_format = LOG_FORMAT_BINARY;
+	}
+	else{
+		fprintf(stderr,"ERROR: invalid log_format string, should be csv or binary\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+static int __parse_log_compression(void)
+{
+	struct json_object *tmp = NULL;
+	char* tmp_str = NULL;
+	if(json_object_object_get_ex(jobj, "log_compression", &tmp)==0){
+		fprintf(stderr,"ERROR: can't find log_compression in settings file\n");
+		return -1;
+	}
+	if(json_object_is_type(tmp, json_type_string)==0){
+		fprintf(stderr,"ERROR: log_compression should be a string\n");
+		return -1;
+	}
+	tmp_str = (char*)json_object_get_string(tmp);
+	if(strcmp(tmp_str, "none")==0){
+		settings.log_compression = LOG_COMPRESSION_NONE;
+	}
+	else if(strcmp(tmp_str, "lz4")==0){
+		settings.log_compression = LOG_COMPRESSION_LZ4;
+	}
+	else if(strcmp(tmp_str, "zstd")==0){
+		settings.log_compression = LOG_COMPRESSION_ZSTD;
+	}
+	else{
+		fprintf(stderr,"ERROR: invalid log_compression string, should be none, lz4 or zstd\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+static int __parse_watchdog_shed_limit(void)
+{
+	struct json_object *tmp = NULL;
+	char* tmp_str = NULL;
+	int i;
+	if(json_object_object_get_ex(jobj, "watchdog_shed_limit", &tmp)==0){
+		fprintf(stderr,"ERROR: can't find watchdog_shed_limit in settings file\n");
+		return -1;
+	}
+	if(json_object_is_type(tmp, json_type_string)==0){
+		fprintf(stderr,"ERROR: watchdog_shed_limit should be a string\n");
+		return -1;
+	}
+	tmp_str = (char*)json_object_get_string(tmp);
+	for(i=0;i<WATCHDOG_NUM_LEVELS;i++){
+		if(strcmp(tmp_str, watchdog_level_name(i))==0){
+			settings.watchdog_shed_limit = i;
+			return 0;
+		}
+	}
+	fprintf(stderr,"ERROR: invalid watchdog_shed_limit string, should be none, log, printf, rates or failsafe\n");
+	return -1;
+}
+
+
+static int __parse_imu_mode(void)
+{
+	struct json_object *tmp = NULL;
+	char* tmp_str = NULL;
+	if(json_object_object_get_ex(jobj, "imu_mode", &tmp)==0){
+		fprintf(stderr,"ERROR: can't find imu_mode in settings file\n");
+		return -1;
+	}
+	if(json_object_is_type(tmp, json_type_string)==0){
+		fprintf(stderr,"ERROR: imu_mode should be a string\n");
+		return -1;
+	}
+	tmp_str = (char*)json_object_get_string(tmp);
+	if(strcmp(tmp_str, "dmp")==0){
+		settings.imu_mode = IMU_MODE_DMP;
+	}
+	else if(strcmp(tmp_str, "raw")==0){
+		settings.imu_mode = IMU_MODE_RAW;
+	}
+	else{
+		fprintf(stderr,"ERROR: invalid imu_mode string, should be dmp or raw\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+/**
+ * @brief      checks feedback_hz against what the imu_mode can deliver and
+ *             fills in dt
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __check_feedback_hz(void)
+{
+	switch(settings.imu_mode){
+	case IMU_MODE_DMP:
+		if(settings.feedback_hz<DMP_MIN_HZ || settings.feedback_hz>DMP_MAX_HZ ||
+		   DMP_MAX_HZ%settings.feedback_hz!=0){
+			fprintf(stderr,"ERROR: with imu_mode dmp feedback_hz must divide %d evenly\n", DMP_MAX_HZ);
+			return -1;
+		}
+		break;
+	case IMU_MODE_RAW:
+		if(settings.feedback_hz<RAW_IMU_MIN_HZ || settings.feedback_hz>RAW_IMU_MAX_HZ){
+			fprintf(stderr,"ERROR: with imu_mode raw feedback_hz must be between %d and %d\n",\
+							RAW_IMU_MIN_HZ, RAW_IMU_MAX_HZ);
+			return -1;
+		}
+		// the complementary filter only does roll and pitch from accel
+		if(settings.enable_magnetometer){
+			fprintf(stderr,"ERROR: imu_mode raw does not support the magnetometer\n");
+			return -1;
+		}
+		break;
+	default:
+		fprintf(stderr,"ERROR: unknown imu_mode\n");
+		return -1;
+	}
+	settings.dt = 1.0/settings.feedback_hz;
+	return 0;
+}
+
+
 /**
  * @brief      parses a json_object and fills in the flight mode.
  *
@@ -261,6 +564,12 @@ static int __parse_flight_mode(json_object* jobj_str, flight_mode_t* mode)
 	else if(strcmp(tmp_str, "POSITION_CONTROL_6DOF")==0){
 		*mode = POSITION_CONTROL_6DOF;
 	}
+	else if(strcmp(tmp_str, "TRAJECTORY_4DOF")==0){
+		*mode = TRAJECTORY_4DOF;
+	}
+	else if(strcmp(tmp_str, "TRAJECTORY_6DOF")==0){
+		*mode = TRAJECTORY_6DOF;
+	}
 	else{
 		fprintf(stderr,"ERROR: invalid flight mode\n");
 		return -1;
@@ -298,25 +607,24 @@ static int __parse_kill_mode(void)
 
 
 /**
- * @ brief     parses a json_object and sets up a new controller
+ * @ brief     parses a json_object into a controller description
+ *
+ * The description is kept in the settings so the controller can be rebuilt
+ * with controller_from_spec() when it is retuned while running.
  *
  * @param      jobj         The jobj to parse
- * @param      filter       pointer to write the new filter to
+ * @param      spec         pointer to write the description to
  *
  * @return     0 on success, -1 on failure
  */
-static int __parse_controller(json_object* jobj_ctl, rc_filter_t* filter)
+static int __parse_controller(json_object* jobj_ctl, controller_spec_t* spec)
 {
 	struct json_object *array = NULL;	// to hold num & den arrays
 	struct json_object *tmp = NULL;		// temp object
 	char* tmp_str = NULL;
-	double tmp_flt, tmp_kp, tmp_ki, tmp_kd;
-	int i, num_len, den_len;
-	rc_vector_t num_vec = RC_VECTOR_INITIALIZER;
-	rc_vector_t den_vec = RC_VECTOR_INITIALIZER;
+	int i;
 
-	// destroy old memory in case the order changes
-	rc_filter_free(filter);
+	memset(spec, 0, sizeof(controller_spec_t));
 
 	// pull out gain
 	if(json_object_object_get_ex(jobj_ctl, "gain", &tmp)==0){
@@ -327,7 +635,7 @@ static int __parse_controller(json_object* jobj_ctl, rc_filter_t* filter)
 		fprintf(stderr,"ERROR: controller gain should be a double\n");
 		return -1;
 	}
-	tmp_flt = json_object_get_double(tmp);
+	spec->gain = json_object_get_double(tmp);
 
 	// check if PID gains or transfer function coefficients
 	if(json_object_object_get_ex(jobj_ctl, "TF_or_PID", &tmp)==0){
@@ -351,23 +659,24 @@ static int __parse_controller(json_object* jobj_ctl, rc_filter_t* filter)
 			fprintf(stderr,"ERROR: controller numerator should be an array\n");
 			return -1;
 		}
-		num_len = json_object_array_length(array);
-		if(num_len<1){
+		spec->num_len = json_object_array_length(array);
+		if(spec->num_len<1){
 			fprintf(stderr,"ERROR, numerator must have at least 1 entry\n");
 			return -1;
 		}
-		rc_vector_alloc(&num_vec,num_len);
-		for(i=0;i<num_len;i++){
+		if(spec->num_len>CONTROLLER_MAX_ORDER+1){
+			fprintf(stderr,"ERROR, numerator can have at most %d entries\n", CONTROLLER_MAX_ORDER+1);
+			return -1;
+		}
+		for(i=0;i<spec->num_len;i++){
 			tmp = json_object_array_get_idx(array,i);
 			if(json_object_is_type(tmp, json_type_double)==0){
 				fprintf(stderr,"ERROR: numerator array entries should be a doubles\n");
 				return -1;
 			}
-			tmp_flt = json_object_get_double(tmp);
-			num_vec.d[i]=tmp_flt;
+			spec->num[i] = json_object_get_double(tmp);
 		}
 
-
 		// pull out denominator
 		if(json_object_object_get_ex(jobj_ctl, "denominator", &array)==0){
 			fprintf(stderr,"ERROR: can't find controller denominator in settings file\n");
@@ -377,27 +686,27 @@ static int __parse_controller(json_object* jobj_ctl, rc_filter_t* filter)
 			fprintf(stderr,"ERROR: controller denominator should be an array\n");
 			return -1;
 		}
-		den_len = json_object_array_length(array);
-		if(den_len<1){
+		spec->den_len = json_object_array_length(array);
+		if(spec->den_len<1){
 			fprintf(stderr,"ERROR, denominator must have at least 1 entry\n");
 			return -1;
 		}
-		rc_vector_alloc(&den_vec,den_len);
-		for(i=0;i<den_len;i++){
+		if(spec->den_len>CONTROLLER_MAX_ORDER+1){
+			fprintf(stderr,"ERROR, denominator can have at most %d entries\n", CONTROLLER_MAX_ORDER+1);
+			return -1;
+		}
+		for(i=0;i<spec->den_len;i++){
 			tmp = json_object_array_get_idx(array,i);
 			if(json_object_is_type(tmp, json_type_double)==0){
 				fprintf(stderr,"ERROR: denominator array entries should be a doubles\n");
 				return -1;
 			}
-			tmp_flt = json_object_get_double(tmp);
-			den_vec.d[i]=tmp_flt;
+			spec->den[i] = json_object_get_double(tmp);
 		}
 
 		// check for improper TF
-		if(num_len>den_len){
+		if(spec->num_len>spec->den_len){
 			fprintf(stderr,"ERROR: improper transfer function\n");
-			rc_vector_free(&num_vec);
-			rc_vector_free(&den_vec);
 			return -1;
 		}
 
@@ -412,9 +721,9 @@ static int __parse_controller(json_object* jobj_ctl, rc_filter_t* filter)
 		}
 		tmp_str = (char*)json_object_get_string(tmp);
 
-
 		// if CT, use tustin's approx to get to DT
 		if(strcmp(tmp_str, "CT")==0){
+			spec->continuous = 1;
 			// get the crossover frequency
 			if(json_object_object_get_ex(jobj_ctl, "crossover_freq_rad_per_sec", &tmp)==0){
 				fprintf(stderr,"ERROR: can't find crossover frequency in settings file\n");
@@ -424,19 +733,12 @@ static int __parse_controller(json_object* jobj_ctl, rc_filter_t* filter)
 				fprintf(stderr,"ERROR: crossover frequency should be a double\n");
 				return -1;
 			}
-			tmp_flt = json_object_get_double(tmp);
-			if(rc_filter_c2d_tustin(filter, DT, num_vec, den_vec, tmp_flt)){
-				fprintf(stderr,"ERROR: failed to c2dtustin while parsing json\n");
-				return -1;
-			}
+			spec->crossover_freq = json_object_get_double(tmp);
 		}
 
-		// if DT, much easier, just construct filter
+		// if DT, much easier, coefficients are used as they are
 		else if(strcmp(tmp_str, "DT")==0){
-			if(rc_filter_alloc(filter,num_vec, den_vec, DT)){
-				fprintf(stderr,"ERROR: failed to alloc filter in __parse_controller()");
-				return -1;
-			}
+			spec->continuous = 0;
 		}
 
 		// wrong value for CT_or_DT
@@ -448,22 +750,23 @@ static int __parse_controller(json_object* jobj_ctl, rc_filter_t* filter)
 	}
 
 	else if(strcmp(tmp_str, "PID")==0){
+		spec->pid = 1;
 		// pull out gains
 		if(json_object_object_get_ex(jobj_ctl, "kp", &tmp)==0){
 			fprintf(stderr,"ERROR: can't find kp in settings file\n");
 			return -1;
 		}
-		tmp_kp = json_object_get_double(tmp);
+		spec->kp = json_object_get_double(tmp);
 		if(json_object_object_get_ex(jobj_ctl, "ki", &tmp)==0){
 			fprintf(stderr,"ERROR: can't find ki in settings file\n");
 			return -1;
 		}
-		tmp_ki = json_object_get_double(tmp);
+		spec->ki = json_object_get_double(tmp);
 		if(json_object_object_get_ex(jobj_ctl, "kd", &tmp)==0){
 			fprintf(stderr,"ERROR: can't find kd in settings file\n");
 			return -1;
 		}
-		tmp_kd = json_object_get_double(tmp);
+		spec->kd = json_object_get_double(tmp);
 		// get the crossover frequency
 		if(json_object_object_get_ex(jobj_ctl, "crossover_freq_rad_per_sec", &tmp)==0){
 			fprintf(stderr,"ERROR: can't find crossover frequency in settings file\n");
@@ -473,20 +776,13 @@ static int __parse_controller(json_object* jobj_ctl, rc_filter_t* filter)
 			fprintf(stderr,"ERROR: crossover frequency should be a double\n");
 			return -1;
 		}
-		tmp_flt = json_object_get_double(tmp);
-		if(rc_filter_pid(filter,tmp_kp,tmp_ki,tmp_kd,1.0/tmp_flt, DT)){
-				fprintf(stderr,"ERROR: failed to alloc pid filter in __parse_controller()");
-				return -1;
-			}
+		spec->crossover_freq = json_object_get_double(tmp);
 	}
 
-	#ifdef DEBUG
-	rc_filter_print(*filter);
-	#endif
-
-	rc_vector_free(&num_vec);
-	rc_vector_free(&den_vec);
-
+	else{
+		fprintf(stderr,"ERROR: TF_or_PID must be 'TF' or 'PID'\n");
+		return -1;
+	}
 	return 0;
 }
 
@@ -554,6 +850,12 @@ int settings_load_from_file(char* path)
 	fprintf(stderr,"v_nominal: %f\n",settings.v_nominal);
 	#endif
 	PARSE_BOOL(enable_magnetometer)
+	PARSE_BOOL(altitude_kf_steady_state)
+
+	// CONTROL LOOP, must come before the controllers which are discretized at dt
+	if(__parse_imu_mode()==-1) return -1;
+	PARSE_INT(feedback_hz)
+	if(__check_feedback_hz()==-1) return -1;
 
 
 	// FLIGHT MODES
@@ -582,6 +884,7 @@ int settings_load_from_file(char* path)
 	#ifdef DEBUG
 	fprintf(stderr,"flight_mode_3: %d\n",settings.flight_mode_3);
 	#endif
+	PARSE_STRING(trajectory_file)
 
 	// DSM RADIO CONFIG
 	PARSE_INT_MIN_MAX(dsm_thr_ch,1,9)
@@ -610,19 +913,76 @@ int settings_load_from_file(char* path)
 	PARSE_BOOL(printf_u)
 	PARSE_BOOL(printf_motors)
 	PARSE_BOOL(printf_mode)
+	PARSE_INT_MIN_MAX(printf_hz, 1, 50)
 
 	// LOGGING
 	PARSE_BOOL(enable_logging)
+	if(__parse_log_format()==-1) return -1;
 	PARSE_BOOL(log_sensors)
 	PARSE_BOOL(log_state)
 	PARSE_BOOL(log_setpoint)
 	PARSE_BOOL(log_control_u)
 	PARSE_BOOL(log_motor_signals)
+	PARSE_BOOL(log_timing)
+	PARSE_BOOL(log_raw)
+	PARSE_BOOL(log_watchdog)
+	if(settings.log_raw && settings.log_format!=LOG_FORMAT_BINARY){
+		fprintf(stderr,"ERROR parsing settings file, log_raw requires log_format binary\n");
+		return -1;
+	}
+	if(__parse_log_compression()==-1) return -1;
+	if(settings.log_compression!=LOG_COMPRESSION_NONE && settings.log_format!=LOG_FORMAT_BINARY){
+		fprintf(stderr,"ERROR parsing settings file, log_compression requires log_format binary\n");
+		return -1;
+	}
+	PARSE_DOUBLE_MIN_MAX(log_buffer_seconds, 0.1, 60.0)
 
 	// MAVLINK
 	PARSE_STRING(dest_ip)
 	PARSE_INT(my_sys_id)
 	PARSE_INT(mav_port)
+	PARSE_BOOL(enable_mavlink_input)
+	PARSE_DOUBLE_MIN_MAX(mocap_latency_ms, 0.0, 100.0)
+	PARSE_BOOL(bumpless_param_updates)
+
+	// TELEMETRY
+	PARSE_BOOL(enable_telemetry)
+	PARSE_DOUBLE_MIN_MAX(telemetry_attitude_hz, 0.0, TELEMETRY_MANAGER_HZ)
+	PARSE_DOUBLE_MIN_MAX(telemetry_position_hz, 0.0, TELEMETRY_MANAGER_HZ)
+	PARSE_DOUBLE_MIN_MAX(telemetry_servo_hz, 0.0, TELEMETRY_MANAGER_HZ)
+	PARSE_DOUBLE_MIN_MAX(telemetry_battery_hz, 0.0, TELEMETRY_MANAGER_HZ)
+	PARSE_DOUBLE_MIN_MAX(telemetry_timing_hz, 0.0, TELEMETRY_MANAGER_HZ)
+
+	// SHARED MEMORY EXPORT
+	PARSE_BOOL(enable_shm_export)
+	PARSE_STRING(shm_name)
+	// PARSE_STRING has checked the length, so this looks at a terminated name
+	if(settings.shm_name[0]!='/' || settings.shm_name[1]=='\0' ||
+	   strchr(settings.shm_name+1, '/')!=NULL){
+		fprintf(stderr,"ERROR parsing settings file, shm_name should be a / followed by a name without slashes\n");
+		return -1;
+	}
+
+	// REAL TIME SETUP
+	PARSE_BOOL(rt_lock_memory)
+	PARSE_INT_MIN_MAX(rt_imu_cpu, -1, RT_MAX_CPU)
+	PARSE_INT_MIN_MAX(rt_input_cpu, -1, RT_MAX_CPU)
+	PARSE_INT_MIN_MAX(rt_log_cpu, -1, RT_MAX_CPU)
+	PARSE_INT_MIN_MAX(rt_printf_cpu, -1, RT_MAX_CPU)
+	PARSE_INT_MIN_MAX(rt_bmp_cpu, -1, RT_MAX_CPU)
+	PARSE_INT_MIN_MAX(rt_telemetry_cpu, -1, RT_MAX_CPU)
+	PARSE_INT_MIN_MAX(rt_batt_cpu, -1, RT_MAX_CPU)
+	PARSE_INT_MIN_MAX(rt_imu_deadline_us, 0, 1000000/settings.feedback_hz)
+	// the kernel refuses SCHED_DEADLINE for threads pinned to a subset of cpus
+	if(settings.rt_imu_deadline_us>0 && settings.rt_imu_cpu>=0){
+		fprintf(stderr,"ERROR parsing settings file, rt_imu_deadline_us can't be used with rt_imu_cpu\n");
+		return -1;
+	}
+
+	// DEADLINE WATCHDOG
+	if(__parse_watchdog_shed_limit()==-1) return -1;
+	PARSE_INT_MIN_MAX(watchdog_shed_misses, 1, 1000)
+	PARSE_DOUBLE_MIN_MAX(watchdog_recover_seconds, 0.1, 60.0)
 
 	// FEEDBACK CONTROLLERS
 	PARSE_CONTROLLER(roll_controller)
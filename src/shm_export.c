@@ -0,0 +1,123 @@
+/**
+ * @file shm_export.c
+ *
+ * Shared memory telemetry ring writer, see shm_export.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <shm_export.h>
+#include <shm_format.h>
+#include <settings.h>
+#include <hal.h>
+
+static int initialized = 0;
+static shm_ring_header_t* header = NULL;
+static shm_ring_slot_t* slots = NULL;
+static uint32_t head;		// only the IMU thread writes, keep a private copy
+
+
+int shm_export_init(void)
+{
+	int fd;
+	void* p;
+
+	if(initialized){
+		fprintf(stderr,"ERROR in shm_export_init, already initialized\n");
+		return -1;
+	}
+	// a ring left over from a crashed run would still read as alive, start
+	// from a new object so its readers don't mistake it for this one
+	shm_unlink(settings.shm_name);
+	fd = shm_open(settings.shm_name, O_CREAT|O_EXCL|O_RDWR, 0644);
+	if(fd==-1){
+		perror("ERROR in shm_export_init, shm_open");
+		return -1;
+	}
+	if(ftruncate(fd, SHM_RING_BYTES)==-1){
+		perror("ERROR in shm_export_init, ftruncate");
+		close(fd);
+		shm_unlink(settings.shm_name);
+		return -1;
+	}
+	p = mmap(NULL, SHM_RING_BYTES, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p==MAP_FAILED){
+		perror("ERROR in shm_export_init, mmap");
+		shm_unlink(settings.shm_name);
+		return -1;
+	}
+
+	// touch every page now so the IMU callback never takes a fault on it,
+	// mlockall(MCL_FUTURE) from rt_setup keeps them resident
+	memset(p, 0, SHM_RING_BYTES);
+	header = p;
+	slots = (shm_ring_slot_t*)((char*)p + sizeof(shm_ring_header_t));
+	head = 0;
+
+	strcpy(header->magic, SHM_RING_MAGIC);
+	header->byte_order	= SHM_RING_BYTE_ORDER;
+	header->version		= SHM_RING_VERSION;
+	header->header_size	= sizeof(shm_ring_header_t);
+	header->slot_size	= sizeof(shm_ring_slot_t);
+	header->num_slots	= SHM_RING_SLOTS;
+	header->state_size	= sizeof(state_estimate_t);
+	header->setpoint_size	= sizeof(setpoint_t);
+	header->fstate_size	= sizeof(feedback_state_t);
+	header->num_rotors	= settings.num_rotors;
+	header->feedback_hz	= settings.feedback_hz;
+	header->writer_pid	= getpid();
+	strncpy(header->name, settings.name, sizeof(header->name)-1);
+	atomic_store_explicit(&header->head, 0, memory_order_relaxed);
+	atomic_store_explicit(&header->alive, 1, memory_order_release);
+
+	initialized = 1;
+	return 0;
+}
+
+
+void shm_export_publish(void)
+{
+	shm_ring_slot_t* s;
+
+	if(!initialized) return;
+	// same steps as seqlock_write() but the sequence number also says which
+	// record the slot holds
+	s = &slots[head%SHM_RING_SLOTS];
+	atomic_store_explicit(&s->seq, 2*head+1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	s->rec.time_ns = hal_time_ns();
+	s->rec.state = state_estimate;
+	s->rec.setpoint = setpoint;
+	s->rec.fstate = fstate;
+	atomic_store_explicit(&s->seq, 2*head+2, memory_order_release);
+	head++;
+	atomic_store_explicit(&header->head, head, memory_order_release);
+	return;
+}
+
+
+int shm_export_cleanup(void)
+{
+	int ret = 0;
+
+	if(!initialized) return 0;
+	initialized = 0;
+	atomic_store_explicit(&header->alive, 0, memory_order_release);
+	if(munmap(header, SHM_RING_BYTES)==-1){
+		perror("ERROR in shm_export_cleanup, munmap");
+		ret = -1;
+	}
+	if(shm_unlink(settings.shm_name)==-1){
+		perror("ERROR in shm_export_cleanup, shm_unlink");
+		ret = -1;
+	}
+	header = NULL;
+	slots = NULL;
+	return ret;
+}
@@ -0,0 +1,138 @@
+/**
+ * @file shm_reader.c
+ *
+ * Shared memory telemetry ring reader for companion processes, see
+ * shm_reader.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <shm_reader.h>
+
+
+/**
+ * @brief      validates the header against this build
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __check_header(const shm_ring_header_t* h)
+{
+	if(strncmp(h->magic, SHM_RING_MAGIC, sizeof(h->magic))!=0){
+		fprintf(stderr,"ERROR in shm_reader, not an rc_pilot telemetry ring\n");
+		return -1;
+	}
+	if(h->byte_order!=SHM_RING_BYTE_ORDER){
+		fprintf(stderr,"ERROR in shm_reader, ring was written with different endianness\n");
+		return -1;
+	}
+	if(h->version!=SHM_RING_VERSION){
+		fprintf(stderr,"ERROR in shm_reader, ring version %d, this build reads %d\n",\
+						h->version, SHM_RING_VERSION);
+		return -1;
+	}
+	// any difference in the structs shows up in one of the sizes, most
+	// likely a reader built without the float32 flag of the writer or the
+	// other way round
+	if(h->header_size!=sizeof(shm_ring_header_t) ||
+	   h->slot_size!=sizeof(shm_ring_slot_t) ||
+	   h->num_slots!=SHM_RING_SLOTS ||
+	   h->state_size!=sizeof(state_estimate_t) ||
+	   h->setpoint_size!=sizeof(setpoint_t) ||
+	   h->fstate_size!=sizeof(feedback_state_t)){
+		fprintf(stderr,"ERROR in shm_reader, ring layout does not match this build, rebuild against the rc_pilot headers\n");
+		return -1;
+	}
+	return 0;
+}
+
+
+int shm_reader_open(shm_reader_t* r, const char* name)
+{
+	int fd;
+	struct stat st;
+	void* p;
+
+	memset(r, 0, sizeof(shm_reader_t));
+	fd = shm_open(name, O_RDONLY, 0);
+	if(fd==-1){
+		perror("ERROR in shm_reader_open, shm_open");
+		return -1;
+	}
+	// rc_pilot sizes the object right after creating it, don't map a ring
+	// that is still empty
+	if(fstat(fd, &st)==-1 || (size_t)st.st_size<SHM_RING_BYTES){
+		fprintf(stderr,"ERROR in shm_reader_open, %s is not a complete ring\n", name);
+		close(fd);
+		return -1;
+	}
+	p = mmap(NULL, SHM_RING_BYTES, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(p==MAP_FAILED){
+		perror("ERROR in shm_reader_open, mmap");
+		return -1;
+	}
+	if(__check_header(p)){
+		munmap(p, SHM_RING_BYTES);
+		return -1;
+	}
+	r->header = p;
+	r->slots = (const shm_ring_slot_t*)((const char*)p + sizeof(shm_ring_header_t));
+	r->next = atomic_load_explicit(&r->header->head, memory_order_acquire);
+	if(r->next>0) r->next--;
+	return 0;
+}
+
+
+int shm_reader_next(shm_reader_t* r, shm_record_t* rec)
+{
+	uint32_t head, want, behind;
+	const shm_ring_slot_t* s;
+
+	if(r->header==NULL) return 0;
+	for(;;){
+		// head only moves after the slot it covers is complete
+		head = atomic_load_explicit(&r->header->head, memory_order_acquire);
+		if(r->next==head) return 0;
+		// unsigned differences so this still holds across the wrap
+		behind = head-r->next;
+		if(behind>SHM_RING_SLOTS){
+			r->missed += behind-SHM_RING_SLOTS;
+			r->next = head-SHM_RING_SLOTS;
+		}
+		s = &r->slots[r->next%SHM_RING_SLOTS];
+		want = 2*r->next+2;
+		// the mapping is read only, atomic loads of a 32 bit word never write
+		if(atomic_load_explicit((atomic_uint*)&s->seq, memory_order_acquire)==want){
+			memcpy(rec, &s->rec, sizeof(shm_record_t));
+			atomic_thread_fence(memory_order_acquire);
+			if(atomic_load_explicit((atomic_uint*)&s->seq, memory_order_relaxed)==want){
+				r->next++;
+				return 1;
+			}
+		}
+		// lapped by the writer while looking at this one, it's gone
+		r->missed++;
+		r->next++;
+	}
+}
+
+
+int shm_reader_alive(const shm_reader_t* r)
+{
+	if(r->header==NULL) return 0;
+	return atomic_load_explicit((atomic_uint*)&r->header->alive, memory_order_acquire)!=0;
+}
+
+
+void shm_reader_close(shm_reader_t* r)
+{
+	if(r->header!=NULL) munmap((void*)r->header, SHM_RING_BYTES);
+	r->header = NULL;
+	r->slots = NULL;
+	return;
+}
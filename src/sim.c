@@ -0,0 +1,608 @@
+/**
+ * @file sim.c
+ *
+ * Software in the loop backend, see sim.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+#include <rc/time.h>
+
+#include <sim.h>
+#include <hal.h>
+#include <rc_pilot_defs.h>
+#include <settings.h>
+#include <mix.h>
+#include <thrust_map.h>
+#include <input_manager.h>
+#include <setpoint_manager.h>
+#include <snapshot.h>
+#include <feedback.h>
+#include <state_estimator.h>
+
+// airframe, roughly a 1kg 450 class quad. The hover thrust fixes the motor
+// size for any rotor count.
+#define SIM_MASS		1.0	// kg
+#define SIM_IXX			0.010	// kg*m^2
+#define SIM_IYY			0.010	// kg*m^2
+#define SIM_IZZ			0.018	// kg*m^2
+#define SIM_TORQUE_ARM		0.20	// m, roll/pitch torque per N per unit of mixing coefficient
+#define SIM_YAW_COEF		0.03	// m, yaw reaction torque per N per unit of mixing coefficient
+#define SIM_HOVER_THRUST	0.5	// normalized thrust per motor needed to hover
+#define SIM_MOTOR_TAU		0.03	// s, motor spin up time constant
+#define SIM_LIN_DRAG		0.25	// N/(m/s)
+#define SIM_ROT_DRAG		0.002	// Nm/(rad/s)
+#define SIM_SUBSTEPS		5	// integration steps per IMU sample
+
+// sensor noise, gaussian standard deviations
+#define SIM_BMP_NOISE		0.05	// m
+#define SIM_GYRO_NOISE		0.05	// deg/s
+#define SIM_ACCEL_NOISE		0.02	// m/s^2
+#define SIM_SEED		0x5eed5eedULL	// fixed so every run is identical
+
+// motion capture, delivered settings.mocap_latency_ms after it was measured
+#define SIM_MOCAP_HZ		100
+#define SIM_MOCAP_NOISE		0.001	// m
+#define SIM_MOCAP_OFFSET_X	0.5	// m, start position in the mocap frame, all
+#define SIM_MOCAP_OFFSET_Y	-0.5	// zeros would read as lost visual
+#define SIM_MOCAP_HISTORY	128	// loops of ground truth kept, power of two
+
+// end of flight conditions
+#define SIM_CRASH_SPEED		2.0	// m/s, touchdown speed counted as a crash
+#define SIM_CRASH_TILT		0.5	// rad, touchdown tilt counted as a crash
+#define SIM_FLYAWAY_DIST	50.0	// m from the origin
+
+// virtual pilot
+#define SIM_PILOT_CLIMB_KP	1.0	// (m/s)/m
+#define SIM_PILOT_MAX_CLIMB	0.5	// m/s
+#define SIM_PILOT_THR_KP	0.4	// throttle per m/s of climb rate error
+#define SIM_PILOT_SETTLE	2.0	// s after an altitude change before scoring
+#define SIM_PILOT_STICK_RATE	2.0	// full scale per second, nobody moves a stick in one sample
+
+#define SIM_START_NS		1000000000ULL	// nonzero so timestamps look like uptime
+#define RAD_TO_DEG		(180.0/M_PI)
+
+/**
+ * rigid body state, body frame is forward right down and the quaternion
+ * rotates body vectors into NED
+ */
+typedef struct sim_state_t{
+	double p[3];			///< NED position (m)
+	double v[3];			///< NED velocity (m/s)
+	double q[4];			///< attitude quaternion W X Y Z
+	double w[3];			///< body angular rate (rad/s)
+	double f[3];			///< body specific force seen by the accelerometer (m/s^2)
+	double thrust[MAX_ROTORS];	///< motor thrust (N)
+	double esc[MAX_ROTORS];		///< last normalized ESC command
+	int on_ground;
+	int crashed;
+} sim_state_t;
+
+/**
+ * one step of the pilot script, holds until the next one starts
+ */
+typedef struct sim_segment_t{
+	double t;		///< start time (s)
+	arm_state_t arm;
+	double alt;		///< altitude target, positive up (m)
+	double roll;		///< sticks
+	double pitch;
+	double yaw;
+} sim_segment_t;
+
+static const sim_segment_t script[] = {
+	{ 0.0, DISARMED, 0.0,  0.0,  0.0,  0.0},	// let the estimator settle
+	{ 1.0, ARMED,    0.0,  0.0,  0.0,  0.0},
+	{ 2.0, ARMED,    1.5,  0.0,  0.0,  0.0},	// take off
+	{ 8.0, ARMED,    1.5,  0.1,  0.0,  0.0},	// roll doublet
+	{ 9.0, ARMED,    1.5, -0.1,  0.0,  0.0},
+	{10.0, ARMED,    1.5,  0.0,  0.0,  0.0},
+	{11.0, ARMED,    1.5,  0.0,  0.1,  0.0},	// pitch doublet
+	{12.0, ARMED,    1.5,  0.0, -0.1,  0.0},
+	{13.0, ARMED,    1.5,  0.0,  0.0,  0.0},
+	{14.0, ARMED,    1.5,  0.0,  0.0,  0.3},	// yaw
+	{16.0, ARMED,    1.5,  0.0,  0.0,  0.0},
+	{18.0, ARMED,    0.0,  0.0,  0.0,  0.0},	// land
+	{24.0, DISARMED, 0.0,  0.0,  0.0,  0.0}
+};
+#define SCRIPT_LEN (int)(sizeof(script)/sizeof(script[0]))
+
+static sim_state_t s;
+static double mix_m[MAX_ROTORS][MAX_INPUTS];	// rotor geometry from the mixer
+static double max_thrust;			// N per motor
+static int rotors;
+static uint64_t sim_ns;
+static uint64_t rng;
+static rc_mpu_data_t* imu_data;
+static void (*imu_callback)(void);
+static sim_state_t past[SIM_MOCAP_HISTORY];	// ground truth of the last loops
+
+
+/**
+ * @brief      xorshift64* so the noise sequence doesn't depend on the libc
+ */
+static double __uniform(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return ((rng * 0x2545F4914F6CDD1DULL) >> 11) * (1.0/9007199254740992.0);
+}
+
+/**
+ * @brief      gaussian noise by Box-Muller
+ */
+static double __noise(double std)
+{
+	double u1 = __uniform();
+	double u2 = __uniform();
+	if(u1<1e-300) u1 = 1e-300;
+	return std*sqrt(-2.0*log(u1))*cos(2.0*M_PI*u2);
+}
+
+/**
+ * @brief      rotation matrix taking body vectors into NED
+ */
+static void __quat_to_R(const double q[4], double R[3][3])
+{
+	const double w=q[0], x=q[1], y=q[2], z=q[3];
+	R[0][0] = 1.0-2.0*(y*y+z*z);
+	R[0][1] = 2.0*(x*y-w*z);
+	R[0][2] = 2.0*(x*z+w*y);
+	R[1][0] = 2.0*(x*y+w*z);
+	R[1][1] = 1.0-2.0*(x*x+z*z);
+	R[1][2] = 2.0*(y*z-w*x);
+	R[2][0] = 2.0*(x*z-w*y);
+	R[2][1] = 2.0*(y*z+w*x);
+	R[2][2] = 1.0-2.0*(x*x+y*y);
+}
+
+static void __quat_normalize(double q[4])
+{
+	int i;
+	double n = sqrt(q[0]*q[0]+q[1]*q[1]+q[2]*q[2]+q[3]*q[3]);
+	for(i=0;i<4;i++) q[i] /= n;
+}
+
+/**
+ * @brief      sets the attitude to level at the current heading
+ */
+static void __level(double q[4])
+{
+	double yaw = atan2(2.0*(q[0]*q[3]+q[1]*q[2]), 1.0-2.0*(q[2]*q[2]+q[3]*q[3]));
+	q[0] = cos(yaw/2.0);
+	q[1] = 0.0;
+	q[2] = 0.0;
+	q[3] = sin(yaw/2.0);
+}
+
+/**
+ * @brief      advances the model by h seconds
+ */
+static void __dynamics_step(double h)
+{
+	int i,j;
+	double R[3][3], F[3], tau[3], a[3], dw[3], dq[4], v_old[3], f_ned[3];
+	double cmd, sig;
+
+	// motors chase the thrust their ESC command maps to
+	for(i=0;i<rotors;i++){
+		sig = s.esc[i];
+		if(sig<0.0) sig = 0.0;
+		if(sig>1.0) sig = 1.0;
+		cmd = thrust_map_signal_to_thrust(sig)*max_thrust;
+		s.thrust[i] += (cmd-s.thrust[i])*h/SIM_MOTOR_TAU;
+	}
+
+	// body wrench, each mixer column gives the direction every motor's
+	// thrust pushes that axis
+	for(j=0;j<3;j++){
+		F[j] = 0.0;
+		tau[j] = 0.0;
+	}
+	for(i=0;i<rotors;i++){
+		F[0]	+= mix_m[i][VEC_X]*s.thrust[i];
+		F[1]	+= mix_m[i][VEC_Y]*s.thrust[i];
+		F[2]	+= mix_m[i][VEC_Z]*s.thrust[i];
+		tau[0]	+= SIM_TORQUE_ARM*mix_m[i][VEC_ROLL]*s.thrust[i];
+		tau[1]	+= SIM_TORQUE_ARM*mix_m[i][VEC_PITCH]*s.thrust[i];
+		tau[2]	+= SIM_YAW_COEF*mix_m[i][VEC_YAW]*s.thrust[i];
+	}
+
+	// translation in NED
+	__quat_to_R(s.q, R);
+	for(j=0;j<3;j++){
+		a[j] = (R[j][0]*F[0] + R[j][1]*F[1] + R[j][2]*F[2] - SIM_LIN_DRAG*s.v[j])/SIM_MASS;
+		v_old[j] = s.v[j];
+	}
+	a[2] += GRAVITY;
+
+	// resting on the ground until thrust exceeds weight
+	if(s.p[2]>=0.0 && a[2]>=0.0){
+		if(!s.on_ground && (s.v[2]>SIM_CRASH_SPEED || acos(R[2][2])>SIM_CRASH_TILT)){
+			s.crashed = 1;
+		}
+		s.on_ground = 1;
+		s.p[2] = 0.0;
+		for(j=0;j<3;j++){
+			s.v[j] = 0.0;
+			s.w[j] = 0.0;
+		}
+		__level(s.q);
+	}
+	else{
+		s.on_ground = 0;
+		for(j=0;j<3;j++){
+			s.v[j] += a[j]*h;
+			s.p[j] += s.v[j]*h;
+		}
+
+		// rotation, J*dw = tau - w x (J*w) - drag
+		dw[0] = (tau[0] - (SIM_IZZ-SIM_IYY)*s.w[1]*s.w[2] - SIM_ROT_DRAG*s.w[0])/SIM_IXX;
+		dw[1] = (tau[1] - (SIM_IXX-SIM_IZZ)*s.w[2]*s.w[0] - SIM_ROT_DRAG*s.w[1])/SIM_IYY;
+		dw[2] = (tau[2] - (SIM_IYY-SIM_IXX)*s.w[0]*s.w[1] - SIM_ROT_DRAG*s.w[2])/SIM_IZZ;
+		for(j=0;j<3;j++) s.w[j] += dw[j]*h;
+
+		// q_dot = 0.5 * q * (0,w)
+		dq[0] = -s.q[1]*s.w[0] - s.q[2]*s.w[1] - s.q[3]*s.w[2];
+		dq[1] =  s.q[0]*s.w[0] + s.q[2]*s.w[2] - s.q[3]*s.w[1];
+		dq[2] =  s.q[0]*s.w[1] - s.q[1]*s.w[2] + s.q[3]*s.w[0];
+		dq[3] =  s.q[0]*s.w[2] + s.q[1]*s.w[1] - s.q[2]*s.w[0];
+		for(j=0;j<4;j++) s.q[j] += 0.5*dq[j]*h;
+		__quat_normalize(s.q);
+	}
+
+	// accelerometer sees acceleration minus gravity, in body frame
+	__quat_to_R(s.q, R);
+	for(j=0;j<3;j++) f_ned[j] = (s.v[j]-v_old[j])/h;
+	f_ned[2] -= GRAVITY;
+	for(j=0;j<3;j++) s.f[j] = R[0][j]*f_ned[0] + R[1][j]*f_ned[1] + R[2][j]*f_ned[2];
+	return;
+}
+
+/**
+ * @brief      writes the model state into the IMU struct the same way the
+ *             librobotcontrol driver does, exactly undoing the axis swap
+ *             state_estimator applies to get NED
+ */
+static void __write_imu(void)
+{
+	double yaw;
+	if(imu_data==NULL) return;
+
+	imu_data->gyro[0]  =  s.w[1]*RAD_TO_DEG + __noise(SIM_GYRO_NOISE);
+	imu_data->gyro[1]  =  s.w[0]*RAD_TO_DEG + __noise(SIM_GYRO_NOISE);
+	imu_data->gyro[2]  = -s.w[2]*RAD_TO_DEG + __noise(SIM_GYRO_NOISE);
+	imu_data->accel[0] =  s.f[1] + __noise(SIM_ACCEL_NOISE);
+	imu_data->accel[1] =  s.f[0] + __noise(SIM_ACCEL_NOISE);
+	imu_data->accel[2] = -s.f[2] + __noise(SIM_ACCEL_NOISE);
+
+	imu_data->dmp_quat[0] =  s.q[0];
+	imu_data->dmp_quat[1] =  s.q[2];
+	imu_data->dmp_quat[2] =  s.q[1];
+	imu_data->dmp_quat[3] = -s.q[3];
+	memcpy(imu_data->fused_quat, imu_data->dmp_quat, sizeof(imu_data->fused_quat));
+
+	yaw = atan2(2.0*(s.q[0]*s.q[3]+s.q[1]*s.q[2]), 1.0-2.0*(s.q[2]*s.q[2]+s.q[3]*s.q[3]));
+	imu_data->compass_heading_raw = yaw;
+	imu_data->compass_heading = yaw;
+	imu_data->temp = 25.0;
+	return;
+}
+
+/**
+ * @brief      flies the script like a pilot watching the vehicle, holding
+ *             altitude with the throttle stick
+ *
+ * @param[in]  t        simulated time (s)
+ * @param[out] settled  time since the altitude target last changed (s)
+ *
+ * @return     altitude target of the current segment
+ */
+static double __pilot(double t, double* settled)
+{
+	static int seg = 0;
+	static double last_alt = 0.0;
+	static double alt_change_t = 0.0;
+	static double stick[3];	// roll pitch yaw
+	const double max_move = SIM_PILOT_STICK_RATE*settings.dt;
+	double climb, climb_des, target[3];
+	int i;
+
+	if(t==0.0){
+		seg = 0;
+		for(i=0;i<3;i++) stick[i] = 0.0;
+	}
+	while(seg<SCRIPT_LEN-1 && t>=script[seg+1].t) seg++;
+	if(script[seg].alt!=last_alt){
+		last_alt = script[seg].alt;
+		alt_change_t = t;
+	}
+	*settled = t-alt_change_t;
+
+	climb = -s.v[2];
+	climb_des = SIM_PILOT_CLIMB_KP*(script[seg].alt + s.p[2]);
+	if(climb_des> SIM_PILOT_MAX_CLIMB) climb_des =  SIM_PILOT_MAX_CLIMB;
+	if(climb_des<-SIM_PILOT_MAX_CLIMB) climb_des = -SIM_PILOT_MAX_CLIMB;
+
+	user_input.initialized = 1;
+	user_input.input_active = 1;
+	user_input.flight_mode = settings.flight_mode_1;
+	user_input.requested_arm_mode = script[seg].arm;
+
+	switch(settings.flight_mode_1){
+	case TEST_BENCH_4DOF:
+	case TEST_BENCH_6DOF:
+	case DIRECT_THROTTLE_4DOF:
+	case DIRECT_THROTTLE_6DOF:
+		// throttle stick is thrust, fly it around hover
+		user_input.thr_stick = SIM_HOVER_THRUST + SIM_PILOT_THR_KP*(climb_des-climb);
+		break;
+	default:
+		// throttle stick is climb rate
+		user_input.thr_stick = climb_des/settings.max_Z_velocity;
+		break;
+	}
+	// stick down on the ground keeps the yaw setpoint at the current heading
+	if(script[seg].alt==0.0 && s.on_ground) user_input.thr_stick = -1.0;
+	if(user_input.thr_stick> 1.0) user_input.thr_stick =  1.0;
+	if(user_input.thr_stick<-1.0) user_input.thr_stick = -1.0;
+
+	// slew the sticks towards the script
+	target[0] = script[seg].roll;
+	target[1] = script[seg].pitch;
+	target[2] = script[seg].yaw;
+	for(i=0;i<3;i++){
+		if(target[i]-stick[i]> max_move) stick[i] += max_move;
+		else if(target[i]-stick[i]<-max_move) stick[i] -= max_move;
+		else stick[i] = target[i];
+	}
+	user_input.roll_stick  = stick[0];
+	user_input.pitch_stick = stick[1];
+	user_input.yaw_stick   = stick[2];
+
+	if(script[seg].arm==DISARMED){
+		user_input.thr_stick   = 0.0;
+		user_input.roll_stick  = 0.0;
+		user_input.pitch_stick = 0.0;
+		user_input.yaw_stick   = 0.0;
+	}
+	user_input.frame_ns = rc_nanos_since_boot();
+	snapshot_publish_user_input();
+	return script[seg].alt;
+}
+
+
+/**
+ * @brief      hands the estimator the pose mocap measured the latency ago,
+ *             stamped now as if it had just come in over the network
+ *
+ * @param[in]  i     loop number
+ */
+static void __publish_mocap(uint64_t i)
+{
+	static uint64_t count = 0;
+	const sim_state_t* t;
+	mocap_sample_t m;
+	uint64_t back, div;
+	double w, x, y, z, sp;
+
+	past[i&(SIM_MOCAP_HISTORY-1)] = s;
+	div = settings.feedback_hz>SIM_MOCAP_HZ ? settings.feedback_hz/SIM_MOCAP_HZ : 1;
+	if(i%div!=0) return;
+	back = (uint64_t)llround(settings.mocap_latency_ms/1000.0/settings.dt);
+	if(back>i || back>=SIM_MOCAP_HISTORY) return;
+	t = &past[(i-back)&(SIM_MOCAP_HISTORY-1)];
+
+	m.pos[0] = t->p[0] + SIM_MOCAP_OFFSET_X + __noise(SIM_MOCAP_NOISE);
+	m.pos[1] = t->p[1] + SIM_MOCAP_OFFSET_Y + __noise(SIM_MOCAP_NOISE);
+	m.pos[2] = t->p[2] + __noise(SIM_MOCAP_NOISE);
+	w = t->q[0];
+	x = t->q[1];
+	y = t->q[2];
+	z = t->q[3];
+	m.quat[0] = w;
+	m.quat[1] = x;
+	m.quat[2] = y;
+	m.quat[3] = z;
+	m.tb[0] = atan2(2.0*(w*x+y*z), 1.0-2.0*(x*x+y*y));
+	sp = 2.0*(w*y-z*x);
+	m.tb[1] = asin(sp>1.0 ? 1.0 : (sp<-1.0 ? -1.0 : sp));
+	m.tb[2] = atan2(2.0*(w*z+x*y), 1.0-2.0*(y*y+z*z));
+	m.timestamp_ns = sim_ns;
+	m.count = ++count;
+	state_estimator_publish_mocap(&m);
+	return;
+}
+
+
+int sim_run(double seconds, sim_result_t* result)
+{
+	uint64_t i, steps, step_ns;
+	uint64_t wall_start;
+	double t, alt_target, settled, tilt, roll, pitch;
+	double att_sq = 0.0, alt_sq = 0.0, pos_sq = 0.0, dx, dy;
+	uint64_t att_n = 0, alt_n = 0, pos_n = 0;
+	double R[3][3];
+	int j;
+
+	if(hal!=&hal_sim_ops){
+		fprintf(stderr,"ERROR in sim_run, sim backend not selected\n");
+		return -1;
+	}
+	if(imu_callback==NULL){
+		fprintf(stderr,"ERROR in sim_run, no IMU callback set\n");
+		return -1;
+	}
+	if(mix_get_matrix(mix_m)){
+		fprintf(stderr,"ERROR in sim_run, mixer not initialized\n");
+		return -1;
+	}
+	rotors = settings.num_rotors;
+	max_thrust = SIM_MASS*GRAVITY/(SIM_HOVER_THRUST*rotors);
+
+	memset(result, 0, sizeof(sim_result_t));
+	steps = (uint64_t)(seconds*settings.feedback_hz);
+	step_ns = (uint64_t)(settings.dt*1e9+0.5);
+	wall_start = rc_nanos_since_boot();
+
+	for(i=0;i<steps;i++){
+		t = i*settings.dt;
+		alt_target = __pilot(t, &settled);
+
+		for(j=0;j<SIM_SUBSTEPS;j++) __dynamics_step(settings.dt/SIM_SUBSTEPS);
+		sim_ns += step_ns;
+		__write_imu();
+		__publish_mocap(i);
+		imu_callback();
+		result->steps++;
+
+		// score the flight against ground truth
+		__quat_to_R(s.q, R);
+		tilt = acos(R[2][2]);
+		if(fstate.arm_state==ARMED && tilt>result->max_tilt) result->max_tilt = tilt;
+		if(fstate.arm_state==ARMED && !s.on_ground){
+			if(setpoint.en_rpy_ctrl){
+				roll = atan2(R[2][1], R[2][2]);
+				pitch = -asin(R[2][0]);
+				att_sq += (setpoint.roll-roll)*(setpoint.roll-roll);
+				att_sq += (setpoint.pitch-pitch)*(setpoint.pitch-pitch);
+				att_n += 2;
+			}
+			if(alt_target>0.0 && settled>=SIM_PILOT_SETTLE){
+				alt_sq += (alt_target+s.p[2])*(alt_target+s.p[2]);
+				alt_n++;
+			}
+		}
+		if(state_estimate.mocap_running){
+			dx = state_estimate.pos_global[0]-SIM_MOCAP_OFFSET_X-s.p[0];
+			dy = state_estimate.pos_global[1]-SIM_MOCAP_OFFSET_Y-s.p[1];
+			pos_sq += dx*dx + dy*dy;
+			pos_n++;
+		}
+		if(tilt>TIP_ANGLE || fabs(s.p[0])>SIM_FLYAWAY_DIST ||
+		   fabs(s.p[1])>SIM_FLYAWAY_DIST || fabs(s.p[2])>SIM_FLYAWAY_DIST){
+			s.crashed = 1;
+		}
+		if(s.crashed) break;
+	}
+
+	result->sim_seconds	= result->steps*settings.dt;
+	result->wall_seconds	= (rc_nanos_since_boot()-wall_start)/1e9;
+	result->rms_att_err	= att_n ? sqrt(att_sq/att_n) : 0.0;
+	result->rms_alt_err	= alt_n ? sqrt(alt_sq/alt_n) : 0.0;
+	result->rms_pos_err	= pos_n ? sqrt(pos_sq/pos_n) : 0.0;
+	for(j=0;j<3;j++) result->final_pos[j] = s.p[j];
+	result->crashed		= s.crashed;
+	return 0;
+}
+
+
+void sim_print_result(FILE* f, const sim_result_t* r)
+{
+	fprintf(f, "simulated %.1fs (%llu steps) in %.3fs",\
+			r->sim_seconds, (unsigned long long)r->steps, r->wall_seconds);
+	if(r->wall_seconds>0.0) fprintf(f, ", %.0fx real time", r->sim_seconds/r->wall_seconds);
+	fprintf(f, "\n");
+	fprintf(f, "max tilt:           %.4f rad\n", r->max_tilt);
+	fprintf(f, "rms attitude error: %.4f rad\n", r->rms_att_err);
+	fprintf(f, "rms altitude error: %.4f m\n", r->rms_alt_err);
+	fprintf(f, "rms X/Y estimate:   %.4f m\n", r->rms_pos_err);
+	fprintf(f, "final position:     %.3f %.3f %.3f m NED\n",\
+			r->final_pos[0], r->final_pos[1], r->final_pos[2]);
+	fprintf(f, "result:             %s\n", r->crashed ? "CRASHED" : "OK");
+}
+
+
+/*******************************************************************************
+ * HAL backend
+ ******************************************************************************/
+
+static int __sim_init(void)
+{
+	int i;
+	memset(&s, 0, sizeof(s));
+	s.q[0] = 1.0;
+	s.on_ground = 1;
+	for(i=0;i<MAX_ROTORS;i++) s.esc[i] = -0.1;
+	s.f[2] = -GRAVITY;
+	sim_ns = SIM_START_NS;
+	rng = SIM_SEED;
+	imu_data = NULL;
+	imu_callback = NULL;
+	return 0;
+}
+
+static int __sim_cleanup(void)
+{
+	imu_callback = NULL;
+	imu_data = NULL;
+	return 0;
+}
+
+static int __sim_imu_init(rc_mpu_data_t* data)
+{
+	imu_data = data;
+	__write_imu();
+	return 0;
+}
+
+static int __sim_imu_set_callback(void (*func)(void))
+{
+	imu_callback = func;
+	return 0;
+}
+
+static int __sim_imu_power_off(void)
+{
+	imu_callback = NULL;
+	return 0;
+}
+
+static int __sim_bmp_read(rc_bmp_data_t* data)
+{
+	data->alt_m = -s.p[2] + __noise(SIM_BMP_NOISE);
+	data->pressure_pa = 101325.0*pow(1.0-2.25577e-5*data->alt_m, 5.25588);
+	data->temp_c = 25.0;
+	return 0;
+}
+
+static double __sim_batt_read(void)
+{
+	return settings.v_nominal;
+}
+
+static int __sim_esc_send(int ch, double val)
+{
+	if(ch<1 || ch>MAX_ROTORS) return -1;
+	s.esc[ch-1] = val;
+	return 0;
+}
+
+static int __sim_led_set(__attribute__ ((unused)) rc_led_t led,
+			__attribute__ ((unused)) int value)
+{
+	return 0;
+}
+
+static uint64_t __sim_time_ns(void)
+{
+	return sim_ns;
+}
+
+const hal_ops_t hal_sim_ops = {
+	.name			= "sim",
+	.realtime		= 0,
+	.init			= __sim_init,
+	.cleanup		= __sim_cleanup,
+	.imu_init		= __sim_imu_init,
+	.imu_set_callback	= __sim_imu_set_callback,
+	.imu_power_off		= __sim_imu_power_off,
+	.bmp_read		= __sim_bmp_read,
+	.batt_read		= __sim_batt_read,
+	.esc_send		= __sim_esc_send,
+	.led_set		= __sim_led_set,
+	.time_ns		= __sim_time_ns
+};
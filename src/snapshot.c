@@ -0,0 +1,108 @@
+/**
+ * @file snapshot.c
+ */
+
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include <snapshot.h>
+#include <seqlock.h>
+
+/**
+ * set of buffers for one published struct
+ */
+typedef struct snapshot_channel_t{
+	atomic_uint newest;		///< index of the newest complete slot
+	seqlock_t lock[SNAPSHOT_SLOTS];	///< one per slot
+	void* slots;			///< array of SNAPSHOT_SLOTS structs
+	size_t size;			///< size of one struct
+} snapshot_channel_t;
+
+static state_estimate_t	state_slots[SNAPSHOT_SLOTS];
+static feedback_state_t	fstate_slots[SNAPSHOT_SLOTS];
+static setpoint_t	setpoint_slots[SNAPSHOT_SLOTS];
+static user_input_t	input_slots[SNAPSHOT_SLOTS];
+
+static snapshot_channel_t state_ch	= {.slots = state_slots,	.size = sizeof(state_estimate_t)};
+static snapshot_channel_t fstate_ch	= {.slots = fstate_slots,	.size = sizeof(feedback_state_t)};
+static snapshot_channel_t setpoint_ch	= {.slots = setpoint_slots,	.size = sizeof(setpoint_t)};
+static snapshot_channel_t input_ch	= {.slots = input_slots,	.size = sizeof(user_input_t)};
+
+static atomic_uint_fast64_t ticks;
+
+
+static void __publish(snapshot_channel_t* ch, const void* src)
+{
+	// only the writer changes newest so a relaxed load is enough here
+	unsigned int i = (atomic_load_explicit(&ch->newest, memory_order_relaxed)+1)%SNAPSHOT_SLOTS;
+	seqlock_write(&ch->lock[i], (char*)ch->slots + i*ch->size, src, ch->size);
+	atomic_store_explicit(&ch->newest, i, memory_order_release);
+	return;
+}
+
+static int __read(snapshot_channel_t* ch, void* dst)
+{
+	int tries;
+	unsigned int i;
+
+	for(tries=0;tries<SNAPSHOT_READ_TRIES;tries++){
+		i = atomic_load_explicit(&ch->newest, memory_order_acquire);
+		if(seqlock_try_read(&ch->lock[i], dst, (char*)ch->slots + i*ch->size, ch->size)==0){
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+void snapshot_publish_tick(void)
+{
+	__publish(&state_ch, &state_estimate);
+	__publish(&fstate_ch, &fstate);
+	__publish(&setpoint_ch, &setpoint);
+	atomic_fetch_add_explicit(&ticks, 1, memory_order_release);
+	return;
+}
+
+void snapshot_publish_user_input(void)
+{
+	__publish(&input_ch, &user_input);
+	return;
+}
+
+uint64_t snapshot_tick_count(void)
+{
+	return atomic_load_explicit(&ticks, memory_order_acquire);
+}
+
+int snapshot_get_state_estimate(state_estimate_t* out)
+{
+	state_estimate_t tmp;
+	if(__read(&state_ch, &tmp)) return -1;
+	*out = tmp;
+	return 0;
+}
+
+int snapshot_get_fstate(feedback_state_t* out)
+{
+	feedback_state_t tmp;
+	if(__read(&fstate_ch, &tmp)) return -1;
+	*out = tmp;
+	return 0;
+}
+
+int snapshot_get_setpoint(setpoint_t* out)
+{
+	setpoint_t tmp;
+	if(__read(&setpoint_ch, &tmp)) return -1;
+	*out = tmp;
+	return 0;
+}
+
+int snapshot_get_user_input(user_input_t* out)
+{
+	user_input_t tmp;
+	if(__read(&input_ch, &tmp)) return -1;
+	*out = tmp;
+	return 0;
+}
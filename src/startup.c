@@ -0,0 +1,248 @@
+/**
+ * @file startup.c
+ *
+ * Dependency ordered, timed start up, see startup.h
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <rc/time.h>
+
+#include <startup.h>
+
+typedef enum phase_state_t{
+	PHASE_PENDING,
+	PHASE_RUNNING,
+	PHASE_DONE,
+	PHASE_FAILED,
+	PHASE_SKIPPED
+} phase_state_t;
+
+typedef struct phase_record_t{
+	const char* name;
+	phase_state_t state;
+	uint64_t start_ns;
+	uint64_t end_ns;
+} phase_record_t;
+
+static uint64_t begin_ns;
+static uint64_t armable_ns;
+static phase_record_t rec[STARTUP_MAX_PHASES];
+static int num_rec;
+
+// the runner sleeps on cond until a phase thread finishes
+static const startup_phase_t* table;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+
+void startup_begin(void)
+{
+	begin_ns = rc_nanos_since_boot();
+	armable_ns = 0;
+	num_rec = 0;
+}
+
+
+static void* __phase_func(void* ptr)
+{
+	const int i = (int)(intptr_t)ptr;
+	int ret;
+
+	ret = table[i].init();
+
+	pthread_mutex_lock(&lock);
+	rec[i].end_ns = rc_nanos_since_boot();
+	rec[i].state = (ret<0) ? PHASE_FAILED : PHASE_DONE;
+	pthread_cond_signal(&cond);
+	pthread_mutex_unlock(&lock);
+	if(ret<0) fprintf(stderr,"ERROR in start up, %s failed\n", table[i].name);
+	return NULL;
+}
+
+
+int startup_run(const startup_phase_t* phases, int n)
+{
+	pthread_t thread[STARTUP_MAX_PHASES];
+	uint32_t done = 0;	// finished or skipped phases
+	uint32_t started = 0;	// phases with a thread to join
+	int i, running, failed, progress;
+
+	if(n<1 || n>STARTUP_MAX_PHASES){
+		fprintf(stderr,"ERROR in startup_run, need 1 to %d phases\n", STARTUP_MAX_PHASES);
+		return -1;
+	}
+	for(i=0;i<n;i++){
+		if((n<STARTUP_MAX_PHASES && phases[i].after>>n) || phases[i].after & STARTUP_AFTER(i)){
+			fprintf(stderr,"ERROR in startup_run, %s waits for a phase that isn't in the table\n", phases[i].name);
+			return -1;
+		}
+	}
+
+	table = phases;
+	num_rec = n;
+	for(i=0;i<n;i++){
+		rec[i].name = phases[i].name;
+		rec[i].start_ns = 0;
+		rec[i].end_ns = 0;
+		rec[i].state = phases[i].enabled ? PHASE_PENDING : PHASE_SKIPPED;
+		if(!phases[i].enabled) done |= STARTUP_AFTER(i);
+	}
+
+	running = 0;
+	failed = 0;
+	pthread_mutex_lock(&lock);
+	while(1){
+		// collect phases that finished since last time
+		for(i=0;i<n;i++){
+			if(!(started & STARTUP_AFTER(i)) || done & STARTUP_AFTER(i)) continue;
+			if(rec[i].state==PHASE_DONE || rec[i].state==PHASE_FAILED){
+				done |= STARTUP_AFTER(i);
+				running--;
+				if(rec[i].state==PHASE_FAILED) failed = 1;
+			}
+		}
+
+		// start everything that is ready
+		progress = 0;
+		for(i=0;i<n && !failed;i++){
+			if(rec[i].state!=PHASE_PENDING) continue;
+			if((phases[i].after & done)!=phases[i].after) continue;
+			rec[i].state = PHASE_RUNNING;
+			rec[i].start_ns = rc_nanos_since_boot();
+			if(pthread_create(&thread[i], NULL, __phase_func, (void*)(intptr_t)i)){
+				fprintf(stderr,"ERROR in startup_run, failed to start thread for %s\n", phases[i].name);
+				rec[i].state = PHASE_FAILED;
+				done |= STARTUP_AFTER(i);
+				failed = 1;
+				break;
+			}
+			started |= STARTUP_AFTER(i);
+			running++;
+			progress = 1;
+		}
+
+		if(running==0){
+			if(failed || done==(uint32_t)((1ull<<n)-1)) break;
+			if(!progress){
+				fprintf(stderr,"ERROR in startup_run, dependency cycle among the remaining phases\n");
+				failed = 1;
+				break;
+			}
+		}
+		else pthread_cond_wait(&cond, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	for(i=0;i<n;i++){
+		if(started & STARTUP_AFTER(i)) pthread_join(thread[i], NULL);
+	}
+	return failed ? -1 : 0;
+}
+
+
+/**
+ * @brief      angle in degrees between two unit vectors
+ */
+static double __angle_deg(const double a[3], const double b[3])
+{
+	double c = a[0]*b[0]+a[1]*b[1]+a[2]*b[2];
+	double norm = sqrt((a[0]*a[0]+a[1]*a[1]+a[2]*a[2])*(b[0]*b[0]+b[1]*b[1]+b[2]*b[2]));
+
+	if(norm<=0.0) return 180.0;
+	c /= norm;
+	if(c>1.0) c = 1.0;
+	else if(c<-1.0) c = -1.0;
+	return acos(c)*180.0/M_PI;
+}
+
+
+int startup_wait_dmp_settled(const rc_mpu_data_t* data)
+{
+	double q[4], q_ref[4], up[3], a[3], g;
+	double tilt, drift, dot, norm;
+	uint64_t t0, now, run_start;
+	int i, ok;
+
+	t0 = rc_nanos_since_boot();
+	run_start = t0;
+	for(i=0;i<4;i++) q_ref[i] = data->dmp_quat[i];
+
+	while(1){
+		rc_usleep(STARTUP_SETTLE_POLL_US);
+		now = rc_nanos_since_boot();
+
+		// the DMP thread keeps writing, a torn read just fails one check
+		for(i=0;i<4;i++) q[i] = data->dmp_quat[i];
+		for(i=0;i<3;i++) a[i] = data->accel[i];
+		g = sqrt(data->gyro[0]*data->gyro[0] + data->gyro[1]*data->gyro[1] +
+							data->gyro[2]*data->gyro[2]);
+
+		// up as seen from the sensor, same as the raw imu filter
+		up[0] = 2.0*(q[1]*q[3]-q[0]*q[2]);
+		up[1] = 2.0*(q[0]*q[1]+q[2]*q[3]);
+		up[2] = q[0]*q[0]-q[1]*q[1]-q[2]*q[2]+q[3]*q[3];
+		tilt = __angle_deg(up, a);
+
+		// rotation since the current run of good samples began
+		norm = sqrt((q[0]*q[0]+q[1]*q[1]+q[2]*q[2]+q[3]*q[3]) *
+		      (q_ref[0]*q_ref[0]+q_ref[1]*q_ref[1]+q_ref[2]*q_ref[2]+q_ref[3]*q_ref[3]));
+		dot = 0.0;
+		for(i=0;i<4;i++) dot += q[i]*q_ref[i];
+		drift = (norm>0.0) ? 2.0*acos(fmin(fabs(dot)/norm, 1.0))*180.0/M_PI : 180.0;
+
+		ok = tilt<STARTUP_SETTLE_TILT_DEG && g<STARTUP_SETTLE_GYRO_DPS &&
+			drift<STARTUP_SETTLE_DRIFT_DPS*STARTUP_SETTLE_WINDOW_S;
+		if(!ok){
+			run_start = now;
+			for(i=0;i<4;i++) q_ref[i] = q[i];
+		}
+		else if(now-run_start>=(uint64_t)(STARTUP_SETTLE_WINDOW_S*1e9)){
+			printf("dmp settled after %.0f ms\n", (now-t0)/1e6);
+			return 0;
+		}
+
+		if(now-t0>=(uint64_t)(STARTUP_SETTLE_TIMEOUT_S*1e9)){
+			printf("WARNING: dmp not settled after %.1fs, tilt error %.1f deg, gyro %.1f deg/s, continuing\n",
+						STARTUP_SETTLE_TIMEOUT_S, tilt, g);
+			return 0;
+		}
+	}
+}
+
+
+void startup_mark_armable(void)
+{
+	armable_ns = rc_nanos_since_boot();
+}
+
+
+void startup_print_report(FILE* f)
+{
+	int i;
+
+	fprintf(f, "\nstart up, ms from launch\n");
+	fprintf(f, "%-22s %9s %9s\n", "phase", "start", "took");
+	for(i=0;i<num_rec;i++){
+		switch(rec[i].state){
+		case PHASE_SKIPPED:
+			fprintf(f, "%-22s %9s %9s\n", rec[i].name, "-", "off");
+			break;
+		case PHASE_DONE:
+		case PHASE_FAILED:
+			fprintf(f, "%-22s %9.1f %9.1f%s\n", rec[i].name,
+						(rec[i].start_ns-begin_ns)/1e6,
+						(rec[i].end_ns-rec[i].start_ns)/1e6,
+						rec[i].state==PHASE_FAILED ? " failed" : "");
+			break;
+		default:
+			fprintf(f, "%-22s %9s %9s\n", rec[i].name, "-", "not run");
+			break;
+		}
+	}
+	if(armable_ns!=0) fprintf(f, "armable after %.1f ms\n", (armable_ns-begin_ns)/1e6);
+	fflush(f);
+	return;
+}
@@ -4,22 +4,27 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <rc/math/filter.h>
-#include <rc/math/kalman.h>
 #include <rc/math/quaternion.h>
-#include <rc/math/matrix.h>
 #include <rc/math/other.h>
 #include <rc/start_stop.h>
 #include <rc/led.h>
 #include <rc/mpu.h>
-#include <rc/adc.h>
 #include <rc/time.h>
 #include <rc/bmp.h>
 
 #include <rc_pilot_defs.h>
 #include <state_estimator.h>
 #include <settings.h>
+#include <bmp_manager.h>
+#include <batt_manager.h>
+#include <scheduler.h>
+#include <controller.h>
+#include <hal.h>
+#include <real.h>
+#include <seqlock.h>
 
 #define TWO_PI (M_PI*2.0)
 
@@ -27,49 +32,179 @@ state_estimate_t state_estimate; // extern variable in state_estimator.h
 
 // sensor data structs
 rc_mpu_data_t mpu_data;
-static rc_bmp_data_t bmp_data;
+static bmp_sample_t bmp_sample;	// newest sample used by the altitude filter
+
+
+// altitude filter model, states are altitude, vertical velocity and accel
+// bias in NED. The input u is filtered vertical acceleration and the
+// measurement is barometer altitude. Q was tuned per step at 200hz, it is
+// scaled with dt so the filter keeps its bandwidth at other loop rates.
+#define ALT_KF_TUNED_DT	0.005
+#define ALT_KF_Q0	0.000000001
+#define ALT_KF_Q1	0.000000001
+#define ALT_KF_Q2	0.0001		// don't want bias to change too quickly
+// R was tuned when the same barometer sample was applied 10 times in a
+// row. Now each sample is only applied once so scale it down to keep the
+// same filter bandwidth.
+#define ALT_KF_R	(1000000.0/10)
+#define ALT_KF_SS_TOL		1e-12	// gain convergence tolerance in steady state mode
+#define ALT_KF_SS_MAX_CYCLES	100000
+#define ACC_LP_TC	0.1	// s, time constant of the accel low pass
+
+// horizontal filter model, one per axis with the same states as the altitude
+// filter but driven by unfiltered horizontal acceleration. Both axes see the
+// same inputs at the same times so they share one covariance.
+#define POS_KF_Q0	0.0000000001
+#define POS_KF_Q1	0.000002	// accel noise of about 0.3 m/s^2 at 200hz
+#define POS_KF_Q2	0.000000001	// tilt error shows up as a slowly changing bias
+#define POS_KF_R	0.000001	// mocap position noise, 1mm std
+#define POS_KF_P0_VEL	1.0	// initial variances after mocap (re)appears
+#define POS_KF_P0_BIAS	0.01
+#define POS_KF_HISTORY	128	// loops of state kept for late samples, power of two
+#define MOCAP_TIMEOUT	0.03	// s without a new packet before mocap counts as lost
+#define MOCAP_LOST_TOL	0.0001	// m, the mocap system sends all zeros when it lost visual
 
-// battery filter
-static rc_filter_t batt_lp = RC_FILTER_INITIALIZER;
+/**
+ * Fixed size 3-state altitude kalman filter. In steady state mode K is
+ * precomputed at init and P is not propagated in flight.
+ */
+typedef struct alt_kf_t{
+	double x[3];		///< state estimate
+	double P[3][3];		///< estimate covariance
+	double K[3];		///< kalman gain from the last update
+	uint64_t step;
+	int steady_state;
+	double dt;		///< settings.dt
+	double G[2];		///< input matrix, G[2] is 0
+	double Q[3];		///< diagonal process noise per step
+} alt_kf_t;
+
+/**
+ * Horizontal filter state at the end of one loop, X in column 0 and Y in
+ * column 1, along with the input and any mocap measurement applied in it.
+ */
+typedef struct pos_kf_entry_t{
+	double x[3][2];		///< position, velocity and accel bias per axis
+	double P[3][3];		///< estimate covariance, common to both axes
+	double u[2];		///< horizontal acceleration in NED
+	double y[2];		///< mocap position if has_meas
+	int has_meas;
+} pos_kf_entry_t;
+
+/**
+ * Horizontal position filter. hist is a ring indexed by loop so a delayed
+ * sample can be applied where it was measured and the loops since re-run.
+ */
+typedef struct pos_kf_t{
+	pos_kf_entry_t hist[POS_KF_HISTORY];
+	uint64_t step;		///< loops since init, indexes hist
+	uint64_t start_step;	///< loop the filter was last reset in
+	uint64_t rx_step;	///< loop the newest sample was received in
+	int running;		///< 0 until the first mocap sample and after mocap is lost
+	double dt;		///< settings.dt
+	double G[2];		///< input matrix, G[2] is 0
+	double Q[3];		///< diagonal process noise per step
+	double dt_ns;
+	double latency_ns;	///< settings.mocap_latency_ms
+	uint64_t timeout_steps;	///< MOCAP_TIMEOUT in loops
+} pos_kf_t;
 
 // altitude filter components
-static rc_kalman_t alt_kf = RC_KALMAN_INITIALIZER;
-static rc_filter_t acc_lp = RC_FILTER_INITIALIZER;
+static alt_kf_t alt_kf;
+static controller_t acc_lp = CONTROLLER_INITIALIZER;
+static int bmp_rate_div;	// loops between barometer samples
+static double accel_world[3];	// accel rotated into NED by the altitude stage
+
+// horizontal filter and the newest mocap sample, single writer
+static pos_kf_t pos_kf;
+static seqlock_t mocap_lock = SEQLOCK_INITIALIZER;
+static mocap_sample_t mocap_latest;
 
 
-static void __batt_init(void)
+static int __batt_init(void)
 {
-	// init the battery low pass filter
-	rc_filter_moving_average(&batt_lp, 20, DT);
-	double tmp = rc_adc_dc_jack();
-	if(tmp<3.0){
-		tmp = settings.v_nominal;
-		if(settings.warnings_en){
-			fprintf(stderr, "WARNING: ADC read %0.1fV on the barrel jack. Please connect\n");
-			fprintf(stderr, "battery to barrel jack, assuming nominal voltage for now.\n");
-		}
+	batt_sample_t s;
+
+	// batt_manager_init() took the first reading, valid before the battery
+	// task first runs
+	if(batt_manager_get_latest(&s)){
+		fprintf(stderr,"ERROR in state_estimator_init, no battery sample\n");
+		return -1;
 	}
-	rc_filter_prefill_inputs(&batt_lp, tmp);
-	rc_filter_prefill_outputs(&batt_lp, tmp);
-	return;
+	state_estimate.v_batt_raw = s.v_raw;
+	state_estimate.v_batt_lp = s.v_lp;
+	state_estimate.batt_gain_scale = s.gain_scale;
+	state_estimate.batt_count = s.count;
+	return 0;
 }
 
 
-static void __batt_march(void)
+
+#ifdef RC_PILOT_FLOAT32
+/**
+ * @brief      single precision rc_quaternion_norm_array() followed by
+ *             rc_quaternion_to_tb_array(), normalizes q in place
+ */
+static void __quat_norm_to_tb(double q[4], double tb[3])
 {
-	double tmp = rc_adc_dc_jack();
-	if(tmp<3.0) tmp = settings.v_nominal;
-	state_estimate.v_batt_raw = tmp;
-	state_estimate.v_batt_lp = rc_filter_march(&batt_lp, tmp);
+	real_t w, x, y, z, s;
+#ifdef RC_PILOT_NEON
+	const float f[4] = {(float)q[0], (float)q[1], (float)q[2], (float)q[3]};
+	float32x4_t v = vld1q_f32(f);
+	float32x4_t sq = vmulq_f32(v, v);
+	float32x2_t n, r;
+
+	// sum of squares then reciprocal square root estimate refined by two
+	// newton steps to close to full single precision
+	n = vpadd_f32(vget_low_f32(sq), vget_high_f32(sq));
+	n = vpadd_f32(n, n);
+	r = vrsqrte_f32(n);
+	r = vmul_f32(r, vrsqrts_f32(vmul_f32(n, r), r));
+	r = vmul_f32(r, vrsqrts_f32(vmul_f32(n, r), r));
+	v = vmulq_lane_f32(v, r, 0);
+	w = vgetq_lane_f32(v, 0);
+	x = vgetq_lane_f32(v, 1);
+	y = vgetq_lane_f32(v, 2);
+	z = vgetq_lane_f32(v, 3);
+#else
+	w = q[0];
+	x = q[1];
+	y = q[2];
+	z = q[3];
+	s = 1.0f/real_sqrt(w*w + x*x + y*y + z*z);
+	w *= s;
+	x *= s;
+	y *= s;
+	z *= s;
+#endif
+	q[0] = w;
+	q[1] = x;
+	q[2] = y;
+	q[3] = z;
+
+	tb[0] = real_atan2(2.0f*(w*x + y*z), 1.0f - 2.0f*(x*x + y*y));
+	s = 2.0f*(w*y - z*x);
+	if(s>1.0f) s = 1.0f;
+	if(s<-1.0f) s = -1.0f;
+	tb[1] = real_asin(s);
+	tb[2] = real_atan2(2.0f*(w*z + x*y), 1.0f - 2.0f*(y*y + z*z));
 	return;
 }
 
-static void __batt_cleanup(void)
+/**
+ * @brief      single precision rc_quaternion_rotate_vector_array(), rotates v
+ *             in place
+ */
+static void __quat_rotate(double v[3], const double q[4])
 {
-	rc_filter_free(&batt_lp);
-	return;
-}
+	real_t w = q[0], x = q[1], y = q[2], z = q[3];
+	real_t a = v[0], b = v[1], c = v[2];
 
+	v[0] = (1.0f - 2.0f*(y*y + z*z))*a + 2.0f*(x*y - w*z)*b + 2.0f*(x*z + w*y)*c;
+	v[1] = 2.0f*(x*y + w*z)*a + (1.0f - 2.0f*(x*x + z*z))*b + 2.0f*(y*z - w*x)*c;
+	v[2] = 2.0f*(x*z - w*y)*a + 2.0f*(y*z + w*x)*b + (1.0f - 2.0f*(x*x + y*y))*c;
+}
+#endif // RC_PILOT_FLOAT32
 
 
 static void __imu_march(void)
@@ -92,10 +227,13 @@ static void __imu_march(void)
 	state_estimate.quat_imu[2] =  mpu_data.dmp_quat[1]; // Y (j)
 	state_estimate.quat_imu[3] = -mpu_data.dmp_quat[3]; // Z (k)
 
-	// normalize it just in case
+	// normalize it just in case and generate tait bryan angles
+	#ifdef RC_PILOT_FLOAT32
+	__quat_norm_to_tb(state_estimate.quat_imu, state_estimate.tb_imu);
+	#else
 	rc_quaternion_norm_array(state_estimate.quat_imu);
-	// generate tait bryan angles
 	rc_quaternion_to_tb_array(state_estimate.quat_imu, state_estimate.tb_imu);
+	#endif
 
 	// yaw is more annoying since we have to detect spins
 	// also make sign negative since NED coordinates has Z point down
@@ -130,10 +268,13 @@ static void __mag_march(void)
 	state_estimate.quat_mag[2] =  mpu_data.fused_quat[1]; // Y (j)
 	state_estimate.quat_mag[3] = -mpu_data.fused_quat[3]; // Z (k)
 
-	// normalize it just in case
+	// normalize it just in case and generate tait bryan angles
+	#ifdef RC_PILOT_FLOAT32
+	__quat_norm_to_tb(state_estimate.quat_mag, state_estimate.tb_mag);
+	#else
 	rc_quaternion_norm_array(state_estimate.quat_mag);
-	// generate tait bryan angles
 	rc_quaternion_to_tb_array(state_estimate.quat_mag, state_estimate.tb_mag);
+	#endif
 
 	// heading
 	state_estimate.mag_heading_raw = mpu_data.compass_heading_raw;
@@ -153,6 +294,108 @@ static void __mag_march(void)
 }
 
 
+/**
+ * @brief      covariance half of the predict step, P = F*P*F' + Q
+ *
+ * F = [1 dt 0; 0 1 -dt; 0 0 1] is written out so the products are unrolled
+ * and only touch the non-zero entries. Shared by the altitude and position
+ * filters which use the same model.
+ */
+static void __kf_cov_predict(double P[3][3], double dt, const double Q[3])
+{
+	double FP[3][3];
+
+	// F*P
+	FP[0][0] = P[0][0] + dt*P[1][0];
+	FP[0][1] = P[0][1] + dt*P[1][1];
+	FP[0][2] = P[0][2] + dt*P[1][2];
+	FP[1][0] = P[1][0] - dt*P[2][0];
+	FP[1][1] = P[1][1] - dt*P[2][1];
+	FP[1][2] = P[1][2] - dt*P[2][2];
+	FP[2][0] = P[2][0];
+	FP[2][1] = P[2][1];
+	FP[2][2] = P[2][2];
+
+	// (F*P)*F' + Q
+	P[0][0] = FP[0][0] + dt*FP[0][1] + Q[0];
+	P[0][1] = FP[0][1] - dt*FP[0][2];
+	P[0][2] = FP[0][2];
+	P[1][0] = FP[1][0] + dt*FP[1][1];
+	P[1][1] = FP[1][1] - dt*FP[1][2] + Q[1];
+	P[1][2] = FP[1][2];
+	P[2][0] = FP[2][0] + dt*FP[2][1];
+	P[2][1] = FP[2][1] - dt*FP[2][2];
+	P[2][2] = FP[2][2] + Q[2];
+	return;
+}
+
+/**
+ * @brief      covariance half of the measurement update with H = [1 0 0]
+ *
+ * With a scalar measurement the innovation covariance is a scalar so there
+ * is no matrix inverse, just one division.
+ *
+ * @param      P     covariance, updated in place
+ * @param[in]  R     measurement noise
+ * @param[out] K     kalman gain
+ */
+static void __kf_cov_update(double P[3][3], double R, double K[3])
+{
+	int i,j;
+	const double S_inv = 1.0/(P[0][0] + R);
+	double P0[3];
+
+	K[0] = P[0][0]*S_inv;
+	K[1] = P[1][0]*S_inv;
+	K[2] = P[2][0]*S_inv;
+	// P = (I-K*H)*P, only the first row of P is involved in K*H*P
+	for(i=0;i<3;i++) P0[i] = P[0][i];
+	for(i=0;i<3;i++){
+		for(j=0;j<3;j++) P[i][j] -= K[i]*P0[j];
+	}
+	return;
+}
+
+/**
+ * @brief      predict step, x = F*x + G*u and P = F*P*F' + Q with
+ *             G = [dt^2/2; dt; 0]
+ *
+ * @param[in]  u     filtered vertical acceleration
+ */
+static void __alt_kf_predict(double u)
+{
+	double* x = alt_kf.x;
+	const double dt = alt_kf.dt;
+
+	x[0] = x[0] + dt*x[1] + alt_kf.G[0]*u;
+	x[1] = x[1] - dt*x[2] + alt_kf.G[1]*u;
+	// x[2], accel bias, is modeled as constant
+
+	if(alt_kf.steady_state) return;
+	__kf_cov_predict(alt_kf.P, dt, alt_kf.Q);
+	return;
+}
+
+/**
+ * @brief      measurement update, in steady state mode only the state is
+ *             corrected with the precomputed gain
+ *
+ * @param[in]  y     measured altitude in NED (negative up)
+ */
+static void __alt_kf_update(double y)
+{
+	double* x = alt_kf.x;
+	double* K = alt_kf.K;
+	double innov = y - x[0];
+
+	if(!alt_kf.steady_state) __kf_cov_update(alt_kf.P, ALT_KF_R, K);
+
+	x[0] += K[0]*innov;
+	x[1] += K[1]*innov;
+	x[2] += K[2]*innov;
+	return;
+}
+
 /**
  * @brief      initialize the altitude kalman filter
  *
@@ -160,76 +403,68 @@ static void __mag_march(void)
  */
 static int __altitude_init(void)
 {
-	//initialize altitude kalman filter and bmp sensor
-    rc_matrix_t F = RC_MATRIX_INITIALIZER;
-    rc_matrix_t G = RC_MATRIX_INITIALIZER;
-    rc_matrix_t H = RC_MATRIX_INITIALIZER;
-    rc_matrix_t Q = RC_MATRIX_INITIALIZER;
-    rc_matrix_t R = RC_MATRIX_INITIALIZER;
-    rc_matrix_t Pi = RC_MATRIX_INITIALIZER;
-
-	const int Nx = 3;
-	const int Ny = 1;
-	const int Nu = 1;
-
-	// allocate appropirate memory for system
-	rc_matrix_zeros(&F, Nx, Nx);
-	rc_matrix_zeros(&G, Nx, Nu);
-	rc_matrix_zeros(&H, Ny, Nx);
-	rc_matrix_zeros(&Q, Nx, Nx);
-	rc_matrix_zeros(&R, Ny, Ny);
-	rc_matrix_zeros(&Pi, Nx, Nx);
-
-	// define system -DT; // accel bias
-	F.d[0][0] = 1.0;
-	F.d[0][1] = DT;
-	F.d[0][2] = 0.0;
-	F.d[1][0] = 0.0;
-	F.d[1][1] = 1.0;
-	F.d[1][2] = -DT; // subtract accel bias
-	F.d[2][0] = 0.0;
-	F.d[2][1] = 0.0;
-	F.d[2][2] = 1.0; // accel bias state
-
-	G.d[0][0] = 0.5*DT*DT;
-	G.d[0][1] = DT;
-	G.d[0][2] = 0.0;
-
-	H.d[0][0] = 1.0;
-	H.d[0][1] = 0.0;
-	H.d[0][2] = 0.0;
-
-	// covariance matrices
-	Q.d[0][0] = 0.000000001;
-	Q.d[1][1] = 0.000000001;
-	Q.d[2][2] = 0.0001; // don't want bias to change too quickly
-	R.d[0][0] = 1000000.0;
+	int i,j;
+	double K_last[3];
 
 	// initial P, cloned from converged P while running
-	Pi.d[0][0] = 1258.69;
-	Pi.d[0][1] = 158.6114;
-	Pi.d[0][2] = -9.9937;
-	Pi.d[1][0] = 158.6114;
-	Pi.d[1][1] = 29.9870;
-	Pi.d[1][2] = -2.5191;
-	Pi.d[2][0] = -9.9937;
-	Pi.d[2][1] = -2.5191;
-	Pi.d[2][2] = 0.3174;
-
-	// initialize the kalman filter
-	if(rc_kalman_alloc_lin(&alt_kf,F,G,H,Q,R,Pi)==-1) return -1;
-	rc_matrix_free(&F);
-	rc_matrix_free(&G);
-	rc_matrix_free(&H);
-	rc_matrix_free(&Q);
-	rc_matrix_free(&R);
-	rc_matrix_free(&Pi);
+	static const double Pi[3][3] = {
+		{1258.69,	158.6114,	-9.9937},
+		{158.6114,	29.9870,	-2.5191},
+		{-9.9937,	-2.5191,	0.3174}};
+
+	alt_kf.steady_state = 0;
+	alt_kf.step = 0;
+	alt_kf.dt = settings.dt;
+	alt_kf.G[0] = 0.5*settings.dt*settings.dt;
+	alt_kf.G[1] = settings.dt;
+	alt_kf.Q[0] = ALT_KF_Q0*(settings.dt/ALT_KF_TUNED_DT);
+	alt_kf.Q[1] = ALT_KF_Q1*(settings.dt/ALT_KF_TUNED_DT);
+	alt_kf.Q[2] = ALT_KF_Q2*(settings.dt/ALT_KF_TUNED_DT);
+	bmp_rate_div = scheduler_rate_div(BMP_HZ);
+	for(i=0;i<3;i++){
+		alt_kf.x[i] = 0.0;
+		alt_kf.K[i] = 0.0;
+		for(j=0;j<3;j++) alt_kf.P[i][j] = Pi[i][j];
+	}
+
+	// Precompute the converged gain by running the covariance recursion with
+	// the same predict/update pattern as in flight, one update every
+	// bmp_rate_div predicts, until K stops changing.
+	if(settings.altitude_kf_steady_state){
+		for(i=0;i<ALT_KF_SS_MAX_CYCLES;i++){
+			for(j=0;j<3;j++) K_last[j] = alt_kf.K[j];
+			for(j=0;j<bmp_rate_div;j++) __alt_kf_predict(0.0);
+			__alt_kf_update(0.0);
+			if(fabs(alt_kf.K[0]-K_last[0])<ALT_KF_SS_TOL &&
+			   fabs(alt_kf.K[1]-K_last[1])<ALT_KF_SS_TOL &&
+			   fabs(alt_kf.K[2]-K_last[2])<ALT_KF_SS_TOL) break;
+		}
+		if(i==ALT_KF_SS_MAX_CYCLES){
+			fprintf(stderr,"ERROR in state_estimator, altitude gain did not converge\n");
+			return -1;
+		}
+		#ifdef DEBUG
+		printf("altitude steady state gain %g %g %g after %d cycles\n",\
+				alt_kf.K[0], alt_kf.K[1], alt_kf.K[2], i);
+		#endif
+		for(i=0;i<3;i++) alt_kf.x[i] = 0.0;
+		alt_kf.steady_state = 1;
+	}
 
 	// initialize the little LP filter to take out accel noise
-	if(rc_filter_first_order_lowpass(&acc_lp, DT, 20*DT)) return -1;
+	rc_filter_t f = RC_FILTER_INITIALIZER;
+	if(rc_filter_first_order_lowpass(&f, settings.dt, ACC_LP_TC)) return -1;
+	if(controller_from_filter(&acc_lp, f)){
+		rc_filter_free(&f);
+		return -1;
+	}
+	rc_filter_free(&f);
 
-	// init barometer and read in first data
-	if(rc_bmp_read(&bmp_data)) return -1;
+	// bmp_manager took the first reading synchronously during its init
+	if(bmp_manager_get_latest(&bmp_sample) || bmp_sample.count==0){
+		fprintf(stderr,"ERROR in state_estimator, no barometer data\n");
+		return -1;
+	}
 
 	return 0;
 }
@@ -237,89 +472,310 @@ static int __altitude_init(void)
 static void __altitude_march(void)
 {
 	int i;
+	int fresh = 0;
 	double accel_vec[3];
-	static rc_vector_t u = RC_VECTOR_INITIALIZER;
-	static rc_vector_t y = RC_VECTOR_INITIALIZER;
+	bmp_sample_t s;
+	static uint64_t last_count = 0;
+
+	// pick up a new barometer sample if the thread published one, if it was
+	// midway through publishing just get it next loop
+	if(bmp_manager_get_latest(&s)==0) bmp_sample = s;
+	if(bmp_sample.count!=last_count){
+		fresh = 1;
+		last_count = bmp_sample.count;
+	}
 
 	// grab raw data
-	state_estimate.bmp_pressure_raw = bmp_data.pressure_pa;
-	state_estimate.alt_bmp_raw = bmp_data.alt_m;
-	state_estimate.bmp_temp = bmp_data.temp_c;
+	state_estimate.bmp_pressure_raw = bmp_sample.data.pressure_pa;
+	state_estimate.bmp_count = bmp_sample.count;
+	state_estimate.alt_bmp_raw = bmp_sample.data.alt_m;
+	state_estimate.bmp_temp = bmp_sample.data.temp_c;
 
 	// make copy of acceleration reading before rotating
 	for(i=0;i<3;i++) accel_vec[i] = state_estimate.accel[i];
 
-	// rotate accel vector
+	// rotate accel vector, the position stage uses it too
+	#ifdef RC_PILOT_FLOAT32
+	__quat_rotate(accel_vec, state_estimate.quat_imu);
+	#else
 	rc_quaternion_rotate_vector_array(accel_vec, state_estimate.quat_imu);
+	#endif
+	for(i=0;i<3;i++) accel_world[i] = accel_vec[i];
 
 	// do first-run filter setup
 	if(alt_kf.step==0){
-        rc_vector_zeros(&u, 1);
-        rc_vector_zeros(&y, 1);
-		alt_kf.x_est.d[0] = -bmp_data.alt_m;
-		rc_filter_prefill_inputs(&acc_lp, accel_vec[2]+GRAVITY);
-		rc_filter_prefill_outputs(&acc_lp, accel_vec[2]+GRAVITY);
+		alt_kf.x[0] = -bmp_sample.data.alt_m;
+		controller_prefill_inputs(&acc_lp, accel_vec[2]+GRAVITY);
+		controller_prefill_outputs(&acc_lp, accel_vec[2]+GRAVITY);
 	}
 
 	// calculate acceleration and smooth it just a tad
 	// put result in u for kalman and flip sign since with altitude, positive
 	// is up whereas acceleration in Z points down.
-	rc_filter_march(&acc_lp, accel_vec[2]+GRAVITY);
-	u.d[0] = acc_lp.newest_output;
+	double acc_z = controller_march(&acc_lp, accel_vec[2]+GRAVITY);
 
+	// always propagate the model, only apply the measurement update when
+	// there is a new sample.
 	// don't bother filtering Barometer, kalman will deal with that
-	y.d[0] = -bmp_data.alt_m;
-
-	rc_kalman_update_lin(&alt_kf, u, y);
+	__alt_kf_predict(acc_z);
+	if(fresh) __alt_kf_update(-bmp_sample.data.alt_m);
+	alt_kf.step++;
 
 	// altitude estimate
-	state_estimate.alt_bmp		= alt_kf.x_est.d[0];
-	state_estimate.alt_bmp_vel	= alt_kf.x_est.d[1];
-	state_estimate.alt_bmp_accel= alt_kf.x_est.d[2];
+	state_estimate.alt_bmp		= alt_kf.x[0];
+	state_estimate.alt_bmp_vel	= alt_kf.x[1];
+	state_estimate.alt_bmp_accel= alt_kf.x[2];
+
+	// Z of the global estimate
+	state_estimate.pos_global[2]	= alt_kf.x[0];
+	state_estimate.vel_global[2]	= alt_kf.x[1];
+	state_estimate.accel_global[2]	= acc_z - alt_kf.x[2];
 
 	return;
 }
 
-static void __feedback_select(void)
+/**
+ * @brief      initialize the horizontal position filter
+ *
+ * @return     0 on success, -1 on failure
+ */
+static int __position_init(void)
 {
-	state_estimate.roll = state_estimate.tb_imu[0];
-	state_estimate.pitch = state_estimate.tb_imu[1];
-	state_estimate.yaw = state_estimate.tb_imu[2];
-	state_estimate.continuous_yaw = state_estimate.imu_continuous_yaw;
-	state_estimate.X = state_estimate.pos_mocap[0];
-	state_estimate.Y = state_estimate.pos_mocap[1];
-	state_estimate.Z = state_estimate.alt_bmp;
+	uint64_t latency_steps;
+
+	memset(&pos_kf, 0, sizeof(pos_kf));
+	pos_kf.dt = settings.dt;
+	pos_kf.G[0] = 0.5*settings.dt*settings.dt;
+	pos_kf.G[1] = settings.dt;
+	pos_kf.Q[0] = POS_KF_Q0*(settings.dt/ALT_KF_TUNED_DT);
+	pos_kf.Q[1] = POS_KF_Q1*(settings.dt/ALT_KF_TUNED_DT);
+	pos_kf.Q[2] = POS_KF_Q2*(settings.dt/ALT_KF_TUNED_DT);
+	pos_kf.dt_ns = settings.dt*1e9;
+	pos_kf.latency_ns = settings.mocap_latency_ms*1e6;
+	pos_kf.timeout_steps = (uint64_t)llround(MOCAP_TIMEOUT/settings.dt);
+
+	// the oldest sample still counted as running must fit in the history
+	latency_steps = (uint64_t)llround(pos_kf.latency_ns/pos_kf.dt_ns);
+	if(latency_steps+pos_kf.timeout_steps>=POS_KF_HISTORY){
+		fprintf(stderr,"ERROR in state_estimator, mocap_latency_ms is too long for %d loops of history at %dhz\n",\
+					POS_KF_HISTORY, settings.feedback_hz);
+		return -1;
+	}
+	state_estimate.mocap_running = 0;
+	state_estimate.mocap_count = 0;
+	return 0;
 }
 
-static void __altitude_cleanup(void)
+/**
+ * @brief      predicts both axes from one loop's entry into the next, the
+ *             next entry must already hold its input
+ */
+static void __pos_kf_predict(const pos_kf_entry_t* from, pos_kf_entry_t* to)
 {
-	rc_kalman_free(&alt_kf);
-	rc_filter_free(&acc_lp);
+	const double dt = pos_kf.dt;
+	int j;
+
+	for(j=0;j<2;j++){
+		to->x[0][j] = from->x[0][j] + dt*from->x[1][j] + pos_kf.G[0]*to->u[j];
+		to->x[1][j] = from->x[1][j] - dt*from->x[2][j] + pos_kf.G[1]*to->u[j];
+		to->x[2][j] = from->x[2][j];
+	}
+	memcpy(to->P, from->P, sizeof(to->P));
+	__kf_cov_predict(to->P, dt, pos_kf.Q);
 	return;
 }
 
+/**
+ * @brief      applies a mocap position to both axes of one entry in place
+ */
+static void __pos_kf_update(pos_kf_entry_t* e, const double y[2])
+{
+	double K[3];
+	double innov;
+	int i,j;
+
+	__kf_cov_update(e->P, POS_KF_R, K);
+	for(j=0;j<2;j++){
+		innov = y[j] - e->x[0][j];
+		for(i=0;i<3;i++) e->x[i][j] += K[i]*innov;
+	}
+	return;
+}
 
+/**
+ * @brief      starts the filter over at the current loop from a mocap
+ *             position, at rest and without bias
+ */
+static void __pos_kf_reset(const double y[2])
+{
+	pos_kf_entry_t* e = &pos_kf.hist[pos_kf.step&(POS_KF_HISTORY-1)];
+	int j;
+
+	memset(e->x, 0, sizeof(e->x));
+	memset(e->P, 0, sizeof(e->P));
+	for(j=0;j<2;j++){
+		e->x[0][j] = y[j];
+		e->y[j] = y[j];
+		e->u[j] = accel_world[j];
+	}
+	e->P[0][0] = POS_KF_R;
+	e->P[1][1] = POS_KF_P0_VEL;
+	e->P[2][2] = POS_KF_P0_BIAS;
+	e->has_meas = 1;
+	pos_kf.start_step = pos_kf.step;
+	pos_kf.running = 1;
+	return;
+}
 
-static void __mocap_check_timeout(void)
+/**
+ * @brief      applies a mocap position measured some loops ago
+ *
+ * The measurement updates the entry of the loop it was measured in, then
+ * every loop since is predicted again from its stored input, reapplying the
+ * measurements they had, so the current entry ends up as if the sample had
+ * arrived on time. If two samples fall in the same loop the newer one is the
+ * one remembered for later re-runs.
+ *
+ * @param[in]  back  loops between the measurement and now
+ * @param[in]  y     measured X and Y
+ */
+static void __pos_kf_fuse(uint64_t back, const double y[2])
 {
-	if(state_estimate.mocap_running){
-		uint64_t current_time = rc_nanos_since_boot();
-		// check if mocap data is > 3 steps old
-		if((current_time-state_estimate.mocap_timestamp_ns) > (3*1E7)){
-			state_estimate.mocap_running = 0;
-			if(settings.warnings_en){
-				fprintf(stderr,"WARNING, MOCAP LOST VISUAL\n");
+	const uint64_t mask = POS_KF_HISTORY-1;
+	uint64_t k = pos_kf.step-back;
+	pos_kf_entry_t* e = &pos_kf.hist[k&mask];
+
+	__pos_kf_update(e, y);
+	e->y[0] = y[0];
+	e->y[1] = y[1];
+	e->has_meas = 1;
+	for(k=k+1;k<=pos_kf.step;k++){
+		__pos_kf_predict(e, &pos_kf.hist[k&mask]);
+		e = &pos_kf.hist[k&mask];
+		if(e->has_meas) __pos_kf_update(e, e->y);
+	}
+	return;
+}
+
+/**
+ * @brief      picks up the newest mocap sample and marches the horizontal
+ *             filter, must run after __altitude_march() rotated the accel
+ */
+static void __position_march(void)
+{
+	const uint64_t mask = POS_KF_HISTORY-1;
+	pos_kf_entry_t* e;
+	mocap_sample_t s;
+	uint64_t now, age_ns, rx_back, back;
+	int j, fresh = 0;
+
+	// if the writer was midway through publishing just get it next loop
+	if(seqlock_try_read(&mocap_lock, &s, &mocap_latest, sizeof(s))==0 &&
+	   s.count!=state_estimate.mocap_count){
+		fresh = 1;
+	}
+
+	// propagate with this loop's input, the entry is the estimate at the
+	// end of this loop until a late sample rewrites it
+	if(pos_kf.running){
+		e = &pos_kf.hist[pos_kf.step&mask];
+		e->u[0] = accel_world[0];
+		e->u[1] = accel_world[1];
+		e->has_meas = 0;
+		__pos_kf_predict(&pos_kf.hist[(pos_kf.step-1)&mask], e);
+	}
+
+	if(fresh){
+		now = hal_time_ns();
+		age_ns = (s.timestamp_ns<now) ? now-s.timestamp_ns : 0;
+		state_estimate.mocap_count = s.count;
+		state_estimate.mocap_timestamp_ns = s.timestamp_ns;
+		state_estimate.mocap_age = age_ns/1e9;
+
+		// all zeros means the mocap system is alive but has lost visual
+		// contact on the object
+		if(fabs(s.pos[0])<MOCAP_LOST_TOL && fabs(s.pos[1])<MOCAP_LOST_TOL &&
+		   fabs(s.pos[2])<MOCAP_LOST_TOL){
+			if(state_estimate.mocap_running==1){
+				state_estimate.mocap_running = 0;
+				pos_kf.running = 0;
+				if(settings.warnings_en){
+					fprintf(stderr,"WARNING, MOCAP LOST VISUAL\n");
+				}
+			}
+			else{
+				state_estimate.is_active = 0;
 			}
 		}
+		// a sample that sat around for longer than the timeout is dropped
+		// so it can't bring mocap back by itself
+		else if((rx_back = (uint64_t)llround(age_ns/pos_kf.dt_ns))<=pos_kf.timeout_steps){
+			for(j=0;j<3;j++) state_estimate.pos_mocap[j] = s.pos[j];
+			for(j=0;j<4;j++) state_estimate.quat_mocap[j] = s.quat[j];
+			for(j=0;j<3;j++) state_estimate.tb_mocap[j] = s.tb[j];
+			pos_kf.rx_step = pos_kf.step-rx_back;
+			back = (uint64_t)llround((age_ns+pos_kf.latency_ns)/pos_kf.dt_ns);
+
+			if(!pos_kf.running) __pos_kf_reset(s.pos);
+			else if(back<=pos_kf.step-pos_kf.start_step && back<POS_KF_HISTORY){
+				__pos_kf_fuse(back, s.pos);
+			}
+			// otherwise older than anything still in the history, the
+			// loops it belongs to can't be re-run
+			state_estimate.mocap_running = 1;
+		}
+	}
+
+	// counted in loops like the history so replay times out identically
+	if(state_estimate.mocap_running && pos_kf.step-pos_kf.rx_step>pos_kf.timeout_steps){
+		state_estimate.mocap_running = 0;
+		pos_kf.running = 0;
+		if(settings.warnings_en){
+			fprintf(stderr,"WARNING, MOCAP LOST VISUAL\n");
+		}
 	}
+
+	// X and Y of the global estimate, held at rest while mocap is out
+	e = &pos_kf.hist[pos_kf.step&mask];
+	for(j=0;j<2;j++){
+		state_estimate.pos_global[j] = e->x[0][j];
+		if(pos_kf.running){
+			state_estimate.vel_global[j] = e->x[1][j];
+			state_estimate.accel_global[j] = e->u[j] - e->x[2][j];
+		}
+		else{
+			state_estimate.vel_global[j] = 0.0;
+			state_estimate.accel_global[j] = 0.0;
+		}
+	}
+	pos_kf.step++;
+	return;
+}
+
+static void __feedback_select(void)
+{
+	state_estimate.roll = state_estimate.tb_imu[0];
+	state_estimate.pitch = state_estimate.tb_imu[1];
+	state_estimate.yaw = state_estimate.tb_imu[2];
+	state_estimate.continuous_yaw = state_estimate.imu_continuous_yaw;
+	state_estimate.X = state_estimate.pos_global[0];
+	state_estimate.Y = state_estimate.pos_global[1];
+	state_estimate.Z = state_estimate.alt_bmp;
+}
+
+static void __altitude_cleanup(void)
+{
+	acc_lp.initialized = 0;
 	return;
 }
 
 
+
 int state_estimator_init(void)
 {
-	__batt_init();
+	if(__batt_init()) return -1;
 	if(__altitude_init()) return -1;
+	if(__position_init()) return -1;
 	state_estimate.initialized = 1;
 	return 0;
 }
@@ -331,35 +787,70 @@ int state_estimator_march(void)
 		return -1;
 	}
 
-	// populate state_estimate struct one setion at a time, top to bottom
-	__batt_march();
+	// populate state_estimate struct one setion at a time, top to bottom,
+	// the battery is done by its own slower task
 	__imu_march();
 	__mag_march();
 	__altitude_march();
+	__position_march();
 	__feedback_select();
-	__mocap_check_timeout();
+	return 0;
+}
+
+
+int state_estimator_batt_march(void)
+{
+	batt_sample_t s;
+
+	// reads and filters inline only when batt_manager has no thread
+	if(batt_manager_request_sample()) return -1;
+	// on a collision with the writer keep the last sample until next time
+	if(batt_manager_get_latest(&s)) return 0;
+	state_estimate.v_batt_raw = s.v_raw;
+	state_estimate.v_batt_lp = s.v_lp;
+	state_estimate.batt_gain_scale = s.gain_scale;
+	state_estimate.batt_count = s.count;
 	return 0;
 }
 
 
 int state_estimator_jobs_after_feedback(void)
 {
-	static int bmp_sample_counter = 0;
+	// The i2c read happens in the bmp_manager thread once this callback
+	// returns, before the next DMP interrupt needs the bus.
+	if(bmp_manager_request_sample()) return -1;
+	return 0;
+}
 
-	// check if we need to sample BMP this loop
-	if(bmp_sample_counter>=BMP_RATE_DIV){
-		// perform the i2c reads to the sensor, on bad read just try later
-		if(rc_bmp_read(&bmp_data)) return -1;
-		bmp_sample_counter=0;
-	}
-	bmp_sample_counter++;
+
+int state_estimator_publish_mocap(const mocap_sample_t* sample)
+{
+	if(sample==NULL) return -1;
+	seqlock_write(&mocap_lock, &mocap_latest, sample, sizeof(mocap_sample_t));
 	return 0;
 }
 
 
 int state_estimator_cleanup(void)
 {
-	__batt_cleanup();
 	__altitude_cleanup();
 	return 0;
-}
\ No newline at end of file
+}
+
+
+#ifdef RC_PILOT_BENCH
+void state_estimator_bench_imu_march(void)
+{
+	__imu_march();
+}
+
+void state_estimator_bench_altitude_march(void)
+{
+	__altitude_march();
+}
+
+void state_estimator_bench_position_march(void)
+{
+	__position_march();
+}
+#endif
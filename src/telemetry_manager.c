@@ -0,0 +1,288 @@
+/**
+ * @file telemetry_manager.c
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <rc/start_stop.h>
+#include <rc/time.h>
+#include <rc/pthread.h>
+#include <rc/mavlink_udp.h>
+
+#include <rc_pilot_defs.h>
+#include <thread_defs.h>
+#include <telemetry_manager.h>
+#include <snapshot.h>
+#include <instrumentation.h>
+#include <watchdog.h>
+#include <settings.h>
+#include <rt_setup.h>
+
+#define HEARTBEAT_HZ	1.0
+
+/**
+ * one coherent set of data for every stream packed in a cycle
+ */
+typedef struct telemetry_frame_t{
+	uint64_t time_ns;
+	state_estimate_t se;
+	feedback_state_t fs;
+} telemetry_frame_t;
+
+/**
+ * a periodic message stream, rate of 0 disables it
+ */
+typedef struct telemetry_stream_t{
+	const double* hz;
+	void (*pack)(const telemetry_frame_t* f);
+	uint64_t next_ns;
+} telemetry_stream_t;
+
+static pthread_t telemetry_thread;
+static int initialized = 0;
+static int sock = -1;
+static struct sockaddr_in dest;
+
+// datagram being built
+static uint8_t dgram[TELEMETRY_MAX_DATAGRAM];
+static int dgram_len = 0;
+
+static const double heartbeat_hz = HEARTBEAT_HZ;
+
+
+/**
+ * @brief      sends whatever is in the datagram buffer
+ */
+static void __flush(void)
+{
+	if(dgram_len==0) return;
+	if(sendto(sock, dgram, dgram_len, 0, (struct sockaddr*)&dest, sizeof(dest))<0){
+		// the ground station going away is normal, don't spam about it
+		if(errno!=ECONNREFUSED && errno!=ENETUNREACH && settings.warnings_en){
+			fprintf(stderr,"WARNING in telemetry_manager, sendto failed\n");
+		}
+	}
+	dgram_len = 0;
+	return;
+}
+
+/**
+ * @brief      appends a message to the datagram, sending first if it would
+ *             not fit
+ */
+static void __queue(const mavlink_message_t* msg)
+{
+	uint8_t buf[MAVLINK_MAX_PACKET_LEN];
+	uint16_t len = mavlink_msg_to_send_buffer(buf, msg);
+
+	if(dgram_len+len>TELEMETRY_MAX_DATAGRAM) __flush();
+	memcpy(dgram+dgram_len, buf, len);
+	dgram_len += len;
+	return;
+}
+
+static void __pack_heartbeat(const telemetry_frame_t* f)
+{
+	mavlink_message_t msg;
+	uint8_t type, mode, status;
+
+	switch(settings.num_rotors){
+	case 6:
+		type = MAV_TYPE_HEXAROTOR;
+		break;
+	case 8:
+		type = MAV_TYPE_OCTOROTOR;
+		break;
+	default:
+		type = MAV_TYPE_QUADROTOR;
+		break;
+	}
+	mode = (f->fs.arm_state==ARMED) ? MAV_MODE_FLAG_SAFETY_ARMED : 0;
+	status = (f->fs.arm_state==ARMED) ? MAV_STATE_ACTIVE : MAV_STATE_STANDBY;
+	mavlink_msg_heartbeat_pack(settings.my_sys_id, MAV_COMP_ID_AUTOPILOT1, &msg,
+				type, MAV_AUTOPILOT_GENERIC, mode, 0, status);
+	__queue(&msg);
+	return;
+}
+
+static void __pack_attitude(const telemetry_frame_t* f)
+{
+	mavlink_message_t msg;
+	mavlink_msg_attitude_quaternion_pack(settings.my_sys_id, MAV_COMP_ID_AUTOPILOT1,
+				&msg, f->time_ns/1000000,
+				f->se.quat_imu[0], f->se.quat_imu[1],
+				f->se.quat_imu[2], f->se.quat_imu[3],
+				f->se.gyro[0], f->se.gyro[1], f->se.gyro[2]);
+	__queue(&msg);
+	return;
+}
+
+static void __pack_position(const telemetry_frame_t* f)
+{
+	mavlink_message_t msg;
+	mavlink_msg_local_position_ned_pack(settings.my_sys_id, MAV_COMP_ID_AUTOPILOT1,
+				&msg, f->time_ns/1000000,
+				f->se.X, f->se.Y, f->se.Z,
+				f->se.vel_global[0], f->se.vel_global[1],
+				f->se.alt_bmp_vel);
+	__queue(&msg);
+	return;
+}
+
+static void __pack_servo(const telemetry_frame_t* f)
+{
+	int i;
+	uint16_t pwm[8];
+	mavlink_message_t msg;
+
+	// normalized ESC signal maps 0-1 onto a 1000-2000us pulse, idle is -0.1,
+	// SERVO_OUTPUT_RAW only has room for the first 8 motors
+	for(i=0;i<8;i++){
+		if(i<settings.num_rotors) pwm[i] = (uint16_t)(1000.0 + 1000.0*f->fs.m[i]);
+		else pwm[i] = 0;
+	}
+	mavlink_msg_servo_output_raw_pack(settings.my_sys_id, MAV_COMP_ID_AUTOPILOT1,
+				&msg, f->time_ns/1000, 0, pwm[0], pwm[1], pwm[2],
+				pwm[3], pwm[4], pwm[5], pwm[6], pwm[7]);
+	__queue(&msg);
+	return;
+}
+
+static void __pack_battery(const telemetry_frame_t* f)
+{
+	mavlink_message_t msg;
+	instr_stats_t isr;
+	uint16_t load = 0;
+
+	// report the share of the loop period spent in the IMU callback as load
+	if(instr_get_stats(INSTR_ISR_TOTAL, &isr)==0){
+		load = (uint16_t)(isr.mean_ns*settings.feedback_hz/1000000);
+	}
+	mavlink_msg_sys_status_pack(settings.my_sys_id, MAV_COMP_ID_AUTOPILOT1, &msg,
+				0, 0, 0, load, (uint16_t)(f->se.v_batt_lp*1000.0),
+				-1, -1, 0, 0, 0, 0, 0, 0);
+	__queue(&msg);
+	return;
+}
+
+static void __pack_timing(const telemetry_frame_t* f)
+{
+	int i;
+	mavlink_message_t msg;
+	instr_stats_t s;
+	watchdog_stats_t wd;
+
+	for(i=0;i<INSTR_NUM_CHANNELS;i++){
+		if(instr_get_stats(i, &s)) continue;
+		mavlink_msg_debug_vect_pack(settings.my_sys_id, MAV_COMP_ID_AUTOPILOT1,
+				&msg, instr_channel_name(i), f->time_ns/1000,
+				s.p50_ns/1000.0, s.p99_ns/1000.0, s.max_ns/1000.0);
+		__queue(&msg);
+	}
+	watchdog_get_stats(&wd);
+	mavlink_msg_debug_vect_pack(settings.my_sys_id, MAV_COMP_ID_AUTOPILOT1,
+				&msg, "watchdog", f->time_ns/1000,
+				wd.overruns, wd.missed, wd.level);
+	__queue(&msg);
+	return;
+}
+
+static telemetry_stream_t streams[] = {
+	{.hz = &heartbeat_hz,			.pack = __pack_heartbeat},
+	{.hz = &settings.telemetry_attitude_hz,	.pack = __pack_attitude},
+	{.hz = &settings.telemetry_position_hz,	.pack = __pack_position},
+	{.hz = &settings.telemetry_servo_hz,	.pack = __pack_servo},
+	{.hz = &settings.telemetry_battery_hz,	.pack = __pack_battery},
+	{.hz = &settings.telemetry_timing_hz,	.pack = __pack_timing}
+};
+#define NUM_STREAMS (int)(sizeof(streams)/sizeof(streams[0]))
+
+
+static void* __telemetry_manager_func(__attribute__ ((unused)) void* ptr)
+{
+	int i;
+	uint64_t period;
+	telemetry_frame_t f;
+
+	rt_setup_thread(RT_THREAD_TELEMETRY);
+	while(rc_get_state()!=EXITING && initialized){
+		f.time_ns = rc_nanos_since_boot();
+		// one coherent copy for this cycle, skip the cycle if the writer
+		// got in the way
+		if(snapshot_get_state_estimate(&f.se) || snapshot_get_fstate(&f.fs)){
+			rc_usleep(1000000/TELEMETRY_MANAGER_HZ);
+			continue;
+		}
+
+		for(i=0;i<NUM_STREAMS;i++){
+			if(*streams[i].hz<=0.0 || f.time_ns<streams[i].next_ns) continue;
+			streams[i].pack(&f);
+			// keep a steady rate but don't burst to catch up after a stall
+			period = 1000000000.0/(*streams[i].hz);
+			streams[i].next_ns += period;
+			if(streams[i].next_ns<f.time_ns) streams[i].next_ns = f.time_ns + period;
+		}
+		__flush();
+		rc_usleep(1000000/TELEMETRY_MANAGER_HZ);
+	}
+	return NULL;
+}
+
+
+int telemetry_manager_init(void)
+{
+	int i;
+
+	if(initialized){
+		fprintf(stderr,"ERROR in telemetry_manager_init, already initialized\n");
+		return -1;
+	}
+
+	memset(&dest, 0, sizeof(dest));
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(settings.mav_port);
+	if(inet_pton(AF_INET, settings.dest_ip, &dest.sin_addr)!=1){
+		fprintf(stderr,"ERROR in telemetry_manager_init, invalid dest_ip %s\n", settings.dest_ip);
+		return -1;
+	}
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if(sock<0){
+		fprintf(stderr,"ERROR in telemetry_manager_init, failed to open socket\n");
+		return -1;
+	}
+
+	dgram_len = 0;
+	for(i=0;i<NUM_STREAMS;i++) streams[i].next_ns = 0;
+
+	initialized = 1;
+	if(rc_pthread_create(&telemetry_thread, __telemetry_manager_func, NULL,
+				SCHED_FIFO, TELEMETRY_MANAGER_PRI)==-1){
+		fprintf(stderr,"ERROR in telemetry_manager_init, failed to start thread\n");
+		initialized = 0;
+		close(sock);
+		sock = -1;
+		return -1;
+	}
+	return 0;
+}
+
+
+int telemetry_manager_cleanup(void)
+{
+	int ret = 0;
+	if(initialized){
+		initialized = 0;
+		ret = rc_pthread_timed_join(telemetry_thread, NULL, TELEMETRY_MANAGER_TOUT);
+		if(ret==1) fprintf(stderr,"WARNING: telemetry_manager_thread exit timeout\n");
+		else if(ret==-1) fprintf(stderr,"ERROR: failed to join telemetry_manager thread\n");
+		close(sock);
+		sock = -1;
+	}
+	return ret;
+}
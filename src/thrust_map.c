@@ -5,16 +5,29 @@
  * input to thrust. For the thrust table defined in thrust_map.h, this provides
  * the function to translate a desired normalized thrust (0-1) to the necessary
  * input (also 0-1).
+ *
+ * At init the selected table is resampled into a dense lookup table with
+ * uniformly spaced thrust values so that mapping a signal at runtime is one
+ * index computation and one linear interpolation regardless of how many
+ * points the original table had or where the throttle sits.
  **/
 
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <thrust_map.h>
+#include <real.h>
+#include <arena.h>
 
 static double* signal;
 static double* thrust;
 static int points;
+static int capacity;	// points signal and thrust have room for
+
+static double __scan_map(double m);
+
+// lut[i] is the motor signal producing normalized thrust i/THRUST_LUT_SIZE
+static float lut[THRUST_LUT_SIZE+1];
 
 // Generic linear mapping
 static const int linear_map_points = 11;
@@ -156,24 +169,74 @@ int thrust_map_init(thrust_map_t map)
 		}
 	}
 
-	// create new global array of normalized thrust and inputs
-	if(signal!=NULL) free(signal);
-	if(thrust!=NULL) free(thrust);
-	signal = (double*) malloc(points * sizeof(double));
-	thrust = (double*) malloc(points * sizeof(double));
+	// create new global array of normalized thrust and inputs, from the
+	// arena so a second init can only reuse or grow them before running
+	if(points>capacity){
+		signal = (double*)arena_alloc(points * sizeof(double));
+		thrust = (double*)arena_alloc(points * sizeof(double));
+		if(signal==NULL || thrust==NULL){
+			fprintf(stderr,"ERROR: failed to allocate thrust map\n");
+			capacity = 0;
+			return -1;
+		}
+		capacity = points;
+	}
 	max = data[points-1][1];
 	for(i=0; i<points; i++){
 		signal[i] = data[i][0];
 		thrust[i] = data[i][1]/max;
 	}
+
+	// resample into the uniform lookup table
+	for(i=0; i<=THRUST_LUT_SIZE; i++){
+		lut[i] = (float)__scan_map((double)i/THRUST_LUT_SIZE);
+	}
 	return 0;
 }
 
 
-double map_motor_signal(double m){
+/**
+ * @brief      Inverts the original thrust table by scanning for the segment
+ *             containing m. Only used to build the lookup table.
+ *
+ * @param[in]  m     normalized thrust between 0 and 1 inclusive
+ *
+ * @return     motor signal
+ */
+static double __scan_map(double m)
+{
 	int i;
 	double pos;
 
+	if(m<=0.0) return 0.0;
+	if(m>=1.0) return 1.0;
+
+	// scan through the data to pick the upper and lower points to interpolate
+	for(i=1; i<points; i++){
+		if(m <= thrust[i]){
+			pos = (m-thrust[i-1])/(thrust[i]-thrust[i-1]);
+			return signal[i-1]+(pos*(signal[i]-signal[i-1]));
+		}
+	}
+	return 1.0;
+}
+
+
+/**
+ * @brief      lookup table interpolation, m must already be range checked.
+ *             The table is float anyway, the float32 build interpolates in
+ *             single precision too.
+ */
+static inline real_t __lut_map(real_t m)
+{
+	real_t x = m*THRUST_LUT_SIZE;
+	int i = (int)x;
+	if(i>=THRUST_LUT_SIZE) return lut[THRUST_LUT_SIZE];
+	return lut[i] + (x-i)*(lut[i+1]-lut[i]);
+}
+
+
+double map_motor_signal(double m){
 	// sanity check
 	if(m>1.0 || m<0.0){
 		printf("ERROR: desired thrust t must be between 0.0 & 1.0\n");
@@ -183,14 +246,43 @@ double map_motor_signal(double m){
 	// return quickly for boundary conditions
 	if(m==0.0 || m==1.0) return m;
 
-	// scan through the data to pick the upper and lower points to interpolate
-	for(i=1; i<points; i++){
-		if(m <= thrust[i]){
-			pos = (m-thrust[i-1])/(thrust[i]-thrust[i-1]);
-			return signal[i-1]+(pos*(signal[i]-signal[i-1]));
+	return __lut_map(m);
+}
+
+
+int map_motor_signals(const double* in, double* out, int n)
+{
+	int i;
+	int ret = 0;
+
+	for(i=0; i<n; i++){
+		// sanity check, still map the remaining motors
+		if(in[i]>1.0 || in[i]<0.0){
+			out[i] = -1;
+			ret = -1;
+			continue;
 		}
+		if(in[i]==0.0 || in[i]==1.0) out[i] = in[i];
+		else out[i] = __lut_map(in[i]);
 	}
+	if(ret) printf("ERROR: desired thrust t must be between 0.0 & 1.0\n");
+	return ret;
+}
+
+
+double thrust_map_signal_to_thrust(double s)
+{
+	int i;
+	double pos;
+
+	if(s<=0.0) return 0.0;
+	if(s>=1.0) return 1.0;
 
-	fprintf(stderr,"ERROR: something in map_motor_signal went wrong\n");
-	return -1;
+	for(i=1; i<points; i++){
+		if(s <= signal[i]){
+			pos = (s-signal[i-1])/(signal[i]-signal[i-1]);
+			return thrust[i-1]+(pos*(thrust[i]-thrust[i-1]));
+		}
+	}
+	return 1.0;
 }
@@ -0,0 +1,283 @@
+/**
+ * @file trajectory.c
+ *
+ * Minimum jerk waypoint trajectories, see trajectory.h
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <json-c/json.h>
+
+#include <trajectory.h>
+#include <settings.h>
+
+#define TRAJ_COEFFS	6	// quintic
+
+/**
+ * one quintic per axis in normalized time s = (t-t_start)/T on [0,1]
+ */
+typedef struct traj_segment_t{
+	double t_start;
+	double t_end;
+	double inv_T;				///< 1/(t_end-t_start)
+	double c[TRAJ_NUM_AXES][TRAJ_COEFFS];	///< lowest order first
+} traj_segment_t;
+
+/**
+ * a complete trajectory
+ */
+typedef struct traj_bank_t{
+	int n;					///< segments, 0 for none loaded
+	traj_segment_t seg[TRAJECTORY_MAX_WAYPOINTS];
+	double end_pos[TRAJ_NUM_AXES];		///< last waypoint, held once done
+} traj_bank_t;
+
+// the IMU callback flies *active, the loading thread fills the other bank
+// and posts it in pending. trajectory_start() takes it with an exchange, so
+// if pending is still set when the next one comes in the loader knows the
+// bank was never touched and reuses it
+static traj_bank_t bank[2];
+static traj_bank_t* active = &bank[0];
+static traj_bank_t* _Atomic pending = NULL;
+static traj_bank_t* published = &bank[0];	// only used by the loader
+
+// state of the running trajectory, IMU callback only
+static int running = 0;
+static int cursor;
+static uint64_t ticks;
+static double origin_pos[TRAJ_NUM_AXES];
+
+
+/**
+ * @brief      minimum jerk quintic from p0,v0 to p1,v1 with zero acceleration
+ *             at both ends, velocities are scaled by T into normalized time
+ */
+static void __quintic(double c[TRAJ_COEFFS], double p0, double v0, double p1, double v1, double T)
+{
+	const double d  = p1-p0;
+	const double V0 = v0*T;
+	const double V1 = v1*T;
+
+	c[0] = p0;
+	c[1] = V0;
+	c[2] = 0.0;
+	c[3] =  10.0*d - 6.0*V0 - 4.0*V1;
+	c[4] = -15.0*d + 8.0*V0 + 7.0*V1;
+	c[5] =   6.0*d - 3.0*V0 - 3.0*V1;
+}
+
+
+int trajectory_set(const traj_waypoint_t* wp, int n)
+{
+	traj_bank_t* b;
+	traj_segment_t* s;
+	double t0, T;
+	const double* p0;
+	const double* v0;
+	static const double zero[TRAJ_NUM_AXES] = {0.0};
+	int i, j, horizontal = 0;
+
+	if(wp==NULL || n<1 || n>TRAJECTORY_MAX_WAYPOINTS){
+		fprintf(stderr,"ERROR in trajectory_set, need 1 to %d waypoints\n", TRAJECTORY_MAX_WAYPOINTS);
+		return -1;
+	}
+	t0 = 0.0;
+	for(i=0;i<n;i++){
+		// allow for rounding of times written in the file
+		if(!isfinite(wp[i].t) || wp[i].t-t0<settings.dt-1e-9){
+			fprintf(stderr,"ERROR in trajectory_set, waypoint %d must come at least one loop period after the previous one\n", i);
+			return -1;
+		}
+		for(j=0;j<TRAJ_NUM_AXES;j++){
+			if(!isfinite(wp[i].pos[j]) || !isfinite(wp[i].vel[j])){
+				fprintf(stderr,"ERROR in trajectory_set, waypoint %d is not finite\n", i);
+				return -1;
+			}
+		}
+		if(wp[i].pos[TRAJ_X]!=0.0 || wp[i].pos[TRAJ_Y]!=0.0 ||
+		   wp[i].vel[TRAJ_X]!=0.0 || wp[i].vel[TRAJ_Y]!=0.0) horizontal = 1;
+		t0 = wp[i].t;
+	}
+	if(horizontal){
+		fprintf(stderr,"WARNING in trajectory_set, trajectory moves in X or Y but only Z and yaw are flown, there is no horizontal position controller yet\n");
+	}
+
+	// a bank still pending was never seen by the IMU callback, otherwise
+	// the callback flies the one published last and the other one is free
+	b = atomic_exchange_explicit(&pending, NULL, memory_order_acquire);
+	if(b==NULL) b = (published==&bank[0]) ? &bank[1] : &bank[0];
+
+	t0 = 0.0;
+	p0 = zero;
+	v0 = zero;
+	for(i=0;i<n;i++){
+		s = &b->seg[i];
+		T = wp[i].t-t0;
+		s->t_start = t0;
+		s->t_end = wp[i].t;
+		s->inv_T = 1.0/T;
+		for(j=0;j<TRAJ_NUM_AXES;j++){
+			__quintic(s->c[j], p0[j], v0[j], wp[i].pos[j], wp[i].vel[j], T);
+		}
+		t0 = wp[i].t;
+		p0 = wp[i].pos;
+		v0 = wp[i].vel;
+	}
+	for(j=0;j<TRAJ_NUM_AXES;j++) b->end_pos[j] = wp[n-1].pos[j];
+	b->n = n;
+
+	published = b;
+	atomic_store_explicit(&pending, b, memory_order_release);
+	return 0;
+}
+
+
+/**
+ * @brief      reads one number out of a waypoint object
+ *
+ * @return     0 on success, -1 if it is mandatory and missing or not a number
+ */
+static int __get_number(json_object* obj, const char* key, int mandatory, double* out)
+{
+	json_object* tmp = NULL;
+
+	if(json_object_object_get_ex(obj, key, &tmp)==0){
+		if(!mandatory){
+			*out = 0.0;
+			return 0;
+		}
+		fprintf(stderr,"ERROR in trajectory file, waypoint missing %s\n", key);
+		return -1;
+	}
+	if(!json_object_is_type(tmp, json_type_double) && !json_object_is_type(tmp, json_type_int)){
+		fprintf(stderr,"ERROR in trajectory file, %s should be a number\n", key);
+		return -1;
+	}
+	*out = json_object_get_double(tmp);
+	return 0;
+}
+
+
+int trajectory_load_file(const char* path)
+{
+	static const char* const pos_keys[TRAJ_NUM_AXES] = {"X", "Y", "Z", "yaw"};
+	static const char* const vel_keys[TRAJ_NUM_AXES] = {"X_dot", "Y_dot", "Z_dot", "yaw_dot"};
+	static traj_waypoint_t wp[TRAJECTORY_MAX_WAYPOINTS];
+	json_object* jobj;
+	json_object* arr = NULL;
+	json_object* w;
+	int i, j, n, ret;
+
+	jobj = json_object_from_file(path);
+	if(jobj==NULL){
+		fprintf(stderr,"ERROR, failed to read trajectory file %s\n", path);
+		return -1;
+	}
+	if(json_object_object_get_ex(jobj, "waypoints", &arr)==0 ||
+	   !json_object_is_type(arr, json_type_array)){
+		fprintf(stderr,"ERROR in trajectory file, should contain a waypoints array\n");
+		json_object_put(jobj);
+		return -1;
+	}
+	n = json_object_array_length(arr);
+	if(n<1 || n>TRAJECTORY_MAX_WAYPOINTS){
+		fprintf(stderr,"ERROR in trajectory file, need 1 to %d waypoints\n", TRAJECTORY_MAX_WAYPOINTS);
+		json_object_put(jobj);
+		return -1;
+	}
+	for(i=0;i<n;i++){
+		w = json_object_array_get_idx(arr, i);
+		if(__get_number(w, "t", 1, &wp[i].t)) goto fail;
+		for(j=0;j<TRAJ_NUM_AXES;j++){
+			if(__get_number(w, pos_keys[j], 1, &wp[i].pos[j])) goto fail;
+			if(__get_number(w, vel_keys[j], 0, &wp[i].vel[j])) goto fail;
+		}
+	}
+	json_object_put(jobj);
+
+	ret = trajectory_set(wp, n);
+	if(ret==0) printf("loaded trajectory of %d waypoints, %.1fs\n", n, wp[n-1].t);
+	return ret;
+
+fail:
+	json_object_put(jobj);
+	return -1;
+}
+
+
+int trajectory_init(void)
+{
+	running = 0;
+	if(settings.trajectory_file[0]=='\0') return 0;
+	return trajectory_load_file(settings.trajectory_file);
+}
+
+
+int trajectory_start(const double origin[TRAJ_NUM_AXES])
+{
+	traj_bank_t* b;
+	int j;
+
+	b = atomic_exchange_explicit(&pending, NULL, memory_order_acquire);
+	if(b!=NULL) active = b;
+	if(active->n==0) return -1;
+	for(j=0;j<TRAJ_NUM_AXES;j++) origin_pos[j] = origin[j];
+	cursor = 0;
+	ticks = 0;
+	running = 1;
+	return 0;
+}
+
+
+int trajectory_step(traj_point_t* p)
+{
+	const traj_segment_t* s;
+	const double* c;
+	double t, u;
+	int j;
+
+	if(!running) return -1;
+	// time from the tick count so it doesn't drift over a long run
+	t = ticks*settings.dt;
+	ticks++;
+
+	// segments are at least one period long, so this moves one segment at
+	// most, the loop is for segments rounded just under a period
+	while(cursor<active->n-1 && t>active->seg[cursor].t_end) cursor++;
+	s = &active->seg[cursor];
+
+	if(t>=s->t_end && cursor==active->n-1){
+		for(j=0;j<TRAJ_NUM_AXES;j++){
+			p->pos[j] = origin_pos[j] + active->end_pos[j];
+			p->vel[j] = 0.0;
+			p->acc[j] = 0.0;
+		}
+		p->done = 1;
+		return 0;
+	}
+
+	u = (t-s->t_start)*s->inv_T;
+	for(j=0;j<TRAJ_NUM_AXES;j++){
+		c = s->c[j];
+		p->pos[j] = origin_pos[j] + c[0]+u*(c[1]+u*(c[2]+u*(c[3]+u*(c[4]+u*c[5]))));
+		p->vel[j] = (c[1]+u*(2.0*c[2]+u*(3.0*c[3]+u*(4.0*c[4]+u*5.0*c[5]))))*s->inv_T;
+		p->acc[j] = (2.0*c[2]+u*(6.0*c[3]+u*(12.0*c[4]+u*20.0*c[5])))*s->inv_T*s->inv_T;
+	}
+	p->done = 0;
+	return 0;
+}
+
+
+void trajectory_stop(void)
+{
+	running = 0;
+}
+
+
+int trajectory_is_running(void)
+{
+	return running;
+}
@@ -0,0 +1,179 @@
+/**
+ * @file watchdog.c
+ *
+ * Deadline watchdog, see watchdog.h
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include <watchdog.h>
+#include <instrumentation.h>
+#include <feedback.h>
+#include <settings.h>
+
+static const char* const level_names[WATCHDOG_NUM_LEVELS] = {
+	"none",
+	"log",
+	"printf",
+	"rates",
+	"failsafe"
+};
+
+static int initialized = 0;
+static uint64_t period_ns;
+static uint64_t late_ns;		// a gap this long between ticks lost at least one
+static uint32_t recover_ticks;
+
+// bookkeeping of the IMU thread
+static uint32_t since_shed;		// misses since the level last went up
+static uint32_t clean;			// ticks without a miss
+
+// single writer, so plain relaxed load+store like the instrumentation
+static atomic_uint_fast64_t overruns;
+static atomic_uint_fast64_t missed;
+static atomic_uint consecutive;
+static atomic_uint max_consecutive;
+static atomic_int level;
+static atomic_int reported;		// level last printed by watchdog_print_level_change()
+
+
+/**
+ * @brief      moves one level up or down and applies what the new level
+ *             needs right away, the rest is polled by the threads it affects.
+ *             Runs in the IMU callback so it doesn't print, the change is
+ *             picked up by watchdog_print_level_change().
+ */
+static void __set_level(int new_level)
+{
+	atomic_store_explicit(&level, new_level, memory_order_relaxed);
+	// feedback keeps the vehicle disarmed for as long as the level stays
+	if(new_level==WATCHDOG_LEVEL_FAILSAFE) feedback_disarm();
+}
+
+
+int watchdog_init(void)
+{
+	period_ns = 1000000000ULL/settings.feedback_hz;
+	late_ns = period_ns + period_ns/2;
+	recover_ticks = (uint32_t)(settings.watchdog_recover_seconds*settings.feedback_hz);
+	if(recover_ticks<1) recover_ticks = 1;
+	since_shed = 0;
+	clean = 0;
+	atomic_store(&overruns, 0);
+	atomic_store(&missed, 0);
+	atomic_store(&consecutive, 0);
+	atomic_store(&max_consecutive, 0);
+	atomic_store(&level, WATCHDOG_LEVEL_NONE);
+	atomic_store(&reported, WATCHDOG_LEVEL_NONE);
+	initialized = 1;
+	return 0;
+}
+
+
+void watchdog_tick(void)
+{
+	instr_tick_t t;
+	uint32_t misses = 0;
+	uint32_t run;
+	uint64_t lost;
+	int l;
+
+	if(!initialized) return;
+	instr_get_last_tick(&t);
+
+	if(t.total_ns>period_ns){
+		misses++;
+		atomic_store_explicit(&overruns,
+			atomic_load_explicit(&overruns, memory_order_relaxed)+1,
+			memory_order_relaxed);
+	}
+	// only divide when something was actually lost, there is no hardware
+	// divide on the Cortex-A8
+	if(t.period_ns>late_ns){
+		lost = (t.period_ns+period_ns/2)/period_ns - 1;
+		misses += lost;
+		atomic_store_explicit(&missed,
+			atomic_load_explicit(&missed, memory_order_relaxed)+lost,
+			memory_order_relaxed);
+	}
+
+	l = atomic_load_explicit(&level, memory_order_relaxed);
+	if(misses==0){
+		atomic_store_explicit(&consecutive, 0, memory_order_relaxed);
+		since_shed = 0;
+		if(l>WATCHDOG_LEVEL_NONE && ++clean>=recover_ticks){
+			clean = 0;
+			__set_level(l-1);
+		}
+		return;
+	}
+
+	clean = 0;
+	run = atomic_load_explicit(&consecutive, memory_order_relaxed)+misses;
+	atomic_store_explicit(&consecutive, run, memory_order_relaxed);
+	if(run>atomic_load_explicit(&max_consecutive, memory_order_relaxed)){
+		atomic_store_explicit(&max_consecutive, run, memory_order_relaxed);
+	}
+	since_shed += misses;
+	while(since_shed>=(uint32_t)settings.watchdog_shed_misses){
+		since_shed -= settings.watchdog_shed_misses;
+		if(l<settings.watchdog_shed_limit) __set_level(++l);
+	}
+	return;
+}
+
+
+watchdog_level_t watchdog_level(void)
+{
+	return atomic_load_explicit(&level, memory_order_relaxed);
+}
+
+
+void watchdog_get_stats(watchdog_stats_t* s)
+{
+	s->overruns		= atomic_load_explicit(&overruns, memory_order_relaxed);
+	s->missed		= atomic_load_explicit(&missed, memory_order_relaxed);
+	s->consecutive		= atomic_load_explicit(&consecutive, memory_order_relaxed);
+	s->max_consecutive	= atomic_load_explicit(&max_consecutive, memory_order_relaxed);
+	s->level		= atomic_load_explicit(&level, memory_order_relaxed);
+}
+
+
+void watchdog_print_level_change(FILE* f)
+{
+	int l, old;
+
+	if(!initialized) return;
+	l = atomic_load_explicit(&level, memory_order_relaxed);
+	// the exchange makes sure only one caller prints each change
+	old = atomic_exchange_explicit(&reported, l, memory_order_relaxed);
+	if(l==old || !settings.warnings_en) return;
+	if(l>old){
+		fprintf(f,"WARNING: %u consecutive deadline misses, watchdog shedding level now %s\n",\
+			atomic_load_explicit(&consecutive, memory_order_relaxed),\
+			level_names[l]);
+	}
+	else fprintf(f,"WARNING: watchdog shedding level back to %s\n", level_names[l]);
+}
+
+
+const char* watchdog_level_name(watchdog_level_t l)
+{
+	if(l<0 || l>=WATCHDOG_NUM_LEVELS) return "unknown";
+	return level_names[l];
+}
+
+
+int watchdog_print_report(FILE* f)
+{
+	watchdog_stats_t s;
+
+	if(!initialized) return -1;
+	watchdog_get_stats(&s);
+	fprintf(f, "deadline watchdog: %llu overruns, %llu missed ticks, longest run %u, level %s\n",\
+		(unsigned long long)s.overruns, (unsigned long long)s.missed,\
+		s.max_consecutive, watchdog_level_name(s.level));
+	return 0;
+}
@@ -0,0 +1,170 @@
+/**
+ * @file rc_pilot_logconv.c
+ *
+ * Host-side tool to convert binary rc_pilot logs (log_format "binary") into
+ * csv files with the same columns the on-board csv logger writes, including
+ * LZ4 and zstd compressed logs. This only depends on the C standard library,
+ * the lz4 and zstd libraries, log_format.h and log_reader.c so it builds on
+ * any machine with "make logconv".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+// to allow printf macros for multi-architecture portability
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#include <log_format.h>
+#include <log_reader.h>
+
+static const char* number_fmt = ",%.4F";	// matches the on-board csv writer
+static log_reader_t reader;
+
+
+static void print_usage(void)
+{
+	printf("\n");
+	printf("Usage: rc_pilot_logconv [options] <log.rcl>\n");
+	printf("\n");
+	printf(" Options\n");
+	printf(" -o {file}  Write csv to file instead of stdout\n");
+	printf(" -r         Print full precision instead of 4 decimal places\n");
+	printf(" -i         Print the file header and exit\n");
+	printf(" -h         Print this help message\n");
+	printf("\n");
+}
+
+
+static void __print_info(log_file_header_t* h)
+{
+	printf("name:        %s\n", h->name);
+	printf("version:     %d\n", h->version);
+	printf("feedback_hz: %d\n", h->feedback_hz);
+	printf("num_rotors:  %d\n", h->num_rotors);
+	printf("record_size: %d bytes\n", h->record_size);
+	printf("compression: %s\n",
+		h->compression==LOG_COMPRESSION_LZ4  ? "lz4"  :
+		h->compression==LOG_COMPRESSION_ZSTD ? "zstd" : "none");
+	printf("groups:     %s%s%s%s%s%s%s%s\n",
+		(h->groups & LOG_GROUP_SENSORS)   ? " sensors"   : "",
+		(h->groups & LOG_GROUP_STATE)     ? " state"     : "",
+		(h->groups & LOG_GROUP_SETPOINT)  ? " setpoint"  : "",
+		(h->groups & LOG_GROUP_CONTROL_U) ? " control_u" : "",
+		(h->groups & LOG_GROUP_MOTORS)    ? " motors"    : "",
+		(h->groups & LOG_GROUP_TIMING)    ? " timing"    : "",
+		(h->groups & LOG_GROUP_RAW)       ? " raw"       : "",
+		(h->groups & LOG_GROUP_WATCHDOG)  ? " watchdog"  : "");
+}
+
+
+static void __write_csv_header(FILE* out, log_file_header_t* h)
+{
+	int i;
+	fprintf(out, LOG_INDEX_NAMES);
+	if(h->groups & LOG_GROUP_SENSORS)	fprintf(out, LOG_SENSORS_NAMES);
+	if(h->groups & LOG_GROUP_STATE)		fprintf(out, LOG_STATE_NAMES);
+	if(h->groups & LOG_GROUP_SETPOINT)	fprintf(out, LOG_SETPOINT_NAMES);
+	if(h->groups & LOG_GROUP_CONTROL_U)	fprintf(out, LOG_CONTROL_U_NAMES);
+	if(h->groups & LOG_GROUP_MOTORS){
+		for(i=0;i<h->num_rotors;i++) fprintf(out, ",mot_%d", i+1);
+	}
+	if(h->groups & LOG_GROUP_TIMING)	fprintf(out, LOG_TIMING_NAMES);
+	if(h->groups & LOG_GROUP_RAW)		fprintf(out, "%s", log_raw_names(h->version));
+	if(h->groups & LOG_GROUP_WATCHDOG)	fprintf(out, LOG_WATCHDOG_NAMES);
+	fprintf(out, "\n");
+}
+
+
+static int __convert(FILE* out, log_file_header_t* h)
+{
+	uint64_t index[2];
+	double val;
+	int i, cols, ret;
+	uint64_t records = 0;
+	char* rec = (char*)malloc(h->record_size);
+
+	if(rec==NULL){
+		fprintf(stderr,"ERROR: failed to allocate record buffer\n");
+		return -1;
+	}
+	cols = (h->record_size - sizeof(index))/sizeof(double);
+
+	__write_csv_header(out, h);
+	while((ret = log_reader_read(&reader, rec))==1){
+		memcpy(index, rec, sizeof(index));
+		fprintf(out, "%" PRIu64 ",%" PRIu64, index[0], index[1]);
+		for(i=0;i<cols;i++){
+			memcpy(&val, rec+sizeof(index)+i*sizeof(double), sizeof(double));
+			fprintf(out, number_fmt, val);
+		}
+		fprintf(out, "\n");
+		records++;
+	}
+	free(rec);
+
+	if(ret<0){
+		fprintf(stderr,"ERROR: read error after %" PRIu64 " records\n", records);
+		return -1;
+	}
+	fprintf(stderr,"converted %" PRIu64 " records\n", records);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c, ret;
+	int info_only = 0;
+	char* out_path = NULL;
+	FILE* out = stdout;
+
+	opterr = 0;
+	while((c = getopt(argc, argv, "o:rih")) != -1){
+		switch(c){
+		case 'o':
+			out_path = optarg;
+			break;
+		case 'r':
+			number_fmt = ",%.17g";
+			break;
+		case 'i':
+			info_only = 1;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			printf("\nInvalid Argument \n");
+			print_usage();
+			return -1;
+		}
+	}
+	if(optind!=argc-1){
+		print_usage();
+		return -1;
+	}
+
+	if(log_reader_open(&reader, argv[optind])) return -1;
+	if(info_only){
+		__print_info(&reader.header);
+		log_reader_close(&reader);
+		return 0;
+	}
+
+	if(out_path!=NULL){
+		out = fopen(out_path, "w");
+		if(out==NULL){
+			fprintf(stderr,"ERROR: can't open %s for writing\n", out_path);
+			log_reader_close(&reader);
+			return -1;
+		}
+	}
+
+	ret = __convert(out, &reader.header);
+	log_reader_close(&reader);
+	if(out!=stdout) fclose(out);
+	return ret;
+}
@@ -0,0 +1,144 @@
+/**
+ * @file rc_pilot_shmcat.c
+ *
+ * Example consumer of the shared memory telemetry ring. Prints one csv line
+ * per tick with the same state, setpoint and motor columns the log has,
+ * then how many records it missed when rc_pilot exits or it is interrupted.
+ * Runs on the board next to rc_pilot without root, build it with
+ * "make shmcat".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+
+// to allow printf macros for multi-architecture portability
+#define __STDC_FORMAT_MACROS
+#include <inttypes.h>
+
+#include <shm_reader.h>
+
+#define POLL_US	1000	// faster than any feedback_hz, so nothing is missed
+
+// same names as the log columns, motors are mot_1...mot_n
+#define CSV_NAMES	"loop_index,time_ns"\
+			",roll,pitch,yaw,X,Y,Z,Xdot,Ydot,Zdot"\
+			",sp_roll,sp_pitch,sp_yaw,sp_X,sp_Y,sp_Z,sp_Xdot,sp_Ydot,sp_Zdot"
+
+static volatile sig_atomic_t running = 1;
+static shm_reader_t reader;
+
+
+static void print_usage(void)
+{
+	printf("\n");
+	printf("Usage: rc_pilot_shmcat [options]\n");
+	printf("\n");
+	printf(" Options\n");
+	printf(" -s {name}  Shared memory object, the shm_name setting (default /rc_pilot)\n");
+	printf(" -n {count} Exit after this many records\n");
+	printf(" -i         Print the ring header and exit\n");
+	printf(" -h         Print this help message\n");
+	printf("\n");
+}
+
+
+static void __on_signal(__attribute__ ((unused)) int sig)
+{
+	running = 0;
+}
+
+
+static void __print_info(const shm_ring_header_t* h)
+{
+	printf("name:        %s\n", h->name);
+	printf("version:     %d\n", h->version);
+	printf("writer_pid:  %d\n", h->writer_pid);
+	printf("feedback_hz: %d\n", h->feedback_hz);
+	printf("num_rotors:  %d\n", h->num_rotors);
+	printf("slots:       %u of %u bytes\n", h->num_slots, h->slot_size);
+	printf("alive:       %d\n", shm_reader_alive(&reader));
+}
+
+
+static void __print_record(const shm_record_t* r, int num_rotors)
+{
+	int i;
+	const state_estimate_t* se = &r->state;
+	const setpoint_t* sp = &r->setpoint;
+	const feedback_state_t* fs = &r->fstate;
+
+	printf("%" PRIu64 ",%" PRIu64, fs->loop_index, r->time_ns);
+	printf(",%.4F,%.4F,%.4F,%.4F,%.4F,%.4F,%.4F,%.4F,%.4F",\
+		se->tb_imu[0], se->tb_imu[1], se->tb_imu[2],\
+		se->pos_global[0], se->pos_global[1], se->pos_global[2],\
+		se->vel_global[0], se->vel_global[1], se->vel_global[2]);
+	printf(",%.4F,%.4F,%.4F,%.4F,%.4F,%.4F,%.4F,%.4F,%.4F",\
+		sp->roll, sp->pitch, sp->yaw, sp->X, sp->Y, sp->Z,\
+		sp->X_dot, sp->Y_dot, sp->Z_dot);
+	for(i=0;i<num_rotors;i++) printf(",%.4F", fs->m[i]);
+	printf("\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	int c, i;
+	int info_only = 0;
+	long count = -1;
+	uint64_t records = 0;
+	const char* name = "/rc_pilot";
+	shm_record_t rec;
+
+	opterr = 0;
+	while((c = getopt(argc, argv, "s:n:ih")) != -1){
+		switch(c){
+		case 's':
+			name = optarg;
+			break;
+		case 'n':
+			count = atol(optarg);
+			break;
+		case 'i':
+			info_only = 1;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			printf("\nInvalid Argument \n");
+			print_usage();
+			return -1;
+		}
+	}
+
+	if(shm_reader_open(&reader, name)) return -1;
+	if(info_only){
+		__print_info(reader.header);
+		shm_reader_close(&reader);
+		return 0;
+	}
+	signal(SIGINT, __on_signal);
+	signal(SIGTERM, __on_signal);
+
+	printf(CSV_NAMES);
+	for(i=0;i<reader.header->num_rotors;i++) printf(",mot_%d", i+1);
+	printf("\n");
+	while(running && (count<0 || (long)records<count)){
+		if(shm_reader_next(&reader, &rec)){
+			__print_record(&rec, reader.header->num_rotors);
+			records++;
+			continue;
+		}
+		// drained, the writer is gone for good once it marked the ring dead
+		if(!shm_reader_alive(&reader)) break;
+		fflush(stdout);
+		usleep(POLL_US);
+	}
+	fflush(stdout);
+	fprintf(stderr,"read %" PRIu64 " records, missed %" PRIu64 "\n", records, reader.missed);
+	shm_reader_close(&reader);
+	return 0;
+}